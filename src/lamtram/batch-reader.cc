@@ -0,0 +1,91 @@
+#include <lamtram/batch-reader.h>
+#include <lamtram/macros.h>
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace lamtram;
+
+// Count the space-separated words in a line
+inline int CountWords(const string & line) {
+  int words = 0;
+  for(size_t i = 0; i < line.size(); i++)
+    if(line[i] != ' ' && (i == 0 || line[i-1] == ' '))
+      words++;
+  return words;
+}
+
+bool BatchReader::GetLine(string & line) {
+  size_t pos = buf_.find('\n');
+  if(pos == string::npos) {
+    // The last line may not end with a newline
+    if(!eof_ || buf_.size() == 0) return false;
+    pos = buf_.size();
+  }
+  line = buf_.substr(0, pos);
+  buf_.erase(0, min(pos + 1, buf_.size()));
+  return true;
+}
+
+bool BatchReader::Fill(int timeout_ms) {
+  pollfd pfd;
+  pfd.fd = fd_; pfd.events = POLLIN; pfd.revents = 0;
+  int ret = poll(&pfd, 1, timeout_ms);
+  if(ret < 0) {
+    if(errno == EINTR) return true;
+    THROW_ERROR("Could not wait for input: " << strerror(errno));
+  } else if(ret == 0) {
+    return false;
+  }
+  char data[65536];
+  ssize_t num_read = read(fd_, data, sizeof(data));
+  if(num_read < 0) {
+    if(errno == EINTR || errno == EAGAIN) return true;
+    THROW_ERROR("Could not read input: " << strerror(errno));
+  } else if(num_read == 0) {
+    eof_ = true;
+  } else {
+    buf_.append(data, num_read);
+  }
+  return true;
+}
+
+bool BatchReader::ReadBatch(vector<string> & lines) {
+  lines.clear();
+  int num_words = 0;
+  chrono::steady_clock::time_point deadline;
+  string line;
+  while(true) {
+    // Add all complete lines that have been read, as long as they fit
+    while(GetLine(line)) {
+      int line_words = CountWords(line);
+      if(lines.size() > 0 && num_words + line_words > max_words_) {
+        buf_.insert(0, line + "\n");
+        return true;
+      }
+      if(lines.size() == 0)
+        deadline = chrono::steady_clock::now() + chrono::milliseconds(max_wait_ms_);
+      lines.push_back(line);
+      num_words += line_words;
+      if(num_words >= max_words_) return true;
+    }
+    if(eof_) return lines.size() > 0;
+    // Wait for more input, up to the deadline if a batch has been started
+    int timeout_ms = -1;
+    if(lines.size() > 0) {
+      timeout_ms = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+      if(timeout_ms <= 0) return true;
+    }
+    if(!Fill(timeout_ms)) return true;
+  }
+}
+
+bool BatchReader::ReadLine(string & line, int timeout_ms) {
+  while(!GetLine(line))
+    if(eof_ || !Fill(timeout_ms)) return false;
+  return true;
+}
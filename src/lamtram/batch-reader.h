@@ -0,0 +1,41 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace lamtram {
+
+// Read lines from a file descriptor and gather them into small batches for
+// decoding requests as they arrive.
+//
+// The first line of a batch is waited for indefinitely. After it arrives, more
+// lines are added until the batch reaches max_words words, or until
+// max_wait_ms milliseconds have passed, whichever comes first.
+class BatchReader {
+
+public:
+    BatchReader(int fd, int max_words, int max_wait_ms) :
+        fd_(fd), max_words_(max_words), max_wait_ms_(max_wait_ms), eof_(false) { }
+
+    // Read the next batch of lines, returning false at the end of the input
+    bool ReadBatch(std::vector<std::string> & lines);
+    // Read a single line, waiting at most timeout_ms (or indefinitely if
+    // negative). Returns false if the time ran out or the input ended.
+    bool ReadLine(std::string & line, int timeout_ms);
+
+protected:
+    // Get a complete line from the buffer if there is one
+    bool GetLine(std::string & line);
+    // Wait at most timeout_ms (or indefinitely if negative) for more input,
+    // returning false if the time ran out
+    bool Fill(int timeout_ms);
+
+    int fd_;
+    int max_words_, max_wait_ms_;
+    // Input that has been read but not yet returned
+    std::string buf_;
+    bool eof_;
+
+};
+
+}
@@ -0,0 +1,128 @@
+#include <lamtram/beam-select.h>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+using namespace lamtram;
+
+// Whether the left candidate should be ranked above the right one
+inline bool BetterCandidate(const BeamCandidate & lhs, const BeamCandidate & rhs) {
+  if(lhs.score_ != rhs.score_) return lhs.score_ > rhs.score_;
+  return lhs.order_ < rhs.order_;
+}
+
+// The score of a word after adding the word and unknown penalties
+inline float PenalizedScore(float log_prob, int wid, float word_pen, int unk_id, float unk_score) {
+  float score = (wid != 0 ? log_prob + word_pen : log_prob);
+  return (wid == unk_id ? score + unk_score : score);
+}
+
+float BeamSelector::GetThreshold() const {
+  return ((int)heap_.size() < beam_size_ ? -numeric_limits<float>::infinity() : heap_[0].score_);
+}
+
+void BeamSelector::AddCandidate(float score, int hyp_id, int word_id, int align, long order) {
+  // Words with zero probability never enter the beam
+  if(!(score > -numeric_limits<float>::infinity())) return;
+  BeamCandidate cand(score, hyp_id, word_id, align, order);
+  if((int)heap_.size() == beam_size_) {
+    if(beam_size_ == 0 || !BetterCandidate(cand, heap_[0])) return;
+    pop_heap(heap_.begin(), heap_.end(), BetterCandidate);
+    heap_.pop_back();
+  }
+  heap_.push_back(cand);
+  push_heap(heap_.begin(), heap_.end(), BetterCandidate);
+}
+
+void BeamSelector::AddHypothesis(const float * log_probs, int vocab_size,
+                                 float hyp_score, float word_pen,
+                                 int unk_id, float unk_score,
+                                 int hyp_id, int align) {
+  if(vocab_size == 0) return;
+  long order = num_added_++ * (long)vocab_size;
+  // The sentence end and unknown words are penalized differently, so add them first
+  AddCandidate(hyp_score + PenalizedScore(log_probs[0], 0, word_pen, unk_id, unk_score), hyp_id, 0, align, order);
+  if(unk_id > 0 && unk_id < vocab_size)
+    AddCandidate(hyp_score + PenalizedScore(log_probs[unk_id], unk_id, word_pen, unk_id, unk_score), hyp_id, unk_id, align, order + unk_id);
+  // Scan the remaining words, only looking closer at those that beat the threshold
+  int wid = 1;
+#if defined(__AVX__)
+  const __m256 v_pen = _mm256_set1_ps(word_pen), v_hyp = _mm256_set1_ps(hyp_score);
+  for(; wid + 8 <= vocab_size; wid += 8) {
+    __m256 v_score = _mm256_add_ps(v_hyp, _mm256_add_ps(_mm256_loadu_ps(log_probs + wid), v_pen));
+    int mask = _mm256_movemask_ps(_mm256_cmp_ps(v_score, _mm256_set1_ps(GetThreshold()), _CMP_GE_OQ));
+    for(; mask != 0; mask &= mask - 1) {
+      int curr = wid + __builtin_ctz(mask);
+      if(curr != unk_id)
+        AddCandidate(hyp_score + (log_probs[curr] + word_pen), hyp_id, curr, align, order + curr);
+    }
+  }
+#elif defined(__SSE2__)
+  const __m128 v_pen = _mm_set1_ps(word_pen), v_hyp = _mm_set1_ps(hyp_score);
+  for(; wid + 4 <= vocab_size; wid += 4) {
+    __m128 v_score = _mm_add_ps(v_hyp, _mm_add_ps(_mm_loadu_ps(log_probs + wid), v_pen));
+    int mask = _mm_movemask_ps(_mm_cmpge_ps(v_score, _mm_set1_ps(GetThreshold())));
+    for(; mask != 0; mask &= mask - 1) {
+      int curr = wid + __builtin_ctz(mask);
+      if(curr != unk_id)
+        AddCandidate(hyp_score + (log_probs[curr] + word_pen), hyp_id, curr, align, order + curr);
+    }
+  }
+#endif
+  for(; wid < vocab_size; wid++) {
+    float score = hyp_score + (log_probs[wid] + word_pen);
+    if(wid != unk_id && score >= GetThreshold())
+      AddCandidate(score, hyp_id, wid, align, order + wid);
+  }
+}
+
+void BeamSelector::AddWords(const float * log_probs, const unsigned * word_ids, int size,
+                            float hyp_score, float word_pen,
+                            int unk_id, float unk_score,
+                            int hyp_id, int align) {
+  long order = (long)hyp_id << 32;
+  for(int i = 0; i < size; i++) {
+    float score = hyp_score + PenalizedScore(log_probs[i], word_ids[i], word_pen, unk_id, unk_score);
+    if(score >= GetThreshold())
+      AddCandidate(score, hyp_id, word_ids[i], align, order + word_ids[i]);
+  }
+}
+
+vector<BeamCandidate> BeamSelector::GetBest() const {
+  vector<BeamCandidate> ret(heap_);
+  sort(ret.begin(), ret.end(), BetterCandidate);
+  return ret;
+}
+
+namespace lamtram {
+
+void PruneCandidates(vector<BeamCandidate> & cands, float rel_ratio, float abs_diff) {
+  if(cands.size() == 0) return;
+  float threshold = -numeric_limits<float>::infinity();
+  if(rel_ratio > 0.f) threshold = max(threshold, cands[0].score_ + log(rel_ratio));
+  if(abs_diff > 0.f) threshold = max(threshold, cands[0].score_ - abs_diff);
+  size_t size = 1;
+  while(size < cands.size() && cands[size].score_ >= threshold) size++;
+  cands.erase(cands.begin() + size, cands.end());
+}
+
+float CalcEntropy(const float * log_probs, int size) {
+  float entropy = 0.f;
+  for(int i = 0; i < size; i++)
+    if(log_probs[i] > -numeric_limits<float>::infinity())
+      entropy -= exp(log_probs[i]) * log_probs[i];
+  return entropy;
+}
+
+int AdaptiveBeamSize(float entropy, int max_size) {
+  float perplexity = exp(entropy);
+  return (perplexity >= max_size ? max_size : max(1, (int)(perplexity + 0.5f)));
+}
+
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <vector>
+
+namespace lamtram {
+
+// A candidate for the next beam: a word expanding one of the hypotheses
+class BeamCandidate {
+public:
+    BeamCandidate(float score, int hyp_id, int word_id, int align, long order) :
+        score_(score), hyp_id_(hyp_id), word_id_(word_id), align_(align), order_(order) { }
+
+    float score_;
+    int hyp_id_, word_id_, align_;
+    // The order in which the candidate was added, used to break ties
+    long order_;
+};
+
+// Select the k best candidates over the words of all hypotheses in a beam.
+//
+// Candidates are kept in a heap of size k, and the scan over the vocabulary
+// is vectorized so that only words that beat the current k-th best score are
+// touched individually. The result is identical to inserting every word into
+// a sorted list, including the order of candidates with equal scores.
+class BeamSelector {
+
+public:
+    BeamSelector(int beam_size) : beam_size_(beam_size), num_added_(0) { }
+
+    // Add the candidates for one hypothesis
+    //  log_probs: The log probabilities of each word
+    //  vocab_size: The number of words
+    //  hyp_score: The score of the hypothesis being expanded
+    //  word_pen: A penalty added to every word except the sentence end (0)
+    //  unk_id: The ID of the unknown word, or -1 if there is none
+    //  unk_score: An extra score added to the unknown word
+    //  hyp_id: The ID of the hypothesis
+    //  align: The alignment of the hypothesis's next word
+    void AddHypothesis(const float * log_probs, int vocab_size,
+                       float hyp_score, float word_pen,
+                       int unk_id, float unk_score,
+                       int hyp_id, int align);
+
+    // Add the candidates for some of the words of a hypothesis, which may be
+    // called several times for each. Ties are broken by the hypothesis ID and
+    // then the word ID, the same as adding all words with AddHypothesis.
+    //  word_ids: The ID of the word of each log probability
+    //  unk_id: The ID of the unknown word, or -1 if there is none
+    void AddWords(const float * log_probs, const unsigned * word_ids, int size,
+                  float hyp_score, float word_pen,
+                  int unk_id, float unk_score,
+                  int hyp_id, int align);
+
+    // Get the best candidates, sorted in descending order of score
+    std::vector<BeamCandidate> GetBest() const;
+
+    // The score a new candidate must exceed to enter the beam
+    float GetThreshold() const;
+
+protected:
+    // Add a single candidate if it is good enough
+    void AddCandidate(float score, int hyp_id, int word_id, int align, long order);
+
+    int beam_size_;
+    long num_added_;
+    // A heap with the worst candidate on top
+    std::vector<BeamCandidate> heap_;
+
+};
+
+// Remove candidates sorted in descending order of score that are too far
+// below the best. Candidates are kept if their probability is at least
+// rel_ratio times that of the best, and their score at most abs_diff below
+// it. A threshold of zero is not applied.
+void PruneCandidates(std::vector<BeamCandidate> & cands, float rel_ratio, float abs_diff);
+
+// Calculate the entropy of a distribution given as log probabilities
+float CalcEntropy(const float * log_probs, int size);
+
+// The beam size for a step whose distribution has the given entropy: the
+// perplexity of the distribution, rounded and limited to [1, max_size]
+int AdaptiveBeamSize(float entropy, int max_size);
+
+}
@@ -1,4 +1,6 @@
 #include <lamtram/builder-factory.h>
+#include <lamtram/ff-builder.h>
+#include <lamtram/fast-lstm-builder.h>
 #include <lamtram/macros.h>
 #include <dynet/model.h>
 #include <dynet/rnn.h>
@@ -14,12 +16,12 @@ BuilderSpec::BuilderSpec(const std::string & spec) {
     vector<string> strs;
     boost::algorithm::split(strs, spec, boost::is_any_of(":"));
     if(strs.size() != 3)
-        THROW_ERROR("Invalid layer specification \"" << spec << "\", must be layer type (rnn/lstm/gru), number of nodes, number of layers, with the three elements separated by a token.");
+        THROW_ERROR("Invalid layer specification \"" << spec << "\", must be layer type (rnn/lstm/fastlstm/gru/ff), number of nodes, number of layers, with the three elements separated by a token.");
     type = strs[0];
     nodes = boost::lexical_cast<int>(strs[1]); 
     if(nodes <= 0) nodes = GlobalVars::layer_size;
     layers = boost::lexical_cast<int>(strs[2]); 
-    multiplier = (type == "lstm" ? 2 : 1);
+    multiplier = (type == "lstm" || type == "fastlstm" ? 2 : 1);
 }
 
 BuilderPtr BuilderFactory::CreateBuilder(const BuilderSpec & spec, int input_dim, dynet::ParameterCollection & model) {
@@ -30,6 +32,10 @@ BuilderPtr BuilderFactory::CreateBuilder(const BuilderSpec & spec, int input_dim
         return BuilderPtr(new dynet::LSTMBuilder(spec.layers, input_dim, spec.nodes, model));
     } else if(spec.type == "lstm") {
         return BuilderPtr(new dynet::VanillaLSTMBuilder(spec.layers, input_dim, spec.nodes, model));
+    } else if(spec.type == "fastlstm") {
+        return BuilderPtr(new FastLSTMBuilder(spec.layers, input_dim, spec.nodes, model));
+    } else if(spec.type == "ff") {
+        return BuilderPtr(new FeedForwardBuilder(spec.layers, input_dim, spec.nodes, model));
     } else if(spec.type == "gru") {
         THROW_ERROR("GRU spec.nodes are not supported yet.");
         // return BuilderPtr(new dynet::GRUBuilder(spec.layers, input_dim, spec.nodes, model));
@@ -16,6 +16,8 @@ public:
     BuilderSpec(const std::string & str);
     std::string type;
     int nodes, layers, multiplier;
+    // Whether the layers carry state from one step to the next
+    bool IsRecurrent() const { return type != "ff"; }
 };
 inline std::ostream & operator<<(std::ostream & out, const BuilderSpec & spec) {
     return out << spec.type << ":" << spec.nodes << ":" << spec.layers;
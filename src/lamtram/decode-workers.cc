@@ -0,0 +1,364 @@
+#include <lamtram/decode-workers.h>
+#include <lamtram/macros.h>
+#include <algorithm>
+#include <iostream>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+using namespace std;
+using namespace lamtram;
+
+// Write the whole buffer to a file descriptor
+inline bool WriteAll(int fd, const char * data, size_t size) {
+  while(size > 0) {
+    ssize_t written = write(fd, data, size);
+    if(written < 0) {
+      if(errno == EINTR) continue;
+      return false;
+    }
+    data += written; size -= written;
+  }
+  return true;
+}
+
+// Read the whole buffer from a file descriptor, returning false at the end of the file
+inline bool ReadAll(int fd, char * data, size_t size) {
+  while(size > 0) {
+    ssize_t num_read = read(fd, data, size);
+    if(num_read < 0) {
+      if(errno == EINTR) continue;
+      return false;
+    } else if(num_read == 0) {
+      return false;
+    }
+    data += num_read; size -= num_read;
+  }
+  return true;
+}
+
+// Results are written as the number of strings, then the length and content of each
+inline bool WriteResult(int fd, const vector<string> & result) {
+  uint64_t size = result.size();
+  if(!WriteAll(fd, (const char*)&size, sizeof(size))) return false;
+  for(const string & str : result) {
+    size = str.size();
+    if(!WriteAll(fd, (const char*)&size, sizeof(size)) || !WriteAll(fd, str.data(), str.size()))
+      return false;
+  }
+  return true;
+}
+
+inline bool ReadResult(int fd, vector<string> & result) {
+  uint64_t size;
+  if(!ReadAll(fd, (char*)&size, sizeof(size))) return false;
+  result.resize(size);
+  for(string & str : result) {
+    if(!ReadAll(fd, (char*)&size, sizeof(size))) return false;
+    str.resize(size);
+    if(size > 0 && !ReadAll(fd, &str[0], size)) return false;
+  }
+  return true;
+}
+
+// Close the pipes and wait for the workers, returning whether all of them succeeded
+inline bool FinishWorkers(const vector<int> & fds, const vector<pid_t> & pids) {
+  for(int fd : fds) close(fd);
+  bool success = true;
+  for(pid_t pid : pids) {
+    int status;
+    while(waitpid(pid, &status, 0) < 0 && errno == EINTR);
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) success = false;
+  }
+  return success;
+}
+
+void DecodeWorkers::Run(int num_jobs, const JobFunc & job, const ResultFunc & result) const {
+  int num_workers = min(num_workers_, num_jobs);
+  if(num_workers <= 1) {
+    for(int i = 0; i < num_jobs; i++)
+      result(i, job(i));
+    return;
+  }
+#ifdef HAVE_CUDA
+  THROW_ERROR("Multiple decoding workers are not supported when decoding on the GPU");
+#endif
+  // Flush the output so buffered contents are not duplicated in the workers
+  cout.flush(); cerr.flush();
+  // Start the workers, each of which handles every num_workers'th job
+  vector<int> fds;
+  vector<pid_t> pids;
+  for(int w = 0; w < num_workers; w++) {
+    int pipe_fds[2];
+    if(pipe(pipe_fds) != 0) {
+      FinishWorkers(fds, pids);
+      THROW_ERROR("Could not create pipe for decoding worker: " << strerror(errno));
+    }
+    pid_t pid = fork();
+    if(pid < 0) {
+      close(pipe_fds[0]); close(pipe_fds[1]);
+      FinishWorkers(fds, pids);
+      THROW_ERROR("Could not start decoding worker: " << strerror(errno));
+    } else if(pid == 0) {
+      for(int fd : fds) close(fd);
+      close(pipe_fds[0]);
+      int ret = 0;
+      try {
+        for(int i = w; i < num_jobs && ret == 0; i += num_workers)
+          if(!WriteResult(pipe_fds[1], job(i)))
+            ret = 1;
+      } catch(std::exception & e) {
+        cerr << e.what() << endl;
+        ret = 1;
+      }
+      close(pipe_fds[1]);
+      // Exit without running the destructors of objects shared with the parent
+      _exit(ret);
+    }
+    close(pipe_fds[1]);
+    fds.push_back(pipe_fds[0]);
+    pids.push_back(pid);
+  }
+  // Collect the results in order, each job's result being the next one from its worker
+  try {
+    vector<string> job_result;
+    for(int i = 0; i < num_jobs; i++) {
+      if(!ReadResult(fds[i % num_workers], job_result))
+        THROW_ERROR("Decoding worker " << i % num_workers << " stopped before finishing job " << i);
+      result(i, job_result);
+    }
+  } catch(...) {
+    FinishWorkers(fds, pids);
+    throw;
+  }
+  if(!FinishWorkers(fds, pids))
+    THROW_ERROR("A decoding worker did not exit cleanly");
+}
+
+// Messages are written as their length, then their content
+inline bool WriteMessage(int fd, const string & data) {
+  uint64_t size = data.size();
+  return WriteAll(fd, (const char*)&size, sizeof(size)) && WriteAll(fd, data.data(), data.size());
+}
+
+inline bool ReadMessage(int fd, string & data) {
+  uint64_t size;
+  if(!ReadAll(fd, (char*)&size, sizeof(size))) return false;
+  data.resize(size);
+  return size == 0 || ReadAll(fd, &data[0], size);
+}
+
+// Ignore SIGPIPE while it is in scope, so that writing to a worker that has
+// died fails with an error instead of killing the calling process
+class IgnoreSigPipe {
+public:
+  IgnoreSigPipe() {
+    struct sigaction ignore;
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigemptyset(&ignore.sa_mask);
+    sigaction(SIGPIPE, &ignore, &old_);
+  }
+  ~IgnoreSigPipe() { sigaction(SIGPIPE, &old_, nullptr); }
+protected:
+  struct sigaction old_;
+};
+
+void DecodeWorkers::RunStream(const InputFunc & input, const StreamJobFunc & job, const ResultFunc & result, bool round_robin) const {
+  string job_input;
+  if(num_workers_ <= 1) {
+    for(int i = 0; input(job_input); i++)
+      result(i, job(job_input));
+    return;
+  }
+#ifdef HAVE_CUDA
+  THROW_ERROR("Multiple decoding workers are not supported when decoding on the GPU");
+#endif
+  IgnoreSigPipe ignore_sigpipe;
+  // Flush the output so buffered contents are not duplicated in the workers
+  cout.flush(); cerr.flush();
+  // Start the workers, each of which decodes the jobs it is sent until its
+  // input is closed
+  vector<int> to_fds, from_fds;
+  vector<pid_t> pids;
+  for(int w = 0; w < num_workers_; w++) {
+    int to_pipe[2], from_pipe[2];
+    if(pipe(to_pipe) != 0) {
+      for(int fd : from_fds) close(fd);
+      FinishWorkers(to_fds, pids);
+      THROW_ERROR("Could not create pipe for decoding worker: " << strerror(errno));
+    }
+    if(pipe(from_pipe) != 0) {
+      close(to_pipe[0]); close(to_pipe[1]);
+      for(int fd : from_fds) close(fd);
+      FinishWorkers(to_fds, pids);
+      THROW_ERROR("Could not create pipe for decoding worker: " << strerror(errno));
+    }
+    pid_t pid = fork();
+    if(pid < 0) {
+      close(to_pipe[0]); close(to_pipe[1]); close(from_pipe[0]); close(from_pipe[1]);
+      for(int fd : from_fds) close(fd);
+      FinishWorkers(to_fds, pids);
+      THROW_ERROR("Could not start decoding worker: " << strerror(errno));
+    } else if(pid == 0) {
+      for(int fd : to_fds) close(fd);
+      for(int fd : from_fds) close(fd);
+      close(to_pipe[1]); close(from_pipe[0]);
+      int ret = 0;
+      try {
+        while(ret == 0 && ReadMessage(to_pipe[0], job_input))
+          if(!WriteResult(from_pipe[1], job(job_input)))
+            ret = 1;
+      } catch(std::exception & e) {
+        cerr << e.what() << endl;
+        ret = 1;
+      }
+      close(to_pipe[0]); close(from_pipe[1]);
+      // Exit without running the destructors of objects shared with the parent
+      _exit(ret);
+    }
+    close(to_pipe[0]); close(from_pipe[1]);
+    to_fds.push_back(to_pipe[1]);
+    from_fds.push_back(from_pipe[0]);
+    pids.push_back(pid);
+  }
+  // Keep a few jobs queued for each worker so it never waits for the input,
+  // and hold finished results until all earlier ones have been passed on
+  const size_t max_pending = 2;
+  vector<deque<int> > pending(num_workers_);
+  map<int, vector<string> > finished;
+  int num_sent = 0, num_done = 0;
+  bool input_done = false;
+  try {
+    vector<string> job_result;
+    while(true) {
+      while(!input_done) {
+        int w = num_sent % num_workers_;
+        if(!round_robin)
+          for(int v = 0; v < num_workers_; v++)
+            if(pending[v].size() < pending[w].size()) w = v;
+        if(pending[w].size() >= max_pending) break;
+        if(!input(job_input)) { input_done = true; break; }
+        if(!WriteMessage(to_fds[w], job_input))
+          THROW_ERROR("Could not send job " << num_sent << " to decoding worker " << w << ": " << strerror(errno));
+        pending[w].push_back(num_sent++);
+      }
+      if(input_done && num_done == num_sent) break;
+      // Wait until a worker with unfinished jobs has a result
+      vector<pollfd> poll_fds;
+      vector<int> poll_workers;
+      for(int w = 0; w < num_workers_; w++) {
+        if(pending[w].size() == 0) continue;
+        pollfd poll_fd = {from_fds[w], POLLIN, 0};
+        poll_fds.push_back(poll_fd);
+        poll_workers.push_back(w);
+      }
+      if(poll(&poll_fds[0], poll_fds.size(), -1) < 0) {
+        if(errno == EINTR) continue;
+        THROW_ERROR("Could not wait for the decoding workers: " << strerror(errno));
+      }
+      for(size_t k = 0; k < poll_fds.size(); k++) {
+        if(poll_fds[k].revents == 0) continue;
+        int w = poll_workers[k];
+        if(!ReadResult(from_fds[w], job_result))
+          THROW_ERROR("Decoding worker " << w << " stopped before finishing job " << pending[w].front());
+        finished[pending[w].front()].swap(job_result);
+        pending[w].pop_front();
+      }
+      for(auto it = finished.begin(); it != finished.end() && it->first == num_done; it = finished.erase(it), num_done++)
+        result(num_done, it->second);
+    }
+  } catch(...) {
+    for(int fd : from_fds) close(fd);
+    FinishWorkers(to_fds, pids);
+    throw;
+  }
+  for(int fd : from_fds) close(fd);
+  if(!FinishWorkers(to_fds, pids))
+    THROW_ERROR("A decoding worker did not exit cleanly");
+}
+
+ProcessGroup::ProcessGroup(int num_procs, const ServeFunc & serve) : num_procs_(num_procs), proc_(0), owner_(getpid()) {
+#ifdef HAVE_CUDA
+  if(num_procs > 1)
+    THROW_ERROR("Multiple processes are not supported when decoding on the GPU");
+#endif
+  // Flush the output so buffered contents are not duplicated in the processes
+  cout.flush(); cerr.flush();
+  for(int p = 1; p < num_procs; p++) {
+    int to_fds[2], from_fds[2];
+    if(pipe(to_fds) != 0) {
+      FinishWorkers(to_fds_, pids_);
+      THROW_ERROR("Could not create pipe for process " << p << ": " << strerror(errno));
+    }
+    if(pipe(from_fds) != 0) {
+      close(to_fds[0]); close(to_fds[1]);
+      FinishWorkers(to_fds_, pids_);
+      THROW_ERROR("Could not create pipe for process " << p << ": " << strerror(errno));
+    }
+    pid_t pid = fork();
+    if(pid < 0) {
+      close(to_fds[0]); close(to_fds[1]); close(from_fds[0]); close(from_fds[1]);
+      FinishWorkers(to_fds_, pids_);
+      THROW_ERROR("Could not start process " << p << ": " << strerror(errno));
+    } else if(pid == 0) {
+      for(int fd : to_fds_) close(fd);
+      for(int fd : from_fds_) close(fd);
+      close(to_fds[1]); close(from_fds[0]);
+      proc_ = p;
+      to_fds_ = vector<int>(1, from_fds[1]);
+      from_fds_ = vector<int>(1, to_fds[0]);
+      pids_.clear();
+      int ret = 0;
+      try {
+        serve(*this);
+      } catch(std::exception & e) {
+        cerr << e.what() << endl;
+        ret = 1;
+      }
+      close(to_fds_[0]); close(from_fds_[0]);
+      // Exit without running the destructors of objects shared with the parent
+      _exit(ret);
+    }
+    close(to_fds[0]); close(from_fds[1]);
+    to_fds_.push_back(to_fds[1]);
+    from_fds_.push_back(from_fds[0]);
+    pids_.push_back(pid);
+  }
+}
+
+ProcessGroup::~ProcessGroup() {
+  // Copies of the group in forked processes do not own the processes
+  if(proc_ != 0 || owner_ != getpid()) return;
+  for(int fd : from_fds_) close(fd);
+  FinishWorkers(to_fds_, pids_);
+}
+
+bool ProcessGroup::Broadcast(string & data) {
+  if(proc_ != 0)
+    return ReadMessage(from_fds_[0], data);
+  for(size_t p = 0; p < to_fds_.size(); p++)
+    if(!WriteMessage(to_fds_[p], data))
+      THROW_ERROR("Could not send data to process " << p+1 << ": " << strerror(errno));
+  return true;
+}
+
+void ProcessGroup::Gather(const string & data, vector<string> & all) {
+  if(proc_ != 0) {
+    if(!WriteMessage(to_fds_[0], data))
+      THROW_ERROR("Could not send data from process " << proc_ << ": " << strerror(errno));
+    return;
+  }
+  all.resize(num_procs_);
+  all[0] = data;
+  for(size_t p = 0; p < from_fds_.size(); p++)
+    if(!ReadMessage(from_fds_[p], all[p+1]))
+      THROW_ERROR("Process " << p+1 << " stopped before sending its data");
+}
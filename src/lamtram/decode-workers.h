@@ -0,0 +1,84 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+namespace lamtram {
+
+// Run decoding jobs on several workers, and collect the results in order.
+//
+// DyNet only allows a single computation graph per process, so each worker
+// is a process forked after the models have been loaded. The parameters are
+// only read during decoding, so they are shared copy-on-write between all
+// workers instead of being loaded once per worker.
+class DecodeWorkers {
+
+public:
+    // A job takes its ID and returns one or more output strings
+    typedef std::function<std::vector<std::string>(int)> JobFunc;
+    // Receives the output of each job, in order of job ID
+    typedef std::function<void(int, const std::vector<std::string> &)> ResultFunc;
+    // Sets the input of the next job, returning false when there are no more
+    typedef std::function<bool(std::string &)> InputFunc;
+    // A streamed job takes its input and returns one or more output strings
+    typedef std::function<std::vector<std::string>(const std::string &)> StreamJobFunc;
+
+    DecodeWorkers(int num_workers) : num_workers_(num_workers) { }
+
+    // Run jobs 0 through num_jobs-1, calling job in the workers and result in
+    // the calling process. With a single worker, everything is run in-process.
+    void Run(int num_jobs, const JobFunc & job, const ResultFunc & result) const;
+
+    // Run jobs as long as input returns more of them, calling job in the
+    // workers and result in the calling process, in the order the jobs were
+    // read. The workers are forked once and sent each job as it is read, so
+    // the input does not need to be known in advance. Each job goes to the
+    // worker with the fewest unfinished jobs, or with round_robin, to the
+    // workers in turn. With a single worker, everything is run in-process.
+    void RunStream(const InputFunc & input, const StreamJobFunc & job, const ResultFunc & result, bool round_robin = false) const;
+
+    int GetNumWorkers() const { return num_workers_; }
+
+protected:
+    int num_workers_;
+
+};
+
+// A group of processes that work together on the same computation, such as
+// the members of an ensemble that are evaluated in parallel.
+//
+// The calling process is process 0, and the others are forked when the group
+// is created, each running serve until the calling process destroys the group.
+class ProcessGroup {
+
+public:
+    typedef std::function<void(ProcessGroup &)> ServeFunc;
+
+    ProcessGroup(int num_procs, const ServeFunc & serve);
+    ~ProcessGroup();
+
+    // In process 0, send data to all others. In the others, receive the data
+    // sent by process 0, returning false if it has destroyed the group.
+    bool Broadcast(std::string & data);
+    // In process 0, receive the data of every process in order (its own
+    // first). In the others, send data to process 0.
+    void Gather(const std::string & data, std::vector<std::string> & all);
+
+    int GetNumProcs() const { return num_procs_; }
+    int GetProc() const { return proc_; }
+    // The process that created the group
+    pid_t GetOwner() const { return owner_; }
+
+protected:
+    int num_procs_, proc_;
+    pid_t owner_;
+    // In process 0, the pipes to and from each other process, and their IDs.
+    // In the others, only the pipes to and from process 0.
+    std::vector<int> to_fds_, from_fds_;
+    std::vector<pid_t> pids_;
+
+};
+
+}
@@ -110,6 +110,8 @@ void ExternAttentional::NewGraph(ComputationGraph & cg) {
   if(attention_hist_ == "sum") {
     i_align_sum_W_ = parameter(cg, p_align_sum_W_);
   }
+  saved_h_.clear(); saved_ehid_hpart_.clear(); saved_sent_len_.clear(); saved_lexicon_.clear();
+  saved_lens_.clear(); selected_sents_.clear(); sent_mask_.clear();
   curr_graph_ = &cg;
 }
 
@@ -173,7 +175,8 @@ void ExternAttentional::InitializeSentence(
   if(hidden_size_) {
     i_ehid_hpart_ = i_ehid_h_W_*i_h_;
     sent_values_.resize(sent_len_, 1.0);
-    i_sent_len_ = input(cg, {1, (unsigned int)sent_len_}, &sent_values_);
+    // Copy the values, as several sentences may be initialized in one graph
+    i_sent_len_ = input(cg, {1, (unsigned int)sent_len_}, sent_values_);
   } else if(attention_type_ == "dot") {
     i_ehid_hpart_ = transpose(i_h_);
   } else if(attention_type_ == "bilin") {
@@ -181,25 +184,29 @@ void ExternAttentional::InitializeSentence(
   } else {
     THROW_ERROR("Bad attention type " << attention_type_);
   }
+  sent_mask_.clear();
 
   // If we're using a lexicon, create the values
-  if(lex_type_ != "none") {
-    vector<float> lex_data;
-    vector<unsigned int> lex_ids;
-    unsigned int start = 0;
-    for(size_t i = 0; i < sent_len_; ++i, start += lex_size_) {
-      WordId wid = (i < sent_src.size() ? sent_src[i] : 0);
-      auto it = lex_mapping_->find(wid);
-      if(it != lex_mapping_->end()) {
-        for(auto & kv : it->second) {
-          lex_ids.push_back(start + kv.first);
-          lex_data.push_back(kv.second);
-        }
+  if(lex_type_ != "none")
+    CreateLexicon(sent_src, cg);
+
+}
+
+void ExternAttentional::CreateLexicon(const Sentence & sent_src, ComputationGraph & cg) {
+  vector<float> lex_data;
+  vector<unsigned int> lex_ids;
+  unsigned int start = 0;
+  for(size_t i = 0; i < sent_len_; ++i, start += lex_size_) {
+    WordId wid = (i < sent_src.size() ? sent_src[i] : 0);
+    auto it = lex_mapping_->find(wid);
+    if(it != lex_mapping_->end()) {
+      for(auto & kv : it->second) {
+        lex_ids.push_back(start + kv.first);
+        lex_data.push_back(kv.second);
       }
     }
-    i_lexicon_ = input(cg, {(unsigned int)lex_size_, (unsigned int)sent_len_}, lex_ids, lex_data, lex_alpha_);
   }
-
+  i_lexicon_ = input(cg, {(unsigned int)lex_size_, (unsigned int)sent_len_}, lex_ids, lex_data, lex_alpha_);
 }
 
 void ExternAttentional::InitializeSentence(
@@ -261,9 +268,113 @@ void ExternAttentional::InitializeSentence(
     }
     i_lexicon_ = input(cg, Dim({(unsigned int)lex_size_, (unsigned int)sent_len_}, (unsigned int)sent_src.size()), lex_ids, lex_data, lex_alpha_);
   }
+  sent_mask_.clear();
 
 }
 
+int ExternAttentional::SaveSentence() {
+  saved_h_.push_back(i_h_);
+  saved_ehid_hpart_.push_back(i_ehid_hpart_);
+  saved_sent_len_.push_back(i_sent_len_);
+  saved_lexicon_.push_back(i_lexicon_);
+  saved_lens_.push_back(sent_len_);
+  selected_sents_.clear();
+  return saved_h_.size() - 1;
+}
+
+void ExternAttentional::SelectSentences(const std::vector<unsigned> & ids, ComputationGraph & cg) {
+  if(&cg != curr_graph_)
+    THROW_ERROR("Initialized computation graph and passed comptuation graph don't match."); 
+  if(saved_h_.size() == 0)
+    THROW_ERROR("Attempting to select sentences when none have been saved");
+  // A single sentence is simply broadcast over the batch
+  if(saved_h_.size() == 1) {
+    i_h_ = saved_h_[0]; i_ehid_hpart_ = saved_ehid_hpart_[0];
+    i_sent_len_ = saved_sent_len_[0]; i_lexicon_ = saved_lexicon_[0];
+    sent_len_ = saved_lens_[0];
+    sent_mask_.clear();
+    return;
+  }
+  // Find the sentences that are used, and their position in the combined batch
+  vector<int> sent_pos(saved_h_.size(), -1);
+  vector<unsigned> used_sents;
+  for(unsigned id : ids) {
+    if(id >= saved_h_.size())
+      THROW_ERROR("Selected sentence " << id << " but only " << saved_h_.size() << " were saved");
+    if(sent_pos[id] == -1) {
+      sent_pos[id] = used_sents.size();
+      used_sents.push_back(id);
+    }
+  }
+  // Pad the sentences to the same length and combine them, unless this has
+  // already been done for the same sentences
+  if(used_sents != selected_sents_) {
+    sent_len_ = 0;
+    for(unsigned id : used_sents)
+      sent_len_ = max(sent_len_, saved_lens_[id]);
+    vector<Expression> hs, lexicons;
+    for(unsigned id : used_sents) {
+      unsigned pad = sent_len_ - saved_lens_[id];
+      hs.push_back(pad ? concatenate_cols({saved_h_[id], zeroes(cg, {(unsigned int)context_size_, pad})}) : saved_h_[id]);
+      if(lex_type_ != "none")
+        lexicons.push_back(pad ? concatenate_cols({saved_lexicon_[id], zeroes(cg, {(unsigned int)lex_size_, pad})}) : saved_lexicon_[id]);
+    }
+    i_selected_h_ = concatenate_to_batch(hs);
+    if(hidden_size_) {
+      i_selected_hpart_ = i_ehid_h_W_*i_selected_h_;
+      sent_values_.resize(sent_len_, 1.0);
+      i_sent_len_ = input(cg, {1, (unsigned int)sent_len_}, sent_values_);
+    } else if(attention_type_ == "dot") {
+      i_selected_hpart_ = transpose(i_selected_h_);
+    } else {
+      i_selected_hpart_ = transpose(i_ehid_h_W_*i_selected_h_);
+    }
+    if(lex_type_ != "none")
+      i_selected_lexicon_ = concatenate_to_batch(lexicons);
+    selected_sents_ = used_sents;
+  }
+  // Arrange the combined sentences to match the batch
+  vector<unsigned> batch_ids(ids.size());
+  bool identity = (ids.size() == used_sents.size());
+  for(size_t i = 0; i < ids.size(); ++i) {
+    batch_ids[i] = sent_pos[ids[i]];
+    identity = identity && (batch_ids[i] == i);
+  }
+  i_h_ = (identity ? i_selected_h_ : pick_batch_elems(i_selected_h_, batch_ids));
+  i_ehid_hpart_ = (identity ? i_selected_hpart_ : pick_batch_elems(i_selected_hpart_, batch_ids));
+  if(lex_type_ != "none")
+    i_lexicon_ = (identity ? i_selected_lexicon_ : pick_batch_elems(i_selected_lexicon_, batch_ids));
+  // Mask the attention over padded words
+  sent_mask_.clear();
+  for(size_t i = 0; i < ids.size(); ++i) {
+    if(saved_lens_[ids[i]] == sent_len_) continue;
+    sent_mask_.resize(sent_len_ * ids.size(), 0.f);
+    for(int j = saved_lens_[ids[i]]; j < sent_len_; ++j)
+      sent_mask_[i * sent_len_ + j] = -1e20f;
+  }
+}
+
+std::vector<Expression> ExternAttentional::GetEncoded() const {
+  return {i_h_, i_h_last_, i_ehid_hpart_};
+}
+
+void ExternAttentional::SetEncoded(const Sentence & sent_src, const std::vector<Expression> & encoded, ComputationGraph & cg) {
+  if(&cg != curr_graph_)
+    THROW_ERROR("Initialized computation graph and passed comptuation graph don't match."); 
+  if(encoded.size() != 3)
+    THROW_ERROR("Expected 3 expressions for an encoded sentence, but got " << encoded.size());
+  i_h_ = encoded[0]; i_h_last_ = encoded[1]; i_ehid_hpart_ = encoded[2];
+  sent_len_ = i_h_.dim()[1];
+  if(hidden_size_) {
+    sent_values_.resize(sent_len_, 1.0);
+    i_sent_len_ = input(cg, {1, (unsigned int)sent_len_}, sent_values_);
+  }
+  sent_mask_.clear();
+  // The lexicon is sparse, so it is cheaper to create it again than to store it
+  if(lex_type_ != "none")
+    CreateLexicon(sent_src, cg);
+}
+
 Expression ExternAttentional::GetEmptyContext(ComputationGraph & cg) const {
   return zeroes(cg, {(unsigned int)state_size_});
 }
@@ -297,10 +408,25 @@ Expression ExternAttentional::CreateContext(
     assert(state_in.size() > 0);
     i_e = i_ehid_hpart_ * (*state_in.rbegin());
   }
-  Expression i_alpha;
+  // Mask padding when decoding sentences of different lengths together
+  if(sent_mask_.size() != 0)
+    i_e = i_e + input(cg, i_e.dim(), sent_mask_);
+  Expression i_alpha, i_align_sum = align_sum_in;
+  // When decoding sentences of different lengths together, the padded length
+  // changes as sentences are added and finished. The sums only differ in
+  // padding, which is never attended to, so they can be padded or cut to fit.
+  if(i_align_sum.pg != nullptr && i_align_sum.dim().rows() != (unsigned)sent_len_) {
+    Dim sum_dim = i_align_sum.dim();
+    if(sum_dim.rows() > (unsigned)sent_len_) {
+      i_align_sum = pick_range(i_align_sum, 0, sent_len_);
+    } else {
+      sum_dim.d[0] = sent_len_ - sum_dim.rows();
+      i_align_sum = concatenate({i_align_sum, zeroes(cg, sum_dim)});
+    }
+  }
   // Calculate the softmax, adding the previous sum if necessary
-  if(align_sum_in.pg != nullptr) {
-    i_alpha = softmax(i_e + align_sum_in * i_align_sum_W_);
+  if(i_align_sum.pg != nullptr) {
+    i_alpha = softmax(i_e + i_align_sum * i_align_sum_W_);
     // // DEBUG
     // Tensor align_sum_tens = align_sum_in.value();
     // vector<float> align_sum_val = as_vector(align_sum_in.value());
@@ -315,7 +441,7 @@ Expression ExternAttentional::CreateContext(
   }
   // Update the sum if necessary
   if(attention_hist_ == "sum") {
-    align_sum_out = (align_sum_in.pg != nullptr ? align_sum_in + i_alpha : i_alpha);
+    align_sum_out = (i_align_sum.pg != nullptr ? i_align_sum + i_alpha : i_alpha);
   }
   // i_h_ is {input_size, sent_len}, i_alpha is {sent_len, 1}
   return i_h_ * i_alpha; 
@@ -21,6 +21,7 @@ namespace lamtram {
 
 // A class to calculate extern_calcal context
 class ExternAttentional : public ExternCalculator {
+    friend class InferenceEngine;
 public:
 
     ExternAttentional(const std::vector<LinearEncoderPtr> & encoders,
@@ -37,6 +38,14 @@ public:
     virtual void InitializeSentence(const Sentence & sent, bool train, dynet::ComputationGraph & cg) override;
     virtual void InitializeSentence(const std::vector<Sentence> & sent, bool train, dynet::ComputationGraph & cg) override;
 
+    // Save and select sentences to decode several sentences together
+    virtual int SaveSentence() override;
+    virtual void SelectSentences(const std::vector<unsigned> & ids, dynet::ComputationGraph & cg) override;
+
+    // Get and restore the encoded sentence
+    virtual std::vector<dynet::Expression> GetEncoded() const override;
+    virtual void SetEncoded(const Sentence & sent, const std::vector<dynet::Expression> & encoded, dynet::ComputationGraph & cg) override;
+
     // Create a variable encoding the context
     virtual dynet::Expression CreateContext(
         // const Sentence & sent, int loc,
@@ -69,6 +78,14 @@ public:
       for(auto & enc : encoders_) enc->SetDropout(dropout);
     }
 
+    // Precompute the input projections of the encoders where their builders
+    // allow it, returning whether any were
+    bool PrecomputeProjections() {
+      bool ret = false;
+      for(auto & enc : encoders_) ret = enc->PrecomputeProjections() || ret;
+      return ret;
+    }
+
 protected:
     std::vector<LinearEncoderPtr> encoders_;
     std::string attention_type_, attention_hist_;
@@ -99,6 +116,18 @@ protected:
     dynet::Expression i_sent_len_;
     dynet::Expression i_lexicon_;
 
+    // Sentences saved for decoding together
+    std::vector<dynet::Expression> saved_h_, saved_ehid_hpart_, saved_sent_len_, saved_lexicon_;
+    std::vector<int> saved_lens_;
+    // The saved sentences currently selected, padded and combined into a batch
+    std::vector<unsigned> selected_sents_;
+    dynet::Expression i_selected_h_, i_selected_hpart_, i_selected_lexicon_;
+    // Added to the attention scores to mask the padding of shorter sentences
+    std::vector<float> sent_mask_;
+
+    // Create the lexicon probabilities for a single sentence
+    void CreateLexicon(const Sentence & sent_src, dynet::ComputationGraph & cg);
+
 private:
     // A pointer to the current computation graph.
     // This is only used for sanity checking to make sure NewGraph
@@ -116,6 +145,7 @@ typedef std::shared_ptr<ExternAttentional> ExternAttentionalPtr;
 
 // A class for feed-forward neural network LMs
 class EncoderAttentional {
+    friend class InferenceEngine;
 
 public:
 
@@ -188,6 +218,13 @@ public:
       decoder_->SetDropout(dropout);
     }
 
+    // Precompute the input projections of the encoders and decoder where
+    // their builders allow it, returning whether any were
+    bool PrecomputeProjections() {
+      bool ret = decoder_->PrecomputeProjections();
+      return extern_calc_->PrecomputeProjections() || ret;
+    }
+
 protected:
 
     // Variables
@@ -86,6 +86,14 @@ public:
       decoder_->SetDropout(dropout);
     }
 
+    // Precompute the input projections of the encoders and decoder where
+    // their builders allow it, returning whether any were
+    bool PrecomputeProjections() {
+      bool ret = decoder_->PrecomputeProjections();
+      for(auto & enc : encoders_) ret = enc->PrecomputeProjections() || ret;
+      return ret;
+    }
+
 protected:
 
     // Variables
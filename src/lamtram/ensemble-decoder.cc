@@ -1,8 +1,19 @@
 #include <lamtram/ensemble-decoder.h>
 #include <lamtram/macros.h>
+#include <lamtram/beam-select.h>
+#include <lamtram/hashes.h>
+#include <lamtram/model-utils.h>
 #include <dynet/nodes.h>
 #include <boost/range/irange.hpp>
 #include <cfloat>
+#include <climits>
+#include <algorithm>
+#include <random>
+#include <numeric>
+#include <unordered_set>
+#include <sstream>
+#include <cstring>
+#include <unistd.h>
 
 using namespace lamtram;
 using namespace std;
@@ -10,7 +21,7 @@ using namespace dynet;
 
 
 EnsembleDecoder::EnsembleDecoder(const vector<EncoderDecoderPtr> & encdecs, const vector<EncoderAttentionalPtr> & encatts, const vector<NeuralLMPtr> & lms)
-      : encdecs_(encdecs), encatts_(encatts), word_pen_(0.f), unk_pen_(1.f), size_limit_(2000), beam_size_(1), ensemble_operation_("sum") {
+      : encdecs_(encdecs), encatts_(encatts), word_pen_(0.f), unk_pen_(1.f), size_limit_(2000), beam_size_(1), beam_batch_(false), beam_adaptive_(false), beam_prune_rel_(0.f), beam_prune_abs_(0.f), recombine_(false), class_search_(true), mips_probes_(0), draft_len_(4), encoder_cache_size_(0), max_decode_ms_(0), num_timeouts_(0), ensemble_threads_(1), parallel_(nullptr), params_released_(false), ensemble_operation_("sum") {
   if(encdecs.size() + encatts.size() + lms.size() == 0)
     THROW_ERROR("Cannot decode with no models!");
   for(auto & ed : encdecs) {
@@ -26,19 +37,384 @@ EnsembleDecoder::EnsembleDecoder(const vector<EncoderDecoderPtr> & encdecs, cons
     externs_.push_back(NULL);
   }
   unk_id_ = lms_[0]->GetUnkId();
+  unk_pos_ = unk_id_;
   unk_log_prob_ = -log(lms_[0]->GetVocabSize());
+  history_len_ = 0;
+  for(auto & lm : lms_)
+    history_len_ = max(history_len_, max(lm->GetNgramContext(), lm->GetSoftmax().GetCtxtLen()));
+  recombine_ = CanRecombine();
+}
+
+bool EnsembleDecoder::CanRecombine() const {
+  // Attention keeps state over the whole history through the alignments
+  for(int j : boost::irange(0, (int)lms_.size()))
+    if(lms_[j]->IsRecurrent() || externs_[j].get() != nullptr)
+      return false;
+  return true;
+}
+
+bool EnsembleDecoder::CanClassSearch() const {
+  if(shortlist_.get() != nullptr || ensemble_threads_ > 1) return false;
+  if(lms_.size() > 1 && ensemble_operation_ != "sum") return false;
+  for(auto & lm : lms_)
+    if(!lm->GetSoftmax().HasClasses() || lm->GetSoftmax().GetClassWords() != lms_[0]->GetSoftmax().GetClassWords())
+      return false;
+  return true;
+}
+
+inline EnsembleDecoderEncoded::Value GetCachedValue(const Expression & expr) {
+  return make_pair(expr.dim(), as_vector(expr.value()));
+}
+
+// Clears the process group of a call when it returns, if the call set it
+class ParallelCallGuard {
+public:
+  ParallelCallGuard(ProcessGroup *& group, bool active) : group_(group), active_(active) { }
+  ~ParallelCallGuard() { if(active_) group_ = nullptr; }
+protected:
+  ProcessGroup *& group_;
+  bool active_;
+};
+
+void EnsembleDecoder::SetEnsembleThreads(int ensemble_threads) {
+  ensemble_threads_ = max(min(ensemble_threads, (int)lms_.size()), 1);
+  parallel_group_.reset();
+}
+
+bool EnsembleDecoder::SetFastInference(bool fast_inference, bool quantize, ParamPrecision precision, bool precompute_inputs) {
+  CheckParameters();
+  fast_.reset();
+  string reason;
+  if(fast_inference && encatts_.size() == 1 && lms_.size() == 1 && InferenceEngine::IsSupported(*encatts_[0], reason))
+    fast_.reset(new InferenceEngine(*encatts_[0], quantize, precision, precompute_inputs));
+  return fast_.get() != nullptr;
+}
+
+size_t EnsembleDecoder::ReleaseParameters(dynet::ParameterCollection & mod) {
+  if(!IsEngineOnly())
+    THROW_ERROR("The parameters of the model can only be released when the inference engine decodes every sentence");
+  params_released_ = true;
+  return ModelUtils::ReleaseParameters(mod);
+}
+
+void EnsembleDecoder::CheckParameters() const {
+  if(params_released_)
+    THROW_ERROR("The parameters of the model were released after copying them to the inference engine, so they cannot be used again");
+}
+
+// Sentences are sent between processes as text
+inline void WriteSents(ostream & out, const vector<Sentence> & sents) {
+  out << sents.size();
+  for(const Sentence & sent : sents) {
+    out << ' ' << sent.size();
+    for(WordId wid : sent) out << ' ' << wid;
+  }
+}
+
+inline vector<Sentence> ReadSents(istream & in) {
+  size_t num_sents = 0, sent_size;
+  in >> num_sents;
+  vector<Sentence> sents(num_sents);
+  for(Sentence & sent : sents) {
+    in >> sent_size;
+    sent.resize(sent_size);
+    for(WordId & wid : sent) in >> wid;
+  }
+  if(!in) THROW_ERROR("Could not read the sentences sent by another process");
+  return sents;
+}
+
+// Scoring calls send the source followed by the targets, and whether they
+// are scored together as a batch
+inline vector<Sentence> JoinSents(const Sentence & sent_src, const Sentence & sent_trg) { return {sent_src, sent_trg}; }
+inline vector<Sentence> JoinSents(const Sentence & sent_src, const vector<Sentence> & sent_trgs) {
+  vector<Sentence> ret(1, sent_src);
+  ret.insert(ret.end(), sent_trgs.begin(), sent_trgs.end());
+  return ret;
+}
+inline int IsBatch(const Sentence & sent) { return 0; }
+inline int IsBatch(const vector<Sentence> & sents) { return 1; }
+
+// Values are sent between processes as the size and batch size of a vector,
+// followed by its contents
+inline void AppendValues(const Tensor & tensor, string & data) {
+  unsigned sizes[2] = {tensor.d.batch_size(), tensor.d.bd};
+  vector<float> vals = as_vector(tensor);
+  data.append((const char*)sizes, sizeof(sizes));
+  data.append((const char*)vals.data(), vals.size() * sizeof(float));
+}
+
+inline Expression ReadValues(const string & data, size_t & pos, ComputationGraph & cg) {
+  unsigned sizes[2];
+  if(pos + sizeof(sizes) > data.size()) THROW_ERROR("Values received from another process were truncated");
+  memcpy(sizes, &data[pos], sizeof(sizes));
+  pos += sizeof(sizes);
+  vector<float> vals(sizes[0] * sizes[1]);
+  if(pos + vals.size() * sizeof(float) > data.size()) THROW_ERROR("Values received from another process were truncated");
+  memcpy(vals.data(), &data[pos], vals.size() * sizeof(float));
+  pos += vals.size() * sizeof(float);
+  return input(cg, Dim({sizes[0]}, sizes[1]), vals);
+}
+
+// Send only the values of some words of each batch element of a vector
+inline void AppendValues(const vector<float> & vals, unsigned size, const vector<unsigned> & ids, string & data) {
+  unsigned sizes[2] = {(unsigned)ids.size(), (unsigned)(vals.size() / size)};
+  vector<float> picked;
+  for(unsigned b = 0; b < sizes[1]; b++)
+    for(unsigned id : ids)
+      picked.push_back(vals[b * size + id]);
+  data.append((const char*)sizes, sizeof(sizes));
+  data.append((const char*)picked.data(), picked.size() * sizeof(float));
+}
+
+inline void AppendIds(const vector<unsigned> & ids, string & data) {
+  unsigned size = ids.size();
+  data.append((const char*)&size, sizeof(size));
+  data.append((const char*)ids.data(), ids.size() * sizeof(unsigned));
+}
+
+inline void ReadIds(const string & data, size_t & pos, vector<unsigned> & ids) {
+  unsigned size;
+  if(pos + sizeof(size) > data.size()) THROW_ERROR("Values received from another process were truncated");
+  memcpy(&size, &data[pos], sizeof(size));
+  pos += sizeof(size);
+  ids.resize(size);
+  if(pos + ids.size() * sizeof(unsigned) > data.size()) THROW_ERROR("Values received from another process were truncated");
+  memcpy(ids.data(), &data[pos], ids.size() * sizeof(unsigned));
+  pos += ids.size() * sizeof(unsigned);
+}
+
+inline bool ReadFlag(const string & data, size_t & pos) {
+  if(pos >= data.size()) THROW_ERROR("Values received from another process were truncated");
+  return data[pos++] == '1';
+}
+
+// Find the words that a beam search keeping num_cands candidates may select
+// from any of the distributions over size words in vals. The word penalty is
+// added to all words but the sentence end, and the unknown word penalty only
+// to the unknown word, so the others keep their order and only the num_cands
+// best of them are needed. Ties are broken by ID, as in BeamSelector.
+inline vector<unsigned> FindCandidates(const vector<float> & vals, unsigned size, int num_cands, int unk_pos) {
+  vector<bool> found(size, false);
+  found[0] = true;
+  if(unk_pos >= 0 && unk_pos < (int)size) found[unk_pos] = true;
+  vector<unsigned> order;
+  for(size_t start = 0; start < vals.size(); start += size) {
+    const float * elem = &vals[start];
+    order.clear();
+    for(unsigned i = 1; i < size; i++)
+      if((int)i != unk_pos) order.push_back(i);
+    size_t num_best = min((size_t)num_cands, order.size());
+    nth_element(order.begin(), order.begin() + num_best, order.end(), [elem](unsigned a, unsigned b) {
+      return elem[a] > elem[b] || (elem[a] == elem[b] && a < b);
+    });
+    for(size_t i = 0; i < num_best; i++)
+      found[order[i]] = true;
+  }
+  vector<unsigned> ids;
+  for(unsigned i = 0; i < size; i++)
+    if(found[i]) ids.push_back(i);
+  return ids;
+}
+
+bool EnsembleDecoder::BeginParallelCall(int type, int size, const vector<Sentence> & sent_srcs, int max_words, int max_graph_sents) {
+  // Calls made while serving another process are not passed on again
+  if(ensemble_threads_ <= 1 || parallel_ != nullptr) return false;
+  // Groups are not shared with processes forked after they were created
+  if(parallel_group_.get() == nullptr || parallel_group_->GetOwner() != getpid())
+    parallel_group_.reset(new ProcessGroup(ensemble_threads_, [this](ProcessGroup & group) { ServeParallelCalls(group); }));
+  ostringstream out;
+  out << type << ' ' << size << ' ' << max_words << ' ' << max_graph_sents << ' ';
+  // Settings may have changed since the processes were started. Penalties
+  // are written with enough digits to be read back exactly.
+  out.precision(9);
+  out << word_pen_ << ' ' << unk_pen_ << ' ' << size_limit_ << ' ' << beam_size_ << ' ' << beam_batch_ << ' ' << beam_adaptive_ << ' ' << beam_prune_rel_ << ' ' << beam_prune_abs_ << ' ' << recombine_ << ' ' << class_search_ << ' ' << mips_probes_ << ' ' << max_decode_ms_ << ' ' << ensemble_operation_ << ' ';
+  WriteSents(out, sent_srcs);
+  // Sampling must draw the same random numbers in all processes
+  if(type == 3) out << ' ' << *dynet::rndeng;
+  string data = out.str();
+  parallel_group_->Broadcast(data);
+  parallel_ = parallel_group_.get();
+  return true;
+}
+
+void EnsembleDecoder::ServeParallelCalls(ProcessGroup & group) {
+  // Make the same calls as the first process, which receives the results
+  string data;
+  while(group.Broadcast(data)) {
+    istringstream in(data);
+    int type, size, max_words, max_graph_sents;
+    in >> type >> size >> max_words >> max_graph_sents;
+    in >> word_pen_ >> unk_pen_ >> size_limit_ >> beam_size_ >> beam_batch_ >> beam_adaptive_ >> beam_prune_rel_ >> beam_prune_abs_ >> recombine_ >> class_search_ >> mips_probes_ >> max_decode_ms_ >> ensemble_operation_;
+    vector<Sentence> sent_srcs = ReadSents(in);
+    parallel_ = &group;
+    ParallelCallGuard guard(parallel_, true);
+    if(type == 0) {
+      GenerateNbest(sent_srcs[0], size);
+    } else if(type == 1) {
+      GenerateNbest(sent_srcs, size);
+    } else if(type == 2) {
+      GenerateNbestContinuous([&](bool wait, int & id, Sentence & sent_src) {
+        string sent_data;
+        if(!group.Broadcast(sent_data)) THROW_ERROR("Process 0 stopped before sending the next sentence");
+        istringstream sent_in(sent_data);
+        bool found;
+        sent_in >> found >> id;
+        sent_src = ReadSents(sent_in)[0];
+        return found;
+      }, size, max_words, [](int id, const vector<EnsembleDecoderHypPtr> & nbest) { }, max_graph_sents);
+    } else if(type == 3) {
+      in >> *dynet::rndeng;
+      SampleSentences(sent_srcs, size);
+    } else if(type == 4) {
+      if(size == 0) {
+        LLStats ll(0);
+        vector<float> wordll;
+        CalcSentLL(sent_srcs[0], sent_srcs[1], ll, wordll);
+      } else {
+        vector<Sentence> sent_trgs(sent_srcs.begin() + 1, sent_srcs.end());
+        vector<LLStats> ll(sent_trgs.size(), LLStats(0));
+        vector<vector<float> > wordll(sent_trgs.size());
+        CalcSentLL(sent_srcs[0], sent_trgs, ll, wordll);
+      }
+    } else {
+      THROW_ERROR("Bad call received from process 0: " << type);
+    }
+  }
 }
 
 vector<vector<Expression> > EnsembleDecoder::GetInitialStates(const Sentence & sent_src, ComputationGraph & cg) {
   vector<vector<Expression> > last_state(encdecs_.size() + encatts_.size() + lms_.size());
   int id = 0;
-  for(auto & tm : encdecs_)
-    last_state[id++] = tm->GetEncodedState(sent_src, false, cg);
+  // If the sentence has already been encoded, restore the values
+  auto it = (encoder_cache_size_ > 0 && parallel_ == nullptr ? encoder_cache_.find(sent_src) : encoder_cache_.end());
+  if(it != encoder_cache_.end()) {
+    const EnsembleDecoderEncoded & encoded = it->second;
+    for(size_t j = 0; j < encoded.states_.size(); j++)
+      for(auto & val : encoded.states_[j])
+        last_state[j].push_back(input(cg, val.first, val.second));
+    for(size_t j = 0; j < encoded.externs_.size(); j++) {
+      if(externs_[j].get() == nullptr) continue;
+      vector<Expression> exprs;
+      for(auto & val : encoded.externs_[j])
+        exprs.push_back(input(cg, val.first, val.second));
+      externs_[j]->SetEncoded(sent_src, exprs, cg);
+    }
+    return last_state;
+  }
+  for(auto & tm : encdecs_) {
+    if(IsLocalModel(id)) last_state[id] = tm->GetEncodedState(sent_src, false, cg);
+    id++;
+  }
   for(int i : boost::irange(0, (int)encatts_.size()))
-    last_state[id + i] = encatts_[i]->GetEncodedState(sent_src, false, cg);
+    if(IsLocalModel(id + i)) last_state[id + i] = encatts_[i]->GetEncodedState(sent_src, false, cg);
+  // Save the values of the encoded sentence, removing the oldest if the cache is full
+  if(encoder_cache_size_ > 0 && parallel_ == nullptr) {
+    EnsembleDecoderEncoded & encoded = encoder_cache_[sent_src];
+    encoded.states_.resize(last_state.size());
+    for(size_t j = 0; j < last_state.size(); j++)
+      for(auto & expr : last_state[j])
+        encoded.states_[j].push_back(GetCachedValue(expr));
+    encoded.externs_.resize(externs_.size());
+    for(size_t j = 0; j < externs_.size(); j++)
+      if(externs_[j].get() != nullptr)
+        for(auto & expr : externs_[j]->GetEncoded())
+          encoded.externs_[j].push_back(GetCachedValue(expr));
+    encoder_cache_order_.push_back(sent_src);
+    if((int)encoder_cache_order_.size() > encoder_cache_size_) {
+      encoder_cache_.erase(encoder_cache_order_.front());
+      encoder_cache_order_.pop_front();
+    }
+  }
   return last_state;
 }
 
+vector<vector<Expression> > EnsembleDecoder::GetInitialStates(const vector<Sentence> & sent_srcs, ComputationGraph & cg) {
+  // Encode each sentence separately, saving it so it can be attended to later
+  vector<vector<vector<Expression> > > sent_states;
+  for(const Sentence & sent_src : sent_srcs) {
+    sent_states.push_back(GetInitialStates(sent_src, cg));
+    for(int j : boost::irange(0, (int)externs_.size()))
+      if(externs_[j].get() != nullptr && IsLocalModel(j)) externs_[j]->SaveSentence();
+  }
+  if(sent_states.size() == 1) return sent_states[0];
+  // Combine the states of the sentences into a batch
+  vector<vector<Expression> > last_state(sent_states[0].size());
+  for(size_t j = 0; j < last_state.size(); j++) {
+    for(size_t k = 0; k < sent_states[0][j].size(); k++) {
+      vector<Expression> exprs;
+      for(auto & states : sent_states)
+        exprs.push_back(states[j][k]);
+      last_state[j].push_back(concatenate_to_batch(exprs));
+    }
+  }
+  return last_state;
+}
+
+vector<unsigned> EnsembleDecoder::InitializeShortlist(const vector<Sentence> & sent_srcs, ComputationGraph & cg, int & unk_pos) {
+  unk_pos = unk_pos_ = unk_id_;
+  if(shortlist_.get() == nullptr) return vector<unsigned>();
+  vector<unsigned> cands = shortlist_->GetCandidates(sent_srcs);
+  assert(cands.size() > 0 && cands[0] == 0);
+  auto it = lower_bound(cands.begin(), cands.end(), (unsigned)unk_id_);
+  unk_pos = unk_pos_ = (it != cands.end() && *it == (unsigned)unk_id_ ? it - cands.begin() : -1);
+  for(auto & lm : lms_)
+    lm->GetSoftmax().SetShortlist(cands, cg);
+  return cands;
+}
+
+bool EnsembleDecoder::SetMips(int num_clusters, int probes) {
+  CheckParameters();
+  mips_probes_ = 0;
+  if(probes > 0 && lms_.size() != 1) return false;
+  if(probes > 0)
+    lms_[0]->GetSoftmax().BuildMipsIndex(num_clusters);
+  mips_probes_ = probes;
+  return true;
+}
+
+void EnsembleDecoder::InitializeMips() {
+  if(mips_probes_ > 0)
+    lms_[0]->GetSoftmax().SetMipsProbes(mips_probes_);
+}
+
+void EnsembleDecoder::AddCandidates(const float * log_probs, int size, const vector<unsigned> & ids, float hyp_score, int unk_id, int hyp_id, int align, BeamSelector & selector) const {
+  if(ids.size() != 0)
+    selector.AddWords(log_probs, ids.data(), size, hyp_score, word_pen_, unk_id, unk_pen_ * unk_log_prob_, hyp_id, align);
+  else
+    selector.AddHypothesis(log_probs, size, hyp_score, word_pen_, unk_id, unk_pen_ * unk_log_prob_, hyp_id, align);
+}
+
+bool EnsembleDecoder::InitializeClassSearch() {
+  if(!class_search_ || !CanClassSearch()) return false;
+  for(auto & lm : lms_)
+    lm->GetSoftmax().SetClassSearch(true);
+  return true;
+}
+
+void EnsembleDecoder::AddClassCandidates(const float * class_log_probs, int num_classes, float hyp_score, int unk_id, int hyp_id, int align, BeamSelector & selector, ComputationGraph & cg) {
+  const vector<vector<unsigned> > & class_words = lms_[0]->GetSoftmax().GetClassWords();
+  vector<int> order(num_classes);
+  iota(order.begin(), order.end(), 0);
+  sort(order.begin(), order.end(), [&](int a, int b) { return class_log_probs[a] > class_log_probs[b]; });
+  // No word has a higher probability than its class, but the penalties may
+  // still raise its score
+  float unk_score = unk_pen_ * unk_log_prob_, max_bonus = max(word_pen_, 0.f) + max(unk_score, 0.f);
+  for(int c : order) {
+    if(hyp_score + class_log_probs[c] + max_bonus < selector.GetThreshold()) break;
+    vector<Expression> i_words;
+    for(auto & lm : lms_)
+      i_words.push_back(lm->GetSoftmax().CalcClassLogProb(c));
+    if(i_words.size() > 1) {
+      for(auto & i_word : i_words) i_word = exp(i_word);
+      i_words = vector<Expression>(1, log(average(i_words)));
+    }
+    vector<float> word_log_probs = as_vector(cg.incremental_forward(i_words[0]));
+    selector.AddWords(word_log_probs.data(), class_words[c].data(), class_words[c].size(),
+                      hyp_score, word_pen_, unk_id, unk_score, hyp_id, align);
+  }
+}
+
 Expression EnsembleDecoder::EnsembleProbs(const std::vector<Expression> & in, ComputationGraph & cg) {
   if(in.size() == 1) return in[0];
   return average(in);
@@ -169,6 +545,9 @@ inline int GetWord(const Sentence & vec, int t) { return vec[t]; }
 
 template <class Sent, class Stat, class WordStat>
 void EnsembleDecoder::CalcSentLL(const Sentence & sent_src, const Sent & sent_trg, Stat & ll, WordStat & wordll) {
+  CheckParameters();
+  ParallelCallGuard guard(parallel_, BeginParallelCall(4, IsBatch(sent_trg), JoinSents(sent_src, sent_trg)));
+
   // First initialize states and do encoding as necessary
   ComputationGraph cg;
   for(auto & tm : encdecs_) tm->NewGraph(cg);
@@ -184,10 +563,18 @@ void EnsembleDecoder::CalcSentLL(const Sentence & sent_src, const Sent & sent_tr
     // Perform the forward step on all models
     vector<Expression> i_sms;
     for(int j : boost::irange(0, (int)lms_.size()))
-      i_sms.push_back(lms_[j]->Forward<Sent>(sent_trg, t, externs_[j].get(), ensemble_operation_ == "logsum", last_state[j], last_extern[j], align_sums[j], next_state[j], next_extern[j], align_sums[j], cg, aligns));
-    // Ensemble the probabilities and calculate the likelihood
+      if(IsLocalModel(j))
+        i_sms.push_back(lms_[j]->Forward<Sent>(sent_trg, t, externs_[j].get(), ensemble_operation_ == "logsum", last_state[j], last_extern[j], align_sums[j], next_state[j], next_extern[j], align_sums[j], cg, aligns));
+    // Ensemble the probabilities and calculate the likelihood. When the models
+    // are split between processes, each only keeps what the average needs:
+    // the sum of its models' probabilities of the word, or of their log
+    // probabilities.
     Expression i_logprob;
-    if(ensemble_operation_ == "sum") {
+    if(parallel_ != nullptr && ensemble_operation_ == "sum") {
+      i_logprob = EnsembleSingleProb(i_sms, sent_trg, t, cg) * (float)i_sms.size();
+    } else if(parallel_ != nullptr && ensemble_operation_ == "logsum") {
+      i_logprob = sum(i_sms);
+    } else if(ensemble_operation_ == "sum") {
       i_logprob = EnsembleSingleProb(i_sms, sent_trg, t, cg);
       i_logprob = log({i_logprob});
     } else if(ensemble_operation_ == "logsum") {
@@ -201,6 +588,24 @@ void EnsembleDecoder::CalcSentLL(const Sentence & sent_src, const Sent & sent_tr
     last_state = next_state;
     last_extern = next_extern;
   }
+  // The sums of all processes are exchanged once for the whole sentence, and
+  // the first process ensembles them
+  if(parallel_ != nullptr) {
+    string data;
+    for(auto & i_part : errs)
+      AppendValues(cg.incremental_forward(i_part), data);
+    vector<string> all;
+    parallel_->Gather(data, all);
+    if(parallel_->GetProc() != 0) return;
+    vector<size_t> pos(all.size(), 0);
+    for(int t : boost::irange(0, max_len)) {
+      vector<Expression> i_parts;
+      for(size_t p = 0; p < all.size(); p++)
+        i_parts.push_back(ReadValues(all[p], pos[p], cg));
+      Expression i_average = sum(i_parts) * (1.f / lms_.size());
+      errs[t] = (ensemble_operation_ == "sum" ? log(i_average) : EnsembleSingleLogProb(vector<Expression>(1, log_softmax(i_average)), sent_trg, t, cg));
+    }
+  }
   Expression err = sum(errs);
   cg.incremental_forward(err);
   AddLik(sent_trg, err, errs, ll, wordll);
@@ -216,57 +621,449 @@ EnsembleDecoderHypPtr EnsembleDecoder::Generate(const Sentence & sent_src) {
   return (nbest.size() > 0 ? nbest[0] : EnsembleDecoderHypPtr());
 }
 
+// Pick the elements of a batched state that correspond to each hypothesis,
+// skipping the pick when it would just copy the expression as-is
+inline Expression PickBatchElems(const Expression & expr, const vector<unsigned> & ids) {
+  if(expr.pg == nullptr) return expr;
+  if(expr.dim().bd == ids.size()) {
+    size_t i;
+    for(i = 0; i < ids.size() && ids[i] == i; i++);
+    if(i == ids.size()) return expr;
+  }
+  return pick_batch_elems(expr, ids);
+}
+
+// Get a pointer to the values of batch element b in host memory,
+// copying them off of the device when running on a GPU
+inline const float* HostBatchValues(const Tensor & tensor, int b, vector<float> & buf) {
+#ifdef HAVE_CUDA
+  if(buf.size() == 0) buf = as_vector(tensor);
+  return buf.data() + b * tensor.d.batch_size();
+#else
+  return tensor.v + b * tensor.d.batch_size();
+#endif
+}
+
+// Get the last len words of a hypothesis in the arena, padded with the sentence
+// end at the front. Models only look at a fixed number of previous words, so
+// this can be passed as the sentence instead of the full history.
+inline Sentence GetHistory(const vector<EnsembleDecoderNode> & arena, int id, int len) {
+  Sentence ret(len, 0);
+  for(int i = len-1; i >= 0 && arena[id].parent_ != -1; i--, id = arena[id].parent_)
+    ret[i] = arena[id].word_;
+  return ret;
+}
+
+// Create the full hypothesis for a node in the arena
+inline EnsembleDecoderHypPtr CreateHyp(const vector<EnsembleDecoderNode> & arena, int id) {
+  Sentence sent, align;
+  float score = arena[id].score_;
+  for(; arena[id].parent_ != -1; id = arena[id].parent_) {
+    sent.push_back(arena[id].word_);
+    align.push_back(arena[id].align_);
+  }
+  reverse(sent.begin(), sent.end());
+  reverse(align.begin(), align.end());
+  return EnsembleDecoderHypPtr(new EnsembleDecoderHyp(score, sent, align));
+}
+
+Expression EnsembleDecoder::EnsembleNextLogProbs(vector<Expression> & i_softmaxes, vector<Expression> & i_aligns, ComputationGraph & cg, int num_cands) {
+  vector<vector<Expression> > step_softmaxes(1, i_softmaxes), step_aligns(1, i_aligns);
+  vector<vector<unsigned> > cand_ids;
+  Expression i_logprob = EnsembleNextLogProbs(step_softmaxes, step_aligns, cg, num_cands, cand_ids)[0];
+  i_aligns = step_aligns[0];
+  cand_ids_ = cand_ids[0];
+  return i_logprob;
+}
+
+vector<Expression> EnsembleDecoder::EnsembleNextLogProbs(vector<vector<Expression> > & i_softmaxes, vector<vector<Expression> > & i_aligns, ComputationGraph & cg, int num_cands, vector<vector<unsigned> > & cand_ids) {
+  size_t num_steps = i_softmaxes.size();
+  vector<Expression> i_logprobs(num_steps);
+  cand_ids.assign(num_steps, vector<unsigned>());
+  if(ensemble_operation_ != "sum" && ensemble_operation_ != "logsum")
+    THROW_ERROR("Bad ensembling operation: " << ensemble_operation_ << endl);
+  if(parallel_ == nullptr) {
+    // Ensemble and calculate the likelihood
+    for(size_t s = 0; s < num_steps; s++)
+      i_logprobs[s] = (ensemble_operation_ == "sum" ? log({EnsembleProbs(i_softmaxes[s], cg)}) : EnsembleLogProbs(i_softmaxes[s], cg));
+    return i_logprobs;
+  }
+  // When the models are split between processes, each sends the sum of the
+  // outputs of its models, which is all the average needs, and the sum of
+  // their alignments. The sums of all steps are added after the models, so
+  // they are calculated with a single forward pass.
+  vector<Expression> i_sums(num_steps), i_align_sums(num_steps);
+  for(size_t s = 0; s < num_steps; s++) {
+    vector<Expression> i_local;
+    for(int j : boost::irange(0, (int)lms_.size()))
+      if(IsLocalModel(j)) i_local.push_back(i_softmaxes[s][j]);
+    i_sums[s] = sum(i_local);
+    if(i_aligns[s].size() != 0) i_align_sums[s] = sum(i_aligns[s]);
+  }
+  string data;
+  for(size_t s = 0; s < num_steps; s++) {
+    AppendValues(cg.incremental_forward(i_sums[s]), data);
+    data += (i_align_sums[s].pg != nullptr ? '1' : '0');
+    if(i_align_sums[s].pg != nullptr) AppendValues(cg.incremental_forward(i_align_sums[s]), data);
+  }
+  vector<string> all;
+  parallel_->Gather(data, all);
+  // The first process ensembles them, and sends back the distributions, or
+  // only the words that can be selected
+  if(parallel_->GetProc() == 0) {
+    data.clear();
+    vector<size_t> pos(all.size(), 0);
+    vector<float> vals;
+    for(size_t s = 0; s < num_steps; s++) {
+      vector<Expression> i_parts, i_part_aligns;
+      for(size_t p = 0; p < all.size(); p++) {
+        i_parts.push_back(ReadValues(all[p], pos[p], cg));
+        if(ReadFlag(all[p], pos[p])) i_part_aligns.push_back(ReadValues(all[p], pos[p], cg));
+      }
+      Expression i_average = sum(i_parts) * (1.f / lms_.size());
+      Tensor tensor = cg.incremental_forward(ensemble_operation_ == "sum" ? log(i_average) : log_softmax(i_average));
+      if(num_cands > 0) {
+        vals = as_vector(tensor);
+        vector<unsigned> ids = FindCandidates(vals, tensor.d.batch_size(), num_cands, unk_pos_);
+        AppendIds(ids, data);
+        AppendValues(vals, tensor.d.batch_size(), ids, data);
+      } else {
+        AppendValues(tensor, data);
+      }
+      data += (i_part_aligns.size() != 0 ? '1' : '0');
+      if(i_part_aligns.size() != 0) AppendValues(cg.incremental_forward(sum(i_part_aligns)), data);
+    }
+  }
+  if(!parallel_->Broadcast(data))
+    THROW_ERROR("Process 0 stopped before sending the ensembled values");
+  // All processes use the values that were sent, so they make the same decisions
+  size_t pos = 0;
+  for(size_t s = 0; s < num_steps; s++) {
+    if(num_cands > 0) ReadIds(data, pos, cand_ids[s]);
+    i_logprobs[s] = ReadValues(data, pos, cg);
+    i_aligns[s].clear();
+    if(ReadFlag(data, pos)) i_aligns[s].push_back(ReadValues(data, pos, cg));
+  }
+  return i_logprobs;
+}
+
+void EnsembleDecoder::ShareTimeouts(string & timeouts) {
+  // Only the first process keeps time, so that all stop at the same step
+  if(parallel_ == nullptr || max_decode_ms_ <= 0) return;
+  if(!parallel_->Broadcast(timeouts))
+    THROW_ERROR("Process 0 stopped before sending the timeouts");
+}
+
+bool EnsembleDecoder::TimedOut(Timer & timer) {
+  if(max_decode_ms_ <= 0) return false;
+  string timeouts(1, (timer.Elapsed() * 1000 >= max_decode_ms_ ? '1' : '0'));
+  ShareTimeouts(timeouts);
+  return timeouts[0] == '1';
+}
+
+void EnsembleDecoder::FinishTimedOut(const vector<EnsembleDecoderNode> & arena, const vector<int> & beam, vector<EnsembleDecoderHypPtr> & nbest) {
+  num_timeouts_++;
+  // Use the best unfinished hypothesis if none have finished
+  if(nbest.size() == 0 && beam.size() != 0)
+    nbest.push_back(CreateHyp(arena, beam[0]));
+  for(auto & hyp : nbest)
+    hyp->SetTruncated(true);
+}
+
+vector<BeamCandidate> EnsembleDecoder::SelectCandidates(const BeamSelector & selector, float entropy, const vector<EnsembleDecoderNode> & arena, const vector<int> & parents, const vector<unsigned> & vocab) const {
+  vector<BeamCandidate> cands = selector.GetBest();
+  if(recombine_) RecombineCandidates(arena, parents, vocab, cands);
+  if(cands.size() > (size_t)beam_size_)
+    cands.erase(cands.begin() + beam_size_, cands.end());
+  if(beam_adaptive_ && entropy >= 0.f)
+    cands.erase(cands.begin() + min(cands.size(), (size_t)AdaptiveBeamSize(entropy, beam_size_)), cands.end());
+  PruneCandidates(cands, beam_prune_rel_, beam_prune_abs_);
+  return cands;
+}
+
+void EnsembleDecoder::RecombineCandidates(const vector<EnsembleDecoderNode> & arena, const vector<int> & parents, const vector<unsigned> & vocab, vector<BeamCandidate> & cands) const {
+  // Candidates are sorted, so the first with each context is the best
+  unordered_set<Sentence> seen;
+  size_t num_kept = 0;
+  for(size_t i = 0; i < cands.size(); i++) {
+    WordId wid = (vocab.size() ? vocab[cands[i].word_id_] : cands[i].word_id_);
+    // Finished hypotheses are never extended, so they are always kept
+    if(wid != 0) {
+      Sentence ctxt = GetHistory(arena, parents[cands[i].hyp_id_], history_len_);
+      ctxt.push_back(wid);
+      ctxt.erase(ctxt.begin());
+      if(!seen.insert(ctxt).second) continue;
+    }
+    if(num_kept != i) cands[num_kept] = cands[i];
+    num_kept++;
+  }
+  cands.erase(cands.begin() + num_kept, cands.end());
+}
+
+vector<Expression> EnsembleDecoder::CalcNextSoftmaxes(const Sentence & sent, int t, const EnsembleDecoderState & state_in, EnsembleDecoderState & state_out, ComputationGraph & cg, vector<Expression> & i_aligns) {
+  vector<Expression> i_softmaxes(lms_.size());
+  for(int j : boost::irange(0, (int)lms_.size()))
+    if(IsLocalModel(j))
+      i_softmaxes[j] = lms_[j]->Forward(sent, t, externs_[j].get(), ensemble_operation_ == "logsum", state_in.states_[j], state_in.externs_[j], state_in.sums_[j], state_out.states_[j], state_out.externs_[j], state_out.sums_[j], cg, i_aligns);
+  return i_softmaxes;
+}
+
+Expression EnsembleDecoder::CalcNextLogProb(const Sentence & sent, int t, const EnsembleDecoderState & state_in, EnsembleDecoderState & state_out, ComputationGraph & cg, vector<Expression> & i_aligns, int num_cands) {
+  // Perform the forward step on all models
+  vector<Expression> i_softmaxes = CalcNextSoftmaxes(sent, t, state_in, state_out, cg, i_aligns);
+  return EnsembleNextLogProbs(i_softmaxes, i_aligns, cg, num_cands);
+}
+
+// Combine expressions picked from the states of several runs of a batch, where
+// parts[i] holds sizes[i] elements. Parts missing from initial states are filled
+// with zeros, as are the ends of vectors shorter than the longest, which only
+// happens for attention sums over sentences with different padding.
+inline Expression CombineBatch(const vector<Expression> & parts, const vector<unsigned> & sizes, ComputationGraph & cg) {
+  if(parts.size() == 1) return parts[0];
+  Dim part_dim;
+  unsigned rows = 0;
+  for(auto & part : parts) {
+    if(part.pg != nullptr && part.dim().rows() > rows) {
+      part_dim = part.dim();
+      rows = part_dim.rows();
+    }
+  }
+  if(rows == 0) return Expression();
+  vector<Expression> combined;
+  for(size_t i = 0; i < parts.size(); i++) {
+    if(parts[i].pg == nullptr) {
+      Dim zero_dim = part_dim; zero_dim.bd = sizes[i];
+      combined.push_back(zeroes(cg, zero_dim));
+    } else if(parts[i].dim().rows() < rows) {
+      Dim zero_dim = parts[i].dim(); zero_dim.d[0] = rows - zero_dim.rows();
+      combined.push_back(concatenate({parts[i], zeroes(cg, zero_dim)}));
+    } else {
+      combined.push_back(parts[i]);
+    }
+  }
+  return concatenate_to_batch(combined);
+}
+
+Expression EnsembleDecoder::CalcNextLogProbs(const vector<Sentence> & sents, int t, const vector<const EnsembleDecoderState*> & states_in, const vector<unsigned> & batch_ids, const vector<unsigned> & batch_sids, EnsembleDecoderState & state_out, ComputationGraph & cg, vector<Expression> & i_aligns, int num_cands) {
+  for(int j : boost::irange(0, (int)externs_.size()))
+    if(externs_[j].get() != nullptr && IsLocalModel(j)) externs_[j]->SelectSentences(batch_sids, cg);
+  // Split the batch into runs of hypotheses that use the same states
+  vector<size_t> run_starts;
+  for(size_t i = 0; i < states_in.size(); i++)
+    if(i == 0 || states_in[i] != states_in[i-1])
+      run_starts.push_back(i);
+  run_starts.push_back(states_in.size());
+  int num_runs = run_starts.size() - 1;
+  vector<vector<unsigned> > run_ids(num_runs);
+  vector<unsigned> run_sizes(num_runs);
+  for(int r = 0; r < num_runs; r++) {
+    run_ids[r] = vector<unsigned>(batch_ids.begin() + run_starts[r], batch_ids.begin() + run_starts[r+1]);
+    run_sizes[r] = run_ids[r].size();
+  }
+  // Perform the forward step on all models, arranging the states to match the batch
+  vector<Expression> i_softmaxes(lms_.size());
+  vector<Expression> parts(num_runs);
+  for(int j : boost::irange(0, (int)lms_.size())) {
+    if(!IsLocalModel(j)) continue;
+    size_t num_states = 0;
+    for(int r = 0; r < num_runs; r++)
+      num_states = max(num_states, states_in[run_starts[r]]->states_[j].size());
+    vector<Expression> layer_in(num_states);
+    for(size_t k = 0; k < num_states; k++) {
+      for(int r = 0; r < num_runs; r++) {
+        const vector<Expression> & run_states = states_in[run_starts[r]]->states_[j];
+        parts[r] = (k < run_states.size() ? PickBatchElems(run_states[k], run_ids[r]) : Expression());
+      }
+      layer_in[k] = CombineBatch(parts, run_sizes, cg);
+    }
+    for(int r = 0; r < num_runs; r++)
+      parts[r] = PickBatchElems(states_in[run_starts[r]]->externs_[j], run_ids[r]);
+    Expression extern_in = CombineBatch(parts, run_sizes, cg);
+    for(int r = 0; r < num_runs; r++)
+      parts[r] = PickBatchElems(states_in[run_starts[r]]->sums_[j], run_ids[r]);
+    Expression sum_in = CombineBatch(parts, run_sizes, cg);
+    // The empty context at the start must be expanded to the size of the batch
+    if(extern_in.pg == nullptr && externs_[j].get() != nullptr && sents.size() > 1)
+      extern_in = concatenate_to_batch(vector<Expression>(sents.size(), externs_[j]->GetEmptyContext(cg)));
+    i_softmaxes[j] = lms_[j]->Forward(sents, t, externs_[j].get(), ensemble_operation_ == "logsum", layer_in, extern_in, sum_in, state_out.states_[j], state_out.externs_[j], state_out.sums_[j], cg, i_aligns);
+  }
+  return EnsembleNextLogProbs(i_softmaxes, i_aligns, cg, num_cands);
+}
+
+void EnsembleDecoder::SetDraft(const std::shared_ptr<EnsembleDecoder> & draft, int draft_len) {
+  if(draft.get() != nullptr) {
+    if(draft->lms_[0]->GetVocabSize() != lms_[0]->GetVocabSize())
+      THROW_ERROR("The draft model must have the same target vocabulary as the decoding models");
+    if(draft_len < 1)
+      THROW_ERROR("The draft model must propose at least one word at a time, but got " << draft_len);
+  }
+  draft_ = draft;
+  draft_len_ = draft_len;
+}
+
+EnsembleDecoderHypPtr EnsembleDecoder::GenerateSpeculative(const Sentence & sent_src) {
+  CheckParameters();
+
+  // Initialize the states of both the models and the draft in a single graph
+  ComputationGraph cg;
+  for(EnsembleDecoder * dec : {this, draft_.get()}) {
+    for(auto & tm : dec->encdecs_) tm->NewGraph(cg);
+    for(auto & tm : dec->encatts_) tm->NewGraph(cg);
+    for(auto & lm : dec->lms_) lm->NewGraph(cg);
+  }
+
+  // Restrict the output vocabulary if necessary. The draft is not restricted,
+  // so its proposals outside of the shortlist will simply be rejected.
+  int unk_pos;
+  vector<unsigned> cands = InitializeShortlist(vector<Sentence>(1, sent_src), cg, unk_pos);
+
+  // The states of each, which have consumed the words before
+  // sent.size() and draft_pos respectively
+  EnsembleDecoderState state(lms_.size()), draft_state(draft_->lms_.size());
+  state.states_ = GetInitialStates(sent_src, cg);
+  draft_state.states_ = draft_->GetInitialStates(sent_src, cg);
+  int draft_pos = 0;
+  Sentence sent, align;
+  float score = 0.f;
+  bool truncated = false;
+  vector<float> softmax_buf;
+  Timer timer;
+
+  while((int)sent.size() <= size_limit_ && (sent.size() == 0 || *sent.rbegin() != 0)) {
+    // Catch the draft up on words that it did not propose itself
+    for(; draft_pos < (int)sent.size(); draft_pos++) {
+      EnsembleDecoderState next_state(draft_->lms_.size());
+      vector<Expression> i_aligns;
+      draft_->CalcNextLogProb(sent, draft_pos, draft_state, next_state, cg, i_aligns);
+      draft_state = next_state;
+    }
+    // Greedily propose words with the draft, remembering its state after each
+    Sentence draft_sent = sent;
+    vector<EnsembleDecoderState> draft_states;
+    for(int i = 0; i < draft_len_ && (int)draft_sent.size() <= size_limit_ && (i == 0 || *draft_sent.rbegin() != 0); i++) {
+      draft_states.push_back(EnsembleDecoderState(draft_->lms_.size()));
+      vector<Expression> i_aligns;
+      Expression i_logprob = draft_->CalcNextLogProb(draft_sent, draft_sent.size(), (i == 0 ? draft_state : draft_states[i-1]), *draft_states.rbegin(), cg, i_aligns);
+      Tensor softmax_tensor = cg.incremental_forward(i_logprob);
+      BeamSelector next_word(1);
+      next_word.AddHypothesis(HostBatchValues(softmax_tensor, 0, softmax_buf), softmax_tensor.d.size(),
+                              0.f, draft_->word_pen_, draft_->unk_id_, draft_->unk_pen_ * draft_->unk_log_prob_, 0, -1);
+      draft_sent.push_back(next_word.GetBest()[0].word_id_);
+    }
+    int num_props = draft_sent.size() - sent.size();
+    // Calculate the probabilities of the proposed words and the word after
+    // them with the models. All steps are added to the graph and evaluated
+    // with a single forward pass, and when the models are split between
+    // processes, they are exchanged once for all steps.
+    vector<EnsembleDecoderState> states;
+    vector<vector<Expression> > step_softmaxes, step_aligns;
+    for(int t = sent.size(); t <= (int)draft_sent.size() && t <= size_limit_; t++) {
+      if(t == (int)draft_sent.size() && *draft_sent.rbegin() == 0) break;
+      states.push_back(EnsembleDecoderState(lms_.size()));
+      step_aligns.push_back(vector<Expression>());
+      step_softmaxes.push_back(CalcNextSoftmaxes(draft_sent, t, (states.size() == 1 ? state : states[states.size()-2]), *states.rbegin(), cg, *step_aligns.rbegin()));
+    }
+    vector<vector<unsigned> > cand_ids;
+    vector<Expression> i_logprobs = EnsembleNextLogProbs(step_softmaxes, step_aligns, cg, 1, cand_ids), i_ens_aligns;
+    Expression i_last = *i_logprobs.rbegin();
+    for(auto & i_aligns : step_aligns) {
+      i_ens_aligns.push_back(i_aligns.size() != 0 ? sum(i_aligns) : Expression());
+      if(i_aligns.size() != 0) i_last = *i_ens_aligns.rbegin();
+    }
+    cg.incremental_forward(i_last);
+    // Accept the proposed words as long as they match the best word of the models
+    int num_accepted = 0;
+    for(size_t i = 0; i < states.size(); i++) {
+      Tensor softmax_tensor = cg.incremental_forward(i_logprobs[i]);
+      WordId best_align = -1;
+      if(i_ens_aligns[i].pg != nullptr) {
+        vector<float> ens_align = as_vector(i_ens_aligns[i].value());
+        best_align = max_element(ens_align.begin(), ens_align.end()) - ens_align.begin();
+      }
+      BeamSelector next_word(1);
+      AddCandidates(HostBatchValues(softmax_tensor, 0, softmax_buf), softmax_tensor.d.size(), cand_ids[i], score, unk_pos, 0, best_align, next_word);
+      BeamCandidate cand = next_word.GetBest()[0];
+      WordId wid = (cands.size() ? cands[cand.word_id_] : cand.word_id_);
+      sent.push_back(wid);
+      align.push_back(cand.align_);
+      score = cand.score_;
+      state = states[i];
+      if((int)i >= num_props || wid != draft_sent[sent.size()-1]) break;
+      num_accepted++;
+    }
+    // Keep the latest draft state that only consumed accepted words
+    int draft_step = min(num_accepted, num_props-1);
+    if(draft_step >= 0 && draft_pos + draft_step + 1 <= (int)sent.size()) {
+      draft_state = draft_states[draft_step];
+      draft_pos += draft_step + 1;
+    }
+    // Stop early if the time budget has been used up
+    if((int)sent.size() <= size_limit_ && *sent.rbegin() != 0 && TimedOut(timer)) {
+      num_timeouts_++;
+      truncated = true;
+      break;
+    }
+  }
+  return EnsembleDecoderHypPtr(new EnsembleDecoderHyp(score, sent, align, truncated));
+}
+
 std::vector<EnsembleDecoderHypPtr> EnsembleDecoder::GenerateNbest(const Sentence & sent_src, int nbest_size) {
 
+  ParallelCallGuard guard(parallel_, BeginParallelCall(0, nbest_size, vector<Sentence>(1, sent_src)));
+
+  // Greedy search can be sped up by checking the words proposed by a draft model
+  if(draft_.get() != nullptr && beam_size_ == 1 && nbest_size == 1)
+    return vector<EnsembleDecoderHypPtr>(1, GenerateSpeculative(sent_src));
+
+  // Batched expansion of the beam is handled by the multi-sentence decoder
+  if(beam_batch_)
+    return GenerateNbest(vector<Sentence>(1, sent_src), nbest_size)[0];
+
+  // The inference engine always scores the full vocabulary
+  if(fast_.get() != nullptr && shortlist_.get() == nullptr && mips_probes_ == 0)
+    return GenerateNbestFast(sent_src, nbest_size);
+  CheckParameters();
+
   // First initialize states
   ComputationGraph cg;
   for(auto & tm : encdecs_) tm->NewGraph(cg);
   for(auto & tm : encatts_) tm->NewGraph(cg);
   for(auto & lm : lms_) lm->NewGraph(cg);
 
+  // Restrict the output vocabulary if necessary
+  int unk_pos;
+  vector<unsigned> cands = InitializeShortlist(vector<Sentence>(1, sent_src), cg, unk_pos);
+  InitializeMips();
+  bool class_search = InitializeClassSearch();
+
   // The n-best hypotheses
   vector<EnsembleDecoderHypPtr> nbest;
 
   // Create the initial hypothesis
-  vector<vector<vector<Expression> > > last_states(beam_size_, vector<vector<Expression> >(lms_.size()));
-  vector<vector<Expression> > last_externs(beam_size_, vector<Expression>(lms_.size()));
-  vector<vector<Expression> > last_sums(beam_size_, vector<Expression>(lms_.size()));
-  vector<EnsembleDecoderHypPtr> curr_beam(1, 
-      EnsembleDecoderHypPtr(new EnsembleDecoderHyp(
-          0.0, GetInitialStates(sent_src, cg), last_externs[0], last_sums[0], Sentence(), Sentence())));
-  int bid;
-  Expression empty_idx;
+  Timer timer;
+  vector<EnsembleDecoderState> states(1, EnsembleDecoderState(lms_.size()));
+  states[0].states_ = GetInitialStates(sent_src, cg);
+  vector<EnsembleDecoderNode> arena(1, EnsembleDecoderNode(-1, -1, -1, 0.0, 0, 0));
+  vector<int> curr_beam(1, 0);
 
   // Perform decoding
   for(int sent_len = 0; sent_len <= size_limit_; sent_len++) {
-    // This vector will hold the best IDs
-    vector<tuple<float,int,int,int> > next_beam_id(beam_size_+1, tuple<float,int,int,int>(-DBL_MAX,-1,-1,-1));
+    // This will hold the best IDs
+    BeamSelector next_beam_id(GetSelectorSize(curr_beam.size()));
+    // The entropy of the distribution of the best hypothesis, if needed
+    float entropy = -1.f;
+    // The states created from each hypothesis
+    vector<int> next_state_ids(curr_beam.size(), -1);
     // Go through all the hypothesis IDs
     for(int hypid = 0; hypid < (int)curr_beam.size(); hypid++) {
-      EnsembleDecoderHypPtr curr_hyp = curr_beam[hypid];
-      const Sentence & sent = curr_beam[hypid]->GetSentence();
-      if(sent_len != 0 && *sent.rbegin() == 0) continue;
+      const EnsembleDecoderNode & curr_hyp = arena[curr_beam[hypid]];
+      if(sent_len != 0 && curr_hyp.word_ == 0) continue;
+      Sentence sent = GetHistory(arena, curr_beam[hypid], history_len_);
       // Perform the forward step on all models
-      vector<Expression> i_softmaxes, i_aligns;
-      for(int j : boost::irange(0, (int)lms_.size()))
-        i_softmaxes.push_back( lms_[j]->Forward(sent, sent_len, externs_[j].get(), ensemble_operation_ == "logsum", curr_hyp->GetStates()[j], curr_hyp->GetExterns()[j], curr_hyp->GetSums()[j], last_states[hypid][j], last_externs[hypid][j], last_sums[hypid][j], cg, i_aligns) );
-      // Ensemble and calculate the likelihood
-      Expression i_softmax, i_logprob;
-      if(ensemble_operation_ == "sum") {
-        i_softmax = EnsembleProbs(i_softmaxes, cg);
-        i_logprob = log({i_softmax});
-      } else if(ensemble_operation_ == "logsum") {
-        i_logprob = EnsembleLogProbs(i_softmaxes, cg);
-      } else {
-        THROW_ERROR("Bad ensembling operation: " << ensemble_operation_ << endl);
-      }
-      // Add the word/unk penalty
-      vector<float> softmax = as_vector(cg.incremental_forward(i_logprob));
-      if(word_pen_ != 0.f) {
-        for(size_t i = 1; i < softmax.size(); i++)
-          softmax[i] += word_pen_;
-      }
-      if(unk_id_ >= 0) softmax[unk_id_] += unk_pen_ * unk_log_prob_;
+      next_state_ids[hypid] = states.size();
+      states.push_back(EnsembleDecoderState(lms_.size()));
+      vector<Expression> i_aligns;
+      Expression i_logprob = CalcNextLogProb(sent, history_len_, states[curr_hyp.state_id_], *states.rbegin(), cg, i_aligns, GetParallelCands());
       // Find the best aligned source, if any alignments exists
       WordId best_align = -1;
       if(i_aligns.size() != 0) {
@@ -277,31 +1074,30 @@ std::vector<EnsembleDecoderHypPtr> EnsembleDecoder::GenerateNbest(const Sentence
           if(align[aid] > align[best_align])
             best_align = aid;
       }
-      // Find the best IDs
-      for(int wid = 0; wid < (int)softmax.size(); wid++) {
-        float my_score = curr_hyp->GetScore() + softmax[wid];
-        for(bid = beam_size_; bid > 0 && my_score > std::get<0>(next_beam_id[bid-1]); bid--)
-          next_beam_id[bid] = next_beam_id[bid-1];
-        next_beam_id[bid] = tuple<float,int,int,int>(my_score,hypid,wid,best_align);
+      // Find the best IDs, adding the word/unk penalty
+      Tensor softmax_tensor = cg.incremental_forward(i_logprob);
+      vector<float> softmax_buf;
+      const float * log_probs = HostBatchValues(softmax_tensor, 0, softmax_buf);
+      // With class search, only the distribution over classes is calculated
+      if(class_search) {
+        AddClassCandidates(log_probs, softmax_tensor.d.size(), curr_hyp.score_, unk_pos, hypid, best_align, next_beam_id, cg);
+        continue;
       }
+      if(beam_adaptive_ && entropy < 0.f)
+        entropy = CalcEntropy(log_probs, softmax_tensor.d.size());
+      AddCandidates(log_probs, softmax_tensor.d.size(), GetCandIds(), curr_hyp.score_, unk_pos, hypid, best_align, next_beam_id);
     }
     // Create the new hypotheses
-    vector<EnsembleDecoderHypPtr> next_beam;
-    for(int i = 0; i < beam_size_; i++) {
-      float score = std::get<0>(next_beam_id[i]);
-      int hypid = std::get<1>(next_beam_id[i]);
-      int wid = std::get<2>(next_beam_id[i]);
-      int aid = std::get<3>(next_beam_id[i]);
-      // cerr << "Adding " << wid << " @ beam " << i << ": score=" << std::get<0>(next_beam_id[i]) - curr_beam[hypid]->GetScore() << endl;
-      if(hypid == -1) break;
-      Sentence next_sent = curr_beam[hypid]->GetSentence();
-      next_sent.push_back(wid);
-      Sentence next_align = curr_beam[hypid]->GetAlignment();
-      next_align.push_back(aid);
-      EnsembleDecoderHypPtr hyp(new EnsembleDecoderHyp(score, last_states[hypid], last_externs[hypid], last_sums[hypid], next_sent, next_align));
+    vector<int> next_beam;
+    vector<BeamCandidate> next_cands = SelectCandidates(next_beam_id, entropy, arena, curr_beam, cands);
+    for(const BeamCandidate & cand : next_cands) {
+      int hypid = cand.hyp_id_;
+      int wid = (cands.size() ? cands[cand.word_id_] : cand.word_id_);
+      // cerr << "Adding " << wid << ": score=" << cand.score_ - arena[curr_beam[hypid]].score_ << endl;
+      arena.push_back(EnsembleDecoderNode(curr_beam[hypid], wid, cand.align_, cand.score_, next_state_ids[hypid], 0));
       if(wid == 0 || sent_len == size_limit_) 
-        nbest.push_back(hyp);
-      next_beam.push_back(hyp);
+        nbest.push_back(CreateHyp(arena, arena.size()-1));
+      next_beam.push_back(arena.size()-1);
     }
     curr_beam = next_beam;
     // Check if we're done with search
@@ -309,11 +1105,371 @@ std::vector<EnsembleDecoderHypPtr> EnsembleDecoder::GenerateNbest(const Sentence
       sort(nbest.begin(), nbest.end());
       if(nbest.size() > nbest_size)
         nbest.resize(nbest_size);
-      if(nbest.size() == nbest_size && (next_beam.size() == 0 || (*nbest.rbegin())->GetScore() >= next_beam[0]->GetScore()))
+      if(nbest.size() == nbest_size && (next_beam.size() == 0 || (*nbest.rbegin())->GetScore() >= arena[next_beam[0]].score_))
         return nbest;
     }
+    // Stop early if the time budget has been used up
+    if(sent_len != size_limit_ && TimedOut(timer)) {
+      FinishTimedOut(arena, curr_beam, nbest);
+      return nbest;
+    }
   }
   cerr << "WARNING: Generated sentence size exceeded " << size_limit_ << ". Truncating." << endl;
   return nbest;
   // return vector<EnsembleDecoderHypPtr>(0);
 }
+
+std::vector<EnsembleDecoderHypPtr> EnsembleDecoder::GenerateNbestFast(const Sentence & sent_src, int nbest_size) {
+
+  // The states of the hypotheses are held in an arena, like their nodes
+  Timer timer;
+  vector<vector<float> > states(1);
+  fast_->InitializeSentence(sent_src, states[0]);
+  vector<EnsembleDecoderNode> arena(1, EnsembleDecoderNode(-1, -1, -1, 0.0, 0, 0));
+  vector<int> curr_beam(1, 0);
+  vector<EnsembleDecoderHypPtr> nbest;
+  int vocab_size = fast_->GetVocabSize(), ngram_context = fast_->GetNgramContext();
+  vector<float> log_probs(vocab_size), align(fast_->GetSrcLen());
+
+  // Perform decoding
+  for(int sent_len = 0; sent_len <= size_limit_; sent_len++) {
+    BeamSelector next_beam_id(GetSelectorSize(curr_beam.size()));
+    float entropy = -1.f;
+    vector<int> next_state_ids(curr_beam.size(), -1);
+    for(int hypid = 0; hypid < (int)curr_beam.size(); hypid++) {
+      const EnsembleDecoderNode & curr_hyp = arena[curr_beam[hypid]];
+      if(sent_len != 0 && curr_hyp.word_ == 0) continue;
+      Sentence sent = GetHistory(arena, curr_beam[hypid], ngram_context);
+      next_state_ids[hypid] = states.size();
+      states.push_back(vector<float>());
+      fast_->CalcNextLogProbs(states[curr_hyp.state_id_], sent.data(), *states.rbegin(), log_probs.data(), align.data());
+      WordId best_align = (fast_->HasAttention() ? max_element(align.begin(), align.end()) - align.begin() : -1);
+      if(beam_adaptive_ && entropy < 0.f)
+        entropy = CalcEntropy(log_probs.data(), vocab_size);
+      next_beam_id.AddHypothesis(log_probs.data(), vocab_size,
+                                 curr_hyp.score_, word_pen_, unk_id_, unk_pen_ * unk_log_prob_, hypid, best_align);
+    }
+    // Create the new hypotheses
+    vector<int> next_beam;
+    for(const BeamCandidate & cand : SelectCandidates(next_beam_id, entropy, arena, curr_beam, vector<unsigned>())) {
+      arena.push_back(EnsembleDecoderNode(curr_beam[cand.hyp_id_], cand.word_id_, cand.align_, cand.score_, next_state_ids[cand.hyp_id_], 0));
+      if(cand.word_id_ == 0 || sent_len == size_limit_)
+        nbest.push_back(CreateHyp(arena, arena.size()-1));
+      next_beam.push_back(arena.size()-1);
+    }
+    curr_beam = next_beam;
+    // Check if we're done with search
+    if(nbest.size() != 0) {
+      sort(nbest.begin(), nbest.end());
+      if(nbest.size() > nbest_size)
+        nbest.resize(nbest_size);
+      if(nbest.size() == nbest_size && (next_beam.size() == 0 || (*nbest.rbegin())->GetScore() >= arena[next_beam[0]].score_))
+        return nbest;
+    }
+    // Stop early if the time budget has been used up
+    if(sent_len != size_limit_ && TimedOut(timer)) {
+      FinishTimedOut(arena, curr_beam, nbest);
+      return nbest;
+    }
+  }
+  cerr << "WARNING: Generated sentence size exceeded " << size_limit_ << ". Truncating." << endl;
+  return nbest;
+}
+
+vector<vector<EnsembleDecoderHypPtr> > EnsembleDecoder::GenerateNbest(const vector<Sentence> & sent_srcs, int nbest_size) {
+
+  ParallelCallGuard guard(parallel_, BeginParallelCall(1, nbest_size, sent_srcs));
+
+  // Speculative decoding is performed one sentence at a time, and so is
+  // decoding with the engine once the parameters of the model are released
+  if(draft_.get() != nullptr && beam_size_ == 1 && nbest_size == 1) {
+    vector<vector<EnsembleDecoderHypPtr> > nbest;
+    for(const Sentence & sent_src : sent_srcs)
+      nbest.push_back(vector<EnsembleDecoderHypPtr>(1, GenerateSpeculative(sent_src)));
+    return nbest;
+  } else if(params_released_ && IsEngineOnly()) {
+    vector<vector<EnsembleDecoderHypPtr> > nbest;
+    for(const Sentence & sent_src : sent_srcs)
+      nbest.push_back(GenerateNbestFast(sent_src, nbest_size));
+    return nbest;
+  }
+
+  // Start decoding all of the sentences together in a single graph
+  vector<vector<EnsembleDecoderHypPtr> > nbest(sent_srcs.size());
+  size_t next_sent = 0;
+  GenerateNbestContinuous([&](bool wait, int & id, Sentence & sent_src) {
+    if(next_sent == sent_srcs.size()) return false;
+    id = next_sent;
+    sent_src = sent_srcs[next_sent++];
+    return true;
+  }, nbest_size, INT_MAX, [&](int id, const vector<EnsembleDecoderHypPtr> & hyps) {
+    nbest[id] = hyps;
+  }, max((int)sent_srcs.size(), 1));
+  return nbest;
+}
+
+namespace lamtram {
+// A sentence being decoded by the continuous batching scheduler
+class EnsembleDecoderSent {
+public:
+    EnsembleDecoderSent(int id, int saved_id, int num_words) : id_(id), saved_id_(saved_id), num_words_(num_words), len_(0) { }
+
+    // The ID given by the source, and the ID of the sentence saved in the externs
+    int id_, saved_id_;
+    int num_words_;
+    // The number of words generated so far
+    int len_;
+    // The hypotheses in the beam, as indices in the arena
+    vector<int> beam_;
+    vector<EnsembleDecoderHypPtr> nbest_;
+    // The time since the sentence started being decoded
+    Timer timer_;
+};
+}
+
+void EnsembleDecoder::GenerateNbestContinuous(const SentenceSource & source, int nbest_size, int max_words, const NbestCallback & callback, int max_graph_sents) {
+  // The other processes must add the same sentences at the same steps
+  CheckParameters();
+  bool parallel = BeginParallelCall(2, nbest_size, vector<Sentence>(), max_words, max_graph_sents);
+  ParallelCallGuard guard(parallel_, parallel);
+  SentenceSource next_source = source;
+  if(parallel) {
+    next_source = [&](bool wait, int & id, Sentence & sent_src) {
+      bool found = source(wait, id, sent_src);
+      ostringstream out;
+      out << found << ' ' << id << ' ';
+      WriteSents(out, vector<Sentence>(1, sent_src));
+      string data = out.str();
+      parallel_->Broadcast(data);
+      return found;
+    };
+  }
+  bool source_done = false;
+  while(!source_done) {
+    // Initialize a new graph, which is used until max_graph_sents sentences have been added
+    ComputationGraph cg;
+    for(auto & tm : encdecs_) tm->NewGraph(cg);
+    for(auto & tm : encatts_) tm->NewGraph(cg);
+    for(auto & lm : lms_) lm->NewGraph(cg);
+    InitializeMips();
+    int unk_pos = unk_id_, graph_sents = 0, active_words = 0;
+    vector<unsigned> cands;
+    vector<EnsembleDecoderState> states;
+    vector<EnsembleDecoderNode> arena;
+    vector<EnsembleDecoderSent> active;
+    vector<Sentence> active_srcs;
+    while(true) {
+      // Add new sentences while there is room in the batch, waiting for one if
+      // nothing is being decoded. Each starts from its own initial states.
+      bool added = false;
+      while(!source_done && graph_sents < max_graph_sents && (active.size() == 0 || active_words < max_words)) {
+        int id;
+        Sentence sent_src;
+        if(!next_source(active.size() == 0, id, sent_src)) {
+          source_done = (active.size() == 0);
+          break;
+        }
+        states.push_back(EnsembleDecoderState(lms_.size()));
+        states.rbegin()->states_ = GetInitialStates(sent_src, cg);
+        int saved_id = 0;
+        for(int j : boost::irange(0, (int)externs_.size()))
+          if(externs_[j].get() != nullptr && IsLocalModel(j)) saved_id = externs_[j]->SaveSentence();
+        active.push_back(EnsembleDecoderSent(id, saved_id, sent_src.size()));
+        active.rbegin()->beam_.push_back(arena.size());
+        arena.push_back(EnsembleDecoderNode(-1, -1, -1, 0.0, states.size()-1, 0));
+        active_srcs.push_back(sent_src);
+        active_words += sent_src.size();
+        graph_sents++;
+        added = true;
+      }
+      if(active.size() == 0) break;
+      // Restrict the output vocabulary to the candidates of the current sentences
+      if(added)
+        cands = InitializeShortlist(active_srcs, cg, unk_pos);
+      // Gather the active hypotheses of all sentences into a single batch
+      vector<int> batch_hyps;
+      vector<unsigned> batch_ids, batch_sids, batch_sents;
+      vector<const EnsembleDecoderState*> batch_states;
+      vector<Sentence> sents;
+      for(size_t i = 0; i < active.size(); i++) {
+        for(int hyp : active[i].beam_) {
+          if(arena[hyp].parent_ != -1 && arena[hyp].word_ == 0) continue;
+          batch_hyps.push_back(hyp);
+          batch_ids.push_back(arena[hyp].batch_id_);
+          batch_sids.push_back(active[i].saved_id_);
+          batch_sents.push_back(i);
+          batch_states.push_back(&states[arena[hyp].state_id_]);
+          sents.push_back(GetHistory(arena, hyp, history_len_));
+        }
+      }
+      // Perform the forward step on all models for the whole batch
+      EnsembleDecoderState next_state(lms_.size());
+      vector<Expression> i_aligns;
+      Expression i_logprob = CalcNextLogProbs(sents, history_len_, batch_states, batch_ids, batch_sids, next_state, cg, i_aligns, GetParallelCands());
+      int next_state_id = states.size();
+      states.push_back(next_state);
+      vector<float> batch_align;
+      if(i_aligns.size() != 0)
+        batch_align = as_vector(cg.incremental_forward(sum(i_aligns)));
+      Tensor batch_softmax = cg.incremental_forward(i_logprob);
+      // Find the best IDs for each sentence, adding the word/unk penalty
+      vector<BeamSelector> next_beam_ids;
+      for(auto & sent : active)
+        next_beam_ids.push_back(BeamSelector(GetSelectorSize(sent.beam_.size())));
+      vector<float> entropies(active.size(), -1.f);
+      vector<float> softmax_buf;
+      size_t align_size = batch_align.size() / batch_hyps.size();
+      for(int pos = 0; pos < (int)batch_hyps.size(); pos++) {
+        // Find the best aligned source, if any alignments exists
+        WordId best_align = -1;
+        if(align_size != 0) {
+          best_align = 0;
+          for(size_t aid = 0; aid < align_size; aid++)
+            if(batch_align[pos*align_size + aid] > batch_align[pos*align_size + best_align])
+              best_align = aid;
+        }
+        const float * log_probs = HostBatchValues(batch_softmax, pos, softmax_buf);
+        if(beam_adaptive_ && entropies[batch_sents[pos]] < 0.f)
+          entropies[batch_sents[pos]] = CalcEntropy(log_probs, batch_softmax.d.batch_size());
+        AddCandidates(log_probs, batch_softmax.d.batch_size(), GetCandIds(), arena[batch_hyps[pos]].score_, unk_pos, pos, best_align, next_beam_ids[batch_sents[pos]]);
+      }
+      // Create the new hypotheses, and find the sentences that are finished
+      string done(active.size(), '0'), timeouts(active.size(), '0');
+      for(size_t i = 0; i < active.size(); i++) {
+        EnsembleDecoderSent & sent = active[i];
+        vector<int> next_beam;
+        bool can_expand = false;
+        vector<BeamCandidate> next_cands = SelectCandidates(next_beam_ids[i], entropies[i], arena, batch_hyps, cands);
+        for(const BeamCandidate & cand : next_cands) {
+          WordId wid = (cands.size() ? cands[cand.word_id_] : cand.word_id_);
+          arena.push_back(EnsembleDecoderNode(batch_hyps[cand.hyp_id_], wid, cand.align_, cand.score_, next_state_id, cand.hyp_id_));
+          if(wid == 0 || sent.len_ == size_limit_)
+            sent.nbest_.push_back(CreateHyp(arena, arena.size()-1));
+          else
+            can_expand = true;
+          next_beam.push_back(arena.size()-1);
+        }
+        sent.beam_ = next_beam;
+        bool finished = false;
+        if(sent.nbest_.size() != 0) {
+          sort(sent.nbest_.begin(), sent.nbest_.end());
+          if(sent.nbest_.size() > nbest_size)
+            sent.nbest_.resize(nbest_size);
+          finished = (sent.nbest_.size() == nbest_size && (next_beam.size() == 0 || (*sent.nbest_.rbegin())->GetScore() >= arena[next_beam[0]].score_));
+        }
+        if(sent.len_ == size_limit_ && !finished)
+          cerr << "WARNING: Generated sentence size exceeded " << size_limit_ << ". Truncating." << endl;
+        sent.len_++;
+        if(finished || !can_expand)
+          done[i] = '1';
+        else if(max_decode_ms_ > 0 && sent.timer_.Elapsed() * 1000 >= max_decode_ms_)
+          timeouts[i] = '1';
+      }
+      ShareTimeouts(timeouts);
+      // Pass on the finished sentences, and those that ran out of time
+      vector<EnsembleDecoderSent> next_active;
+      vector<Sentence> next_active_srcs;
+      for(size_t i = 0; i < active.size(); i++) {
+        EnsembleDecoderSent & sent = active[i];
+        if(timeouts[i] == '1')
+          FinishTimedOut(arena, sent.beam_, sent.nbest_);
+        if(done[i] == '1' || timeouts[i] == '1') {
+          active_words -= sent.num_words_;
+          callback(sent.id_, sent.nbest_);
+        } else {
+          next_active.push_back(sent);
+          next_active_srcs.push_back(active_srcs[i]);
+        }
+      }
+      active = next_active;
+      active_srcs = next_active_srcs;
+    }
+  }
+}
+
+// Sample a word from log probabilities
+inline int SampleWord(const float * log_probs, int size, vector<float> & probs) {
+  probs.resize(size);
+  float sum = 0.f;
+  for(int i = 0; i < size; i++)
+    sum += (probs[i] = exp(log_probs[i]));
+  std::uniform_real_distribution<float> dist(0.f, sum);
+  sum = dist(*rndeng);
+  for(int i = 0; i < size; i++) {
+    sum -= probs[i];
+    if(sum < 0) return i;
+  }
+  // Rounding errors may cause the sample to exceed the total
+  return max_element(probs.begin(), probs.end()) - probs.begin();
+}
+
+vector<vector<EnsembleDecoderHypPtr> > EnsembleDecoder::SampleSentences(const vector<Sentence> & sent_srcs, int num_samples) {
+
+  CheckParameters();
+  ParallelCallGuard guard(parallel_, BeginParallelCall(3, num_samples, sent_srcs));
+
+  // First initialize states
+  ComputationGraph cg;
+  for(auto & tm : encdecs_) tm->NewGraph(cg);
+  for(auto & tm : encatts_) tm->NewGraph(cg);
+  for(auto & lm : lms_) lm->NewGraph(cg);
+
+  // Restrict the output vocabulary if necessary
+  int unk_pos;
+  vector<unsigned> cands = InitializeShortlist(sent_srcs, cg, unk_pos);
+
+  // All samples start from the encoded states of their sentence
+  int num_sents = sent_srcs.size();
+  EnsembleDecoderState state(lms_.size());
+  state.states_ = GetInitialStates(sent_srcs, cg);
+  vector<Sentence> sents(num_sents * num_samples), aligns(num_sents * num_samples);
+  vector<float> scores(num_sents * num_samples, 0.f);
+  vector<vector<EnsembleDecoderHypPtr> > samples(num_sents, vector<EnsembleDecoderHypPtr>(num_samples));
+  // The samples that are not finished, and their position in the batch of the states
+  vector<int> active;
+  vector<unsigned> batch_ids;
+  for(int id = 0; id < num_sents * num_samples; id++) {
+    active.push_back(id);
+    batch_ids.push_back(id / num_samples);
+  }
+
+  // Sample all unfinished sentences together in a single batch at each step
+  vector<float> softmax_buf, probs;
+  for(int t = 0; t <= size_limit_ && active.size() > 0; t++) {
+    vector<unsigned> batch_sids;
+    vector<Sentence> batch_sents;
+    for(int id : active) {
+      batch_sids.push_back(id / num_samples);
+      batch_sents.push_back(sents[id]);
+    }
+    EnsembleDecoderState next_state(lms_.size());
+    vector<Expression> i_aligns;
+    Expression i_logprob = CalcNextLogProbs(batch_sents, t, vector<const EnsembleDecoderState*>(active.size(), &state), batch_ids, batch_sids, next_state, cg, i_aligns);
+    vector<float> batch_align;
+    if(i_aligns.size() != 0)
+      batch_align = as_vector(cg.incremental_forward(sum(i_aligns)));
+    Tensor batch_softmax = cg.incremental_forward(i_logprob);
+    size_t align_size = batch_align.size() / active.size();
+    // Sample the next words, and remove finished sentences from the batch
+    vector<int> next_active;
+    vector<unsigned> next_batch_ids;
+    for(int pos = 0; pos < (int)active.size(); pos++) {
+      int id = active[pos];
+      const float * log_probs = HostBatchValues(batch_softmax, pos, softmax_buf);
+      int word = SampleWord(log_probs, batch_softmax.d.batch_size(), probs);
+      sents[id].push_back(cands.size() ? cands[word] : word);
+      scores[id] += log_probs[word];
+      aligns[id].push_back(align_size ? max_element(batch_align.begin() + pos*align_size, batch_align.begin() + (pos+1)*align_size) - (batch_align.begin() + pos*align_size) : -1);
+      if(word == 0 || t == size_limit_) {
+        samples[id / num_samples][id % num_samples].reset(new EnsembleDecoderHyp(scores[id], sents[id], aligns[id]));
+      } else {
+        next_active.push_back(id);
+        next_batch_ids.push_back(pos);
+      }
+    }
+    active = next_active;
+    batch_ids = next_batch_ids;
+    state = next_state;
+  }
+  return samples;
+}
@@ -4,33 +4,77 @@
 #include <lamtram/encoder-attentional.h>
 #include <lamtram/neural-lm.h>
 #include <lamtram/extern-calculator.h>
+#include <lamtram/shortlist.h>
+#include <lamtram/decode-workers.h>
+#include <lamtram/timer.h>
+#include <lamtram/beam-select.h>
+#include <lamtram/inference-engine.h>
 #include <dynet/tensor.h>
 #include <dynet/dynet.h>
 #include <vector>
+#include <deque>
+#include <functional>
+#include <map>
 
 namespace lamtram {
 
+// A finished hypothesis
 class EnsembleDecoderHyp {
 public:
-    EnsembleDecoderHyp(float score, const std::vector<std::vector<dynet::Expression> > & states, const std::vector<dynet::Expression> & externs, const std::vector<dynet::Expression> & sums, const Sentence & sent, const Sentence & align) :
-        score_(score), states_(states), externs_(externs), sums_(sums), sent_(sent), align_(align) { }
+    EnsembleDecoderHyp(float score, const Sentence & sent, const Sentence & align, bool truncated = false) :
+        score_(score), sent_(sent), align_(align), truncated_(truncated) { }
 
     float GetScore() const { return score_; }
-    const std::vector<std::vector<dynet::Expression> > & GetStates() const { return states_; }
-    const std::vector<dynet::Expression> & GetExterns() const { return externs_; }
-    const std::vector<dynet::Expression> & GetSums() const { return sums_; }
     const Sentence & GetSentence() const { return sent_; }
     const Sentence & GetAlignment() const { return align_; }
+    // Whether search was stopped early because it ran out of time
+    bool IsTruncated() const { return truncated_; }
+    void SetTruncated(bool truncated) { truncated_ = truncated; }
 
 protected:
 
     float score_;
+    Sentence sent_;
+    Sentence align_;
+    bool truncated_;
+
+};
+
+// The states of all models after a decoding step. In batched decoding, the
+// states of all hypotheses expanded in the step are held together as a batch.
+class EnsembleDecoderState {
+public:
+    EnsembleDecoderState(int num_models) : states_(num_models), externs_(num_models), sums_(num_models) { }
+
     std::vector<std::vector<dynet::Expression> > states_;
     std::vector<dynet::Expression> externs_;
     std::vector<dynet::Expression> sums_;
-    Sentence sent_;
-    Sentence align_;
+};
+
+// A hypothesis during search, stored in an arena with all the others created
+// while decoding. Each only records the word it adds to its parent, so
+// sentences are only created for hypotheses that make it to the n-best list.
+class EnsembleDecoderNode {
+public:
+    EnsembleDecoderNode(int parent, WordId word, WordId align, float score, int state_id, int batch_id) :
+        parent_(parent), word_(word), align_(align), score_(score), state_id_(state_id), batch_id_(batch_id) { }
+
+    // The index of the parent in the arena, or -1 for an initial hypothesis
+    int parent_;
+    WordId word_, align_;
+    float score_;
+    // The index of the states in the state arena, and of this hypothesis in their batch
+    int state_id_, batch_id_;
+};
 
+// Host copies of the values of a source sentence encoded by each model, which
+// can be restored in later computation graphs instead of encoding it again
+class EnsembleDecoderEncoded {
+public:
+    typedef std::pair<dynet::Dim, std::vector<float> > Value;
+
+    std::vector<std::vector<Value> > states_;
+    std::vector<std::vector<Value> > externs_;
 };
 
 typedef std::shared_ptr<EnsembleDecoderHyp> EnsembleDecoderHypPtr;
@@ -49,13 +93,76 @@ public:
                     const std::vector<NeuralLMPtr> & lms);
     ~EnsembleDecoder() {}
 
+    // Calculate the log likelihood of one or a batch of target sentences. When
+    // the models are split between processes, the likelihood is only
+    // calculated by the first, and the others serve the call.
     template <class OutSent, class OutLL, class OutWords>
     void CalcSentLL(const Sentence & sent_src, const OutSent & sent_trg, OutLL & ll, OutWords & words);
 
     EnsembleDecoderHypPtr Generate(const Sentence & sent_src);
     std::vector<EnsembleDecoderHypPtr> GenerateNbest(const Sentence & sent_src, int nbest);
+    // Decode several sentences together, expanding the beams of all sentences
+    // in a single batch at each step
+    std::vector<std::vector<EnsembleDecoderHypPtr> > GenerateNbest(const std::vector<Sentence> & sent_srcs, int nbest);
+
+    // Generate the best sentence with greedy search, where a draft model
+    // proposes several words at a time, and the models check them together
+    EnsembleDecoderHypPtr GenerateSpeculative(const Sentence & sent_src);
+
+    // Perform one step of all models for a single hypothesis, returning the
+    // ensembled log probabilities of word t of the sentence. When the models
+    // are split between processes and num_cands is not 0, they are only
+    // calculated for the words that a beam search keeping num_cands candidates
+    // may select, which are given by GetCandIds.
+    dynet::Expression CalcNextLogProb(const Sentence & sent, int t, const EnsembleDecoderState & state_in, EnsembleDecoderState & state_out, dynet::ComputationGraph & cg, std::vector<dynet::Expression> & aligns, int num_cands = 0);
+
+    // Perform one step of all models for a batch of hypotheses, where batch
+    // element i uses element batch_ids[i] of states_in[i] and sentence batch_sids[i]
+    dynet::Expression CalcNextLogProbs(const std::vector<Sentence> & sents, int t, const std::vector<const EnsembleDecoderState*> & states_in, const std::vector<unsigned> & batch_ids, const std::vector<unsigned> & batch_sids, EnsembleDecoderState & state_out, dynet::ComputationGraph & cg, std::vector<dynet::Expression> & aligns, int num_cands = 0);
+
+    // The words of the distribution last returned by CalcNextLogProb or
+    // CalcNextLogProbs, or nothing if it covers the whole output vocabulary
+    const std::vector<unsigned> & GetCandIds() const { return mips_probes_ > 0 ? lms_[0]->GetSoftmax().GetMipsIds() : cand_ids_; }
+
+    // Draw num_samples sentences from the ensembled distribution for each
+    // source, with all samples drawn together in a single batch
+    std::vector<std::vector<EnsembleDecoderHypPtr> > SampleSentences(const std::vector<Sentence> & sent_srcs, int num_samples);
+
+    // Get the next sentence to decode and an ID for it. If wait is true, block
+    // until one is available. Returns false if no sentence is available.
+    typedef std::function<bool(bool wait, int & id, Sentence & sent_src)> SentenceSource;
+    // Receives the n-best list for a sentence as soon as it is finished
+    typedef std::function<void(int id, const std::vector<EnsembleDecoderHypPtr> & nbest)> NbestCallback;
+
+    // Decode sentences with continuous batching. Each step expands the beams
+    // of all sentences in a single batch, and new sentences are taken from
+    // source and join the batch at the next step whenever the sentences being
+    // decoded have fewer than max_words words. A new graph is started after
+    // max_graph_sents sentences to bound memory use.
+    void GenerateNbestContinuous(const SentenceSource & source, int nbest_size, int max_words, const NbestCallback & callback, int max_graph_sents = 1000);
 
     std::vector<std::vector<dynet::Expression> > GetInitialStates(const Sentence & sent_src, dynet::ComputationGraph & cg);
+    // Encode several sentences, combining their states into a batch
+    std::vector<std::vector<dynet::Expression> > GetInitialStates(const std::vector<Sentence> & sent_srcs, dynet::ComputationGraph & cg);
+
+    // Restrict the output of all models to the shortlist for the sentences.
+    // Returns the candidate words, or nothing if there is no shortlist, and the
+    // position of the unknown word in the output (-1 if it is not a candidate),
+    // which is also kept in unk_pos_.
+    std::vector<unsigned> InitializeShortlist(const std::vector<Sentence> & sent_srcs, dynet::ComputationGraph & cg, int & unk_pos);
+    // Search the output layers with their indices in the current graph if enabled
+    void InitializeMips();
+    // Add the candidates for a hypothesis to the beam, given the log
+    // probabilities of the full vocabulary, or of the words in ids if it is
+    // not empty (see GetCandIds)
+    void AddCandidates(const float * log_probs, int size, const std::vector<unsigned> & ids, float hyp_score, int unk_id, int hyp_id, int align, BeamSelector & selector) const;
+    // Search the class-factored softmaxes by class in the current graph if
+    // possible, returning whether this is done
+    bool InitializeClassSearch();
+    // Add the candidates for a hypothesis to the beam by class, given the log
+    // probabilities of the classes. Classes are expanded from the most
+    // probable, until none of their words can enter the beam.
+    void AddClassCandidates(const float * class_log_probs, int num_classes, float hyp_score, int unk_id, int hyp_id, int align, BeamSelector & selector, dynet::ComputationGraph & cg);
     
     template <class Sent, class Stat, class WordLik>
     void AddLik(const Sent & sent, const dynet::Expression & expr, const std::vector<dynet::Expression> & exprs, Stat & ll, WordLik & wordll);
@@ -81,8 +188,126 @@ public:
     void SetBeamSize(int beam_size) { beam_size_ = beam_size; }
     int GetSizeLimit() const { return size_limit_; }
     void SetSizeLimit(int size_limit) { size_limit_ = size_limit; }
+    bool GetBeamBatch() const { return beam_batch_; }
+    void SetBeamBatch(bool beam_batch) { beam_batch_ = beam_batch; }
+    bool GetBeamAdaptive() const { return beam_adaptive_; }
+    void SetBeamAdaptive(bool beam_adaptive) { beam_adaptive_ = beam_adaptive; }
+    float GetBeamPruneRel() const { return beam_prune_rel_; }
+    float GetBeamPruneAbs() const { return beam_prune_abs_; }
+    void SetBeamPrune(float beam_prune_rel, float beam_prune_abs) { beam_prune_rel_ = beam_prune_rel; beam_prune_abs_ = beam_prune_abs; }
+    // Recombination is only possible when no model has a recurrent state
+    bool CanRecombine() const;
+    bool GetRecombine() const { return recombine_; }
+    void SetRecombine(bool recombine) { recombine_ = recombine && CanRecombine(); }
+    // Class search is only possible when all models use the same classes, the
+    // probabilities are ensembled by sum, and there is no shortlist or
+    // parallel evaluation. It is used for beams over single sentences.
+    bool CanClassSearch() const;
+    bool GetClassSearch() const { return class_search_; }
+    void SetClassSearch(bool class_search) { class_search_ = class_search; }
+    const ShortlistPtr & GetShortlist() const { return shortlist_; }
+    void SetShortlist(const ShortlistPtr & shortlist) { shortlist_ = shortlist; }
+    // Build an index with num_clusters clusters over the output layer of the
+    // model, and only score the words in the best probes clusters when
+    // generating with a beam search. Zero probes use the full vocabulary.
+    // Ensembles combine full distributions, so this returns false and uses the
+    // full vocabulary unless there is a single model.
+    bool SetMips(int num_clusters, int probes);
+    int GetMipsProbes() const { return mips_probes_; }
+    const std::shared_ptr<EnsembleDecoder> & GetDraft() const { return draft_; }
+    int GetDraftLen() const { return draft_len_; }
+    void SetDraft(const std::shared_ptr<EnsembleDecoder> & draft, int draft_len);
+    int GetEncoderCacheSize() const { return encoder_cache_size_; }
+    void SetEncoderCacheSize(int encoder_cache_size) { encoder_cache_size_ = encoder_cache_size; ClearEncoderCache(); }
+    void ClearEncoderCache() { encoder_cache_.clear(); encoder_cache_order_.clear(); }
+    int GetMaxDecodeMs() const { return max_decode_ms_; }
+    void SetMaxDecodeMs(int max_decode_ms) { max_decode_ms_ = max_decode_ms; }
+    // The number of sentences whose search ran out of time
+    int GetNumTimeouts() const { return num_timeouts_; }
+    void ResetNumTimeouts() { num_timeouts_ = 0; }
+    int GetEnsembleThreads() const { return ensemble_threads_; }
+    void SetEnsembleThreads(int ensemble_threads);
+    // Run the beam search over single sentences on an InferenceEngine instead
+    // of computation graphs. This is only possible for a single attentional
+    // model supported by the engine, and returns whether it is used. The
+    // engine copies the parameters, so this must be set again if they change.
+    // With quantize, the weights of the recurrent layers and the softmax are
+    // stored as 8-bit integers (see InferenceMatrix::Quantize), and the
+    // remaining parameters are stored with the given precision. With
+    // precompute_inputs, the embeddings are replaced by their products with
+    // the input weights of the first layers (see InferenceLayers::PrecomputeInputs).
+    bool SetFastInference(bool fast_inference, bool quantize = false, ParamPrecision precision = PRECISION_FP32, bool precompute_inputs = false);
+    bool GetFastInference() const { return fast_.get() != nullptr; }
+    // The engine used by fast inference, or null
+    InferenceEngine * GetInferenceEngine() const { return fast_.get(); }
+    // Whether the engine decodes every sentence given to GenerateNbest
+    // without computation graphs, so the engine's copy is the only one of the
+    // parameters that is used
+    bool IsEngineOnly() const { return fast_.get() != nullptr && !beam_batch_ && draft_.get() == nullptr && shortlist_.get() == nullptr && mips_probes_ == 0; }
+    // Give the memory of the parameters of the model (mod) back to the system
+    // when IsEngineOnly(), returning the number of bytes released (see
+    // ModelUtils::ReleaseParameters). Afterwards, batches of sentences are
+    // decoded one at a time by the engine, and everything that would build
+    // computation graphs throws an error instead of reading zeros.
+    size_t ReleaseParameters(dynet::ParameterCollection & mod);
+    bool GetParametersReleased() const { return params_released_; }
 
 protected:
+    // Perform one step of the models evaluated in this process for a single
+    // hypothesis, returning their outputs (null for the other models)
+    std::vector<dynet::Expression> CalcNextSoftmaxes(const Sentence & sent, int t, const EnsembleDecoderState & state_in, EnsembleDecoderState & state_out, dynet::ComputationGraph & cg, std::vector<dynet::Expression> & aligns);
+    // Ensemble the outputs of the models for a step, exchanging them with the
+    // other processes if the models are split between several
+    dynet::Expression EnsembleNextLogProbs(std::vector<dynet::Expression> & softmaxes, std::vector<dynet::Expression> & aligns, dynet::ComputationGraph & cg, int num_cands = 0);
+    // Ensemble the outputs of the models for several steps, which are
+    // exchanged together when the models are split between processes. Each
+    // process sends the sum of the outputs of its models, and the first sends
+    // back the ensembled distributions. If num_cands is not 0, it only sends
+    // the words of each that a beam search keeping num_cands candidates may
+    // select, whose IDs are put in cand_ids.
+    std::vector<dynet::Expression> EnsembleNextLogProbs(std::vector<std::vector<dynet::Expression> > & softmaxes, std::vector<std::vector<dynet::Expression> > & aligns, dynet::ComputationGraph & cg, int num_cands, std::vector<std::vector<unsigned> > & cand_ids);
+    // The number of candidates to exchange when the models are split between
+    // processes, which is the most any selector keeps, as no sentence has
+    // more hypotheses than the beam size. The adaptive beam needs the entropy
+    // of the full distributions, so they are exchanged in full.
+    int GetParallelCands() const { return beam_adaptive_ ? 0 : GetSelectorSize(beam_size_); }
+    // Throw an error if the parameters were released, before using them
+    void CheckParameters() const;
+
+    // The number of candidates a selector must keep to fill the next beam
+    // when expanding num_hyps hypotheses. When recombining, each context can
+    // be reached from every hypothesis, so num_hyps times the beam size are
+    // kept to leave beam_size_ distinct contexts after merging.
+    int GetSelectorSize(int num_hyps) const { return recombine_ ? beam_size_ * std::max(num_hyps, 1) : beam_size_; }
+    // Get the candidates for the next beam from a selector of GetSelectorSize(),
+    // merging those with the same context when recombining, then cutting them
+    // to the beam size, adapting it to the entropy of the best hypothesis's
+    // distribution, and pruning those far below the best
+    //  parents: The arena ID of the hypothesis expanded by each hyp_id_
+    //  vocab: The vocabulary shortlist used for the candidates, if any
+    std::vector<BeamCandidate> SelectCandidates(const BeamSelector & selector, float entropy, const std::vector<EnsembleDecoderNode> & arena, const std::vector<int> & parents, const std::vector<unsigned> & vocab) const;
+    // Merge candidates that end in the same history_len_ words, keeping the
+    // best scoring one, as the models will give them identical future scores
+    void RecombineCandidates(const std::vector<EnsembleDecoderNode> & arena, const std::vector<int> & parents, const std::vector<unsigned> & vocab, std::vector<BeamCandidate> & cands) const;
+
+    // Generate the n-best list for a sentence with the inference engine
+    std::vector<EnsembleDecoderHypPtr> GenerateNbestFast(const Sentence & sent_src, int nbest_size);
+
+    // Whether the time budget of a sentence has run out
+    bool TimedOut(Timer & timer);
+    // Make the timeouts of each sentence found by the first process those of all processes
+    void ShareTimeouts(std::string & timeouts);
+    // Return the finished hypotheses marked as truncated, or the best unfinished one if there are none
+    void FinishTimedOut(const std::vector<EnsembleDecoderNode> & arena, const std::vector<int> & beam, std::vector<EnsembleDecoderHypPtr> & nbest);
+
+    // Whether model j is evaluated in this process
+    bool IsLocalModel(int j) const { return parallel_ == nullptr || j % parallel_->GetNumProcs() == parallel_->GetProc(); }
+    // Send a decoding call to the other processes so they run it too, starting
+    // them if necessary. Returns false if the models are not split.
+    bool BeginParallelCall(int type, int size, const std::vector<Sentence> & sent_srcs, int max_words = 0, int max_graph_sents = 0);
+    // Run the calls received from the first process until it finishes
+    void ServeParallelCalls(ProcessGroup & group);
+
     std::vector<EncoderDecoderPtr> encdecs_;
     std::vector<EncoderAttentionalPtr> encatts_;
     std::vector<NeuralLMPtr> lms_;
@@ -92,6 +317,52 @@ protected:
     int unk_id_;
     int size_limit_;
     int beam_size_;
+    // Whether to expand all hypotheses in the beam in a single batched step
+    bool beam_batch_;
+    // Whether to shrink the beam at steps where the distribution is peaked,
+    // using beam_size_ as the maximum
+    bool beam_adaptive_;
+    // Prune candidates whose probability is less than beam_prune_rel_ times
+    // that of the best, or whose score is more than beam_prune_abs_ below it
+    float beam_prune_rel_, beam_prune_abs_;
+    // Merge hypotheses that share the words the models look at
+    bool recombine_;
+    // Search class-factored softmaxes by class when possible
+    bool class_search_;
+    // Candidate target words used when decoding, or null for the full vocabulary
+    ShortlistPtr shortlist_;
+    // The number of clusters of the output layer indices to search
+    int mips_probes_;
+    // The number of previous words used by the models at each step
+    int history_len_;
+    // A cheaper decoder that proposes draft_len_ words at a time for greedy
+    // search, or null to decode normally
+    std::shared_ptr<EnsembleDecoder> draft_;
+    int draft_len_;
+    // The most recently encoded source sentences, kept so scoring n-best lists
+    // only encodes each source once. Zero disables the cache.
+    int encoder_cache_size_;
+    std::map<Sentence, EnsembleDecoderEncoded> encoder_cache_;
+    std::deque<Sentence> encoder_cache_order_;
+    // The time limit for searching for the translation of a sentence, or 0
+    // for no limit, and the number of sentences that reached it
+    int max_decode_ms_;
+    int num_timeouts_;
+    // The number of processes the models are split between when generating.
+    // The process group is started when first needed, and parallel_ is only
+    // set during a call that uses it.
+    int ensemble_threads_;
+    std::shared_ptr<ProcessGroup> parallel_group_;
+    ProcessGroup * parallel_;
+    // The words of the last distribution exchanged by the processes, if they
+    // were limited to the candidates, and the position of the unknown word in
+    // the distributions of the current graph
+    std::vector<unsigned> cand_ids_;
+    int unk_pos_;
+    // The engine used instead of computation graphs, or null, and whether
+    // the parameters of the model were released so that only it can be used
+    InferenceEnginePtr fast_;
+    bool params_released_;
     std::string ensemble_operation_;
 
 };
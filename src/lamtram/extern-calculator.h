@@ -1,6 +1,7 @@
 #pragma once
 
 #include <lamtram/sentence.h>
+#include <lamtram/macros.h>
 #include <dynet/tensor.h>
 #include <vector>
 #include <memory>
@@ -20,6 +21,26 @@ public:
     virtual void InitializeSentence(const Sentence & sent, bool train, dynet::ComputationGraph & cg) { }
     virtual void InitializeSentence(const std::vector<Sentence> & sent, bool train, dynet::ComputationGraph & cg) { }
 
+    // When decoding several sentences in one graph, save the sentence last
+    // passed to InitializeSentence and return its index
+    virtual int SaveSentence() {
+      THROW_ERROR("Decoding multiple sentences is not supported by this context");
+    }
+    // Use the saved sentences as a batch, where element i uses sentence ids[i]
+    virtual void SelectSentences(const std::vector<unsigned> & ids, dynet::ComputationGraph & cg) {
+      THROW_ERROR("Decoding multiple sentences is not supported by this context");
+    }
+
+    // Get the expressions encoding the sentence last passed to InitializeSentence,
+    // and restore them from expressions with the same values (possibly in a
+    // later graph), so the sentence does not need to be encoded again
+    virtual std::vector<dynet::Expression> GetEncoded() const {
+      THROW_ERROR("Caching encoded sentences is not supported by this context");
+    }
+    virtual void SetEncoded(const Sentence & sent, const std::vector<dynet::Expression> & encoded, dynet::ComputationGraph & cg) {
+      THROW_ERROR("Caching encoded sentences is not supported by this context");
+    }
+
     // Create a variable encoding the context
     virtual dynet::Expression CreateContext(
         // const Sentence & sent, int loc,
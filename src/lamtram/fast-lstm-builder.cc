@@ -0,0 +1,301 @@
+#include <lamtram/fast-lstm-builder.h>
+#include <lamtram/macros.h>
+#include <dynet/model.h>
+#include <dynet/tensor.h>
+#include <Eigen/Dense>
+#include <sstream>
+
+using namespace std;
+using namespace lamtram;
+using namespace dynet;
+
+typedef Eigen::Map<Eigen::MatrixXf> MatrixMap;
+typedef Eigen::Map<Eigen::ArrayXXf> ArrayMap;
+
+// A tensor as a matrix, with a column for each batch element of a vector or
+// the columns of a matrix
+inline MatrixMap AsBatches(const Tensor & t) { return MatrixMap(t.v, t.d.batch_size(), t.d.bd); }
+inline MatrixMap AsWeights(const Tensor & t) { return MatrixMap(t.v, t.d.rows(), t.d.cols()); }
+
+// The positions of the arguments of a FastLSTMNode
+struct FastLSTMArgs {
+  FastLSTMArgs(bool projected, bool has_prev) :
+    W_x(projected ? -1 : 0), x(projected ? 0 : 1), W_h(has_prev ? x + 1 : -1), s_prev(has_prev ? x + 2 : -1), b(has_prev ? x + 3 : x + 1) { }
+  int W_x, x, W_h, s_prev, b;
+};
+
+string FastLSTMNode::as_string(const vector<string> & arg_names) const {
+  ostringstream s;
+  s << "fast_lstm(" << arg_names[0];
+  for(size_t i = 1; i < arg_names.size(); i++)
+    s << ", " << arg_names[i];
+  s << ')';
+  return s.str();
+}
+
+Dim FastLSTMNode::dim_forward(const vector<Dim> & xs) const {
+  FastLSTMArgs a(projected_, has_prev_);
+  if(xs.size() != (size_t)a.b + 1)
+    THROW_ERROR("fast_lstm expected " << a.b + 1 << " arguments but got " << xs.size());
+  unsigned gates = xs[a.b].rows(), hidden = gates / 4, bd = xs[a.x].bd;
+  if(gates % 4 != 0 || xs[a.b].cols() != 1)
+    THROW_ERROR("Bad bias dimensions in fast_lstm: " << xs[a.b]);
+  if(projected_) {
+    if(xs[a.x].rows() != gates || xs[a.x].cols() != 1)
+      THROW_ERROR("Bad projected input dimensions in fast_lstm: " << xs[a.x]);
+  } else if(xs[a.W_x].rows() != gates || xs[a.x].rows() != xs[a.W_x].cols() || xs[a.x].cols() != 1) {
+    THROW_ERROR("Bad input dimensions in fast_lstm: " << xs[a.W_x] << " * " << xs[a.x]);
+  }
+  if(has_prev_) {
+    if(xs[a.W_h].rows() != gates || xs[a.W_h].cols() != hidden || xs[a.s_prev].rows() != 2 * hidden || xs[a.s_prev].cols() != 1)
+      THROW_ERROR("Bad state dimensions in fast_lstm: " << xs[a.W_h] << " * " << xs[a.s_prev]);
+    if(bd != 1 && xs[a.s_prev].bd != 1 && xs[a.s_prev].bd != bd)
+      THROW_ERROR("Mismatched batch sizes in fast_lstm: " << xs[a.x] << " and " << xs[a.s_prev]);
+    bd = max(bd, xs[a.s_prev].bd);
+  }
+  return Dim({2 * hidden}, bd);
+}
+
+size_t FastLSTMNode::aux_storage_size() const {
+  return 2 * 4 * (dim.rows() / 2) * dim.bd * sizeof(float);
+}
+
+void FastLSTMNode::forward_impl(const vector<const Tensor*> & xs, Tensor & fx) const {
+#ifdef HAVE_CUDA
+  THROW_ERROR("fast_lstm is only implemented on the CPU");
+#endif
+  FastLSTMArgs a(projected_, has_prev_);
+  int hidden = fx.d.rows() / 2, bd = fx.d.bd;
+  ArrayMap gates(static_cast<float*>(aux_mem), 4 * hidden, bd);
+  MatrixMap gates_mat(static_cast<float*>(aux_mem), 4 * hidden, bd);
+  // Every gate of every batch element in one product for the input and one
+  // for the previous output, broadcasting inputs with a single element
+  gates_mat = AsBatches(*xs[a.b]).col(0).replicate(1, bd);
+  MatrixMap x = AsBatches(*xs[a.x]);
+  if(projected_) {
+    if(x.cols() == bd) gates_mat += x; else gates_mat.colwise() += x.col(0);
+  } else if(x.cols() == bd) {
+    gates_mat.noalias() += AsWeights(*xs[a.W_x]) * x;
+  } else {
+    gates_mat.colwise() += AsWeights(*xs[a.W_x]) * x.col(0);
+  }
+  if(has_prev_) {
+    MatrixMap s_prev = AsBatches(*xs[a.s_prev]);
+    if(s_prev.cols() == bd)
+      gates_mat.noalias() += AsWeights(*xs[a.W_h]) * s_prev.bottomRows(hidden);
+    else
+      gates_mat.colwise() += AsWeights(*xs[a.W_h]) * s_prev.col(0).tail(hidden);
+  }
+  // Apply the nonlinearities and update the cell in one pass
+  gates.middleRows(hidden, hidden) += 1.f;
+  gates.topRows(3 * hidden) = (1.f + (-gates.topRows(3 * hidden)).exp()).inverse();
+  gates.bottomRows(hidden) = gates.bottomRows(hidden).tanh();
+  ArrayMap s(fx.v, 2 * hidden, bd);
+  s.topRows(hidden) = gates.topRows(hidden) * gates.bottomRows(hidden);
+  if(has_prev_) {
+    ArrayMap s_prev(xs[a.s_prev]->v, 2 * hidden, xs[a.s_prev]->d.bd);
+    if(s_prev.cols() == bd)
+      s.topRows(hidden) += gates.middleRows(hidden, hidden) * s_prev.topRows(hidden);
+    else
+      s.topRows(hidden) += gates.middleRows(hidden, hidden).colwise() * s_prev.col(0).head(hidden);
+  }
+  s.bottomRows(hidden) = gates.middleRows(2 * hidden, hidden) * s.topRows(hidden).tanh();
+}
+
+void FastLSTMNode::CalcGateGradients(const vector<const Tensor*> & xs, const Tensor & fx, const Tensor & dEdf) const {
+  FastLSTMArgs a(projected_, has_prev_);
+  int hidden = fx.d.rows() / 2, bd = fx.d.bd;
+  ArrayMap gates(static_cast<float*>(aux_mem), 4 * hidden, bd);
+  ArrayMap d_gates(static_cast<float*>(aux_mem) + 4 * hidden * bd, 4 * hidden, bd);
+  ArrayMap s(fx.v, 2 * hidden, bd), d_s(dEdf.v, 2 * hidden, bd);
+  auto in = gates.topRows(hidden), forget = gates.middleRows(hidden, hidden);
+  auto out = gates.middleRows(2 * hidden, hidden), cand = gates.bottomRows(hidden);
+  // The gradient of the cell, including that through the output, is kept in
+  // the rows of the forget gate until it is needed
+  Eigen::ArrayXXf tanh_c = s.topRows(hidden).tanh();
+  auto d_c = d_gates.middleRows(hidden, hidden);
+  d_c = d_s.topRows(hidden) + d_s.bottomRows(hidden) * out * (1.f - tanh_c.square());
+  d_gates.middleRows(2 * hidden, hidden) = d_s.bottomRows(hidden) * tanh_c * out * (1.f - out);
+  d_gates.topRows(hidden) = d_c * cand * in * (1.f - in);
+  d_gates.bottomRows(hidden) = d_c * in * (1.f - cand.square());
+  if(has_prev_) {
+    ArrayMap s_prev(xs[a.s_prev]->v, 2 * hidden, xs[a.s_prev]->d.bd);
+    if(s_prev.cols() == bd)
+      d_c *= s_prev.topRows(hidden) * forget * (1.f - forget);
+    else
+      d_c *= (forget * (1.f - forget)).colwise() * s_prev.col(0).head(hidden);
+  } else {
+    d_c.setZero();
+  }
+}
+
+void FastLSTMNode::backward_impl(const vector<const Tensor*> & xs, const Tensor & fx, const Tensor & dEdf,
+                                 unsigned i, Tensor & dEdxi) const {
+#ifdef HAVE_CUDA
+  THROW_ERROR("fast_lstm is only implemented on the CPU");
+#endif
+  FastLSTMArgs a(projected_, has_prev_);
+  int hidden = fx.d.rows() / 2, bd = fx.d.bd, arg = i;
+  // The gradients of the gates are shared by every argument but the previous
+  // cell, which needs that of the cell before it is overwritten
+  MatrixMap d_gates(static_cast<float*>(aux_mem) + 4 * hidden * bd, 4 * hidden, bd);
+  if(arg == a.s_prev) {
+    // The previous cell gets the gradient of the cell times the forget gate
+    ArrayMap gates(static_cast<float*>(aux_mem), 4 * hidden, bd);
+    ArrayMap s(fx.v, 2 * hidden, bd), d_s(dEdf.v, 2 * hidden, bd);
+    Eigen::ArrayXXf d_c = d_s.topRows(hidden) + d_s.bottomRows(hidden) * gates.middleRows(2 * hidden, hidden) * (1.f - s.topRows(hidden).tanh().square());
+    d_c *= gates.middleRows(hidden, hidden);
+    MatrixMap d_prev = AsBatches(dEdxi);
+    if(d_prev.cols() == bd)
+      d_prev.topRows(hidden) += d_c.matrix();
+    else
+      d_prev.col(0).head(hidden) += d_c.matrix().rowwise().sum();
+    CalcGateGradients(xs, fx, dEdf);
+    MatrixMap W_h = AsWeights(*xs[a.W_h]);
+    if(d_prev.cols() == bd)
+      d_prev.bottomRows(hidden).noalias() += W_h.transpose() * d_gates;
+    else
+      d_prev.col(0).tail(hidden).noalias() += W_h.transpose() * d_gates.rowwise().sum();
+    return;
+  }
+  CalcGateGradients(xs, fx, dEdf);
+  if(arg == a.b) {
+    AsBatches(dEdxi).col(0) += d_gates.rowwise().sum();
+  } else if(arg == a.x) {
+    MatrixMap d_x = AsBatches(dEdxi);
+    if(projected_) {
+      if(d_x.cols() == bd) d_x += d_gates; else d_x.col(0) += d_gates.rowwise().sum();
+    } else {
+      MatrixMap W_x = AsWeights(*xs[a.W_x]);
+      if(d_x.cols() == bd) d_x.noalias() += W_x.transpose() * d_gates;
+      else d_x.col(0).noalias() += W_x.transpose() * d_gates.rowwise().sum();
+    }
+  } else if(arg == a.W_x) {
+    MatrixMap x = AsBatches(*xs[a.x]);
+    if(x.cols() == bd) AsWeights(dEdxi).noalias() += d_gates * x.transpose();
+    else AsWeights(dEdxi).noalias() += d_gates.rowwise().sum() * x.col(0).transpose();
+  } else if(arg == a.W_h) {
+    MatrixMap s_prev = AsBatches(*xs[a.s_prev]);
+    if(s_prev.cols() == bd) AsWeights(dEdxi).noalias() += d_gates * s_prev.bottomRows(hidden).transpose();
+    else AsWeights(dEdxi).noalias() += d_gates.rowwise().sum() * s_prev.col(0).tail(hidden).transpose();
+  } else {
+    THROW_ERROR("Bad argument " << i << " for fast_lstm");
+  }
+}
+
+FastLSTMBuilder::FastLSTMBuilder(unsigned layers, unsigned input_dim, unsigned hidden_dim, ParameterCollection & model) : layers(layers), hidden_dim(hidden_dim) {
+  local_model = model.add_subcollection("fast-lstm-builder");
+  unsigned layer_input_dim = input_dim;
+  for(unsigned i = 0; i < layers; ++i) {
+    Parameter p_Wx = local_model.add_parameters({hidden_dim * 4, layer_input_dim});
+    Parameter p_Wh = local_model.add_parameters({hidden_dim * 4, hidden_dim});
+    Parameter p_b = local_model.add_parameters({hidden_dim * 4}, ParameterInitConst(0.f));
+    params.push_back({p_Wx, p_Wh, p_b});
+    layer_input_dim = hidden_dim;
+  }
+  dropout_rate = 0.f;
+}
+
+void FastLSTMBuilder::new_graph_impl(ComputationGraph & cg, bool update) {
+  this->cg = &cg;
+  split_states.clear();
+  param_vars.clear();
+  for(auto & p : params) {
+    param_vars.push_back(vector<Expression>());
+    for(auto & pi : p)
+      param_vars.back().push_back(update ? parameter(cg, pi) : const_parameter(cg, pi));
+  }
+}
+
+void FastLSTMBuilder::start_new_sequence_impl(const vector<Expression> & h_0) {
+  s.clear(); h.clear();
+  s0.clear(); h0.clear();
+  if(h_0.size() == 0) return;
+  if(h_0.size() != 2 * layers)
+    THROW_ERROR("Fast LSTM builder expected " << 2 * layers << " initial values but got " << h_0.size());
+  for(unsigned i = 0; i < layers; ++i) {
+    auto it = split_states.find(h_0[i].i);
+    if(it != split_states.end() && it->second.first == h_0[layers + i].i)
+      s0.push_back(it->second.second);
+    else
+      s0.push_back(concatenate({h_0[i], h_0[layers + i]}));
+    h0.push_back(h_0[layers + i]);
+  }
+}
+
+Expression FastLSTMBuilder::add_input_impl(int prev, const Expression & in) {
+  const vector<Expression> & s_prev = (prev == -1 ? s0 : s[prev]);
+  s.push_back(vector<Expression>(layers));
+  h.push_back(vector<Expression>(layers));
+  vector<Expression> & st = s.back(), & ht = h.back();
+  Expression x = in;
+  for(unsigned i = 0; i < layers; ++i) {
+    bool projected = (i == 0 && projected_input);
+    if(dropout_rate && !projected) x = dropout(x, dropout_rate);
+    vector<VariableIndex> args;
+    if(!projected) args.push_back(param_vars[i][0].i);
+    args.push_back(x.i);
+    if(s_prev.size()) { args.push_back(param_vars[i][1].i); args.push_back(s_prev[i].i); }
+    args.push_back(param_vars[i][2].i);
+    st[i] = Expression(cg, cg->add_function<FastLSTMNode>(args, projected, s_prev.size() != 0));
+    ht[i] = x = pick_range(st[i], hidden_dim, 2 * hidden_dim);
+  }
+  return ht.back();
+}
+
+Expression FastLSTMBuilder::AddProjectedInput(const Expression & proj) {
+  projected_input = true;
+  Expression ret = add_input(proj);
+  projected_input = false;
+  return ret;
+}
+
+vector<Expression> FastLSTMBuilder::get_s(RNNPointer i) const {
+  if(i == -1) {
+    vector<Expression> ret;
+    for(auto & si : s0) ret.push_back(pick_range(si, 0, hidden_dim));
+    ret.insert(ret.end(), h0.begin(), h0.end());
+    return ret;
+  }
+  vector<Expression> ret;
+  for(unsigned l = 0; l < layers; ++l) {
+    ret.push_back(pick_range(s[i][l], 0, hidden_dim));
+    split_states[ret.back().i] = make_pair(h[i][l].i, s[i][l]);
+  }
+  ret.insert(ret.end(), h[i].begin(), h[i].end());
+  return ret;
+}
+
+Expression FastLSTMBuilder::set_h_impl(int prev, const vector<Expression> & h_new) {
+  // Keep the cells of the previous state, or zero if there is none
+  if(h_new.size() != layers)
+    THROW_ERROR("Fast LSTM builder expected " << layers << " values but got " << h_new.size());
+  vector<Expression> s_new = get_s(prev);
+  if(s_new.size() == 0)
+    for(unsigned i = 0; i < layers; ++i)
+      s_new.push_back(zeros(*cg, {hidden_dim}));
+  s_new.resize(layers);
+  s_new.insert(s_new.end(), h_new.begin(), h_new.end());
+  return set_s_impl(prev, s_new);
+}
+
+Expression FastLSTMBuilder::set_s_impl(int prev, const vector<Expression> & s_new) {
+  if(s_new.size() != 2 * layers)
+    THROW_ERROR("Fast LSTM builder expected " << 2 * layers << " values but got " << s_new.size());
+  s.push_back(vector<Expression>(layers));
+  h.push_back(vector<Expression>(layers));
+  for(unsigned i = 0; i < layers; ++i) {
+    s.back()[i] = concatenate({s_new[i], s_new[layers + i]});
+    h.back()[i] = s_new[layers + i];
+  }
+  return h.back().back();
+}
+
+void FastLSTMBuilder::copy(const RNNBuilder & rnn) {
+  const FastLSTMBuilder & rnn_fast = (const FastLSTMBuilder &)rnn;
+  if(params.size() != rnn_fast.params.size())
+    THROW_ERROR("Attempt to copy between fast LSTM builders with different numbers of layers");
+  for(size_t i = 0; i < params.size(); ++i)
+    for(size_t j = 0; j < params[i].size(); ++j)
+      params[i][j] = rnn_fast.params[i][j];
+}
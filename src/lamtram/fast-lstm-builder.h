@@ -0,0 +1,98 @@
+#pragma once
+
+#include <lamtram/projection-table.h>
+#include <dynet/rnn.h>
+#include <dynet/expr.h>
+#include <dynet/dynet.h>
+#include <unordered_map>
+#include <vector>
+
+namespace lamtram {
+
+// A whole step of an LSTM layer as a single node. The inputs are the input
+// weights and input (or the input already multiplied by the weights), the
+// recurrent weights and previous state if there is one, and the bias. The
+// state is the cell followed by the output, so the next step can read both
+// from one node.
+//
+// The four gates are calculated by one matrix multiplication over the stacked
+// weights, followed by one loop that applies the nonlinearities and updates
+// the cell. The gates are ordered input, forget, output and candidate, with a
+// bias of one added to the forget gate, the same as VanillaLSTMBuilder.
+struct FastLSTMNode : public dynet::Node {
+  FastLSTMNode(const std::vector<dynet::VariableIndex> & a, bool projected, bool has_prev) :
+    dynet::Node(a), projected_(projected), has_prev_(has_prev) { }
+
+  std::string as_string(const std::vector<std::string> & arg_names) const override;
+  dynet::Dim dim_forward(const std::vector<dynet::Dim> & xs) const override;
+  // The activated gates, and room for their gradients during backward
+  size_t aux_storage_size() const override;
+  void forward_impl(const std::vector<const dynet::Tensor*> & xs, dynet::Tensor & fx) const override;
+  void backward_impl(const std::vector<const dynet::Tensor*> & xs, const dynet::Tensor & fx, const dynet::Tensor & dEdf,
+                     unsigned i, dynet::Tensor & dEdxi) const override;
+  bool supports_multibatch() const override { return true; }
+
+protected:
+  // Calculate the gradients of the pre-activations of the gates
+  void CalcGateGradients(const std::vector<const dynet::Tensor*> & xs, const dynet::Tensor & fx, const dynet::Tensor & dEdf) const;
+
+  // Whether the first input is the input multiplied by the weights, and
+  // whether there is a previous state
+  bool projected_, has_prev_;
+};
+
+// An LSTM that calculates each step of each layer with a FastLSTMNode.
+//
+// The parameters are the same as those of VanillaLSTMBuilder, and so are the
+// states seen from outside: the cells of every layer followed by their
+// outputs. Each step of a layer adds two nodes to the graph (the step and the
+// extraction of its output) instead of one for every operation of each gate.
+// The node runs on the CPU only.
+struct FastLSTMBuilder : public dynet::RNNBuilder, public ProjectedInputBuilder {
+  FastLSTMBuilder() = default;
+  explicit FastLSTMBuilder(unsigned layers,
+                           unsigned input_dim,
+                           unsigned hidden_dim,
+                           dynet::ParameterCollection & model);
+
+  dynet::Expression back() const override { return (cur == -1 ? h0.back() : h[cur].back()); }
+  std::vector<dynet::Expression> final_h() const override { return (h.size() == 0 ? h0 : h.back()); }
+  std::vector<dynet::Expression> final_s() const override { return get_s(h.size() == 0 ? dynet::RNNPointer(-1) : dynet::RNNPointer(h.size() - 1)); }
+  std::vector<dynet::Expression> get_h(dynet::RNNPointer i) const override { return (i == -1 ? h0 : h[i]); }
+  std::vector<dynet::Expression> get_s(dynet::RNNPointer i) const override;
+  unsigned num_h0_components() const override { return 2 * layers; }
+  void copy(const dynet::RNNBuilder & params) override;
+  dynet::ParameterCollection & get_parameter_collection() override { return local_model; }
+
+  // Take the input of the first layer as its product with the input weights
+  dynet::Parameter GetInputWeights() const override { return params[0][0]; }
+  dynet::Expression AddProjectedInput(const dynet::Expression & proj) override;
+
+protected:
+  void new_graph_impl(dynet::ComputationGraph & cg, bool update) override;
+  void start_new_sequence_impl(const std::vector<dynet::Expression> & h_0) override;
+  dynet::Expression add_input_impl(int prev, const dynet::Expression & x) override;
+  dynet::Expression set_h_impl(int prev, const std::vector<dynet::Expression> & h_new) override;
+  dynet::Expression set_s_impl(int prev, const std::vector<dynet::Expression> & s_new) override;
+
+  // The input, recurrent and bias weights of each layer
+  std::vector<std::vector<dynet::Parameter> > params;
+  std::vector<std::vector<dynet::Expression> > param_vars;
+
+  // The states (cell and output) and outputs of each layer at each step, and
+  // the initial values, where s0 is empty if the sequence starts from zero
+  std::vector<std::vector<dynet::Expression> > s, h;
+  std::vector<dynet::Expression> s0, h0;
+  // The state each cell extracted by get_s() came from, and the output
+  // extracted from the same state, so that a sequence started from both can
+  // continue from the state instead of concatenating them again
+  mutable std::unordered_map<dynet::VariableIndex, std::pair<dynet::VariableIndex, dynet::Expression> > split_states;
+
+  dynet::ParameterCollection local_model;
+  dynet::ComputationGraph * cg = nullptr;
+  unsigned layers, hidden_dim;
+  // Whether the input being added is already multiplied by the weights
+  bool projected_input = false;
+};
+
+}
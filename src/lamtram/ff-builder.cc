@@ -0,0 +1,73 @@
+#include <lamtram/ff-builder.h>
+#include <lamtram/macros.h>
+#include <dynet/model.h>
+
+using namespace std;
+using namespace lamtram;
+using namespace dynet;
+
+FeedForwardBuilder::FeedForwardBuilder(unsigned layers, unsigned input_dim, unsigned hidden_dim, ParameterCollection & model) : layers(layers) {
+  local_model = model.add_subcollection("ff-builder");
+  unsigned layer_input_dim = input_dim;
+  for(unsigned i = 0; i < layers; ++i) {
+    Parameter p_W = local_model.add_parameters({hidden_dim, layer_input_dim});
+    Parameter p_b = local_model.add_parameters({hidden_dim});
+    params.push_back({p_W, p_b});
+    layer_input_dim = hidden_dim;
+  }
+  dropout_rate = 0.f;
+}
+
+void FeedForwardBuilder::new_graph_impl(ComputationGraph & cg, bool update) {
+  param_vars.clear();
+  for(auto & p : params)
+    param_vars.push_back({update ? parameter(cg, p[0]) : const_parameter(cg, p[0]),
+                          update ? parameter(cg, p[1]) : const_parameter(cg, p[1])});
+}
+
+void FeedForwardBuilder::start_new_sequence_impl(const vector<Expression> & h_0) {
+  h.clear();
+  h0 = h_0;
+  if(h0.size() != 0 && h0.size() != layers)
+    THROW_ERROR("Feed-forward builder expected " << layers << " initial values but got " << h0.size());
+}
+
+Expression FeedForwardBuilder::add_input_impl(int prev, const Expression & in) {
+  // The previous step is not used, only the input
+  h.push_back(vector<Expression>(layers));
+  vector<Expression> & ht = h.back();
+  Expression x = in;
+  for(unsigned i = 0; i < layers; ++i) {
+    if(i == 0 && projected_input) {
+      x = tanh(x + param_vars[i][1]);
+    } else {
+      if(dropout_rate) x = dropout(x, dropout_rate);
+      x = tanh(affine_transform({param_vars[i][1], param_vars[i][0], x}));
+    }
+    ht[i] = x;
+  }
+  return ht.back();
+}
+
+Expression FeedForwardBuilder::AddProjectedInput(const Expression & proj) {
+  projected_input = true;
+  Expression ret = add_input(proj);
+  projected_input = false;
+  return ret;
+}
+
+Expression FeedForwardBuilder::set_h_impl(int prev, const vector<Expression> & h_new) {
+  if(h_new.size() != layers)
+    THROW_ERROR("Feed-forward builder expected " << layers << " values but got " << h_new.size());
+  h.push_back(h_new);
+  return h.back().back();
+}
+
+void FeedForwardBuilder::copy(const RNNBuilder & rnn) {
+  const FeedForwardBuilder & rnn_ff = (const FeedForwardBuilder &)rnn;
+  if(params.size() != rnn_ff.params.size())
+    THROW_ERROR("Attempt to copy between feed-forward builders with different numbers of layers");
+  for(size_t i = 0; i < params.size(); ++i)
+    for(size_t j = 0; j < params[i].size(); ++j)
+      params[i][j] = rnn_ff.params[i][j];
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <lamtram/projection-table.h>
+#include <dynet/rnn.h>
+#include <dynet/expr.h>
+#include <vector>
+
+namespace lamtram {
+
+// A stack of feed-forward layers behind the interface of an RNN builder.
+//
+// Each layer calculates tanh(W x + b) from the output of the layer below,
+// without any connection to the previous time step. When used with an n-gram
+// context, the output only depends on the last n words, which allows the
+// decoder to recombine hypotheses that share them.
+struct FeedForwardBuilder : public dynet::RNNBuilder, public ProjectedInputBuilder {
+  FeedForwardBuilder() = default;
+  explicit FeedForwardBuilder(unsigned layers,
+                              unsigned input_dim,
+                              unsigned hidden_dim,
+                              dynet::ParameterCollection & model);
+
+  dynet::Expression back() const override { return (cur == -1 ? h0.back() : h[cur].back()); }
+  std::vector<dynet::Expression> final_h() const override { return (h.size() == 0 ? h0 : h.back()); }
+  std::vector<dynet::Expression> final_s() const override { return final_h(); }
+  std::vector<dynet::Expression> get_h(dynet::RNNPointer i) const override { return (i == -1 ? h0 : h[i]); }
+  std::vector<dynet::Expression> get_s(dynet::RNNPointer i) const override { return get_h(i); }
+  unsigned num_h0_components() const override { return layers; }
+  void copy(const dynet::RNNBuilder & params) override;
+  dynet::ParameterCollection & get_parameter_collection() override { return local_model; }
+
+  // Take the input of the first layer as its product with the weights
+  dynet::Parameter GetInputWeights() const override { return params[0][0]; }
+  dynet::Expression AddProjectedInput(const dynet::Expression & proj) override;
+
+protected:
+  void new_graph_impl(dynet::ComputationGraph & cg, bool update) override;
+  void start_new_sequence_impl(const std::vector<dynet::Expression> & h_0) override;
+  dynet::Expression add_input_impl(int prev, const dynet::Expression & x) override;
+  dynet::Expression set_h_impl(int prev, const std::vector<dynet::Expression> & h_new) override;
+  dynet::Expression set_s_impl(int prev, const std::vector<dynet::Expression> & s_new) override { return set_h_impl(prev, s_new); }
+
+  // The weights and bias of each layer
+  std::vector<std::vector<dynet::Parameter> > params;
+  std::vector<std::vector<dynet::Expression> > param_vars;
+
+  // The outputs of each layer at each step, and the initial values
+  std::vector<std::vector<dynet::Expression> > h;
+  std::vector<dynet::Expression> h0;
+
+  dynet::ParameterCollection local_model;
+  unsigned layers;
+  // Whether the input being added is already multiplied by the weights
+  bool projected_input = false;
+};
+
+}
@@ -0,0 +1,624 @@
+#include <lamtram/inference-engine.h>
+#include <lamtram/encoder-attentional.h>
+#include <lamtram/softmax-full.h>
+#include <lamtram/macros.h>
+#include <dynet/model.h>
+#include <dynet/rnn.h>
+#include <dynet/tensor.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+using namespace std;
+using namespace lamtram;
+
+// The number of floats in a cache line
+static const int kLineSize = 16;
+// The number of rows multiplied at a time, so their sums stay in the cache
+static const int kBlockRows = 256;
+
+inline float Sigmoid(float x) { return 1.f / (1.f + exp(-x)); }
+
+inline float Dot(const float * a, const float * b, int size) {
+  float ret = 0.f;
+  for(int i = 0; i < size; i++)
+    ret += a[i] * b[i];
+  return ret;
+}
+
+// Replace scores with their log softmax
+inline void LogSoftmax(float * vals, int size) {
+  float max_val = *max_element(vals, vals + size), sum = 0.f;
+  for(int i = 0; i < size; i++)
+    sum += exp(vals[i] - max_val);
+  float norm = max_val + log(sum);
+  for(int i = 0; i < size; i++)
+    vals[i] -= norm;
+}
+
+// Replace scores with their softmax
+inline void Softmax(float * vals, int size) {
+  float max_val = *max_element(vals, vals + size), sum = 0.f;
+  for(int i = 0; i < size; i++)
+    sum += (vals[i] = exp(vals[i] - max_val));
+  for(int i = 0; i < size; i++)
+    vals[i] /= sum;
+}
+
+void InferenceMatrix::Resize(int rows, int cols) {
+  rows_ = rows; cols_ = cols;
+  stride_ = (rows + kLineSize - 1) / kLineSize * kLineSize;
+  vals_.assign(stride_ * cols + kLineSize, 0.f);
+}
+
+void InferenceMatrix::Set(const dynet::ParameterStorage & param) {
+  Resize(param.dim.rows(), param.dim.cols());
+  vector<float> vals = dynet::as_vector(param.values);
+  for(int j = 0; j < cols_; j++)
+    copy(vals.begin() + j * rows_, vals.begin() + (j+1) * rows_, Col(j));
+}
+
+void InferenceMatrix::Set(const dynet::LookupParameterStorage & param) {
+  Resize(param.dim.rows(), param.values.size());
+  for(int j = 0; j < cols_; j++) {
+    vector<float> vals = dynet::as_vector(param.values[j]);
+    copy(vals.begin(), vals.end(), Col(j));
+  }
+}
+
+// The first cache line boundary in a vector with room to align it
+template <class T>
+inline T * Aligned(vector<T> & vals) {
+  uintptr_t start = reinterpret_cast<uintptr_t>(vals.data()), align = kLineSize * sizeof(float);
+  return reinterpret_cast<T*>((start + align - 1) / align * align);
+}
+
+// Copy the aligned values of a vector with room to align them
+template <class T>
+inline void CopyAligned(const vector<T> & from, vector<T> & to) {
+  to.resize(from.size());
+  size_t pad = kLineSize * sizeof(float) / sizeof(T);
+  if(from.size() > pad) {
+    const T * start = Aligned(const_cast<vector<T>&>(from));
+    copy(start, start + from.size() - pad, Aligned(to));
+  }
+}
+
+InferenceMatrix & InferenceMatrix::operator=(const InferenceMatrix & other) {
+  if(this == &other) return *this;
+  rows_ = other.rows_; cols_ = other.cols_;
+  stride_ = other.stride_; qstride_ = other.qstride_; hstride_ = other.hstride_;
+  precision_ = other.precision_;
+  CopyAligned(other.vals_, vals_);
+  CopyAligned(other.qvals_, qvals_);
+  CopyAligned(other.hvals_, hvals_);
+  scales_ = other.scales_;
+  return *this;
+}
+
+float * InferenceMatrix::Data() {
+  return Aligned(vals_);
+}
+const float * InferenceMatrix::Data() const {
+  return const_cast<InferenceMatrix*>(this)->Data();
+}
+
+const int8_t * InferenceMatrix::QuantizedCol(int j) const {
+  return Aligned(const_cast<vector<int8_t>&>(qvals_)) + j * qstride_;
+}
+
+const uint16_t * InferenceMatrix::HalfCol(int j) const {
+  return Aligned(const_cast<vector<uint16_t>&>(hvals_)) + j * hstride_;
+}
+
+void InferenceMatrix::SetPrecision(ParamPrecision precision) {
+  if(IsQuantized() || precision == precision_) return;
+  if(precision_ != PRECISION_FP32)
+    THROW_ERROR("Cannot change the precision of a matrix from " << PrecisionName(precision_) << " to " << PrecisionName(precision));
+  int align = kLineSize * sizeof(float) / sizeof(uint16_t);
+  hstride_ = (rows_ + align - 1) / align * align;
+  hvals_.assign(hstride_ * cols_ + align, 0);
+  for(int j = 0; j < cols_; j++)
+    FloatToHalf(Col(j), const_cast<uint16_t*>(HalfCol(j)), rows_, precision);
+  vector<float>().swap(vals_);
+  precision_ = precision;
+}
+
+void InferenceMatrix::GetCol(int j, float * out) const {
+  if(IsQuantized()) {
+    const int8_t * col = QuantizedCol(j);
+    for(int i = 0; i < rows_; i++)
+      out[i] = col[i] * scales_[i];
+  } else if(precision_ != PRECISION_FP32) {
+    HalfToFloat(HalfCol(j), out, rows_, precision_);
+  } else {
+    copy(Col(j), Col(j) + rows_, out);
+  }
+}
+
+size_t InferenceMatrix::GetMemorySize() const {
+  return vals_.size() * sizeof(float) + qvals_.size() * sizeof(int8_t) + scales_.size() * sizeof(float) + hvals_.size() * sizeof(uint16_t);
+}
+
+void InferenceMatrix::Quantize() {
+  if(IsQuantized()) return;
+  if(precision_ != PRECISION_FP32)
+    THROW_ERROR("Only matrices of 32-bit floats can be quantized");
+  int align = kLineSize * sizeof(float);
+  qstride_ = (rows_ + align - 1) / align * align;
+  qvals_.assign(qstride_ * cols_ + align, 0);
+  scales_.assign(rows_, 0.f);
+  for(int j = 0; j < cols_; j++) {
+    const float * col = Col(j);
+    for(int i = 0; i < rows_; i++)
+      scales_[i] = max(scales_[i], fabs(col[i]));
+  }
+  for(float & scale : scales_)
+    scale = (scale > 0.f ? scale / 127.f : 1.f);
+  for(int j = 0; j < cols_; j++) {
+    const float * col = Col(j);
+    int8_t * qcol = const_cast<int8_t*>(QuantizedCol(j));
+    for(int i = 0; i < rows_; i++)
+      qcol[i] = static_cast<int8_t>(max(-127.f, min(127.f, round(col[i] / scales_[i]))));
+  }
+  vector<float>().swap(vals_);
+}
+
+void InferenceMatrix::MultAdd(const float * x, float * y) const {
+  if(IsQuantized()) {
+    MultAddQuantized(x, y);
+    return;
+  } else if(precision_ != PRECISION_FP32) {
+    MultAddHalf(x, y);
+    return;
+  }
+  // Columns are added four at a time, so each sum is loaded and stored once
+  // for every four columns
+  for(int start = 0; start < rows_; start += kBlockRows) {
+    int end = min(start + kBlockRows, rows_), j = 0;
+    for(; j + 4 <= cols_; j += 4) {
+      const float *c0 = Col(j), *c1 = Col(j+1), *c2 = Col(j+2), *c3 = Col(j+3);
+      float x0 = x[j], x1 = x[j+1], x2 = x[j+2], x3 = x[j+3];
+      for(int i = start; i < end; i++)
+        y[i] += c0[i] * x0 + c1[i] * x1 + c2[i] * x2 + c3[i] * x3;
+    }
+    for(; j < cols_; j++) {
+      const float * c = Col(j);
+      float xj = x[j];
+      for(int i = start; i < end; i++)
+        y[i] += c[i] * xj;
+    }
+  }
+}
+
+void InferenceMatrix::MultAddQuantized(const float * x, float * y) const {
+  // Quantize the input to 8-bit integers with a single scale, so the
+  // products of each column can be summed exactly as 32-bit integers. With
+  // both sides at most 127, pairs of products fit in 16 bits, and the sums of
+  // up to 2^31/127^2 columns fit in 32 bits.
+  float x_scale = 0.f;
+  for(int j = 0; j < cols_; j++)
+    x_scale = max(x_scale, fabs(x[j]));
+  x_scale = (x_scale > 0.f ? x_scale / 127.f : 1.f);
+  qx_.resize(cols_);
+  for(int j = 0; j < cols_; j++)
+    qx_[j] = static_cast<int16_t>(round(x[j] / x_scale));
+  // The same order as the floating point version, with the sums of each
+  // block of rows kept apart until all columns are added
+  int32_t sums[kBlockRows];
+  for(int start = 0; start < rows_; start += kBlockRows) {
+    int end = min(start + kBlockRows, rows_), j = 0;
+    int32_t * s = sums - start;
+    fill(sums, sums + (end - start), 0);
+    for(; j + 4 <= cols_; j += 4) {
+      const int8_t *c0 = QuantizedCol(j), *c1 = QuantizedCol(j+1), *c2 = QuantizedCol(j+2), *c3 = QuantizedCol(j+3);
+      int16_t x0 = qx_[j], x1 = qx_[j+1], x2 = qx_[j+2], x3 = qx_[j+3];
+      for(int i = start; i < end; i++)
+        s[i] += static_cast<int16_t>(c0[i] * x0 + c1[i] * x1) + static_cast<int16_t>(c2[i] * x2 + c3[i] * x3);
+    }
+    for(; j < cols_; j++) {
+      const int8_t * c = QuantizedCol(j);
+      int16_t xj = qx_[j];
+      for(int i = start; i < end; i++)
+        s[i] += c[i] * xj;
+    }
+    for(int i = start; i < end; i++)
+      y[i] += s[i] * (scales_[i] * x_scale);
+  }
+}
+
+void InferenceMatrix::MultAddHalf(const float * x, float * y) const {
+  // The same order as the floating point version, converting the block of
+  // each column to a buffer that stays in the cache before adding it
+  float buf[4][kBlockRows];
+  for(int start = 0; start < rows_; start += kBlockRows) {
+    int end = min(start + kBlockRows, rows_), len = end - start, j = 0;
+    float * yb = y + start;
+    for(; j + 4 <= cols_; j += 4) {
+      for(int k = 0; k < 4; k++)
+        HalfToFloat(HalfCol(j+k) + start, buf[k], len, precision_);
+      float x0 = x[j], x1 = x[j+1], x2 = x[j+2], x3 = x[j+3];
+      for(int i = 0; i < len; i++)
+        yb[i] += buf[0][i] * x0 + buf[1][i] * x1 + buf[2][i] * x2 + buf[3][i] * x3;
+    }
+    for(; j < cols_; j++) {
+      HalfToFloat(HalfCol(j) + start, buf[0], len, precision_);
+      float xj = x[j];
+      for(int i = 0; i < len; i++)
+        yb[i] += buf[0][i] * xj;
+    }
+  }
+}
+
+InferenceLayers::InferenceLayers(const BuilderSpec & spec, dynet::RNNBuilder & builder, int input_dim) : spec_(spec), nodes_(spec.nodes) {
+  if(!IsSupported(spec))
+    THROW_ERROR("The inference engine does not support layers of type " << spec.type);
+  // The builders create the weights of each layer in order: the input,
+  // recurrent (except for ff) and bias weights
+  const auto & params = builder.get_parameter_collection().parameters_list();
+  int per_layer = (spec.type == "ff" ? 2 : 3), gates = (IsLSTM(spec) ? 4 : 1);
+  if((int)params.size() != per_layer * spec.layers)
+    THROW_ERROR("Expected " << per_layer * spec.layers << " parameters for " << spec << " layers, but found " << params.size());
+  input_W_.resize(spec.layers); b_.resize(spec.layers);
+  if(per_layer == 3) hidden_W_.resize(spec.layers);
+  for(int l = 0; l < spec.layers; l++) {
+    input_W_[l].Set(*params[l * per_layer]);
+    if(per_layer == 3) hidden_W_[l].Set(*params[l * per_layer + 1]);
+    b_[l].Set(*params[(l+1) * per_layer - 1]);
+    int in_size = (l == 0 ? input_dim : nodes_);
+    if(input_W_[l].GetRows() != gates * nodes_ || input_W_[l].GetCols() != in_size || b_[l].GetRows() != gates * nodes_ ||
+       (per_layer == 3 && (hidden_W_[l].GetRows() != gates * nodes_ || hidden_W_[l].GetCols() != nodes_)))
+      THROW_ERROR("Parameters of layer " << l << " do not match the shape of " << spec << " layers");
+  }
+  state_size_ = spec.multiplier * spec.layers * nodes_;
+  gates_.resize(gates * nodes_);
+}
+
+void InferenceLayers::PrecomputeInputs(const InferenceMatrix & embeddings, int num_words) {
+  InferenceMatrix & W = input_W_[0];
+  int emb_size = embeddings.GetRows(), rows = W.GetRows(), num_cols = num_words * emb_size;
+  if(W.IsQuantized() || W.GetPrecision() != PRECISION_FP32 || embeddings.GetPrecision() != PRECISION_FP32)
+    THROW_ERROR("Inputs can only be precomputed from 32-bit parameters");
+  if(W.GetCols() < num_cols)
+    THROW_ERROR("Input weights with " << W.GetCols() << " columns cannot be applied to " << num_words << " embeddings of size " << emb_size);
+  proj_.assign(num_words, InferenceMatrix());
+  for(int k = 0; k < num_words; k++) {
+    proj_[k].Resize(rows, embeddings.GetCols());
+    for(int wid = 0; wid < embeddings.GetCols(); wid++) {
+      float * out = proj_[k].Col(wid);
+      if(k == 0) b_[0].GetCol(0, out);
+      const float * emb = embeddings.Col(wid);
+      for(int j = 0; j < emb_size; j++) {
+        const float * col = W.Col(k * emb_size + j);
+        float e = emb[j];
+        for(int i = 0; i < rows; i++)
+          out[i] += col[i] * e;
+      }
+    }
+  }
+  InferenceMatrix rest;
+  rest.Resize(rows, W.GetCols() - num_cols);
+  for(int j = 0; j < rest.GetCols(); j++)
+    copy(W.Col(num_cols + j), W.Col(num_cols + j) + rows, rest.Col(j));
+  W = rest;
+  proj_col_.resize(rows);
+}
+
+void InferenceLayers::Step(const float * state_in, const float * x, float * state_out) {
+  if(HasPrecomputedInputs())
+    THROW_ERROR("Layers with precomputed inputs must be given the IDs of the words");
+  float * g = gates_.data();
+  b_[0].GetCol(0, g);
+  input_W_[0].MultAdd(x, g);
+  StepLayers(state_in, state_out);
+}
+
+void InferenceLayers::Step(const float * state_in, const WordId * words, const float * x, float * state_out) {
+  if(!HasPrecomputedInputs())
+    THROW_ERROR("The inputs of the layers were not precomputed");
+  // The first table includes the bias
+  float * g = gates_.data();
+  proj_[0].GetCol(words[0], g);
+  for(size_t k = 1; k < proj_.size(); k++) {
+    proj_[k].GetCol(words[k], proj_col_.data());
+    for(size_t i = 0; i < proj_col_.size(); i++)
+      g[i] += proj_col_[i];
+  }
+  if(input_W_[0].GetCols() > 0)
+    input_W_[0].MultAdd(x, g);
+  StepLayers(state_in, state_out);
+}
+
+void InferenceLayers::StepLayers(const float * state_in, float * state_out) {
+  int layers = spec_.layers, n = nodes_;
+  float * g = gates_.data();
+  const float * x = nullptr;
+  for(int l = 0; l < layers; l++) {
+    if(l > 0) {
+      b_[l].GetCol(0, g);
+      input_W_[l].MultAdd(x, g);
+    }
+    if(IsLSTM(spec_)) {
+      const float * c_prev = (state_in ? state_in + l * n : nullptr);
+      if(state_in) hidden_W_[l].MultAdd(state_in + (layers + l) * n, g);
+      float * c = state_out + l * n, * h = state_out + (layers + l) * n;
+      // The gates are ordered input, forget, output and candidate, and dynet
+      // adds a bias of one to the forget gate
+      for(int i = 0; i < n; i++) {
+        float c_new = Sigmoid(g[i]) * tanh(g[3*n + i]);
+        if(c_prev) c_new += Sigmoid(g[n + i] + 1.f) * c_prev[i];
+        c[i] = c_new;
+        h[i] = Sigmoid(g[2*n + i]) * tanh(c_new);
+      }
+      x = h;
+    } else {
+      if(state_in && spec_.type == "rnn") hidden_W_[l].MultAdd(state_in + l * n, g);
+      float * h = state_out + l * n;
+      for(int i = 0; i < n; i++)
+        h[i] = tanh(g[i]);
+      x = h;
+    }
+  }
+}
+
+void InferenceLayers::Quantize() {
+  for(auto & W : input_W_) W.Quantize();
+  for(auto & W : hidden_W_) W.Quantize();
+}
+
+void InferenceLayers::SetPrecision(ParamPrecision precision) {
+  for(auto & W : input_W_) W.SetPrecision(precision);
+  for(auto & W : hidden_W_) W.SetPrecision(precision);
+  for(auto & b : b_) b.SetPrecision(precision);
+  for(auto & W : proj_) W.SetPrecision(precision);
+}
+
+size_t InferenceLayers::GetMemorySize() const {
+  size_t ret = 0;
+  for(auto * Ws : {&input_W_, &hidden_W_, &b_, &proj_})
+    for(auto & W : *Ws)
+      ret += W.GetMemorySize();
+  return ret;
+}
+
+bool InferenceEngine::IsSupported(const EncoderAttentional & model, std::string & reason) {
+  const ExternAttentional & ext = *model.extern_calc_;
+  const NeuralLM & dec = *model.decoder_;
+  for(auto & enc : ext.encoders_) {
+    if(!InferenceLayers::IsSupported(enc->hidden_spec_)) {
+      reason = "encoder layers of type " + enc->hidden_spec_.type + " are not supported";
+      return false;
+    }
+  }
+  if(!InferenceLayers::IsSupported(dec.hidden_spec_)) {
+    reason = "decoder layers of type " + dec.hidden_spec_.type + " are not supported";
+    return false;
+  }
+  if(ext.lex_type_ != "none") {
+    reason = "lexicon priors are not supported";
+    return false;
+  }
+  if(dynamic_cast<const SoftmaxFull*>(dec.softmax_.get()) == nullptr) {
+    reason = "only the full softmax is supported";
+    return false;
+  }
+  if(dec.extern_context_ != 0 && dec.extern_context_ != ext.GetContextSize()) {
+    reason = "the decoder context size does not match the encoders";
+    return false;
+  }
+  return true;
+}
+
+InferenceEngine::InferenceEngine(const EncoderAttentional & model, bool quantize, ParamPrecision precision, bool precompute_inputs) : src_len_(0) {
+  string reason;
+  if(!IsSupported(model, reason))
+    THROW_ERROR("The inference engine cannot run this model: " << reason);
+  const ExternAttentional & ext = *model.extern_calc_;
+  const NeuralLM & dec = *model.decoder_;
+  // The encoders
+  for(auto & enc : ext.encoders_) {
+    encoders_.push_back(make_shared<InferenceLayers>(enc->hidden_spec_, *enc->builder_, enc->wordrep_size_));
+    enc_wr_W_.push_back(InferenceMatrix());
+    enc_wr_W_.rbegin()->Set(enc->p_wr_W_.get_storage());
+    enc_reverse_.push_back(enc->reverse_);
+  }
+  // The attention
+  attention_type_ = ext.attention_type_;
+  attention_sum_ = (ext.attention_hist_ == "sum");
+  align_sum_W_ = (attention_sum_ ? dynet::as_vector(ext.p_align_sum_W_.get_storage().values)[0] : 0.f);
+  context_size_ = ext.GetContextSize();
+  hidden_size_ = ext.hidden_size_;
+  if(attention_type_ != "dot")
+    ehid_h_W_.Set(ext.p_ehid_h_W_.get_storage());
+  if(hidden_size_) {
+    ehid_state_W_.Set(ext.p_ehid_state_W_.get_storage());
+    e_ehid_W_ = dynet::as_vector(ext.p_e_ehid_W_.get_storage().values);
+  }
+  enc2dec_W_.Set(model.p_enc2dec_W_.get_storage());
+  enc2dec_b_.Set(model.p_enc2dec_b_.get_storage());
+  // The decoder and softmax
+  decoder_ = make_shared<InferenceLayers>(dec.hidden_spec_, *dec.builder_, dec.ngram_context_ * dec.wordrep_size_ + (dec.extern_feed_ ? dec.extern_context_ : 0));
+  dec_wr_W_.Set(dec.p_wr_W_.get_storage());
+  const SoftmaxFull & softmax = dynamic_cast<const SoftmaxFull&>(*dec.softmax_);
+  sm_W_.Set(softmax.p_sm_W_.get_storage());
+  sm_b_.Set(softmax.p_sm_b_.get_storage());
+  vocab_size_ = sm_b_.GetRows();
+  wordrep_size_ = dec.wordrep_size_;
+  ngram_context_ = dec.ngram_context_;
+  attend_ = (dec.extern_context_ > 0);
+  attention_sum_ = attention_sum_ && attend_;
+  feed_ = attend_ && dec.extern_feed_;
+  // The embeddings are only needed to precompute the inputs
+  if(precompute_inputs) {
+    for(size_t e = 0; e < encoders_.size(); e++) {
+      encoders_[e]->PrecomputeInputs(enc_wr_W_[e], 1);
+      enc_wr_W_[e] = InferenceMatrix();
+    }
+    decoder_->PrecomputeInputs(dec_wr_W_, ngram_context_);
+    dec_wr_W_ = InferenceMatrix();
+  }
+  if(quantize) {
+    for(auto & enc : encoders_) enc->Quantize();
+    decoder_->Quantize();
+    sm_W_.Quantize();
+  }
+  for(auto & enc : encoders_) enc->SetPrecision(precision);
+  decoder_->SetPrecision(precision);
+  for(InferenceMatrix * W : {&ehid_h_W_, &ehid_state_W_, &enc2dec_W_, &enc2dec_b_, &dec_wr_W_, &sm_W_, &sm_b_})
+    W->SetPrecision(precision);
+  for(auto & W : enc_wr_W_) W.SetPrecision(precision);
+  // The buffers
+  input_.resize(ngram_context_ * wordrep_size_ + (feed_ ? context_size_ : 0));
+  state_part_.resize(hidden_size_);
+  softmax_in_.resize(decoder_->GetNumNodes() + (attend_ ? context_size_ : 0));
+}
+
+size_t InferenceEngine::GetMemorySize() const {
+  size_t ret = decoder_->GetMemorySize() + e_ehid_W_.size() * sizeof(float);
+  for(auto & enc : encoders_) ret += enc->GetMemorySize();
+  for(const InferenceMatrix * W : {&ehid_h_W_, &ehid_state_W_, &enc2dec_W_, &enc2dec_b_, &dec_wr_W_, &sm_W_, &sm_b_})
+    ret += W->GetMemorySize();
+  for(auto & W : enc_wr_W_) ret += W.GetMemorySize();
+  return ret;
+}
+
+void InferenceEngine::InitializeSentence(const Sentence & sent_src, std::vector<float> & state) {
+  // Run each encoder over the sentence followed by the end symbol, and put its
+  // outputs in its rows of the columns for each word
+  src_len_ = sent_src.size() + 1;
+  src_h_.Resize(context_size_, src_len_);
+  vector<float> state_prev, state_next, word;
+  int offset = 0;
+  for(size_t e = 0; e < encoders_.size(); e++) {
+    InferenceLayers & enc = *encoders_[e];
+    state_prev.resize(enc.GetStateSize()); state_next.resize(enc.GetStateSize());
+    word.resize(enc_wr_W_[e].GetRows());
+    bool started = false;
+    auto add_word = [&](WordId wid, int pos) {
+      if(enc.HasPrecomputedInputs()) {
+        enc.Step(started ? state_prev.data() : nullptr, &wid, nullptr, state_next.data());
+      } else {
+        enc_wr_W_[e].GetCol(wid, word.data());
+        enc.Step(started ? state_prev.data() : nullptr, word.data(), state_next.data());
+      }
+      const float * out = enc.GetOutput(state_next.data());
+      copy(out, out + enc.GetNumNodes(), src_h_.Col(pos) + offset);
+      swap(state_prev, state_next);
+      started = true;
+    };
+    if(enc_reverse_[e]) {
+      for(int t = sent_src.size() - 1; t >= 0; t--) add_word(sent_src[t], t);
+    } else {
+      for(int t = 0; t < (int)sent_src.size(); t++) add_word(sent_src[t], t);
+    }
+    add_word(0, src_len_ - 1);
+    offset += enc.GetNumNodes();
+  }
+  // Project the states used by the attention
+  if(attention_type_ != "dot") {
+    src_hpart_.Resize(ehid_h_W_.GetRows(), src_len_);
+    for(int j = 0; j < src_len_; j++)
+      ehid_h_W_.MultAdd(src_h_.Col(j), src_hpart_.Col(j));
+  }
+  attention_.resize(src_len_);
+  // Map the last state to the initial state of the decoder, with the cells
+  // followed by the outputs of lstm layers
+  vector<float> dec_in(enc2dec_b_.GetRows());
+  enc2dec_b_.GetCol(0, dec_in.data());
+  enc2dec_W_.MultAdd(src_h_.Col(src_len_ - 1), dec_in.data());
+  int layer_size = decoder_->GetStateSize();
+  state.assign(layer_size + (feed_ ? context_size_ : 0) + (attention_sum_ ? src_len_ : 0), 0.f);
+  if(layer_size == (int)dec_in.size() * 2) {
+    copy(dec_in.begin(), dec_in.end(), state.begin());
+    for(size_t i = 0; i < dec_in.size(); i++)
+      state[dec_in.size() + i] = tanh(dec_in[i]);
+  } else {
+    for(size_t i = 0; i < dec_in.size(); i++)
+      state[i] = tanh(dec_in[i]);
+  }
+}
+
+void InferenceEngine::CalcNextLogProbs(const std::vector<float> & state_in, const WordId * history,
+                                       std::vector<float> & state_out, float * log_probs, float * align) {
+  int layer_size = decoder_->GetStateSize(), nodes = decoder_->GetNumNodes();
+  state_out.resize(state_in.size());
+  // Concatenate the embeddings of the history and the last context, and run
+  // the decoder, where precomputed inputs only need the last context
+  bool precomputed = decoder_->HasPrecomputedInputs();
+  int emb_size = (precomputed ? 0 : ngram_context_ * wordrep_size_);
+  if(!precomputed)
+    for(int k = 0; k < ngram_context_; k++)
+      dec_wr_W_.GetCol(history[k], input_.data() + k * wordrep_size_);
+  if(feed_)
+    copy(state_in.begin() + layer_size, state_in.begin() + layer_size + context_size_, input_.begin() + emb_size);
+  if(precomputed)
+    decoder_->Step(state_in.data(), history, input_.data(), state_out.data());
+  else
+    decoder_->Step(state_in.data(), input_.data(), state_out.data());
+  const float * h = decoder_->GetOutput(state_out.data());
+  copy(h, h + nodes, softmax_in_.begin());
+  // Attend to the source
+  if(attend_) {
+    float * e = attention_.data();
+    if(hidden_size_) {
+      fill(state_part_.begin(), state_part_.end(), 0.f);
+      ehid_state_W_.MultAdd(h, state_part_.data());
+      for(int j = 0; j < src_len_; j++) {
+        const float * hpart = src_hpart_.Col(j);
+        float score = 0.f;
+        for(int k = 0; k < hidden_size_; k++)
+          score += e_ehid_W_[k] * tanh(hpart[k] + state_part_[k]);
+        e[j] = score;
+      }
+    } else {
+      const InferenceMatrix & keys = (attention_type_ == "dot" ? src_h_ : src_hpart_);
+      for(int j = 0; j < src_len_; j++)
+        e[j] = Dot(keys.Col(j), h, keys.GetRows());
+    }
+    const float * sum_in = state_in.data() + layer_size + (feed_ ? context_size_ : 0);
+    if(attention_sum_)
+      for(int j = 0; j < src_len_; j++)
+        e[j] += sum_in[j] * align_sum_W_;
+    Softmax(e, src_len_);
+    if(attention_sum_) {
+      float * sum_out = state_out.data() + layer_size + (feed_ ? context_size_ : 0);
+      for(int j = 0; j < src_len_; j++)
+        sum_out[j] = sum_in[j] + e[j];
+    }
+    // The context is the sum of the source states weighted by the attention
+    float * ctxt = softmax_in_.data() + nodes;
+    fill(ctxt, ctxt + context_size_, 0.f);
+    for(int j = 0; j < src_len_; j++) {
+      const float * col = src_h_.Col(j);
+      for(int k = 0; k < context_size_; k++)
+        ctxt[k] += col[k] * e[j];
+    }
+    if(feed_)
+      copy(ctxt, ctxt + context_size_, state_out.begin() + layer_size);
+    if(align)
+      copy(e, e + src_len_, align);
+  }
+  // Calculate the softmax
+  sm_b_.GetCol(0, log_probs);
+  sm_W_.MultAdd(softmax_in_.data(), log_probs);
+  LogSoftmax(log_probs, vocab_size_);
+}
+
+float InferenceEngine::CalcSentLL(const Sentence & sent_src, const Sentence & sent_trg, std::vector<float> & word_lls) {
+  vector<float> state, next_state, log_probs(vocab_size_);
+  InitializeSentence(sent_src, state);
+  Sentence history(ngram_context_);
+  float ll = 0.f;
+  word_lls.clear();
+  for(int t = 0; t < (int)sent_trg.size(); t++) {
+    for(int k = 0; k < ngram_context_; k++) {
+      int pos = t - ngram_context_ + k;
+      history[k] = (pos >= 0 ? sent_trg[pos] : 0);
+    }
+    CalcNextLogProbs(state, history.data(), next_state, log_probs.data(), nullptr);
+    word_lls.push_back(log_probs[sent_trg[t]]);
+    ll += log_probs[sent_trg[t]];
+    swap(state, next_state);
+  }
+  return ll;
+}
@@ -0,0 +1,237 @@
+#pragma once
+
+#include <lamtram/sentence.h>
+#include <lamtram/builder-factory.h>
+#include <lamtram/param-precision.h>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace dynet {
+struct ParameterStorage;
+struct LookupParameterStorage;
+struct RNNBuilder;
+}
+
+namespace lamtram {
+
+class EncoderAttentional;
+
+// A matrix used by the inference engine, stored by column like dynet's
+// tensors, but with each column padded to a whole number of cache lines and
+// starting at the beginning of one. Weight matrices can be quantized to 8-bit
+// integers, which takes a quarter of the memory bandwidth to multiply, and
+// any matrix can be stored with 16-bit values, which takes half.
+class InferenceMatrix {
+
+public:
+    InferenceMatrix() : rows_(0), cols_(0), stride_(0), qstride_(0), hstride_(0), precision_(PRECISION_FP32) { }
+    // Copies align their values again, as a copied buffer may start at a
+    // different offset from a cache line
+    InferenceMatrix(const InferenceMatrix & other) { *this = other; }
+    InferenceMatrix & operator=(const InferenceMatrix & other);
+
+    // Copy the values of a parameter or lookup parameter, with one column for
+    // each word of the latter
+    void Set(const dynet::ParameterStorage & param);
+    void Set(const dynet::LookupParameterStorage & param);
+    // Resize the matrix and set all values to zero
+    void Resize(int rows, int cols);
+
+    // Replace the values with 8-bit integers and a scale for each row, the
+    // largest absolute value in the row divided by 127. After this only
+    // MultAdd can be used, which quantizes its input the same way, sums the
+    // integer products of each row in 32 bits, and then scales them.
+    void Quantize();
+    bool IsQuantized() const { return !scales_.empty(); }
+
+    // Replace the values with 16-bit ones (fp16 or bf16), which are converted
+    // back to 32 bits a block at a time as they are used. After this only
+    // GetCol and MultAdd can be used. Quantized matrices are left as they are.
+    void SetPrecision(ParamPrecision precision);
+    ParamPrecision GetPrecision() const { return precision_; }
+
+    // Copy the GetRows() values of a column in any format
+    void GetCol(int j, float * out) const;
+    // The number of bytes taken by the values
+    size_t GetMemorySize() const;
+
+    // y += W x
+    void MultAdd(const float * x, float * y) const;
+
+    int GetRows() const { return rows_; }
+    int GetCols() const { return cols_; }
+    // The values of a column, when they are stored as 32-bit floats
+    float * Col(int j) { return Data() + j * stride_; }
+    const float * Col(int j) const { return Data() + j * stride_; }
+
+protected:
+    float * Data();
+    const float * Data() const;
+    const int8_t * QuantizedCol(int j) const;
+    const uint16_t * HalfCol(int j) const;
+
+    void MultAddQuantized(const float * x, float * y) const;
+    void MultAddHalf(const float * x, float * y) const;
+
+    int rows_, cols_, stride_, qstride_, hstride_;
+    // The values, with room to align the start of the first column
+    std::vector<float> vals_;
+    // The quantized values, aligned the same way, and the scale of each row
+    std::vector<int8_t> qvals_;
+    std::vector<float> scales_;
+    // The quantized input of the last MultAdd, kept to avoid reallocating it
+    mutable std::vector<int16_t> qx_;
+    // The 16-bit values, aligned the same way, and their format
+    std::vector<uint16_t> hvals_;
+    ParamPrecision precision_;
+
+};
+
+// The layers of a builder (lstm, rnn or ff), run one step at a time on
+// preallocated buffers. The state of an lstm holds the cells of every layer
+// followed by their outputs, the same as dynet's, and that of the others
+// holds the outputs of every layer.
+class InferenceLayers {
+
+public:
+    // Copy the parameters of a builder created by BuilderFactory
+    InferenceLayers(const BuilderSpec & spec, dynet::RNNBuilder & builder, int input_dim);
+
+    // Whether the engine can run a type of builder
+    static bool IsSupported(const BuilderSpec & spec) { return IsLSTM(spec) || spec.type == "rnn" || spec.type == "ff"; }
+    // Whether layers are lstms, which share the parameters and states of
+    // VanillaLSTMBuilder whether or not they are fused
+    static bool IsLSTM(const BuilderSpec & spec) { return spec.type == "lstm" || spec.type == "fastlstm"; }
+
+    // Precompute the product of the input weights of the first layer and
+    // every word embedding (a column of embeddings), plus the bias, for each
+    // of the first num_words * embeddings.GetRows() inputs, and keep only
+    // the weights of the rest of the input. This must be done before
+    // quantizing the weights or changing their precision.
+    void PrecomputeInputs(const InferenceMatrix & embeddings, int num_words);
+    bool HasPrecomputedInputs() const { return !proj_.empty(); }
+
+    // Quantize the input and recurrent weights
+    void Quantize();
+    // Store all weights with a precision (see InferenceMatrix::SetPrecision)
+    void SetPrecision(ParamPrecision precision);
+    size_t GetMemorySize() const;
+
+    // Read an input and calculate the next state. A null state_in is the
+    // empty state at the start of a sequence.
+    void Step(const float * state_in, const float * x, float * state_out);
+    // The same with precomputed inputs, given the IDs of the words and the
+    // rest of the input x
+    void Step(const float * state_in, const WordId * words, const float * x, float * state_out);
+
+    // The output of the last layer in a state
+    const float * GetOutput(const float * state) const { return state + state_size_ - nodes_; }
+    int GetStateSize() const { return state_size_; }
+    int GetNumNodes() const { return nodes_; }
+
+protected:
+    // Finish a step given the pre-activations of the first layer without
+    // its recurrent weights
+    void StepLayers(const float * state_in, float * state_out);
+
+    BuilderSpec spec_;
+    int nodes_, state_size_;
+    // The input, recurrent (except for ff) and bias weights of each layer
+    std::vector<InferenceMatrix> input_W_, hidden_W_, b_;
+    // The precomputed inputs of the first layer for each word position
+    std::vector<InferenceMatrix> proj_;
+    // The pre-activations of the current step, and a precomputed input
+    std::vector<float> gates_, proj_col_;
+
+};
+
+// An engine that runs an attentional model (an EncoderAttentional and its
+// NeuralLM decoder) for inference without building computation graphs. The
+// parameters are copied at construction into aligned matrices, and each step
+// runs the recurrent layers, the attention and the softmax as a few fused
+// loops over buffers that are allocated once and reused.
+//
+// The engine supports lstm, fastlstm, rnn and ff layers, all attention types
+// and histories, and the full softmax without a lexicon. It copies the
+// parameters, so it must be created again if the model changes.
+class InferenceEngine {
+
+public:
+    // quantize: Whether to quantize the weights of the recurrent layers and
+    //           the softmax to 8-bit integers
+    // precision: The precision of the other parameters, including the
+    //            embeddings
+    // precompute_inputs: Whether to replace the embeddings of the encoders
+    //                    and decoder with their products with the input
+    //                    weights of the first layer (see PrecomputeInputs)
+    explicit InferenceEngine(const EncoderAttentional & model, bool quantize = false, ParamPrecision precision = PRECISION_FP32, bool precompute_inputs = false);
+
+    // Whether the engine supports a model, and if not why
+    static bool IsSupported(const EncoderAttentional & model, std::string & reason);
+
+    // Encode a source sentence and get the initial state of the decoder
+    void InitializeSentence(const Sentence & sent_src, std::vector<float> & state);
+
+    // Calculate the log probabilities of the next word given the state of the
+    // decoder and the last GetNgramContext() words, and the state after
+    // reading them
+    //  log_probs: The GetVocabSize() log probabilities
+    //  align: The GetSrcLen() attention weights (may be null)
+    void CalcNextLogProbs(const std::vector<float> & state_in, const WordId * history,
+                          std::vector<float> & state_out, float * log_probs, float * align);
+
+    // Calculate the log likelihood of a target sentence ending in 0, and
+    // that of each of its words
+    float CalcSentLL(const Sentence & sent_src, const Sentence & sent_trg, std::vector<float> & word_lls);
+
+    int GetVocabSize() const { return vocab_size_; }
+    int GetNgramContext() const { return ngram_context_; }
+    bool HasAttention() const { return attend_; }
+    bool IsQuantized() const { return sm_W_.IsQuantized(); }
+    ParamPrecision GetPrecision() const { return sm_b_.GetPrecision(); }
+    bool HasPrecomputedInputs() const { return decoder_->HasPrecomputedInputs(); }
+    // The number of bytes taken by the parameters
+    size_t GetMemorySize() const;
+    // The length of the current source sentence including the end symbol
+    int GetSrcLen() const { return src_len_; }
+
+protected:
+    // The encoders
+    std::vector<std::shared_ptr<InferenceLayers> > encoders_;
+    std::vector<InferenceMatrix> enc_wr_W_;
+    std::vector<bool> enc_reverse_;
+
+    // The attention
+    std::string attention_type_;
+    bool attention_sum_;
+    float align_sum_W_;
+    int context_size_, hidden_size_;
+    InferenceMatrix ehid_h_W_, ehid_state_W_;
+    std::vector<float> e_ehid_W_;
+
+    // The mapping from the encoded sentence to the initial decoder state
+    InferenceMatrix enc2dec_W_, enc2dec_b_;
+
+    // The decoder and softmax, where the embeddings are empty when the inputs
+    // are precomputed
+    std::shared_ptr<InferenceLayers> decoder_;
+    InferenceMatrix dec_wr_W_, sm_W_, sm_b_;
+    int vocab_size_, wordrep_size_, ngram_context_;
+    // Whether the decoder attends to the source, and is fed the last context
+    bool attend_, feed_;
+
+    // The current source sentence: the states of the encoders for each word
+    // as columns, and their projections used by the attention
+    int src_len_;
+    InferenceMatrix src_h_, src_hpart_;
+
+    // Buffers reused at every step
+    std::vector<float> input_, attention_, state_part_, softmax_in_;
+
+};
+
+typedef std::shared_ptr<InferenceEngine> InferenceEnginePtr;
+
+}
@@ -52,7 +52,7 @@ int LamtramTrain::main(int argc, char** argv) {
     ("eval_every", po::value<int>()->default_value(-1), "Evaluate every n sentences (-1 for full training set)")
     ("early_stop", po::value<int>()->default_value(-1), "Stop if no improvement in n evals (TMs only, -1 for no early stopping)")
     ("eval_meas", po::value<string>()->default_value("bleu:smooth=1"), "The evaluation measure to use for minimum risk training (default: BLEU+1)")
-    ("layers", po::value<string>()->default_value("lstm:0:1"), "Descriptor for hidden layers, type:num_units:num_layers")
+    ("layers", po::value<string>()->default_value("lstm:0:1"), "Descriptor for hidden layers, type:num_units:num_layers (type is rnn, lstm, clstm, fastlstm for an lstm with each step fused into one node, or ff for feed-forward layers)")
     ("learning_criterion", po::value<string>()->default_value("ml"), "The criterion to use for learning (ml/minrisk)")
     ("learning_rate", po::value<float>()->default_value(0.001), "Learning rate")
     ("minibatch_size", po::value<int>()->default_value(1), "Number of words per mini-batch")
@@ -62,6 +62,7 @@ int LamtramTrain::main(int argc, char** argv) {
     ("minrisk_num_samples", po::value<int>()->default_value(50), "The number of samples to perform for minimum risk training")
     ("minrisk_scaling", po::value<float>()->default_value(0.005), "The scaling factor for min risk training")
     ("model_in", po::value<string>()->default_value(""), "If resuming training, read the model in")
+    ("param_precision", po::value<string>()->default_value("fp32"), "The precision to save parameters in (fp32 in DyNet's text format, or fp16/bf16 as 16-bit binary values)")
     ("rate_decay", po::value<float>()->default_value(0.5), "Learning rate decay when dev perplexity gets worse")
     ("rate_thresh",  po::value<float>()->default_value(1e-5), "Threshold for the learning rate")
     ("scheduled_samp", po::value<float>()->default_value(0.f), "If set to 1 or more, perform scheduled sampling where the selected value is the number of iterations after which the sampling value reaches 0.5")
@@ -139,6 +140,7 @@ int LamtramTrain::main(int argc, char** argv) {
   softmax_sig_ = vm_["softmax"].as<string>();
   scheduled_samp_ = vm_["scheduled_samp"].as<float>();
   dropout_ = vm_["dropout"].as<float>();
+  param_precision_ = ParsePrecision(vm_["param_precision"].as<string>());
 
   // Perform appropriate training
   if(model_type == "nlm")           TrainLM();
@@ -297,9 +299,7 @@ void LamtramTrain::TrainLM() {
   std::shared_ptr<ParameterCollection> model;
   std::shared_ptr<NeuralLM> nlm;
   if(model_in_file_.size()) {
-    nlm.reset(ModelUtils::LoadMonolingualModel<NeuralLM>(model_in_file_, model, vocab_trg));
-    TextFileLoader loader(model_in_file_ + ".data");
-    loader.populate(*model);
+    nlm.reset(ModelUtils::LoadMonolingualModelWithParameters<NeuralLM>(model_in_file_, model, vocab_trg));
   } else {
     vocab_trg.reset(CreateNewDict());
     model.reset(new ParameterCollection);
@@ -424,8 +424,7 @@ void LamtramTrain::TrainLM() {
       WriteDict(*vocab_trg, out);
       // vocab_trg->Write(out);
       nlm->Write(out);
-      TextFileSaver saver(model_out_file_ + ".data");
-      saver.save(*model);
+      ModelUtils::SaveParameters(model_out_file_ + ".data", *model, param_precision_);
       best_loss = my_loss;
     }
     // If the rate is less than the threshold
@@ -442,9 +441,7 @@ void LamtramTrain::TrainEncDec() {
   std::shared_ptr<EncoderDecoder> encdec;
   NeuralLMPtr decoder;
   if(model_in_file_.size()) {
-    encdec.reset(ModelUtils::LoadBilingualModel<EncoderDecoder>(model_in_file_, model, vocab_src, vocab_trg));
-    TextFileLoader loader(model_in_file_ + ".data");
-    loader.populate(*model);
+    encdec.reset(ModelUtils::LoadBilingualModelWithParameters<EncoderDecoder>(model_in_file_, model, vocab_src, vocab_trg));
     decoder = encdec->GetDecoderPtr();
   } else {
     vocab_src.reset(CreateNewDict());
@@ -529,9 +526,7 @@ void LamtramTrain::TrainEncAtt() {
   std::shared_ptr<EncoderAttentional> encatt;
   NeuralLMPtr decoder;
   if(model_in_file_.size()) {
-    encatt.reset(ModelUtils::LoadBilingualModel<EncoderAttentional>(model_in_file_, model, vocab_src, vocab_trg));
-    TextFileLoader loader(model_in_file_ + ".data");
-    loader.populate(*model);
+    encatt.reset(ModelUtils::LoadBilingualModelWithParameters<EncoderAttentional>(model_in_file_, model, vocab_src, vocab_trg));
     decoder = encatt->GetDecoderPtr();
   } else {
     vocab_src.reset(CreateNewDict());
@@ -613,9 +608,7 @@ void LamtramTrain::TrainEncCls() {
   std::shared_ptr<ParameterCollection> model;
   std::shared_ptr<EncoderClassifier> enccls;
   if(model_in_file_.size()) {
-    enccls.reset(ModelUtils::LoadBilingualModel<EncoderClassifier>(model_in_file_, model, vocab_src, vocab_trg));
-    TextFileLoader loader(model_in_file_ + ".data");
-    loader.populate(*model);
+    enccls.reset(ModelUtils::LoadBilingualModelWithParameters<EncoderClassifier>(model_in_file_, model, vocab_src, vocab_trg));
   } else {
     vocab_src.reset(CreateNewDict());
     vocab_trg.reset(CreateNewDict(false));
@@ -841,8 +834,7 @@ void LamtramTrain::BilingualTraining(const vector<Sentence> & train_src,
       WriteDict(vocab_src, out);
       WriteDict(vocab_trg, out);
       encdec.Write(out);
-      TextFileSaver saver(model_out_file_ + ".data");
-      saver.save(model);
+      ModelUtils::SaveParameters(model_out_file_ + ".data", model, param_precision_);
       best_loss = my_loss;
       evals_since_improvement = 0;
     } else {
@@ -1017,8 +1009,7 @@ void LamtramTrain::MinRiskTraining(const vector<Sentence> & train_src,
       WriteDict(vocab_src, out);
       WriteDict(vocab_trg, out);
       encdec.Write(out);
-      TextFileSaver saver(model_out_file_ + ".data");
-      saver.save(model);
+      ModelUtils::SaveParameters(model_out_file_ + ".data", model, param_precision_);
       best_loss = my_loss;
     }
     // If the rate is less than the threshold
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <lamtram/sentence.h>
+#include <lamtram/param-precision.h>
 #include <dynet/tensor.h>
 #include <boost/program_options.hpp>
 #include <string>
@@ -79,6 +80,7 @@ protected:
     std::vector<std::string> train_files_trg_, train_files_src_, train_files_weights_, train_files_kickout_keep_;
     std::string dev_file_trg_, dev_file_src_;
     std::string softmax_sig_;
+    ParamPrecision param_precision_;
 
     std::vector<std::string> wildcards_;
 
@@ -11,7 +11,11 @@
 #include <lamtram/string-util.h>
 #include <lamtram/ensemble-decoder.h>
 #include <lamtram/ensemble-classifier.h>
+#include <lamtram/decode-workers.h>
+#include <lamtram/batch-reader.h>
 #include <lamtram/mapping.h>
+#include <lamtram/inference-engine.h>
+#include <lamtram/eval-measure-bleu.h>
 #include <boost/program_options.hpp>
 #include <boost/algorithm/string.hpp>
 #include <dynet/dict.h>
@@ -19,6 +23,14 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <algorithm>
+#include <sstream>
+#include <iomanip>
+#include <limits>
+#include <cmath>
+#include <functional>
+#include <deque>
+#include <map>
 
 using namespace std;
 using namespace lamtram;
@@ -58,39 +70,39 @@ int Lamtram::SequenceOperation(const boost::program_options::variables_map & vm)
 
   int max_minibatch_size = vm["minibatch_size"].as<int>();
   int nbest_size = vm["nbest_size"].as<int>();
+  bool shared_weights = vm["shared_weights"].as<bool>();
   
   // Buffers
   string line;
   vector<string> strs;
 
-  // Read in the files
-  vector<string> infiles;
-  boost::split(infiles, vm["models_in"].as<std::string>(), boost::is_any_of("|"));
-  string type, file;
-  for(string & infile : infiles) {
+  // Read in a model, adding it to the models of the appropriate type. Only
+  // the model files are read here, and the parameters of all models are
+  // loaded together afterwards, followed by the precomputed projections.
+  vector<function<void()> > load_params;
+  vector<pair<string, function<bool()> > > precomputes;
+  auto load_model = [&](const string & infile, vector<EncoderDecoderPtr> & my_encdecs, vector<EncoderAttentionalPtr> & my_encatts, vector<NeuralLMPtr> & my_lms) {
     int eqpos = infile.find('=');
     if(eqpos == string::npos)
       THROW_ERROR("Bad model type. Must specify encdec=, encatt=, or nlm= before model name." << endl << infile);
-    type = infile.substr(0, eqpos);
-    file = infile.substr(eqpos+1);
+    string type = infile.substr(0, eqpos);
+    string file = infile.substr(eqpos+1);
     DictPtr vocab_src_temp, vocab_trg_temp;
     shared_ptr<dynet::ParameterCollection> mod_temp;
+    load_params.push_back(function<void()>());
     // Read in the model
     if(type == "encdec") {
-      EncoderDecoder * tm = ModelUtils::LoadBilingualModel<EncoderDecoder>(file, mod_temp, vocab_src_temp, vocab_trg_temp);
-      dynet::TextFileLoader loader(file + ".data");
-      loader.populate(*mod_temp);
-      encdecs.push_back(shared_ptr<EncoderDecoder>(tm));
+      EncoderDecoder * tm = ModelUtils::LoadBilingualModelWithParameters<EncoderDecoder>(file, mod_temp, vocab_src_temp, vocab_trg_temp, shared_weights, &load_params.back());
+      precomputes.push_back(make_pair(file, [tm]() { return tm->PrecomputeProjections(); }));
+      my_encdecs.push_back(shared_ptr<EncoderDecoder>(tm));
     } else if(type == "encatt") {
-      EncoderAttentional * tm = ModelUtils::LoadBilingualModel<EncoderAttentional>(file, mod_temp, vocab_src_temp, vocab_trg_temp);
-      dynet::TextFileLoader loader(file + ".data");
-      loader.populate(*mod_temp);
-      encatts.push_back(shared_ptr<EncoderAttentional>(tm));
+      EncoderAttentional * tm = ModelUtils::LoadBilingualModelWithParameters<EncoderAttentional>(file, mod_temp, vocab_src_temp, vocab_trg_temp, shared_weights, &load_params.back());
+      precomputes.push_back(make_pair(file, [tm]() { return tm->PrecomputeProjections(); }));
+      my_encatts.push_back(shared_ptr<EncoderAttentional>(tm));
     } else if(type == "nlm") {
-      NeuralLM * lm = ModelUtils::LoadMonolingualModel<NeuralLM>(file, mod_temp, vocab_trg_temp);
-      dynet::TextFileLoader loader(file + ".data");
-      loader.populate(*mod_temp);
-      lms.push_back(shared_ptr<NeuralLM>(lm));
+      NeuralLM * lm = ModelUtils::LoadMonolingualModelWithParameters<NeuralLM>(file, mod_temp, vocab_trg_temp, shared_weights, &load_params.back());
+      precomputes.push_back(make_pair(file, [lm]() { return lm->PrecomputeProjections(); }));
+      my_lms.push_back(shared_ptr<NeuralLM>(lm));
     }
     // Sanity check
     if(vocab_trg.get() && vocab_trg_temp->get_words() != vocab_trg->get_words())
@@ -100,7 +112,25 @@ int Lamtram::SequenceOperation(const boost::program_options::variables_map & vm)
     models.push_back(mod_temp);
     vocab_trg = vocab_trg_temp;
     if(vocab_src_temp.get()) vocab_src = vocab_src_temp;
-  }
+  };
+
+  // Read in the files
+  vector<string> infiles;
+  boost::split(infiles, vm["models_in"].as<std::string>(), boost::is_any_of("|"));
+  for(string & infile : infiles)
+    load_model(infile, encdecs, encatts, lms);
+  // Read in the draft model for speculative decoding
+  vector<EncoderDecoderPtr> draft_encdecs;
+  vector<EncoderAttentionalPtr> draft_encatts;
+  vector<NeuralLMPtr> draft_lms;
+  if(vm["draft_model"].as<string>() != "")
+    load_model(vm["draft_model"].as<string>(), draft_encdecs, draft_encatts, draft_lms);
+  ModelUtils::LoadInParallel(load_params, vm["load_threads"].as<int>());
+  bool precompute_inputs = vm["precompute_inputs"].as<bool>();
+  vector<bool> precomputed(precomputes.size(), false);
+  if(precompute_inputs)
+    for(size_t i = 0; i < precomputes.size(); i++)
+      precomputed[i] = precomputes[i].second();
   int vocab_size = vocab_trg->size();
 
   // Get the mapping table if necessary
@@ -140,136 +170,454 @@ int Lamtram::SequenceOperation(const boost::program_options::variables_map & vm)
   decoder.SetUnkPen(vm["unk_pen"].as<float>());
   decoder.SetEnsembleOperation(vm["ensemble_op"].as<string>());
   decoder.SetBeamSize(vm["beam"].as<int>());
+  decoder.SetBeamBatch(vm["beam_batch"].as<bool>());
+  decoder.SetBeamAdaptive(vm["beam_adaptive"].as<bool>());
+  decoder.SetBeamPrune(vm["beam_prune_rel"].as<float>(), vm["beam_prune_abs"].as<float>());
+  decoder.SetRecombine(vm["recombine"].as<bool>());
+  decoder.SetClassSearch(vm["class_search"].as<bool>());
   decoder.SetSizeLimit(vm["max_len"].as<int>());
+  decoder.SetEnsembleThreads(vm["ensemble_threads"].as<int>());
+  int max_decode_ms = vm["max_decode_ms"].as<int>();
+  decoder.SetMaxDecodeMs(max_decode_ms);
+  if(vm["draft_model"].as<string>() != "") {
+    shared_ptr<EnsembleDecoder> draft(new EnsembleDecoder(draft_encdecs, draft_encatts, draft_lms));
+    draft->SetWordPen(decoder.GetWordPen());
+    draft->SetUnkPen(decoder.GetUnkPen());
+    decoder.SetDraft(draft, vm["draft_len"].as<int>());
+  }
+  if(vm["shortlist"].as<string>() != "") {
+    if(vocab_src.get() == nullptr)
+      THROW_ERROR("A shortlist can only be used with translation models");
+    decoder.SetShortlist(ShortlistPtr(Shortlist::Read(vm["shortlist"].as<string>(), vocab_src, vocab_trg)));
+  }
+  if(!decoder.SetMips(vm["mips_clusters"].as<int>(), vm["mips_probes"].as<int>()))
+    cerr << "WARNING: --mips_probes only applies to a single model, so the full vocabulary is scored" << endl;
+  ParamPrecision precision = ParsePrecision(vm["param_precision"].as<string>());
+  if(vm["fast_inference"].as<bool>() && !decoder.SetFastInference(true, vm["quantize"].as<bool>(), precision, precompute_inputs))
+    cerr << "WARNING: --fast_inference needs a single encatt model with lstm, fastlstm, rnn or ff layers and a full softmax without a lexicon, so computation graphs are used" << endl;
+  // The engine precomputes the inputs of all its layers for the first model
+  if(precompute_inputs)
+    for(size_t i = 0; i < precomputes.size(); i++)
+      if(!precomputed[i] && !(i == 0 && decoder.GetFastInference()))
+        cerr << "WARNING: no layer of " << precomputes[i].first << " can use precomputed input projections without --fast_inference" << endl;
+  if(vm["quantize"].as<bool>() && !decoder.GetFastInference())
+    cerr << "WARNING: --quantize only applies with --fast_inference, so full precision is used" << endl;
+  if(precision != PRECISION_FP32 && !decoder.GetFastInference())
+    cerr << "WARNING: --param_precision only applies with --fast_inference, so 32-bit parameters are used" << endl;
+  if(vm["shared_weights"].as<bool>() && (decoder.GetFastInference() || vm["precompute_inputs"].as<bool>() || decoder.GetMipsProbes() > 0))
+    cerr << "WARNING: --fast_inference, --precompute_inputs and --mips_probes copy parameters into memory of their own, which is not shared by --shared_weights" << endl;
 
   
   // Perform operation
   string operation = vm["operation"].as<std::string>();
+  // When the engine generates every sentence, its copy of the parameters is
+  // the only one used, so those of the model are given back to the system
+  if(operation == "gen" && !vm["continuous_batch"].as<bool>() && decoder.IsEngineOnly()) {
+    size_t released = decoder.ReleaseParameters(*models[0]);
+    cerr << "Released " << released / (1 << 20) << "MB of parameters copied to the inference engine (" << decoder.GetInferenceEngine()->GetMemorySize() / (1 << 20) << "MB)" << endl;
+  }
   string wpout_file = vm["wordprob_out"].as<std::string>();
   Sentence sent_src, sent_trg;
-  vector<string> str_src, str_trg;
-  Sentence align;
+  vector<string> str_src;
   int last_id = -1;
   bool do_sent = false;
+  DecodeWorkers workers(vm["threads"].as<int>());
+  // Format the generated sentences for an input, in n-best format with the
+  // sentence ID when there is more than one or they are samples
+  auto format_hyps = [&](int sent_id, const vector<string> & str_src, const vector<EnsembleDecoderHypPtr> & hyps) {
+    ostringstream out;
+    if(GlobalVars::verbose >= 1 && hyps.size() != 0 && hyps[0].get() != nullptr && hyps[0]->IsTruncated())
+      cerr << "WARNING: Ran out of time when translating sentence " << sent_id << endl;
+    if(nbest_size == 1 && operation != "samp") {
+      if(hyps.size() == 0 || hyps[0].get() == nullptr) {
+        out << endl;
+      } else {
+        Sentence sent_trg = hyps[0]->GetSentence();
+        vector<string> str_trg = ConvertWords(*vocab_trg, sent_trg, false);
+        MapWords(str_src, sent_trg, hyps[0]->GetAlignment(), mapping, str_trg);
+        out << PrintWords(str_trg) << endl;
+      }
+    } else {
+      for(auto & trg_hyp : hyps) {
+        if(trg_hyp.get() != nullptr) {
+          Sentence sent_trg = trg_hyp->GetSentence();
+          vector<string> str_trg = ConvertWords(*vocab_trg, sent_trg, false);
+          MapWords(str_src, sent_trg, trg_hyp->GetAlignment(), mapping, str_trg);
+          out << sent_id << " ||| " << PrintWords(str_trg) << " ||| " << trg_hyp->GetScore() << endl;
+        }
+      }
+    }
+    return out.str();
+  };
+
   if(operation == "ppl") {
     shared_ptr<ofstream> wpout;
     if(wpout_file != "")
       wpout.reset(new ofstream(wpout_file));
     LLStats corpus_ll(vocab_size);
     Timer time;
-    while(getline(cin, line)) { 
-      // Get the target, and if it exists, source sentences
-      if(GlobalVars::verbose >= 2) { cerr << "SentLL trg: " << line << endl; }
-      sent_trg = ParseWords(*vocab_trg, line, true);
-      if(encdecs.size() + encatts.size() > 0) {
-        if(!getline(*src_in, line))
-          THROW_ERROR("Source and target files don't match");
-        if(GlobalVars::verbose >= 2) { cerr << "SentLL src: " << line << endl; }
-        sent_src = ParseWords(*vocab_src, line, false);
-      }
-      last_id++;
-      // If we're inside the range, do it
-      if(last_id >= sent_range.first && last_id < sent_range.second) {
-        LLStats sent_ll(vocab_size);
-        vector<float> word_lls;
-        decoder.CalcSentLL<Sentence,LLStats,vector<float> >(sent_src, sent_trg, sent_ll, word_lls);
-        if(GlobalVars::verbose >= 1) { cout << "ll=" << -sent_ll.CalcUnkLoss() << " unk=" << sent_ll.unk_  << endl; }
-        corpus_ll += sent_ll;
-        // Write word probabilities if necessary
-        if(wpout.get()) {
-          if(word_lls.size()) *wpout << -word_lls[0];
-          for(size_t i = 1; i < word_lls.size(); i++) *wpout << ' ' << -word_lls[i];
-          *wpout << endl;
+    bool use_src = (encdecs.size() + encatts.size() > 0);
+    // Read the sentences inside the range as they are needed, sending the
+    // target and, if it exists, source of each as a job
+    auto read_job = [&](string & job) {
+      while(getline(cin, line)) {
+        if(GlobalVars::verbose >= 2) { cerr << "SentLL trg: " << line << endl; }
+        job = line;
+        if(use_src) {
+          if(!getline(*src_in, line))
+            THROW_ERROR("Source and target files don't match");
+          if(GlobalVars::verbose >= 2) { cerr << "SentLL src: " << line << endl; }
+          job += "\n" + line;
         }
+        last_id++;
+        if(last_id >= sent_range.first && last_id < sent_range.second)
+          return true;
       }
-    }
+      return false;
+    };
+    // Calculate the likelihood of each sentence, returning the statistics and word probabilities
+    workers.RunStream(read_job, [&](const string & job) {
+      size_t newline = job.find('\n');
+      Sentence job_trg = ParseWords(*vocab_trg, job.substr(0, newline), true), job_src;
+      if(use_src)
+        job_src = ParseWords(*vocab_src, job.substr(newline + 1), false);
+      LLStats sent_ll(vocab_size);
+      vector<float> word_lls;
+      decoder.CalcSentLL<Sentence,LLStats,vector<float> >(job_src, job_trg, sent_ll, word_lls);
+      ostringstream stats_out, wp_out;
+      stats_out << setprecision(numeric_limits<dynet::real>::max_digits10) << sent_ll.loss_ << ' ' << sent_ll.words_ << ' ' << sent_ll.unk_;
+      if(word_lls.size()) wp_out << -word_lls[0];
+      for(size_t j = 1; j < word_lls.size(); j++) wp_out << ' ' << -word_lls[j];
+      return vector<string>({stats_out.str(), wp_out.str()});
+    }, [&](int i, const vector<string> & result) {
+      LLStats sent_ll(vocab_size);
+      istringstream stats_in(result[0]);
+      stats_in >> sent_ll.loss_ >> sent_ll.words_ >> sent_ll.unk_;
+      if(GlobalVars::verbose >= 1) { cout << "ll=" << -sent_ll.CalcUnkLoss() << " unk=" << sent_ll.unk_  << endl; }
+      corpus_ll += sent_ll;
+      // Write word probabilities if necessary
+      if(wpout.get())
+        *wpout << result[1] << endl;
+    });
     double elapsed = time.Elapsed();
     cerr << "ppl=" << corpus_ll.CalcPPL() << ", unk=" << corpus_ll.unk_ << ", time=" << elapsed << " (" << corpus_ll.words_/elapsed << " w/s)" << endl;
   } else if(operation == "nbest") {
     Timer time;
-    int all_words = 0, curr_words = 0;
-    std::vector<Sentence> sents_trg;
-    while(getline(cin, line)) { 
-      // Get the new sentence
-      vector<string> columns = Tokenize(line, " ||| ");
-      if(columns.size() < 2) THROW_ERROR("Bad line in n-best:\n" << line);
-      int my_id = stoi(columns[0]);
-      sent_trg = ParseWords(*vocab_trg, columns[1], true);
-      // If we've finished the current source, print
-      if((my_id != last_id || curr_words+sents_trg.size() > max_minibatch_size) && sents_trg.size() > 0) {
-        vector<LLStats> sents_ll(sents_trg.size(), LLStats(vocab_size));
-        vector<vector<float> > word_lls(sents_trg.size());
-        if(sents_trg.size() > 1)
-          decoder.CalcSentLL<vector<Sentence>,vector<LLStats>,vector<vector<float> > >(sent_src, sents_trg, sents_ll, word_lls);
-        else
-          decoder.CalcSentLL<Sentence,LLStats,vector<float> >(sent_src, sents_trg[0], sents_ll[0], word_lls[0]);
-        for(auto & sent_ll : sents_ll)
-          cout << "ll=" << -sent_ll.CalcUnkLoss() << " unk=" << sent_ll.unk_  << endl;
-        sents_trg.resize(0);
-        curr_words = 0;
-      }
-      // Load the new source word
-      if(my_id != last_id) {
-        if(!getline(*src_in, line))
-          THROW_ERROR("Source and target files don't match");
-        sent_src = ParseWords(*vocab_src, line, false);
-        if(do_sent) {
-          double elapsed = time.Elapsed();
-          cerr << "sent=" << last_id << ", time=" << elapsed << " (" << all_words/elapsed << " w/s)" << endl;
+    // Hypotheses for the same source are split into several minibatches, so
+    // reuse the encoded source instead of encoding it for each one
+    decoder.SetEncoderCacheSize(vm["encoder_cache"].as<int>());
+    int all_words = 0;
+    string next_line, src_line;
+    bool have_next = static_cast<bool>(getline(cin, next_line));
+    // Get the source ID of the next line of the n-best list
+    auto next_id = [&]() {
+      vector<string> columns = Tokenize(next_line, " ||| ");
+      if(columns.size() < 2) THROW_ERROR("Bad line in n-best:\n" << next_line);
+      return stoi(columns[0]);
+    };
+    // Read the n-best list as it is needed, splitting the hypotheses for each
+    // source into minibatches. Each job is the source ID, whether it is the
+    // last minibatch for the source, the source, and then the hypotheses.
+    auto read_job = [&](string & job) {
+      while(have_next) {
+        int my_id = next_id();
+        // Load the new source sentence
+        if(my_id != last_id) {
+          if(!getline(*src_in, src_line))
+            THROW_ERROR("Source and target files don't match");
+          last_id = my_id;
+          do_sent = (last_id >= sent_range.first && last_id < sent_range.second);
+        }
+        if(!do_sent) {
+          have_next = static_cast<bool>(getline(cin, next_line));
+          continue;
+        }
+        ostringstream hyps;
+        int curr_words = 0, num_hyps = 0;
+        for(; have_next && next_id() == my_id && (num_hyps == 0 || curr_words+num_hyps <= max_minibatch_size); num_hyps++) {
+          string hyp = Tokenize(next_line, " ||| ")[1];
+          hyps << hyp << endl;
+          curr_words += SplitWords(hyp).size() + 1;
+          have_next = static_cast<bool>(getline(cin, next_line));
         }
-        last_id = my_id;
-        do_sent = (last_id >= sent_range.first && last_id < sent_range.second);
+        bool last_batch = !(have_next && next_id() == my_id);
+        job = to_string(my_id) + ' ' + to_string(last_batch) + '\n' + src_line + '\n' + hyps.str();
+        return true;
       }
-      // Add to the data
-      if(do_sent) {
-        sents_trg.push_back(sent_trg);
-        all_words += sent_trg.size();
-        curr_words += sent_trg.size();
+      return false;
+    };
+    // Score each minibatch, printing the time after the last one for each source
+    workers.RunStream(read_job, [&](const string & job) {
+      istringstream job_in(job);
+      string job_line;
+      getline(job_in, job_line);
+      getline(job_in, job_line);
+      Sentence job_src = ParseWords(*vocab_src, job_line, false);
+      vector<Sentence> job_trg;
+      int job_words = 0;
+      while(getline(job_in, job_line)) {
+        job_trg.push_back(ParseWords(*vocab_trg, job_line, true));
+        job_words += job_trg.rbegin()->size();
       }
-    }
-    if(do_sent) {
-      vector<LLStats> sents_ll(sents_trg.size(), LLStats(vocab_size));
-      vector<vector<float> > word_lls(sents_trg.size());
-      decoder.CalcSentLL<vector<Sentence>,vector<LLStats>, vector<vector<float> > >(sent_src, sents_trg, sents_ll, word_lls);
+      vector<LLStats> sents_ll(job_trg.size(), LLStats(vocab_size));
+      vector<vector<float> > word_lls(job_trg.size());
+      if(job_trg.size() > 1)
+        decoder.CalcSentLL<vector<Sentence>,vector<LLStats>,vector<vector<float> > >(job_src, job_trg, sents_ll, word_lls);
+      else
+        decoder.CalcSentLL<Sentence,LLStats,vector<float> >(job_src, job_trg[0], sents_ll[0], word_lls[0]);
+      ostringstream ll_out;
       for(auto & sent_ll : sents_ll)
-        cout << "ll=" << -sent_ll.CalcUnkLoss() << " unk=" << sent_ll.unk_  << endl;
-      double elapsed = time.Elapsed();
-      cerr << "sent=" << last_id << ", time=" << elapsed << " (" << all_words/elapsed << " w/s)" << endl;
-    }
+        ll_out << "ll=" << -sent_ll.CalcUnkLoss() << " unk=" << sent_ll.unk_  << endl;
+      // The ID and whether this is the last minibatch for it are passed back, with the number of words
+      return vector<string>({ll_out.str(), job.substr(0, job.find('\n')), to_string(job_words)});
+    }, [&](int i, const vector<string> & result) {
+      cout << result[0];
+      all_words += stoi(result[2]);
+      int job_id, last_batch;
+      istringstream header_in(result[1]);
+      header_in >> job_id >> last_batch;
+      if(last_batch) {
+        double elapsed = time.Elapsed();
+        cerr << "sent=" << job_id << ", time=" << elapsed << " (" << all_words/elapsed << " w/s)" << endl;
+      }
+    });
   } else if(operation == "gen" || operation == "samp") {
-    if(operation == "samp") THROW_ERROR("Sampling not implemented yet");
-    for(int i = 0; i < sent_range.second; ++i) {
-      if(encdecs.size() + encatts.size() > 0) {
-        if(!getline(*src_in, line)) break;
-        str_src = SplitWords(line);
-        sent_src = ParseWords(*vocab_src, str_src, false);
+    int samp_size = vm["samp_size"].as<int>();
+    if(operation == "samp" && samp_size < 1) THROW_ERROR("samp_size must be at least one, but got " << samp_size);
+    // When batching or using multiple workers, read in a window of sentences
+    // and, when dispatching by length, sort them so that sentences of similar
+    // length are decoded together
+    bool continuous_batch = (operation == "gen" && vm["continuous_batch"].as<bool>());
+    string dispatch = vm["worker_dispatch"].as<string>();
+    if(dispatch != "length" && dispatch != "rr") THROW_ERROR("worker_dispatch must be length or rr, but got " << dispatch);
+    int window_size = (max_minibatch_size > 1 || workers.GetNumWorkers() > 1 || continuous_batch ? vm["sort_window"].as<int>() : 1);
+    if(window_size < 1) THROW_ERROR("sort_window must be at least one, but got " << window_size);
+    bool use_src = (encdecs.size() + encatts.size() > 0);
+    bool input_done = false;
+    int next_sent = 0, next_out = sent_range.first, num_sents = 0, num_timeouts = 0;
+    double num_words = 0, decode_time = 0;
+    deque<string> jobs;
+    map<int, string> outputs;
+    Timer time;
+    // Read the next window of sentences and split it into jobs. Each job is a
+    // minibatch, written as the seed to sample it with (so that workers do not
+    // share the random state they were forked with), then a line with the ID
+    // and source of each of its sentences.
+    auto read_window = [&]() {
+      vector<int> sent_ids, sent_lens;
+      vector<string> lines;
+      for(; next_sent < sent_range.second && (int)sent_ids.size() < window_size; ++next_sent) {
+        if(use_src && !getline(*src_in, line)) { input_done = true; break; }
+        if(next_sent >= sent_range.first) {
+          sent_ids.push_back(next_sent);
+          sent_lens.push_back(use_src ? SplitWords(line).size() : 0);
+          lines.push_back(use_src ? line : "");
+        }
       }
-      if(i >= sent_range.first) {
-        if(nbest_size == 1) {
-          EnsembleDecoderHypPtr trg_hyp = decoder.Generate(sent_src);
-          if(trg_hyp.get() == nullptr) {
-            cout << endl;
-          } else {
-            sent_trg = trg_hyp->GetSentence();
-            align = trg_hyp->GetAlignment();
-            str_trg = ConvertWords(*vocab_trg, sent_trg, false);
-            MapWords(str_src, sent_trg, align, mapping, str_trg);
-            cout << PrintWords(str_trg) << endl;
-          }
-        } else {
-          auto trg_hyps = decoder.GenerateNbest(sent_src, nbest_size);
-          for(auto & trg_hyp : trg_hyps) {
-            if(trg_hyp.get() != nullptr) {
-              sent_trg = trg_hyp->GetSentence();
-              align = trg_hyp->GetAlignment();
-              str_trg = ConvertWords(*vocab_trg, sent_trg, false);
-              MapWords(str_src, sent_trg, align, mapping, str_trg);
-              cout << i << " ||| " << PrintWords(str_trg) << " ||| " << trg_hyp->GetScore() << endl;
-            }
-          }
+      if(next_sent >= sent_range.second) input_done = true;
+      // Split into minibatches of up to max_minibatch_size words
+      vector<int> order(sent_ids.size());
+      for(size_t k = 0; k < order.size(); ++k) order[k] = k;
+      if(dispatch == "length")
+        stable_sort(order.begin(), order.end(), [&](int a, int b) { return sent_lens[a] < sent_lens[b]; });
+      vector<vector<int> > batches;
+      if(continuous_batch) {
+        // With continuous batching, each worker schedules its share of the
+        // window itself, adding sentences as others finish
+        batches.resize(min(max(workers.GetNumWorkers(), 1), (int)order.size()));
+        for(size_t k = 0; k < order.size(); ++k)
+          batches[k % batches.size()].push_back(order[k]);
+      }
+      for(size_t start = 0, end; start < order.size() && !continuous_batch; start = end) {
+        int curr_words = sent_lens[order[start]];
+        for(end = start + 1; end < order.size() && curr_words + sent_lens[order[end]] <= max_minibatch_size; ++end)
+          curr_words += sent_lens[order[end]];
+        batches.push_back(vector<int>(order.begin() + start, order.begin() + end));
+      }
+      for(auto & batch : batches) {
+        ostringstream job;
+        job << (*dynet::rndeng)() << endl;
+        for(int k : batch)
+          job << sent_ids[k] << ' ' << lines[k] << endl;
+        jobs.push_back(job.str());
+      }
+    };
+    // Decode a minibatch, returning the ID and output of each of its sentences
+    auto decode_job = [&](const string & job) {
+      Timer job_time;
+      istringstream job_in(job);
+      string job_line;
+      getline(job_in, job_line);
+      unsigned samp_seed = stoul(job_line);
+      vector<int> sent_ids;
+      vector<vector<string> > strs_src;
+      vector<Sentence> sents_src;
+      while(getline(job_in, job_line)) {
+        size_t space = job_line.find(' ');
+        sent_ids.push_back(stoi(job_line.substr(0, space)));
+        strs_src.push_back(SplitWords(job_line.substr(space + 1)));
+        sents_src.push_back(use_src ? ParseWords(*vocab_src, strs_src.back(), false) : Sentence());
+      }
+      vector<vector<EnsembleDecoderHypPtr> > trg_nbests;
+      int start_timeouts = decoder.GetNumTimeouts();
+      if(operation == "samp") {
+        dynet::rndeng->seed(samp_seed);
+        trg_nbests = decoder.SampleSentences(sents_src, samp_size);
+      } else if(continuous_batch) {
+        trg_nbests.resize(sents_src.size());
+        size_t next = 0;
+        decoder.GenerateNbestContinuous([&](bool wait, int & id, Sentence & batch_src) {
+          if(next == sents_src.size()) return false;
+          id = next;
+          batch_src = sents_src[next++];
+          return true;
+        }, nbest_size, max_minibatch_size, [&](int id, const vector<EnsembleDecoderHypPtr> & hyps) {
+          trg_nbests[id] = hyps;
+        });
+      } else if(sents_src.size() == 1) {
+        trg_nbests.push_back(decoder.GenerateNbest(sents_src[0], nbest_size));
+      } else {
+        trg_nbests = decoder.GenerateNbest(sents_src, nbest_size);
+      }
+      vector<string> job_out;
+      int job_words = 0;
+      for(size_t j = 0; j < sents_src.size(); ++j) {
+        job_out.push_back(to_string(sent_ids[j]));
+        job_out.push_back(format_hyps(sent_ids[j], strs_src[j], trg_nbests[j]));
+        if(trg_nbests[j].size() != 0 && trg_nbests[j][0].get() != nullptr)
+          job_words += trg_nbests[j][0]->GetSentence().size();
+      }
+      // The number of sentences that ran out of time, the number of words
+      // generated, and the time taken are passed back last
+      job_out.push_back(to_string(decoder.GetNumTimeouts() - start_timeouts));
+      job_out.push_back(to_string(job_words));
+      job_out.push_back(to_string(job_time.Elapsed()));
+      return job_out;
+    };
+    // Stream the jobs to the workers as the input is read, and print the
+    // outputs in the original order as soon as all earlier ones are finished
+    workers.RunStream([&](string & job) {
+      while(jobs.empty() && !input_done)
+        read_window();
+      if(jobs.empty()) return false;
+      job = jobs.front();
+      jobs.pop_front();
+      return true;
+    }, decode_job, [&](int j, const vector<string> & result) {
+      size_t num_outs = result.size() - 3;
+      for(size_t k = 0; k < num_outs; k += 2)
+        outputs[stoi(result[k])] = result[k+1];
+      for(auto it = outputs.begin(); it != outputs.end() && it->first == next_out; it = outputs.erase(it), ++next_out)
+        cout << it->second;
+      cout.flush();
+      num_sents += num_outs / 2;
+      num_timeouts += stoi(result[num_outs]);
+      num_words += stod(result[num_outs+1]);
+      decode_time += stod(result[num_outs+2]);
+    }, dispatch == "rr");
+    if(max_decode_ms > 0)
+      cerr << "Ran out of time (" << max_decode_ms << "ms) for " << num_timeouts << " of " << num_sents << " sentences" << endl;
+    double elapsed = time.Elapsed();
+    cerr << "sents=" << num_sents << ", words=" << num_words << ", time=" << elapsed << " (" << num_words/elapsed << " w/s)";
+    if(workers.GetNumWorkers() > 1)
+      cerr << ", worker time=" << decode_time << " (" << num_words/decode_time << " w/s per worker)";
+    cerr << endl;
+  } else if(operation == "serve") {
+    if(encdecs.size() + encatts.size() == 0)
+      THROW_ERROR("Serving is only supported for translation models");
+    // Read requests from stdin, one sentence per line, gathering them into
+    // batches of up to minibatch_size words or as many as arrive within
+    // max_wait_ms. The results of each batch are written as soon as it finishes.
+    BatchReader reader(0, max_minibatch_size, vm["max_wait_ms"].as<int>());
+    vector<string> lines;
+    int sent_id = 0;
+    if(vm["continuous_batch"].as<bool>()) {
+      // New requests join the batch whenever there is room, and results are
+      // written as soon as each finishes. As they can finish out of order,
+      // each result is preceded by the index of its request.
+      map<int, vector<string> > strs_src;
+      decoder.GenerateNbestContinuous([&](bool wait, int & id, Sentence & sent_src) {
+        string src_line;
+        if(!reader.ReadLine(src_line, wait ? -1 : 0)) return false;
+        id = sent_id++;
+        strs_src[id] = SplitWords(src_line);
+        sent_src = ParseWords(*vocab_src, strs_src[id], false);
+        return true;
+      }, nbest_size, max_minibatch_size, [&](int id, const vector<EnsembleDecoderHypPtr> & hyps) {
+        if(nbest_size == 1) cout << id << " ||| ";
+        cout << format_hyps(id, strs_src[id], hyps);
+        cout.flush();
+        strs_src.erase(id);
+      });
+    } else {
+      while(reader.ReadBatch(lines)) {
+        Timer time;
+        vector<vector<string> > strs_src;
+        vector<Sentence> batch_src;
+        for(const string & src_line : lines) {
+          strs_src.push_back(SplitWords(src_line));
+          batch_src.push_back(ParseWords(*vocab_src, *strs_src.rbegin(), false));
         }
+        vector<vector<EnsembleDecoderHypPtr> > trg_nbests;
+        if(batch_src.size() == 1)
+          trg_nbests.push_back(decoder.GenerateNbest(batch_src[0], nbest_size));
+        else
+          trg_nbests = decoder.GenerateNbest(batch_src, nbest_size);
+        for(size_t j = 0; j < batch_src.size(); ++j)
+          cout << format_hyps(sent_id++, strs_src[j], trg_nbests[j]);
+        cout.flush();
+        if(GlobalVars::verbose >= 1)
+          cerr << "batch=" << batch_src.size() << ", time=" << time.Elapsed() << endl;
+      }
+    }
+    if(max_decode_ms > 0)
+      cerr << "Ran out of time (" << max_decode_ms << "ms) for " << decoder.GetNumTimeouts() << " of " << sent_id << " sentences" << endl;
+  } else if(operation == "quanteval") {
+    // Compare the model with its weights quantized to 8-bit integers and the
+    // others stored with --param_precision (as they would be deployed) against
+    // the full precision model, with the references read from stdin
+    if(!decoder.SetFastInference(true))
+      THROW_ERROR("quanteval needs a single encatt model that can be run with --fast_inference");
+    vector<Sentence> sents_src, sents_trg;
+    int num_words = 0;
+    while(getline(cin, line)) {
+      sent_trg = ParseWords(*vocab_trg, line, true);
+      if(!getline(*src_in, line))
+        THROW_ERROR("Source and target files don't match");
+      sent_src = ParseWords(*vocab_src, line, false);
+      last_id++;
+      if(last_id >= sent_range.first && last_id < sent_range.second) {
+        sents_src.push_back(sent_src);
+        sents_trg.push_back(sent_trg);
+        num_words += sent_trg.size();
+      }
+    }
+    // Score the references and generate with each version of the weights,
+    // measuring BLEU over word IDs without the end symbol
+    EvalMeasureBleu bleu;
+    vector<double> ppls, bleus;
+    for(bool quantize : {false, true}) {
+      Timer time;
+      // Score and generate with the same engine, so the model is only copied once
+      decoder.SetFastInference(true, quantize, quantize ? precision : PRECISION_FP32);
+      InferenceEngine & engine = *decoder.GetInferenceEngine();
+      double ll = 0.0;
+      vector<float> word_lls;
+      EvalStatsPtr stats;
+      for(size_t i = 0; i < sents_trg.size(); i++) {
+        ll += engine.CalcSentLL(sents_src[i], sents_trg[i], word_lls);
+        vector<EnsembleDecoderHypPtr> hyps = decoder.GenerateNbest(sents_src[i], 1);
+        Sentence ref(sents_trg[i].begin(), sents_trg[i].end() - 1), hyp;
+        if(hyps.size() != 0 && hyps[0].get() != nullptr) hyp = hyps[0]->GetSentence();
+        if(hyp.size() != 0 && *hyp.rbegin() == 0) hyp.pop_back();
+        EvalStatsPtr sent_stats = bleu.CalculateStats(ref, hyp);
+        if(stats.get() == nullptr) stats = sent_stats; else stats->PlusEquals(*sent_stats);
       }
+      ppls.push_back(exp(-ll / max(num_words, 1)));
+      bleus.push_back(stats.get() != nullptr ? stats->ConvertToScore() : 0.0);
+      cout << (quantize ? "int8+" + PrecisionName(precision) : string("fp32")) << ": ppl=" << ppls.back() << ", bleu=" << bleus.back() << ", time=" << time.Elapsed() << endl;
     }
+    cout << "delta: ppl=" << showpos << ppls[1] - ppls[0] << " (" << (ppls[1] / ppls[0] - 1.0) * 100 << "%), bleu=" << bleus[1] - bleus[0] << noshowpos << endl;
   } else {
     THROW_ERROR("Illegal operation " << operation);
   }
@@ -286,6 +634,8 @@ int Lamtram::ClassifierOperation(const boost::program_options::variables_map & v
   // Read in the files
   vector<string> infiles;
   boost::split(infiles, vm["models_in"].as<std::string>(), boost::is_any_of("|"));
+  bool shared_weights = vm["shared_weights"].as<bool>();
+  vector<function<void()> > load_params;
   string type, file;
   for(string & infile : infiles) {
     int eqpos = infile.find('=');
@@ -298,9 +648,8 @@ int Lamtram::ClassifierOperation(const boost::program_options::variables_map & v
     DictPtr vocab_src_temp, vocab_trg_temp;
     shared_ptr<dynet::ParameterCollection> mod_temp;
     // Read in the model
-    EncoderClassifier * tm = ModelUtils::LoadBilingualModel<EncoderClassifier>(file, mod_temp, vocab_src_temp, vocab_trg_temp);
-    dynet::TextFileLoader loader(file + ".data");
-    loader.populate(*mod_temp);
+    load_params.push_back(function<void()>());
+    EncoderClassifier * tm = ModelUtils::LoadBilingualModelWithParameters<EncoderClassifier>(file, mod_temp, vocab_src_temp, vocab_trg_temp, shared_weights, &load_params.back());
     encclss.push_back(shared_ptr<EncoderClassifier>(tm));
     // Sanity check
     if(vocab_trg.get() && vocab_trg_temp->get_words() != vocab_trg->get_words())
@@ -311,6 +660,7 @@ int Lamtram::ClassifierOperation(const boost::program_options::variables_map & v
     vocab_trg = vocab_trg_temp;
     vocab_src = vocab_src_temp;
   }
+  ModelUtils::LoadInParallel(load_params, vm["load_threads"].as<int>());
   int vocab_size = vocab_trg->size();
 
   // Get the source input if necessary, "-" means stdin
@@ -368,21 +718,61 @@ int Lamtram::ClassifierOperation(const boost::program_options::variables_map & v
   return 0;
 }
 
+int Lamtram::ConvertOperation(const boost::program_options::variables_map & vm) {
+  string infile = vm["models_in"].as<std::string>(), outfile = vm["model_out"].as<std::string>();
+  int eqpos = infile.find('=');
+  if(eqpos == string::npos || infile.find('|') != string::npos)
+    THROW_ERROR("Must specify a single model to convert in format \"{encdec,encatt,enccls,nlm}=filename\"" << endl << infile);
+  if(outfile == "")
+    THROW_ERROR("Must specify the file to write the binary model to with --model_out");
+  Timer time;
+  ModelUtils::ConvertToBinaryModel(infile.substr(0, eqpos), infile.substr(eqpos+1), outfile, ParsePrecision(vm["param_precision"].as<string>()));
+  cerr << "Wrote binary model " << outfile << ", time=" << time.Elapsed() << endl;
+  return 0;
+}
+
 int Lamtram::main(int argc, char** argv) {
   po::options_description desc("*** lamtram-train (by Graham Neubig) ***");
   desc.add_options()
     ("help", "Produce help message")
     ("verbose", po::value<int>()->default_value(0), "How much verbose output to print")
     ("beam", po::value<int>()->default_value(1), "Number of hypotheses to expand")
+    ("beam_batch", po::value<bool>()->default_value(false), "Expand all hypotheses in the beam as a single batch (faster for larger beams)")
+    ("beam_adaptive", po::value<bool>()->default_value(false), "Adapt the number of hypotheses to expand at each step to the entropy of the distribution of the best one, up to the size of the beam")
+    ("beam_prune_rel", po::value<float>()->default_value(0.f), "Prune hypotheses whose probability is less than this ratio times that of the best (0 to disable)")
+    ("beam_prune_abs", po::value<float>()->default_value(0.f), "Prune hypotheses whose log probability is more than this much below that of the best (0 to disable)")
+    ("recombine", po::value<bool>()->default_value(true), "Merge hypotheses that end in the same words when no model has a recurrent state (feed-forward n-gram models)")
+    ("class_search", po::value<bool>()->default_value(true), "When all models use the same class-factored softmax, expand the words of the most probable classes only as long as they can enter the beam")
+    ("draft_model", po::value<string>()->default_value(""), "A small model in format \"{encdec,encatt,nlm}=filename\" used to propose words when generating with a beam of 1, which are then checked together by the main models")
+    ("draft_len", po::value<int>()->default_value(4), "The number of words proposed by the draft model at a time")
     ("dynet_mem", po::value<int>()->default_value(512), "How much memory to allocate to dynet")
+    ("encoder_cache", po::value<int>()->default_value(16), "When scoring n-best lists, the number of encoded source sentences to keep, so each source is only encoded once (0 to disable)")
+    ("ensemble_threads", po::value<int>()->default_value(1), "When generating or scoring with an ensemble, split the models between this many processes that evaluate them in parallel")
     ("ensemble_op", po::value<string>()->default_value("sum"), "The operation to use when ensembling probabilities (sum/logsum)")
+    ("fast_inference", po::value<bool>()->default_value(false), "When generating with a beam over single sentences and a single encatt model, run the search on a dedicated engine instead of building computation graphs (not with --shortlist or --mips_probes)")
     ("wordprob_out", po::value<string>()->default_value(""), "Output word log probabilities during perplexity calculation")
     ("map_in", po::value<string>()->default_value(""), "A file containing a mapping table (\"src trg prob\" format)")
+    ("continuous_batch", po::value<bool>()->default_value(false), "When generating or serving, add new sentences to the batch as others finish, keeping up to minibatch_size words in it")
+    ("max_decode_ms", po::value<int>()->default_value(0), "When generating, stop searching for the translation of a sentence after this many milliseconds, returning the best hypothesis found so far (0 for no limit)")
+    ("max_wait_ms", po::value<int>()->default_value(10), "When serving, the maximum time to wait for more sentences to add to a batch after the first arrives")
     ("minibatch_size", po::value<int>()->default_value(1), "Max size of a minibatch in words (may be exceeded if there are longer sentences)")
-    ("models_in", po::value<string>()->default_value(""), "Model files in format \"{encdec,encatt,nlm}=filename\" with encdec for encoder-decoders, encatt for attentional models, nlm for language models. When multiple, separate by a pipe.")
+    ("models_in", po::value<string>()->default_value(""), "Model files in format \"{encdec,encatt,nlm}=filename\" with encdec for encoder-decoders, encatt for attentional models, nlm for language models. When multiple, separate by a pipe. Either text model files with the parameters in filename.data, or binary model files written by --operation convert")
+    ("model_out", po::value<string>()->default_value(""), "With --operation convert, the file to write the binary model to")
     ("nbest_size", po::value<int>()->default_value(1), "The size of an n-best to generate when generating n-best")
-    ("operation", po::value<string>()->default_value("ppl"), "Operations (ppl: measure perplexity, nbest: score n-best list, gen: generate most likely sentence, samp: sample sentences randomly)")
+    ("operation", po::value<string>()->default_value("ppl"), "Operations (ppl: measure perplexity, nbest: score n-best list, gen: generate most likely sentence, samp: sample sentences randomly, serve: translate sentences from stdin as they arrive, quanteval: compare the perplexity of the references on stdin and the BLEU of the translations of src_in with --quantize against full precision, convert: convert the model in models_in to a binary model that loads faster)")
+    ("load_threads", po::value<int>()->default_value(0), "The number of threads that load the parameters of the models, which are loaded after all model files have been read (0 for one per model)")
+    ("mips_clusters", po::value<int>()->default_value(0), "The number of clusters of output words used by --mips_probes (0 for the square root of the vocabulary size)")
+    ("mips_probes", po::value<int>()->default_value(0), "When generating, only calculate the exact scores of words in this many clusters of the output layer whose scores may be highest (0 to score all words)")
+    ("param_precision", po::value<string>()->default_value("fp32"), "With --fast_inference, store the parameters that are not quantized as fp32, or as 16-bit fp16/bf16 values that are converted when used, halving the memory read at each step at a small cost in accuracy. When the engine generates every sentence (--operation gen without --continuous_batch, --beam_batch, --draft_model, --shortlist or --mips_probes), the 32-bit parameters of the model and their gradients are released, so the process only keeps the engine's copy. With --operation convert, the precision of the parameters in the binary model")
+    ("precompute_inputs", po::value<bool>()->default_value(false), "When loading models, precompute the product of every word embedding and the input weights of the first layer where the layer type allows it (ff and fastlstm, or any layer type supported by --fast_inference when it is used), trading memory for speed")
+    ("quantize", po::value<bool>()->default_value(false), "With --fast_inference, store the weights of the recurrent layers and the output layer as 8-bit integers with a scale for each row, and multiply them by inputs quantized to 8 bits with 32-bit integer sums, which reduces memory traffic at a small cost in accuracy (measured by --operation quanteval)")
+    ("shared_weights", po::value<bool>()->default_value(false), "Map the parameters of the models read-only, so that lamtram processes on the same host that load the same models share one copy of them. Binary models in fp32 are mapped directly, and other models are converted by the first process to a binary model in /dev/shm that the others map")
+    ("shortlist", po::value<string>()->default_value(""), "Only consider a shortlist of target words when generating, specified as \"lex=FILE:freq=FILE:top=N:per_word=K\" with a lexicon in \"src trg prob\" format, and a target corpus to find the N most frequent words")
+    ("samp_size", po::value<int>()->default_value(1), "The number of sentences to sample for each input when sampling, printed with their log probabilities")
     ("sent_range", po::value<string>()->default_value(""), "Optionally specify a comma-delimited range on how many sentences to process")
+    ("sort_window", po::value<int>()->default_value(1000), "When generating with minibatch_size > 1 or multiple threads, the number of sentences to read in and sort by length before batching")
+    ("threads", po::value<int>()->default_value(1), "Number of decoding workers. Workers are processes forked after the models are loaded, so they share the model memory")
+    ("worker_dispatch", po::value<string>()->default_value("length"), "When generating, how to split the input into jobs for the workers: \"length\" to sort each window of sort_window sentences by length before batching, or \"rr\" to keep the input order and give the jobs to the workers in turn")
     ("max_len", po::value<int>()->default_value(200), "Limit on the max length of sentences")
     ("src_in", po::value<string>()->default_value("-"), "File to read the source from, if any")
     ("word_pen", po::value<float>()->default_value(0.f), "The \"word penalty\", a larger value favors longer sentences, shorter favors shorter")
@@ -400,10 +790,12 @@ int Lamtram::main(int argc, char** argv) {
   GlobalVars::verbose = vm["verbose"].as<int>();
 
   string operation = vm["operation"].as<std::string>();
-  if(operation == "ppl" || operation == "nbest" || operation == "gen" || operation == "samp") {
+  if(operation == "ppl" || operation == "nbest" || operation == "gen" || operation == "samp" || operation == "serve" || operation == "quanteval") {
     return SequenceOperation(vm);
   } else if(operation == "cls" || operation == "clseval") {
     return ClassifierOperation(vm);
+  } else if(operation == "convert") {
+    return ConvertOperation(vm);
   } else {
     THROW_ERROR("Illegal operation: " << operation);
   }
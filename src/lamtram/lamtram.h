@@ -18,6 +18,7 @@ public:
 
   int SequenceOperation(const boost::program_options::variables_map & vm);
   int ClassifierOperation(const boost::program_options::variables_map & vm);
+  int ConvertOperation(const boost::program_options::variables_map & vm);
 
 protected:
   boost::program_options::variables_map vm_;
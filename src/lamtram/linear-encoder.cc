@@ -14,35 +14,40 @@ using namespace lamtram;
 LinearEncoder::LinearEncoder(int vocab_size, int wordrep_size,
            const BuilderSpec & hidden_spec, int unk_id,
            dynet::ParameterCollection & model) :
-      vocab_size_(vocab_size), wordrep_size_(wordrep_size), unk_id_(unk_id), hidden_spec_(hidden_spec), reverse_(false) {
+      vocab_size_(vocab_size), wordrep_size_(wordrep_size), unk_id_(unk_id), hidden_spec_(hidden_spec), reverse_(false), proj_builder_(nullptr) {
   // Hidden layers
   builder_ = BuilderFactory::CreateBuilder(hidden_spec_, wordrep_size, model);
   // Word representations
   p_wr_W_ = model.add_lookup_parameters(vocab_size, {(unsigned int)wordrep_size}); 
 }
 
+template <class Words>
+dynet::Expression LinearEncoder::AddWords(const Words & words, bool train, dynet::ComputationGraph & cg) {
+  if(!train && proj_table_.get() != nullptr)
+    return proj_builder_->AddProjectedInput(proj_table_->Lookup(cg, 0, words));
+  return builder_->add_input(lookup(cg, p_wr_W_, words));
+}
+
 dynet::Expression LinearEncoder::BuildSentGraph(const Sentence & sent, bool add, bool train, dynet::ComputationGraph & cg) {
   if(&cg != curr_graph_)
     THROW_ERROR("Initialized computation graph and passed comptuation graph don't match.");
   word_states_.resize(sent.size() + (add ? 1 : 0));
   builder_->start_new_sequence();
   // First get all the word representations
-  dynet::Expression i_wr_t, i_h_t;
+  dynet::Expression i_h_t;
   if(!reverse_) {
     for(int t = 0; t < (int)sent.size(); t++) {
-      i_wr_t = lookup(cg, p_wr_W_, sent[t]);
-      i_h_t = builder_->add_input(i_wr_t);
+      i_h_t = AddWords(sent[t], train, cg);
       word_states_[t] = i_h_t;
     }
   } else {
     for(int t = sent.size()-1; t >= 0; t--) {
-      i_wr_t = lookup(cg, p_wr_W_, sent[t]);
-      i_h_t = builder_->add_input(i_wr_t);
+      i_h_t = AddWords(sent[t], train, cg);
       word_states_[t] = i_h_t;
     }
   }
   if(add) {
-    *word_states_.rbegin() = i_h_t = builder_->add_input(lookup(cg, p_wr_W_, (unsigned)0));
+    *word_states_.rbegin() = i_h_t = AddWords((unsigned)0, train, cg);
   }
   return i_h_t;
 }
@@ -58,28 +63,26 @@ dynet::Expression LinearEncoder::BuildSentGraph(const vector<Sentence> & sent, b
   word_states_.resize(max_len + (add ? 1 : 0));
   builder_->start_new_sequence();
   // First get all the word representations
-  dynet::Expression i_wr_t, i_h_t;
+  dynet::Expression i_h_t;
   vector<unsigned> words(sent.size());
   if(!reverse_) {
     for(int t = 0; t < max_len; t++) {
       for(size_t i = 0; i < sent.size(); i++)
         words[i] = (t < sent[i].size() ? sent[i][t] : 0);
-      i_wr_t = lookup(cg, p_wr_W_, words);
-      i_h_t = builder_->add_input(i_wr_t);
+      i_h_t = AddWords(words, train, cg);
       word_states_[t] = i_h_t;
     }
   } else {
     for(int t = max_len-1; t >= 0; t--) {
       for(size_t i = 0; i < sent.size(); i++)
         words[i] = (t < sent[i].size() ? sent[i][t] : 0);
-      i_wr_t = lookup(cg, p_wr_W_, words);
-      i_h_t = builder_->add_input(i_wr_t);
+      i_h_t = AddWords(words, train, cg);
       word_states_[t] = i_h_t;
     }
   }
   if(add) {
     std::fill(words.begin(), words.end(), 0);
-    *word_states_.rbegin() = i_h_t = builder_->add_input(lookup(cg, p_wr_W_, words));
+    *word_states_.rbegin() = i_h_t = AddWords(words, train, cg);
   }
   return i_h_t;
 }
@@ -120,3 +123,10 @@ vector<dynet::Expression> LinearEncoder::GetFinalHiddenLayers() const {
 }
 
 void LinearEncoder::SetDropout(float dropout) { builder_->set_dropout(dropout); }
+
+bool LinearEncoder::PrecomputeProjections() {
+  proj_builder_ = dynamic_cast<ProjectedInputBuilder*>(builder_.get());
+  if(proj_builder_ == nullptr) return false;
+  proj_table_.reset(new ProjectionTable(p_wr_W_, proj_builder_->GetInputWeights(), 1));
+  return true;
+}
@@ -3,6 +3,7 @@
 #include <lamtram/sentence.h>
 #include <lamtram/ll-stats.h>
 #include <lamtram/builder-factory.h>
+#include <lamtram/projection-table.h>
 #include <dynet/dynet.h>
 #include <dynet/expr.h>
 #include <vector>
@@ -19,6 +20,7 @@ namespace lamtram {
 
 // A class for feed-forward neural network LMs
 class LinearEncoder {
+    friend class InferenceEngine;
 
 public:
 
@@ -56,6 +58,11 @@ public:
     void SetReverse(bool reverse) { reverse_ = reverse; }
     void SetDropout(float dropout);
 
+    // Precompute the products of the word embeddings and the input weights of
+    // the first layer to look them up during inference. Returns false if the
+    // builder cannot take projected inputs.
+    bool PrecomputeProjections();
+
 protected:
 
     // Variables
@@ -74,6 +81,14 @@ protected:
     // This records the last set of word states acquired during BuildSentGraph
     std::vector<dynet::Expression> word_states_;
 
+    // Add the input of a word (or batch of words) to the builder
+    template <class Words>
+    dynet::Expression AddWords(const Words & words, bool train, dynet::ComputationGraph & cg);
+
+    // The precomputed projections if any, and the builder that takes them
+    ProjectionTablePtr proj_table_;
+    ProjectedInputBuilder * proj_builder_;
+
 private:
     // A pointer to the current computation graph.
     // This is only used for sanity checking to make sure NewGraph
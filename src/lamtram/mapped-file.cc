@@ -0,0 +1,35 @@
+#include <lamtram/mapped-file.h>
+#include <lamtram/macros.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+using namespace std;
+using namespace lamtram;
+
+MappedFile::MappedFile(const std::string & file, bool read_only) : file_(file), data_(nullptr), size_(0), read_only_(read_only) {
+  int fd = open(file.c_str(), O_RDONLY);
+  if(fd < 0) THROW_ERROR("Could not open " << file << ": " << strerror(errno));
+  struct stat st;
+  if(fstat(fd, &st) != 0) {
+    close(fd);
+    THROW_ERROR("Could not get the size of " << file << ": " << strerror(errno));
+  }
+  size_ = st.st_size;
+  if(size_ == 0) { close(fd); THROW_ERROR("Empty file " << file); }
+  void * data = (read_only ? mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0) :
+                             mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0));
+  // The mapping stays valid after the file is closed
+  close(fd);
+  if(data == MAP_FAILED) THROW_ERROR("Could not map " << file << ": " << strerror(errno));
+  data_ = static_cast<char*>(data);
+  madvise(data_, size_, MADV_WILLNEED);
+}
+
+MappedFile::~MappedFile() {
+  if(data_ != nullptr)
+    munmap(data_, size_);
+}
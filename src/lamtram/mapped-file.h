@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+namespace lamtram {
+
+// A whole file mapped into memory. Pages are read from the file when they are
+// first touched (the kernel is asked to start reading ahead when the file is
+// mapped), and writes to them stay private to this process. With read_only,
+// the pages cannot be written at all, so every process mapping the file uses
+// the same pages of memory.
+class MappedFile {
+public:
+  explicit MappedFile(const std::string & file, bool read_only = false);
+  ~MappedFile();
+
+  const std::string & GetFile() const { return file_; }
+  char * GetData() { return data_; }
+  const char * GetData() const { return data_; }
+  size_t GetSize() const { return size_; }
+  bool IsReadOnly() const { return read_only_; }
+
+protected:
+  std::string file_;
+  char * data_;
+  size_t size_;
+  bool read_only_;
+
+private:
+  MappedFile(const MappedFile &) = delete;
+  MappedFile & operator=(const MappedFile &) = delete;
+};
+typedef std::shared_ptr<MappedFile> MappedFilePtr;
+
+}
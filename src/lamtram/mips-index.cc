@@ -0,0 +1,178 @@
+#include <lamtram/mips-index.h>
+#include <lamtram/macros.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <random>
+
+using namespace std;
+using namespace lamtram;
+
+// The inner product of a row with a state, with the bias as the last element
+inline float RowScore(const float * row, const float * h, int dim) {
+  float score = row[dim];
+  for(int i = 0; i < dim; i++)
+    score += row[i] * h[i];
+  return score;
+}
+
+inline float SquaredDistance(const float * a, const float * b, int size) {
+  float dist = 0.f;
+  for(int i = 0; i < size; i++)
+    dist += (a[i] - b[i]) * (a[i] - b[i]);
+  return dist;
+}
+
+MipsIndex::MipsIndex(const float * weights, const float * bias, int num_rows, int dim, int num_clusters, int iterations) : dim_(dim) {
+  if(num_rows <= 0 || dim <= 0)
+    THROW_ERROR("Cannot build an index over an empty output layer");
+  if(num_clusters <= 0)
+    num_clusters = max(1, (int)sqrt((float)num_rows));
+  num_clusters = min(num_clusters, num_rows);
+  int size = dim + 1;
+  vector<float> rows(num_rows * size);
+  for(int i = 0; i < num_rows; i++) {
+    copy(weights + i * dim, weights + (i+1) * dim, rows.begin() + i * size);
+    rows[i * size + dim] = bias[i];
+  }
+  // Start from randomly chosen rows, with a fixed seed so that the index is
+  // the same every time a model is loaded
+  vector<int> perm(num_rows);
+  iota(perm.begin(), perm.end(), 0);
+  mt19937 rng(0);
+  shuffle(perm.begin(), perm.end(), rng);
+  vector<float> centroids(num_clusters * size);
+  for(int k = 0; k < num_clusters; k++)
+    copy(rows.begin() + perm[k] * size, rows.begin() + (perm[k]+1) * size, centroids.begin() + k * size);
+  // Alternate between assigning rows to the closest centroid and moving
+  // centroids to the mean of their rows
+  vector<int> assign(num_rows, -1);
+  for(int iter = 0; iter <= iterations; iter++) {
+    bool changed = false;
+    for(int i = 0; i < num_rows; i++) {
+      int best = 0;
+      float best_dist = numeric_limits<float>::max();
+      for(int k = 0; k < num_clusters; k++) {
+        float dist = SquaredDistance(&rows[i * size], &centroids[k * size], size);
+        if(dist < best_dist) { best = k; best_dist = dist; }
+      }
+      changed = changed || (assign[i] != best);
+      assign[i] = best;
+    }
+    if(!changed) break;
+    vector<int> counts(num_clusters, 0);
+    vector<float> sums(num_clusters * size, 0.f);
+    for(int i = 0; i < num_rows; i++) {
+      counts[assign[i]]++;
+      for(int j = 0; j < size; j++)
+        sums[assign[i] * size + j] += rows[i * size + j];
+    }
+    // Empty clusters keep their centroid
+    for(int k = 0; k < num_clusters; k++)
+      if(counts[k] > 0)
+        for(int j = 0; j < size; j++)
+          centroids[k * size + j] = sums[k * size + j] / counts[k];
+  }
+  // Store the rows of each cluster together
+  ids_.resize(num_rows);
+  iota(ids_.begin(), ids_.end(), 0);
+  stable_sort(ids_.begin(), ids_.end(), [&](unsigned a, unsigned b) { return assign[a] < assign[b]; });
+  rows_.resize(num_rows * size);
+  for(int i = 0; i < num_rows; i++)
+    copy(rows.begin() + ids_[i] * size, rows.begin() + (ids_[i]+1) * size, rows_.begin() + i * size);
+  starts_.assign(num_clusters + 1, 0);
+  for(int i = 0; i < num_rows; i++)
+    starts_[assign[i] + 1]++;
+  partial_sum(starts_.begin(), starts_.end(), starts_.begin());
+  centroids_ = centroids;
+  radii_.assign(num_clusters, 0.f);
+  variances_.assign(num_clusters * size, 0.f);
+  for(int k = 0; k < num_clusters; k++) {
+    for(int i = starts_[k]; i < starts_[k+1]; i++) {
+      radii_[k] = max(radii_[k], sqrt(SquaredDistance(&rows_[i * size], &centroids_[k * size], size)));
+      for(int j = 0; j < size; j++)
+        variances_[k * size + j] += (rows_[i * size + j] - centroids_[k * size + j]) * (rows_[i * size + j] - centroids_[k * size + j]);
+    }
+    if(starts_[k+1] != starts_[k])
+      for(int j = 0; j < size; j++)
+        variances_[k * size + j] /= starts_[k+1] - starts_[k];
+  }
+}
+
+void MipsIndex::RankClusters(const float * h, vector<int> & order) const {
+  int num_clusters = GetNumClusters();
+  // The norm of the state, including the 1 multiplied by the bias
+  float norm = 1.f;
+  for(int i = 0; i < dim_; i++)
+    norm += h[i] * h[i];
+  norm = sqrt(norm);
+  vector<float> bounds(num_clusters);
+  for(int k = 0; k < num_clusters; k++)
+    bounds[k] = RowScore(&centroids_[k * (dim_+1)], h, dim_) + radii_[k] * norm;
+  order.resize(num_clusters);
+  iota(order.begin(), order.end(), 0);
+  stable_sort(order.begin(), order.end(), [&](int a, int b) { return bounds[a] > bounds[b]; });
+}
+
+void MipsIndex::Search(const float * h, int probes, vector<unsigned> & ids) const {
+  vector<int> clusters;
+  SearchClusters(h, probes, clusters);
+  ids.clear();
+  for(int k : clusters)
+    AddRows(k, ids);
+}
+
+void MipsIndex::SearchClusters(const float * h, int probes, vector<int> & clusters) const {
+  RankClusters(h, clusters);
+  clusters.resize(min(probes, (int)clusters.size()));
+}
+
+void MipsIndex::AddRows(int cluster, vector<unsigned> & ids) const {
+  ids.insert(ids.end(), ids_.begin() + starts_[cluster], ids_.begin() + starts_[cluster+1]);
+}
+
+float MipsIndex::EstimateLogMass(const float * h, const vector<bool> & skip) const {
+  // The score of a row is that of the centroid plus the inner product of its
+  // deviation with the state. If the deviations are normal, the expected
+  // exponentiated score is exp(mean + sum_j var_j * h_j^2 / 2), while exp(mean)
+  // alone is always an underestimate.
+  int size = dim_ + 1;
+  vector<float> terms;
+  for(int k = 0; k < GetNumClusters(); k++) {
+    if(skip[k] || starts_[k+1] == starts_[k]) continue;
+    float spread = variances_[k * size + dim_];
+    for(int j = 0; j < dim_; j++)
+      spread += variances_[k * size + j] * h[j] * h[j];
+    terms.push_back(RowScore(&centroids_[k * size], h, dim_) + 0.5f * spread + log((float)(starts_[k+1] - starts_[k])));
+  }
+  if(terms.size() == 0) return -numeric_limits<float>::infinity();
+  float max_term = *max_element(terms.begin(), terms.end()), sum = 0.f;
+  for(float term : terms)
+    sum += exp(term - max_term);
+  return max_term + log(sum);
+}
+
+void MipsIndex::CalcLogProbs(const float * h, int probes, vector<unsigned> & ids, vector<float> & log_probs) const {
+  vector<int> clusters;
+  SearchClusters(h, probes, clusters);
+  vector<bool> searched(GetNumClusters(), false);
+  ids.clear();
+  log_probs.clear();
+  // Score the words in the best clusters exactly, and add the estimate for
+  // the others to the normalizer
+  for(int k : clusters) {
+    searched[k] = true;
+    AddRows(k, ids);
+    for(int i = starts_[k]; i < starts_[k+1]; i++)
+      log_probs.push_back(RowScore(&rows_[i * (dim_+1)], h, dim_));
+  }
+  float rest = EstimateLogMass(h, searched), max_term = rest, sum = 0.f;
+  for(float score : log_probs)
+    max_term = max(max_term, score);
+  for(float score : log_probs)
+    sum += exp(score - max_term);
+  float log_z = max_term + log(sum + exp(rest - max_term));
+  for(float & score : log_probs)
+    score -= log_z;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <vector>
+
+namespace lamtram {
+
+// An index over the rows of an output layer, used to find the words with the
+// highest scores for a hidden state without calculating all of them.
+//
+// The rows, each with its bias appended, are clustered with k-means. For a
+// hidden state, clusters are ranked by an upper bound on the score of their
+// members (the score of the centroid plus the cluster radius times the norm
+// of the state), and only the members of the best clusters are scored
+// exactly. The contribution of the other clusters to the normalizer is
+// estimated from their centroids and the variance of their rows.
+class MipsIndex {
+
+public:
+    // Build an index
+    //  weights: The num_rows * dim weights, with each row contiguous
+    //  bias: The num_rows biases
+    //  num_clusters: The number of clusters (0 for the square root of num_rows)
+    //  iterations: The number of k-means iterations
+    MipsIndex(const float * weights, const float * bias, int num_rows, int dim, int num_clusters = 0, int iterations = 5);
+    ~MipsIndex() { }
+
+    // Get the rows in the probes best clusters for the state h
+    void Search(const float * h, int probes, std::vector<unsigned> & ids) const;
+    // Get the IDs of the probes best clusters for the state h
+    void SearchClusters(const float * h, int probes, std::vector<int> & clusters) const;
+    // Append the rows of a cluster to ids
+    void AddRows(int cluster, std::vector<unsigned> & ids) const;
+
+    // Estimate the log of the sum of the exponentiated scores of the rows in
+    // the clusters that are not skipped, or negative infinity if there are
+    // none. The deviations of the rows from their centroid are treated as
+    // independent normal variables, which corrects for most of the
+    // underestimate of the centroid score alone, but it is still approximate.
+    float EstimateLogMass(const float * h, const std::vector<bool> & skip) const;
+
+    // Calculate the log probabilities of the words in the probes best clusters
+    // for the state h, with exact scores normalized by an estimate of the total.
+    // The IDs of the words are put in ids, and the others are not scored.
+    void CalcLogProbs(const float * h, int probes, std::vector<unsigned> & ids, std::vector<float> & log_probs) const;
+
+    int GetNumRows() const { return ids_.size(); }
+    int GetDim() const { return dim_; }
+    int GetNumClusters() const { return starts_.size() - 1; }
+
+protected:
+    // Score the clusters for h, and sort their IDs by the upper bound
+    void RankClusters(const float * h, std::vector<int> & order) const;
+
+    int dim_;
+    // The rows with their biases appended, sorted by cluster
+    std::vector<float> rows_;
+    // The original ID of each sorted row
+    std::vector<unsigned> ids_;
+    // The first sorted row of each cluster, followed by the number of rows
+    std::vector<int> starts_;
+    // The centroid and radius of each cluster
+    std::vector<float> centroids_, radii_;
+    // The variance of each element of the rows in each cluster
+    std::vector<float> variances_;
+
+};
+
+}
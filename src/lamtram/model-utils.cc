@@ -5,11 +5,27 @@
 #include <lamtram/encoder-attentional.h>
 #include <lamtram/encoder-classifier.h>
 #include <lamtram/neural-lm.h>
+#include <lamtram/mapped-file.h>
 #include <dynet/model.h>
 #include <dynet/dict.h>
+#include <dynet/io.h>
+#include <dynet/tensor.h>
+#include <dynet/devices.h>
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/archive/text_oarchive.hpp>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
 #include <fstream>
+#include <sstream>
 
 using namespace std;
 using namespace lamtram;
@@ -65,6 +81,252 @@ ModelType* ModelUtils::LoadMonolingualModel(const std::string & file,
     return ModelUtils::LoadMonolingualModel<ModelType>(model_in, mod, vocab_trg);
 }
 
+// The header of a binary model file, followed by the text of the model file
+// at text_offset, the parameters, and an index of the parameters with a line
+// for each ("#Parameter# name size offset") at index_offset. Numbers are in
+// the byte order of the machine that wrote the file.
+struct BinaryModelHeader {
+  char magic[8];
+  uint32_t version, precision;
+  uint64_t text_offset, text_size, index_offset, num_params;
+};
+static const char kBinaryModelMagic[8] = {'L', 'A', 'M', 'T', 'R', 'A', 'M', 'B'};
+static const uint32_t kBinaryModelVersion = 1;
+static const size_t kBinaryModelAlign = 64;
+
+// Read the header of a binary model and check it against the file size
+static const BinaryModelHeader & GetBinaryHeader(const MappedFile & mapped) {
+  const BinaryModelHeader & header = *reinterpret_cast<const BinaryModelHeader*>(mapped.GetData());
+  if(mapped.GetSize() < sizeof(BinaryModelHeader) || memcmp(header.magic, kBinaryModelMagic, sizeof(kBinaryModelMagic)))
+    THROW_ERROR("Not a binary model file: " << mapped.GetFile());
+  if(header.version != kBinaryModelVersion)
+    THROW_ERROR("Binary model file " << mapped.GetFile() << " has version " << header.version << ", but " << kBinaryModelVersion << " is supported");
+  if(header.text_offset + header.text_size > mapped.GetSize() || header.index_offset > mapped.GetSize())
+    THROW_ERROR("Binary model file " << mapped.GetFile() << " is truncated");
+  return header;
+}
+
+// Give the whole pages of memory that is no longer used back to the system,
+// returning the number of bytes. Reading them again gives zeros.
+static size_t ReleaseMemory(float * data, size_t size) {
+  if(data == nullptr) return 0;
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t begin = (reinterpret_cast<uintptr_t>(data) + page - 1) / page * page;
+  uintptr_t end = reinterpret_cast<uintptr_t>(data + size) / page * page;
+  if(begin >= end || madvise(reinterpret_cast<void*>(begin), end - begin, MADV_DONTNEED) != 0)
+    return 0;
+  return end - begin;
+}
+
+// Set the parameters of a model from a binary model. Parameters in 32 bits
+// on the CPU point into the mapping, and the memory DyNet allocated for them
+// is released. The others are converted and copied, split between threads.
+// With release_grads, the memory of the gradients (which are zero until the
+// model is trained) is released as well. The mapping must outlive the model.
+static void MapParameters(MappedFile & mapped, dynet::ParameterCollection & mod, bool release_grads = false) {
+  const BinaryModelHeader & header = GetBinaryHeader(mapped);
+  ParamPrecision precision = (ParamPrecision)header.precision;
+  if(precision != PRECISION_FP32 && precision != PRECISION_FP16 && precision != PRECISION_BF16)
+    THROW_ERROR("Binary model file " << mapped.GetFile() << " has an unknown precision " << header.precision);
+  size_t value_size = (precision == PRECISION_FP32 ? sizeof(float) : sizeof(uint16_t));
+  const auto & params = mod.parameters_list();
+  const auto & lookups = mod.lookup_parameters_list();
+  // Find the values of each parameter in the index
+  istringstream index(string(mapped.GetData() + header.index_offset, mapped.GetSize() - header.index_offset));
+  string line;
+  vector<char*> data;
+  auto read_index = [&](const std::string & type, const std::string & name, size_t size) {
+    string my_type, my_name;
+    size_t my_size = 0, offset = 0;
+    if(!getline(index, line)) THROW_ERROR("Binary model file " << mapped.GetFile() << " has no values for " << type << " " << name);
+    istringstream iss(line);
+    iss >> my_type >> my_name >> my_size >> offset;
+    if(my_type != type || my_name != name || my_size != size)
+      THROW_ERROR("Expected " << type << " " << name << " of size " << size << " in " << mapped.GetFile() << ", but found: " << line);
+    if(offset % kBinaryModelAlign != 0 || offset + size * value_size > header.index_offset)
+      THROW_ERROR("Binary model file " << mapped.GetFile() << " has a bad offset for " << name);
+    data.push_back(mapped.GetData() + offset);
+  };
+  for(auto & p : params)
+    read_index("#Parameter#", p->name, p->dim.size());
+  for(auto & p : lookups)
+    read_index("#LookupParameter#", p->name, p->all_dim.size());
+  // Return where the values of a tensor are if it can use them directly
+  auto read_values = [&](const char * my_data, size_t size, dynet::Tensor & tensor) -> float* {
+    if(precision == PRECISION_FP32 && tensor.device->type == dynet::DeviceType::CPU)
+      return reinterpret_cast<float*>(const_cast<char*>(my_data));
+    vector<float> vals(size);
+    if(precision == PRECISION_FP32)
+      memcpy(vals.data(), my_data, size * sizeof(float));
+    else
+      HalfToFloat(reinterpret_cast<const uint16_t*>(my_data), vals.data(), size, precision);
+    dynet::TensorTools::set_elements(tensor, vals);
+    return nullptr;
+  };
+  int num_params = params.size(), num_all = params.size() + lookups.size();
+  #pragma omp parallel for schedule(dynamic)
+  for(int i = 0; i < num_all; i++) {
+    if(i < num_params) {
+      dynet::ParameterStorage & p = *params[i];
+      float * vals = read_values(data[i], p.dim.size(), p.values);
+      if(vals != nullptr) {
+        ReleaseMemory(p.values.v, p.dim.size());
+        p.values.v = vals;
+        if(release_grads) ReleaseMemory(p.g.v, p.dim.size());
+      }
+    } else {
+      dynet::LookupParameterStorage & p = *lookups[i - num_params];
+      float * vals = read_values(data[i], p.all_dim.size(), p.all_values);
+      if(vals != nullptr) {
+        ReleaseMemory(p.all_values.v, p.all_dim.size());
+        if(release_grads) ReleaseMemory(p.all_grads.v, p.all_dim.size());
+        p.all_values.v = vals;
+        for(size_t j = 0; j < p.values.size(); j++)
+          p.values[j].v = vals + j * p.dim.size();
+      }
+    }
+  }
+}
+
+// Get the text of a model file, or of the model file in a binary model
+static std::string ReadModelText(const std::string & file) {
+  if(ModelUtils::IsBinaryModel(file)) {
+    MappedFile mapped(file);
+    const BinaryModelHeader & header = GetBinaryHeader(mapped);
+    return string(mapped.GetData() + header.text_offset, header.text_size);
+  }
+  ifstream in(file);
+  if(!in) THROW_ERROR("Could not open model file " << file);
+  ostringstream text;
+  text << in.rdbuf();
+  return text.str();
+}
+
+// Hold an exclusive lock on a file while it is in scope, creating the file if
+// necessary. The lock is released by the system if the process dies.
+class FileLock {
+public:
+  explicit FileLock(const std::string & file) : fd_(open(file.c_str(), O_RDWR | O_CREAT, 0666)) {
+    if(fd_ < 0) THROW_ERROR("Could not open lock file " << file << ": " << strerror(errno));
+    while(flock(fd_, LOCK_EX) != 0) {
+      if(errno == EINTR) continue;
+      close(fd_);
+      THROW_ERROR("Could not lock " << file << ": " << strerror(errno));
+    }
+  }
+  ~FileLock() { close(fd_); }
+protected:
+  int fd_;
+};
+
+// Remove the shared copies of older versions of a model, given the name of
+// the current one. Processes that still map them keep their pages until they
+// exit.
+static void RemoveStaleSharedModels(const std::string & binary_file) {
+  size_t dash = binary_file.rfind('-');
+  glob_t found;
+  if(glob((binary_file.substr(0, dash) + "-*.bin").c_str(), 0, nullptr, &found) == 0) {
+    for(size_t i = 0; i < found.gl_pathc; i++) {
+      string old_file = found.gl_pathv[i];
+      if(old_file != binary_file) {
+        remove(old_file.c_str());
+        remove((old_file + ".lock").c_str());
+      }
+    }
+  }
+  globfree(&found);
+}
+
+// Load a model with a function that reads the model from the text of its
+// model file, and load its parameters now, or with load_parameters if given
+template <class ModelType>
+static ModelType* LoadModelWithParameters(const std::string & file,
+                                          std::shared_ptr<dynet::ParameterCollection> & mod,
+                                          bool shared,
+                                          std::function<void()> * load_parameters,
+                                          const std::function<ModelType*(std::istream &)> & read_model) {
+    string binary_file = (shared ? ModelUtils::GetSharedModelFile(file) : file);
+    // The first process to share a model that is not a binary model in 32
+    // bits loads it, and writes the binary model the others will map
+    bool write_shared = (binary_file != file && !ModelUtils::IsBinaryModel(binary_file));
+    MappedFilePtr mapped;
+    ModelType* ret;
+    if(write_shared ? ModelUtils::IsBinaryModel(file) : ModelUtils::IsBinaryModel(binary_file)) {
+      mapped.reset(new MappedFile(write_shared ? file : binary_file, shared && !write_shared));
+      const BinaryModelHeader & header = GetBinaryHeader(*mapped);
+      istringstream model_in(string(mapped->GetData() + header.text_offset, header.text_size));
+      ret = read_model(model_in);
+    } else {
+      ifstream model_in(file);
+      if(!model_in) THROW_ERROR("Could not open model file " << file);
+      ret = read_model(model_in);
+    }
+    // The memory DyNet allocated for the parameters is not freed one parameter
+    // at a time, so only the mappings need to outlive the collection
+    std::shared_ptr<vector<MappedFilePtr> > mappings(new vector<MappedFilePtr>);
+    if(mapped.get() != nullptr) mappings->push_back(mapped);
+    std::shared_ptr<dynet::ParameterCollection> owned = mod;
+    mod.reset(owned.get(), [owned, mappings](dynet::ParameterCollection *) { });
+    dynet::ParameterCollection * params = owned.get();
+    std::function<void()> load = [=]() {
+      // Only one process writes the shared model, and the others that start
+      // at the same time wait for it and then map it
+      std::shared_ptr<FileLock> lock;
+      if(write_shared) {
+        lock.reset(new FileLock(binary_file + ".lock"));
+        if(ModelUtils::IsBinaryModel(binary_file)) {
+          MappedFilePtr shared_mapped(new MappedFile(binary_file, true));
+          MapParameters(*shared_mapped, *params, true);
+          mappings->push_back(shared_mapped);
+          return;
+        }
+      }
+      if(mapped.get() != nullptr)
+        MapParameters(*mapped, *params, shared && !write_shared);
+      else
+        ModelUtils::LoadParameters(file + ".data", *params);
+      if(write_shared) {
+        string temp_file = binary_file + "." + to_string(getpid());
+        ModelUtils::SaveBinaryModel(temp_file, ReadModelText(file), *params);
+        if(rename(temp_file.c_str(), binary_file.c_str()) != 0) {
+          remove(temp_file.c_str());
+          THROW_ERROR("Could not write the shared model " << binary_file << ": " << strerror(errno));
+        }
+        RemoveStaleSharedModels(binary_file);
+        MappedFilePtr shared_mapped(new MappedFile(binary_file, true));
+        MapParameters(*shared_mapped, *params, true);
+        mappings->push_back(shared_mapped);
+      }
+    };
+    if(load_parameters != nullptr)
+      *load_parameters = load;
+    else
+      load();
+    return ret;
+}
+
+template <class ModelType>
+ModelType* ModelUtils::LoadBilingualModelWithParameters(const std::string & file,
+                                                        std::shared_ptr<dynet::ParameterCollection> & mod,
+                                                        DictPtr & vocab_src, DictPtr & vocab_trg,
+                                                        bool shared,
+                                                        std::function<void()> * load_parameters) {
+    return LoadModelWithParameters<ModelType>(file, mod, shared, load_parameters, [&](std::istream & model_in) {
+      return LoadBilingualModel<ModelType>(model_in, mod, vocab_src, vocab_trg);
+    });
+}
+
+template <class ModelType>
+ModelType* ModelUtils::LoadMonolingualModelWithParameters(const std::string & file,
+                                                          std::shared_ptr<dynet::ParameterCollection> & mod,
+                                                          DictPtr & vocab_trg,
+                                                          bool shared,
+                                                          std::function<void()> * load_parameters) {
+    return LoadModelWithParameters<ModelType>(file, mod, shared, load_parameters, [&](std::istream & model_in) {
+      return LoadMonolingualModel<ModelType>(model_in, mod, vocab_trg);
+    });
+}
+
 // Instantiate LoadModel
 template
 EncoderDecoder* ModelUtils::LoadBilingualModel<EncoderDecoder>(std::istream & model_in,
@@ -98,3 +360,233 @@ template
 NeuralLM* ModelUtils::LoadMonolingualModel<NeuralLM>(const std::string & infile,
                                                      std::shared_ptr<dynet::ParameterCollection> & mod,
                                                      DictPtr & vocab_trg);
+template
+EncoderDecoder* ModelUtils::LoadBilingualModelWithParameters<EncoderDecoder>(const std::string & infile,
+                                                                    std::shared_ptr<dynet::ParameterCollection> & mod,
+                                                                    DictPtr & vocab_src, DictPtr & vocab_trg, bool shared, std::function<void()> * load_parameters);
+template
+EncoderAttentional* ModelUtils::LoadBilingualModelWithParameters<EncoderAttentional>(const std::string & infile,
+                                                                            std::shared_ptr<dynet::ParameterCollection> & mod,
+                                                                            DictPtr & vocab_src, DictPtr & vocab_trg, bool shared, std::function<void()> * load_parameters);
+template
+EncoderClassifier* ModelUtils::LoadBilingualModelWithParameters<EncoderClassifier>(const std::string & infile,
+                                                                          std::shared_ptr<dynet::ParameterCollection> & mod,
+                                                                          DictPtr & vocab_src, DictPtr & vocab_trg, bool shared, std::function<void()> * load_parameters);
+template
+NeuralLM* ModelUtils::LoadMonolingualModelWithParameters<NeuralLM>(const std::string & infile,
+                                                                   std::shared_ptr<dynet::ParameterCollection> & mod,
+                                                                   DictPtr & vocab_trg, bool shared, std::function<void()> * load_parameters);
+
+// The first line of a file with 16-bit parameters
+static const std::string kHalfParamsMagic = "#lamtram-params#";
+
+void ModelUtils::SaveParameters(const std::string & file,
+                                const dynet::ParameterCollection & mod,
+                                ParamPrecision precision) {
+  if(precision == PRECISION_FP32) {
+    dynet::TextFileSaver saver(file);
+    saver.save(mod);
+    return;
+  }
+  ofstream out(file, ios::binary);
+  if(!out) THROW_ERROR("Could not open parameter file for writing: " << file);
+  out << kHalfParamsMagic << ' ' << PrecisionName(precision) << '\n';
+  // Each parameter is a line with its type, name and size, then its values
+  vector<uint16_t> halves;
+  auto write_values = [&](const std::string & type, const std::string & name, const vector<float> & vals) {
+    out << type << ' ' << name << ' ' << vals.size() << '\n';
+    halves.resize(vals.size());
+    FloatToHalf(vals.data(), halves.data(), vals.size(), precision);
+    out.write(reinterpret_cast<const char*>(halves.data()), halves.size() * sizeof(uint16_t));
+    out << '\n';
+  };
+  for(auto & p : mod.parameters_list())
+    write_values("#Parameter#", p->name, dynet::as_vector(p->values));
+  for(auto & p : mod.lookup_parameters_list())
+    write_values("#LookupParameter#", p->name, dynet::as_vector(p->all_values));
+  if(!out) THROW_ERROR("Failed to write parameter file: " << file);
+}
+
+void ModelUtils::LoadParameters(const std::string & file,
+                                dynet::ParameterCollection & mod) {
+  ifstream in(file, ios::binary);
+  if(!in) THROW_ERROR("Could not open parameter file: " << file);
+  string line, magic, precision_name;
+  getline(in, line);
+  istringstream header(line);
+  header >> magic >> precision_name;
+  // Files without the header are in DyNet's text format
+  if(magic != kHalfParamsMagic) {
+    in.close();
+    dynet::TextFileLoader loader(file);
+    loader.populate(mod);
+    return;
+  }
+  ParamPrecision precision = ParsePrecision(precision_name);
+  if(precision == PRECISION_FP32)
+    THROW_ERROR("Parameter file " << file << " has a header but 32-bit values");
+  in.close();
+  // Find the values of each parameter, then convert them in parallel
+  MappedFile mapped(file);
+  const char * pos = mapped.GetData(), * end = mapped.GetData() + mapped.GetSize();
+  pos = static_cast<const char*>(memchr(pos, '\n', end - pos));
+  if(pos == nullptr) THROW_ERROR("Parameter file " << file << " has no parameters");
+  pos++;
+  vector<pair<const uint16_t*, dynet::Tensor*> > data;
+  auto read_values = [&](const std::string & type, const std::string & name, size_t size, dynet::Tensor & tensor) {
+    const char * line_end = static_cast<const char*>(memchr(pos, '\n', end - pos));
+    if(line_end == nullptr) THROW_ERROR("Parameter file " << file << " ended before " << type << " " << name);
+    string line(pos, line_end), my_type, my_name;
+    size_t my_size = 0;
+    istringstream iss(line);
+    iss >> my_type >> my_name >> my_size;
+    if(my_type != type || my_name != name || my_size != size)
+      THROW_ERROR("Expected " << type << " " << name << " of size " << size << " in " << file << ", but found: " << line);
+    pos = line_end + 1;
+    if(size_t(end - pos) < size * sizeof(uint16_t) + 1 || pos[size * sizeof(uint16_t)] != '\n')
+      THROW_ERROR("Parameter file " << file << " has bad values for " << name);
+    data.push_back(make_pair(reinterpret_cast<const uint16_t*>(pos), &tensor));
+    pos += size * sizeof(uint16_t) + 1;
+  };
+  for(auto & p : mod.parameters_list())
+    read_values("#Parameter#", p->name, p->dim.size(), p->values);
+  for(auto & p : mod.lookup_parameters_list())
+    read_values("#LookupParameter#", p->name, p->all_dim.size(), p->all_values);
+  #pragma omp parallel for schedule(dynamic)
+  for(int i = 0; i < (int)data.size(); i++) {
+    vector<float> vals(data[i].second->d.size());
+    HalfToFloat(data[i].first, vals.data(), vals.size(), precision);
+    dynet::TensorTools::set_elements(*data[i].second, vals);
+  }
+}
+
+void ModelUtils::LoadInParallel(const std::vector<std::function<void()> > & loads, int threads) {
+  if(threads <= 0) threads = loads.size();
+  // Exceptions cannot leave the loop, so the first is thrown after it
+  vector<string> errors(loads.size());
+  #pragma omp parallel for schedule(dynamic) num_threads(threads)
+  for(int i = 0; i < (int)loads.size(); i++) {
+    try {
+      if(loads[i]) loads[i]();
+    } catch(std::exception & e) {
+      errors[i] = e.what();
+    }
+  }
+  for(const string & error : errors)
+    if(error.size())
+      throw std::runtime_error(error);
+}
+
+size_t ModelUtils::ReleaseParameters(dynet::ParameterCollection & mod) {
+  size_t ret = 0;
+  for(auto & p : mod.parameters_list()) {
+    if(p->values.device->type != dynet::DeviceType::CPU) continue;
+    ret += ReleaseMemory(p->values.v, p->dim.size());
+    ret += ReleaseMemory(p->g.v, p->dim.size());
+  }
+  for(auto & p : mod.lookup_parameters_list()) {
+    if(p->all_values.device->type != dynet::DeviceType::CPU) continue;
+    ret += ReleaseMemory(p->all_values.v, p->all_dim.size());
+    ret += ReleaseMemory(p->all_grads.v, p->all_dim.size());
+  }
+  return ret;
+}
+
+bool ModelUtils::IsBinaryModel(const std::string & file) {
+  ifstream in(file, ios::binary);
+  char magic[sizeof(kBinaryModelMagic)];
+  return in.read(magic, sizeof(magic)) && !memcmp(magic, kBinaryModelMagic, sizeof(magic));
+}
+
+void ModelUtils::SaveBinaryModel(const std::string & file,
+                                 const std::string & model_text,
+                                 const dynet::ParameterCollection & mod,
+                                 ParamPrecision precision) {
+  ofstream out(file, ios::binary);
+  if(!out) THROW_ERROR("Could not open binary model file for writing: " << file);
+  BinaryModelHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kBinaryModelMagic, sizeof(kBinaryModelMagic));
+  header.version = kBinaryModelVersion;
+  header.precision = precision;
+  header.text_offset = sizeof(header);
+  header.text_size = model_text.size();
+  // Write the header again at the end, when the index is known
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  out << model_text;
+  ostringstream index;
+  vector<uint16_t> halves;
+  const char zeros[kBinaryModelAlign] = {0};
+  auto write_values = [&](const std::string & type, const std::string & name, const vector<float> & vals) {
+    size_t offset = out.tellp();
+    size_t padding = (kBinaryModelAlign - offset % kBinaryModelAlign) % kBinaryModelAlign;
+    out.write(zeros, padding);
+    index << type << ' ' << name << ' ' << vals.size() << ' ' << offset + padding << '\n';
+    if(precision == PRECISION_FP32) {
+      out.write(reinterpret_cast<const char*>(vals.data()), vals.size() * sizeof(float));
+    } else {
+      halves.resize(vals.size());
+      FloatToHalf(vals.data(), halves.data(), vals.size(), precision);
+      out.write(reinterpret_cast<const char*>(halves.data()), halves.size() * sizeof(uint16_t));
+    }
+    header.num_params++;
+  };
+  for(auto & p : mod.parameters_list())
+    write_values("#Parameter#", p->name, dynet::as_vector(p->values));
+  for(auto & p : mod.lookup_parameters_list())
+    write_values("#LookupParameter#", p->name, dynet::as_vector(p->all_values));
+  header.index_offset = out.tellp();
+  out << index.str();
+  out.seekp(0);
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  if(!out) THROW_ERROR("Failed to write binary model file: " << file);
+}
+
+void ModelUtils::ConvertToBinaryModel(const std::string & type,
+                                      const std::string & infile,
+                                      const std::string & outfile,
+                                      ParamPrecision precision) {
+  // The parameters may be in a mapping of the input file
+  if(infile == outfile) THROW_ERROR("Cannot convert " << infile << " to itself");
+  string model_text = ReadModelText(infile);
+  shared_ptr<dynet::ParameterCollection> mod;
+  DictPtr vocab_src, vocab_trg;
+  // Load the model to create its parameters, which are then filled in
+  if(type == "encdec") {
+    unique_ptr<EncoderDecoder> model(LoadBilingualModelWithParameters<EncoderDecoder>(infile, mod, vocab_src, vocab_trg));
+  } else if(type == "encatt") {
+    unique_ptr<EncoderAttentional> model(LoadBilingualModelWithParameters<EncoderAttentional>(infile, mod, vocab_src, vocab_trg));
+  } else if(type == "enccls") {
+    unique_ptr<EncoderClassifier> model(LoadBilingualModelWithParameters<EncoderClassifier>(infile, mod, vocab_src, vocab_trg));
+  } else if(type == "nlm") {
+    unique_ptr<NeuralLM> model(LoadMonolingualModelWithParameters<NeuralLM>(infile, mod, vocab_trg));
+  } else {
+    THROW_ERROR("Bad model type " << type << ". Must be encdec, encatt, enccls or nlm.");
+  }
+  SaveBinaryModel(outfile, model_text, *mod, precision);
+}
+
+std::string ModelUtils::GetSharedModelFile(const std::string & file) {
+  BinaryModelHeader header;
+  ifstream in(file, ios::binary);
+  if(in.read(reinterpret_cast<char*>(&header), sizeof(header)) &&
+     !memcmp(header.magic, kBinaryModelMagic, sizeof(kBinaryModelMagic)) &&
+     header.precision == PRECISION_FP32)
+    return file;
+  // Name the copy after the files it is made from, and then when they
+  // changed, so that copies of older versions of the model can be found
+  ostringstream path_id, version_id;
+  for(const string & my_file : {file, file + ".data"}) {
+    char * path = realpath(my_file.c_str(), nullptr);
+    struct stat st;
+    if(path != nullptr && stat(path, &st) == 0) {
+      path_id << path << ' ';
+      version_id << st.st_size << ' ' << st.st_mtime << ' ';
+    }
+    free(path);
+  }
+  ostringstream shared_file;
+  shared_file << "/dev/shm/lamtram-" << hex << std::hash<std::string>()(path_id.str())
+              << '-' << std::hash<std::string>()(version_id.str()) << ".bin";
+  return shared_file.str();
+}
@@ -1,9 +1,12 @@
 #pragma once
 
 #include <lamtram/dict-utils.h>
+#include <lamtram/param-precision.h>
 #include <dynet/dynet.h>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <vector>
 
 namespace dynet {
 class Model;
@@ -42,6 +45,74 @@ public:
                                 std::shared_ptr<dynet::ParameterCollection> & mod,
                                 DictPtr & vocab_trg);
 
+    // Load a model and its parameters, either from a binary model file, or
+    // from a text model file with the parameters in file + ".data". With
+    // shared, the parameters are mapped read-only from the file given by
+    // GetSharedModelFile(), so processes that load the same model share one
+    // copy of them in memory, and the model cannot be trained. With
+    // load_parameters, only the model is read, and the parameters are loaded
+    // when the function it is set to is called, which may be in another
+    // thread at the same time as other models.
+    template <class ModelType>
+    static ModelType* LoadBilingualModelWithParameters(const std::string & file,
+                                std::shared_ptr<dynet::ParameterCollection> & mod,
+                                DictPtr & vocab_src, DictPtr & vocab_trg,
+                                bool shared = false,
+                                std::function<void()> * load_parameters = nullptr);
+    template <class ModelType>
+    static ModelType* LoadMonolingualModelWithParameters(const std::string & file,
+                                std::shared_ptr<dynet::ParameterCollection> & mod,
+                                DictPtr & vocab_trg,
+                                bool shared = false,
+                                std::function<void()> * load_parameters = nullptr);
+
+    // Call functions that load parameters, with up to threads of them at once
+    // (0 for all). The parameters of each model are also converted in
+    // parallel where the format allows it.
+    static void LoadInParallel(const std::vector<std::function<void()> > & loads, int threads = 0);
+
+    // The binary model the parameters of a model are shared from: the model
+    // itself if it is a binary model in 32 bits, and otherwise a binary model
+    // in shared memory (/dev/shm), written by the first process that loads
+    // the model and named after the files of the model and when they changed.
+    // The process that writes it holds a lock (the same name + ".lock") so
+    // others wait for it, and removes the copies of older versions.
+    static std::string GetSharedModelFile(const std::string & file);
+
+    // Give the memory of the values and gradients of the parameters of a
+    // model back to the system, once they are only used through a copy (such
+    // as an InferenceEngine). The parameters read as zeros afterwards, so the
+    // model cannot be used again. Returns the number of bytes released.
+    static size_t ReleaseParameters(dynet::ParameterCollection & mod);
+
+    // Save the parameters of a model. In 32 bits they are written in DyNet's
+    // text format, and in 16 bits they are written as raw values, at a
+    // quarter of the size.
+    static void SaveParameters(const std::string & file,
+                               const dynet::ParameterCollection & mod,
+                               ParamPrecision precision = PRECISION_FP32);
+
+    // Load the parameters of a model saved in any precision
+    static void LoadParameters(const std::string & file,
+                               dynet::ParameterCollection & mod);
+
+    // Binary model files hold the text of a model file (the vocabularies and
+    // the model specification) followed by the raw parameters, each aligned
+    // to 64 bytes. They are loaded by mapping them into memory, and in 32
+    // bits the parameters are used where they are in the mapping, so loading
+    // only costs reading the file.
+    static bool IsBinaryModel(const std::string & file);
+    static void SaveBinaryModel(const std::string & file,
+                                const std::string & model_text,
+                                const dynet::ParameterCollection & mod,
+                                ParamPrecision precision = PRECISION_FP32);
+
+    // Convert a model of type encdec, encatt, enccls or nlm to a binary model
+    static void ConvertToBinaryModel(const std::string & type,
+                                     const std::string & infile,
+                                     const std::string & outfile,
+                                     ParamPrecision precision = PRECISION_FP32);
+
 };
 
 }
@@ -28,7 +28,7 @@ NeuralLM::NeuralLM(const DictPtr & vocab, int ngram_context, int extern_context,
            ParameterCollection & model) :
       vocab_(vocab), ngram_context_(ngram_context),
       extern_context_(extern_context), extern_feed_(extern_feed), wordrep_size_(wordrep_size),
-      unk_id_(unk_id), hidden_spec_(hidden_spec), curr_graph_(NULL) {
+      unk_id_(unk_id), hidden_spec_(hidden_spec), proj_builder_(nullptr), curr_graph_(NULL) {
   if(wordrep_size_ <= 0) wordrep_size_ = GlobalVars::layer_size;
   // Hidden layers
   builder_ = BuilderFactory::CreateBuilder(hidden_spec_,
@@ -398,23 +398,32 @@ Expression NeuralLM::Forward(const Sent & sent, int t,
   // Start a new sequence if necessary
   if(layer_in.size())
     builder_->start_new_sequence(layer_in);
-  // Concatenate wordrep and external context into a vector for the hidden unit
-  vector<Expression> i_wrs_t;
-  for(auto hist : boost::irange(t - ngram_context_, t))
-    i_wrs_t.push_back(lookup(cg, p_wr_W_, CreateWord(sent, hist)));
-  if(extern_feed_)
-    i_wrs_t.push_back(extern_in.pg == nullptr ? extern_calc->GetEmptyContext(cg) : extern_in);
-  // Concatenate the inputs if necessary
-  Expression i_wr_t;
-  if(i_wrs_t.size() > 1) {
-    i_wr_t = concatenate(i_wrs_t);
+  // Look up the precomputed projections of the context if possible
+  Expression i_h_t;
+  if(proj_table_.get() != nullptr) {
+    vector<Expression> i_projs_t;
+    for(auto hist : boost::irange(t - ngram_context_, t))
+      i_projs_t.push_back(proj_table_->Lookup(cg, hist - t + ngram_context_, CreateWord(sent, hist)));
+    i_h_t = proj_builder_->AddProjectedInput(i_projs_t.size() == 1 ? i_projs_t[0] : sum(i_projs_t));
   } else {
-    assert(i_wrs_t.size() == 1);
-    i_wr_t = i_wrs_t[0];
+    // Concatenate wordrep and external context into a vector for the hidden unit
+    vector<Expression> i_wrs_t;
+    for(auto hist : boost::irange(t - ngram_context_, t))
+      i_wrs_t.push_back(lookup(cg, p_wr_W_, CreateWord(sent, hist)));
+    if(extern_feed_)
+      i_wrs_t.push_back(extern_in.pg == nullptr ? extern_calc->GetEmptyContext(cg) : extern_in);
+    // Concatenate the inputs if necessary
+    Expression i_wr_t;
+    if(i_wrs_t.size() > 1) {
+      i_wr_t = concatenate(i_wrs_t);
+    } else {
+      assert(i_wrs_t.size() == 1);
+      i_wr_t = i_wrs_t[0];
+    }
+    // cerr << "i_wr_t == " << print_vec(as_vector(i_wr_t.value())) << endl;
+    // Run the hidden unit
+    i_h_t = builder_->add_input(i_wr_t);
   }
-  // cerr << "i_wr_t == " << print_vec(as_vector(i_wr_t.value())) << endl;
-  // Run the hidden unit
-  Expression i_h_t = builder_->add_input(i_wr_t);
   Expression i_prior;
   // Calculate the extern if existing
   if(extern_context_ > 0) {
@@ -489,3 +498,10 @@ void NeuralLM::Write(std::ostream & out) {
 int NeuralLM::GetVocabSize() const { return vocab_->size(); }
 void NeuralLM::SetDropout(float dropout) { builder_->set_dropout(dropout); }
 
+bool NeuralLM::PrecomputeProjections() {
+  proj_builder_ = dynamic_cast<ProjectedInputBuilder*>(builder_.get());
+  if(proj_builder_ == nullptr || extern_feed_) return false;
+  proj_table_.reset(new ProjectionTable(p_wr_W_, proj_builder_->GetInputWeights(), ngram_context_));
+  return true;
+}
+
@@ -3,6 +3,7 @@
 #include <lamtram/sentence.h>
 #include <lamtram/ll-stats.h>
 #include <lamtram/builder-factory.h>
+#include <lamtram/projection-table.h>
 #include <lamtram/softmax-base.h>
 #include <lamtram/dict-utils.h>
 #include <dynet/dynet.h>
@@ -23,6 +24,7 @@ class ExternCalculator;
 
 // A class for feed-forward neural network LMs
 class NeuralLM {
+    friend class InferenceEngine;
 
 public:
 
@@ -133,11 +135,19 @@ public:
     int GetNumLayers() const { return hidden_spec_.layers; }
     int GetNumNodes() const { return hidden_spec_.nodes; }
     int GetLayerMultiplier() const { return hidden_spec_.multiplier; }
+    // Whether the hidden state depends on anything other than the n-gram context
+    bool IsRecurrent() const { return hidden_spec_.IsRecurrent() || extern_feed_; }
     SoftmaxBase & GetSoftmax() { return *softmax_; }
 
     // Setters
     void SetDropout(float dropout);
 
+    // Precompute the products of the word embeddings and the input weights of
+    // the first layer to look them up in Forward. Returns false if the
+    // builder cannot take projected inputs or the input includes the
+    // external context.
+    bool PrecomputeProjections();
+
 protected:
 
     // The vocabulary
@@ -158,6 +168,10 @@ protected:
     // The RNN builder
     BuilderPtr builder_;
 
+    // The precomputed projections if any, and the builder that takes them
+    ProjectionTablePtr proj_table_;
+    ProjectedInputBuilder * proj_builder_;
+
 private:
     // A pointer to the current computation graph.
     // This is only used for sanity checking to make sure NewGraph
@@ -0,0 +1,104 @@
+#include <lamtram/param-precision.h>
+#include <lamtram/macros.h>
+#include <cstring>
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+using namespace std;
+using namespace lamtram;
+
+inline uint32_t FloatBits(float val) { uint32_t ret; memcpy(&ret, &val, sizeof(ret)); return ret; }
+inline float BitsFloat(uint32_t val) { float ret; memcpy(&ret, &val, sizeof(ret)); return ret; }
+
+ParamPrecision lamtram::ParsePrecision(const std::string & str) {
+  if(str == "fp32") return PRECISION_FP32;
+  if(str == "fp16") return PRECISION_FP16;
+  if(str == "bf16") return PRECISION_BF16;
+  THROW_ERROR("Unknown parameter precision " << str << " (must be fp32, fp16 or bf16)");
+}
+
+std::string lamtram::PrecisionName(ParamPrecision precision) {
+  switch(precision) {
+    case PRECISION_FP16: return "fp16";
+    case PRECISION_BF16: return "bf16";
+    default: return "fp32";
+  }
+}
+
+uint16_t lamtram::FloatToHalf(float val, ParamPrecision precision) {
+  uint32_t x = FloatBits(val);
+  if(precision == PRECISION_BF16) {
+    // Keep NaNs quiet, and round the rest to the nearest even
+    if((x & 0x7fffffff) > 0x7f800000) return (x >> 16) | 0x40;
+    return (x + 0x7fff + ((x >> 16) & 1)) >> 16;
+  } else if(precision != PRECISION_FP16) {
+    THROW_ERROR("Cannot convert to 16 bits with precision " << PrecisionName(precision));
+  }
+  uint32_t sign = (x >> 16) & 0x8000;
+  x &= 0x7fffffff;
+  // Infinity and NaN, and values that round to infinity
+  if(x >= 0x7f800000) return sign | (x > 0x7f800000 ? 0x7e00 : 0x7c00);
+  if(x >= 0x477ff000) return sign | 0x7c00;
+  // Values below the smallest normal are rounded to a multiple of 2^-24
+  if(x < 0x38800000) {
+    if(x < 0x33000000) return sign;
+    uint32_t mant = (x & 0x7fffff) | 0x800000, shift = 126 - (x >> 23);
+    uint32_t ret = mant >> shift, rem = mant & ((1u << shift) - 1), half = 1u << (shift - 1);
+    if(rem > half || (rem == half && (ret & 1))) ret++;
+    return sign | ret;
+  }
+  // Normal values change the bias of the exponent and drop 13 bits, where a
+  // carry out of the mantissa correctly increments the exponent
+  uint32_t ret = (x >> 13) - (112 << 10), rem = x & 0x1fff;
+  if(rem > 0x1000 || (rem == 0x1000 && (ret & 1))) ret++;
+  return sign | ret;
+}
+
+float lamtram::HalfToFloat(uint16_t val, ParamPrecision precision) {
+  if(precision == PRECISION_BF16) {
+    return BitsFloat((uint32_t)val << 16);
+  } else if(precision != PRECISION_FP16) {
+    THROW_ERROR("Cannot convert from 16 bits with precision " << PrecisionName(precision));
+  }
+  uint32_t sign = (uint32_t)(val & 0x8000) << 16, exp = (val >> 10) & 0x1f, mant = val & 0x3ff;
+  if(exp == 0) {
+    if(mant == 0) return BitsFloat(sign);
+    // Normalize values below the smallest normal
+    exp = 113;
+    while(!(mant & 0x400)) { mant <<= 1; exp--; }
+    return BitsFloat(sign | (exp << 23) | ((mant & 0x3ff) << 13));
+  } else if(exp == 31) {
+    return BitsFloat(sign | 0x7f800000 | (mant << 13));
+  }
+  return BitsFloat(sign | ((exp + 112) << 23) | (mant << 13));
+}
+
+void lamtram::FloatToHalf(const float * in, uint16_t * out, int size, ParamPrecision precision) {
+  int i = 0;
+#ifdef __F16C__
+  if(precision == PRECISION_FP16)
+    for(; i + 8 <= size; i += 8)
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT));
+#endif
+  for(; i < size; i++)
+    out[i] = FloatToHalf(in[i], precision);
+}
+
+void lamtram::HalfToFloat(const uint16_t * in, float * out, int size, ParamPrecision precision) {
+  int i = 0;
+  if(precision == PRECISION_BF16) {
+    // A shift that the compiler can vectorize
+    uint32_t * out_bits = reinterpret_cast<uint32_t*>(out);
+    for(; i < size; i++)
+      out_bits[i] = (uint32_t)in[i] << 16;
+    return;
+  }
+#ifdef __F16C__
+  if(precision == PRECISION_FP16)
+    for(; i + 8 <= size; i += 8)
+      _mm256_storeu_ps(out + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i))));
+#endif
+  for(; i < size; i++)
+    out[i] = HalfToFloat(in[i], precision);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace lamtram {
+
+// The formats parameters can be stored in: 32-bit floats, IEEE half
+// precision floats (10 bits of mantissa, and a range up to 65504), or
+// bfloat16 (the top 16 bits of a 32-bit float, with 7 bits of mantissa and
+// the same range)
+typedef enum { PRECISION_FP32, PRECISION_FP16, PRECISION_BF16 } ParamPrecision;
+
+// Convert between names (fp32, fp16, bf16) and precisions
+ParamPrecision ParsePrecision(const std::string & str);
+std::string PrecisionName(ParamPrecision precision);
+
+// Convert values to and from a 16-bit precision, rounding to the nearest
+uint16_t FloatToHalf(float val, ParamPrecision precision);
+float HalfToFloat(uint16_t val, ParamPrecision precision);
+void FloatToHalf(const float * in, uint16_t * out, int size, ParamPrecision precision);
+void HalfToFloat(const uint16_t * in, float * out, int size, ParamPrecision precision);
+
+}
@@ -0,0 +1,39 @@
+#include <lamtram/projection-table.h>
+#include <lamtram/macros.h>
+#include <dynet/tensor.h>
+
+using namespace std;
+using namespace lamtram;
+using namespace dynet;
+
+ProjectionTable::ProjectionTable(const LookupParameter & embeddings, const Parameter & weights, int num_pos) : model_(new ParameterCollection) {
+  const LookupParameterStorage & emb_storage = embeddings.get_storage();
+  unsigned vocab_size = emb_storage.values.size(), emb_size = emb_storage.dim.rows();
+  Dim weight_dim = weights.get_storage().dim;
+  unsigned rows = weight_dim.rows();
+  if(weight_dim.cols() != emb_size * num_pos)
+    THROW_ERROR("Input weights with " << weight_dim.cols() << " columns cannot be applied to " << num_pos << " embeddings of size " << emb_size);
+  // Parameters are stored by column
+  vector<float> weight_vals = as_vector(weights.get_storage().values), proj(rows);
+  for(int pos = 0; pos < num_pos; pos++) {
+    tables_.push_back(model_->add_lookup_parameters(vocab_size, {rows}));
+    for(unsigned wid = 0; wid < vocab_size; wid++) {
+      vector<float> emb = as_vector(emb_storage.values[wid]);
+      fill(proj.begin(), proj.end(), 0.f);
+      for(unsigned j = 0; j < emb_size; j++) {
+        const float * col = &weight_vals[(pos * emb_size + j) * rows];
+        for(unsigned i = 0; i < rows; i++)
+          proj[i] += col[i] * emb[j];
+      }
+      tables_[pos].initialize(wid, proj);
+    }
+  }
+}
+
+Expression ProjectionTable::Lookup(ComputationGraph & cg, int pos, unsigned wid) const {
+  return const_lookup(cg, tables_[pos], wid);
+}
+
+Expression ProjectionTable::Lookup(ComputationGraph & cg, int pos, const vector<unsigned> & wids) const {
+  return const_lookup(cg, tables_[pos], wids);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <dynet/model.h>
+#include <dynet/expr.h>
+#include <memory>
+#include <vector>
+
+namespace lamtram {
+
+// A builder whose first layer can take its input already multiplied by the
+// input weights, so that the products for each word can be precomputed
+class ProjectedInputBuilder {
+
+public:
+    virtual ~ProjectedInputBuilder() { }
+
+    // The weights that multiply the input of the first layer
+    virtual dynet::Parameter GetInputWeights() const = 0;
+    // Add an input given as its product with the input weights
+    virtual dynet::Expression AddProjectedInput(const dynet::Expression & proj) = 0;
+
+};
+
+// Tables holding the product of the input weights of a layer and every word
+// embedding, used during inference instead of multiplying each embedding by
+// the same matrix at every step. The input of the layer is the concatenation
+// of the embeddings of num_pos words, and there is one table per position.
+class ProjectionTable {
+
+public:
+    // Create the tables
+    //  embeddings: The word embeddings
+    //  weights: The input weights, with num_pos * embedding size columns
+    //  num_pos: The number of words in the input
+    ProjectionTable(const dynet::LookupParameter & embeddings, const dynet::Parameter & weights, int num_pos);
+    ~ProjectionTable() { }
+
+    // Look up the projection of a word (or a batch of words) at a position
+    dynet::Expression Lookup(dynet::ComputationGraph & cg, int pos, unsigned wid) const;
+    dynet::Expression Lookup(dynet::ComputationGraph & cg, int pos, const std::vector<unsigned> & wids) const;
+
+protected:
+    // The tables are not part of the model, so they are never saved or trained
+    std::shared_ptr<dynet::ParameterCollection> model_;
+    std::vector<dynet::LookupParameter> tables_;
+
+};
+
+typedef std::shared_ptr<ProjectionTable> ProjectionTablePtr;
+
+}
@@ -0,0 +1,87 @@
+#include <lamtram/shortlist.h>
+#include <lamtram/macros.h>
+#include <dynet/dict.h>
+#include <boost/algorithm/string.hpp>
+#include <algorithm>
+#include <fstream>
+
+using namespace std;
+using namespace lamtram;
+
+Shortlist::Shortlist(const MultipleIdMapping & lexicon, const vector<WordId> & frequent, int per_word) : frequent_(frequent) {
+  for(const auto & lex_val : lexicon) {
+    // Keep the most probable translations
+    vector<pair<WordId,float> > trans(lex_val.second);
+    stable_sort(trans.begin(), trans.end(), [](const pair<WordId,float> & a, const pair<WordId,float> & b) { return a.second > b.second; });
+    if(per_word > 0 && (int)trans.size() > per_word)
+      trans.resize(per_word);
+    vector<WordId> & my_trans = translations_[lex_val.first];
+    for(const auto & kv : trans)
+      my_trans.push_back(kv.first);
+  }
+}
+
+Shortlist* Shortlist::Read(const string & spec, const DictPtr & vocab_src, const DictPtr & vocab_trg) {
+  string lex_file, freq_file;
+  int top = 0, per_word = 0;
+  vector<string> strs;
+  boost::split(strs, spec, boost::is_any_of(":"));
+  for(const string & str : strs) {
+    if(str.substr(0,4) == "lex=") {
+      lex_file = str.substr(4);
+    } else if(str.substr(0,5) == "freq=") {
+      freq_file = str.substr(5);
+    } else if(str.substr(0,4) == "top=") {
+      top = stoi(str.substr(4));
+    } else if(str.substr(0,9) == "per_word=") {
+      per_word = stoi(str.substr(9));
+    } else {
+      THROW_ERROR("Illegal shortlist specification: " << spec);
+    }
+  }
+  if(lex_file == "")
+    THROW_ERROR("Shortlist must specify a lexicon with lex=: " << spec);
+  if(top > 0 && freq_file == "")
+    THROW_ERROR("Shortlist must specify a corpus with freq= when using the top words: " << spec);
+  MultipleIdMappingPtr lexicon(LoadMultipleIdMapping(lex_file, vocab_src, vocab_trg));
+  // The sentence end and unknown words are always candidates
+  vector<WordId> frequent(1, 0);
+  if(vocab_trg->contains("<unk>"))
+    frequent.push_back(vocab_trg->convert("<unk>"));
+  // Count the target words and add the most frequent
+  if(top > 0) {
+    ifstream freq_in(freq_file);
+    if(!freq_in)
+      THROW_ERROR("Could not find shortlist frequency file " << freq_file);
+    vector<int> counts(vocab_trg->size(), 0);
+    string line;
+    while(getline(freq_in, line))
+      for(WordId wid : ParseWords(*vocab_trg, line, false))
+        counts[wid]++;
+    vector<WordId> wids(counts.size());
+    for(size_t i = 0; i < wids.size(); i++) wids[i] = i;
+    stable_sort(wids.begin(), wids.end(), [&](WordId a, WordId b) { return counts[a] > counts[b]; });
+    for(int i = 0; i < top && i < (int)wids.size() && counts[wids[i]] > 0; i++)
+      frequent.push_back(wids[i]);
+  }
+  return new Shortlist(*lexicon, frequent, per_word);
+}
+
+vector<unsigned> Shortlist::GetCandidates(const Sentence & sent_src) const {
+  return GetCandidates(vector<Sentence>(1, sent_src));
+}
+
+vector<unsigned> Shortlist::GetCandidates(const vector<Sentence> & sent_srcs) const {
+  vector<unsigned> ret(frequent_.begin(), frequent_.end());
+  ret.push_back(0);
+  for(const Sentence & sent_src : sent_srcs) {
+    for(WordId wid : sent_src) {
+      auto it = translations_.find(wid);
+      if(it != translations_.end())
+        ret.insert(ret.end(), it->second.begin(), it->second.end());
+    }
+  }
+  sort(ret.begin(), ret.end());
+  ret.erase(unique(ret.begin(), ret.end()), ret.end());
+  return ret;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <lamtram/sentence.h>
+#include <lamtram/dict-utils.h>
+#include <lamtram/mapping.h>
+#include <unordered_map>
+#include <memory>
+#include <vector>
+
+namespace lamtram {
+
+// A shortlist of candidate target words for each input sentence, used to
+// restrict the output vocabulary during decoding. The candidates are the
+// lexical translations of each source word plus the most frequent target words.
+class Shortlist {
+
+public:
+    // Create a shortlist
+    //  lexicon: Translation probabilities for each source word
+    //  frequent: Target words that are always candidates
+    //  per_word: The number of most probable translations used per source word (0 for all)
+    Shortlist(const MultipleIdMapping & lexicon, const std::vector<WordId> & frequent, int per_word);
+    ~Shortlist() { }
+
+    // Read a shortlist specified as "lex=FILE:freq=FILE:top=N:per_word=K", where
+    // lex is a lexicon in "src trg prob" format, and the top N words are counted
+    // over the target corpus in freq. The sentence end and unknown word are always included.
+    static Shortlist* Read(const std::string & spec, const DictPtr & vocab_src, const DictPtr & vocab_trg);
+
+    // Get the sorted candidate words for one or more sentences
+    std::vector<unsigned> GetCandidates(const Sentence & sent_src) const;
+    std::vector<unsigned> GetCandidates(const std::vector<Sentence> & sent_srcs) const;
+
+protected:
+    // The translation candidates of each source word
+    std::unordered_map<WordId, std::vector<WordId> > translations_;
+    // Words that are always included
+    std::vector<WordId> frequent_;
+
+};
+
+typedef std::shared_ptr<Shortlist> ShortlistPtr;
+
+}
@@ -2,6 +2,7 @@
 
 #include <lamtram/sentence.h>
 #include <lamtram/dict-utils.h>
+#include <lamtram/macros.h>
 #include <dynet/expr.h>
 #include <memory>
 
@@ -49,6 +50,51 @@ public:
   virtual dynet::Expression CalcLogProbCache(dynet::Expression & in, dynet::Expression & prior, int cache_id,                       const Sentence & ctxt, bool train) { return CalcLogProb(in,prior,ctxt,train); }
   virtual dynet::Expression CalcLogProbCache(dynet::Expression & in, dynet::Expression & prior, const Sentence & cache_ids, const std::vector<Sentence> & ctxt, bool train) { return CalcLogProb(in,prior,ctxt,train); }
 
+  // Restrict the distributions calculated by CalcProb and CalcLogProb to the
+  // words in ids, in order, until the next call to NewGraph. This is used to
+  // speed up decoding, and an empty list uses the full vocabulary again.
+  virtual void SetShortlist(const std::vector<unsigned> & ids, dynet::ComputationGraph & cg) {
+    if(ids.size() != 0)
+      THROW_ERROR("Shortlists are not supported for softmax " << sig_);
+  }
+
+  // Build an index over the output layer to find the words with the highest
+  // scores without calculating all of them (see MipsIndex). This is done
+  // once after the parameters are loaded.
+  virtual void BuildMipsIndex(int num_clusters) {
+    THROW_ERROR("Approximate search is not supported for softmax " << sig_);
+  }
+  // Use the index in CalcProb and CalcLogProb until the next call to NewGraph.
+  // Each distribution is then only calculated for the words in the best probes
+  // clusters of any state in the batch, in the order of GetMipsIds, and the
+  // other words are left out. Zero probes use the full vocabulary.
+  virtual void SetMipsProbes(int probes) {
+    if(probes != 0)
+      THROW_ERROR("Approximate search is not supported for softmax " << sig_);
+  }
+  // The words of the last distribution calculated with the index, or an empty
+  // list if it covered the full vocabulary
+  virtual const std::vector<unsigned> & GetMipsIds() const {
+    THROW_ERROR("Approximate search is not supported for softmax " << sig_);
+  }
+
+  // Class-factored distributions can be searched without calculating the
+  // probabilities of all words. When enabled with SetClassSearch until the next
+  // call to NewGraph, CalcProb and CalcLogProb calculate the distribution over
+  // classes, and CalcClassLogProb the joint log probabilities of the words in
+  // a class (in the order of GetClassWords) for the same input.
+  virtual bool HasClasses() const { return false; }
+  virtual void SetClassSearch(bool class_search) {
+    if(class_search)
+      THROW_ERROR("Class search is not supported for softmax " << sig_);
+  }
+  virtual dynet::Expression CalcClassLogProb(int class_id) {
+    THROW_ERROR("Class search is not supported for softmax " << sig_);
+  }
+  virtual const std::vector<std::vector<unsigned> > & GetClassWords() const {
+    THROW_ERROR("Class search is not supported for softmax " << sig_);
+  }
+
   // Cache data for the entire training corpus if necessary
   //  data is the data, set_ids is which data set the sentences belong to
   virtual void Cache(const std::vector<Sentence> & sents, const std::vector<int> & set_ids, std::vector<Sentence> & cache_ids) { }
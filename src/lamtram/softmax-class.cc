@@ -3,19 +3,36 @@
 #include <lamtram/string-util.h>
 #include <dynet/cfsm-builder.h>
 #include <dynet/expr.h>
+#include <dynet/dict.h>
+#include <fstream>
+#include <sstream>
 
 using namespace lamtram;
 using namespace dynet;
 using namespace std;
 
-SoftmaxClass::SoftmaxClass(const std::string & sig, int input_size, const DictPtr & vocab, ParameterCollection & mod) : SoftmaxBase(sig,input_size,vocab,mod) {
+SoftmaxClass::SoftmaxClass(const std::string & sig, int input_size, const DictPtr & vocab, ParameterCollection & mod) : SoftmaxBase(sig,input_size,vocab,mod), class_search_(false) {
   vector<string> strs = Tokenize(sig, ":");
   if(strs.size() != 2 || strs[0] != "class") THROW_ERROR("Bad signature in SoftmaxClass: " << sig);
   cfsm_builder_.reset(new ClassFactoredSoftmaxBuilder(input_size, strs[1], *vocab, mod));
+  // Read the "class word" lines of the cluster file again, numbering classes
+  // in order of appearance like the builder does
+  ifstream in(strs[1]);
+  if(!in) THROW_ERROR("Could not open cluster file " << strs[1]);
+  dynet::Dict class_dict;
+  string line, class_str, word_str;
+  while(getline(in, line)) {
+    istringstream line_in(line);
+    if(!(line_in >> class_str >> word_str)) continue;
+    unsigned class_id = class_dict.convert(class_str);
+    if(class_id >= class_words_.size()) class_words_.resize(class_id + 1);
+    class_words_[class_id].push_back(vocab->convert(word_str));
+  }
 }
 
 void SoftmaxClass::NewGraph(ComputationGraph & cg) {
   cfsm_builder_->new_graph(cg);
+  class_search_ = false;
 }
 
 // Calculate training loss for one word
@@ -30,15 +47,40 @@ Expression SoftmaxClass::CalcLoss(Expression & in, Expression & prior, const std
 
 // Calculate the full probability distribution
 Expression SoftmaxClass::CalcProb(Expression & in, Expression & prior, const Sentence & ctxt, bool train) {
-  THROW_ERROR("SoftmaxClass::CalcProb Not implemented yet");
+  return exp(CalcFullLogProb(in));
 }
 Expression SoftmaxClass::CalcProb(Expression & in, Expression & prior, const vector<Sentence> & ctxt, bool train) {
-  THROW_ERROR("SoftmaxClass::CalcProb Not implemented yet");
+  return exp(CalcFullLogProb(in));
 }
 Expression SoftmaxClass::CalcLogProb(Expression & in, Expression & prior, const Sentence & ctxt, bool train) {
-  THROW_ERROR("SoftmaxClass::CalcLogProb Not implemented yet");
+  return CalcFullLogProb(in);
 }
 Expression SoftmaxClass::CalcLogProb(Expression & in, Expression & prior, const vector<Sentence> & ctxt, bool train) {
-  THROW_ERROR("SoftmaxClass::CalcLogProb Not implemented yet");
+  return CalcFullLogProb(in);
+}
+
+Expression SoftmaxClass::CalcFullLogProb(Expression & in) {
+  unsigned batch_size = in.dim().bd;
+  if(class_search_) {
+    if(batch_size != 1) THROW_ERROR("SoftmaxClass can only search by class one input at a time");
+    last_in_ = in;
+    last_class_ = cfsm_builder_->class_log_distribution(in);
+    return last_class_;
+  }
+  // The builder calculates distributions for single inputs
+  if(batch_size == 1) return cfsm_builder_->full_log_distribution(in);
+  vector<Expression> dists(batch_size);
+  for(unsigned b = 0; b < batch_size; b++)
+    dists[b] = cfsm_builder_->full_log_distribution(pick_batch_elem(in, b));
+  return concatenate_to_batch(dists);
+}
+
+Expression SoftmaxClass::CalcClassLogProb(int class_id) {
+  if(!class_search_ || last_in_.pg == nullptr)
+    THROW_ERROR("SoftmaxClass::CalcClassLogProb must follow CalcLogProb with class search enabled");
+  Expression class_log_prob = pick(last_class_, (unsigned)class_id);
+  // Words alone in their class have the probability of the class
+  if(class_words_[class_id].size() == 1) return class_log_prob;
+  return class_log_prob + cfsm_builder_->subclass_log_distribution(last_in_, class_id);
 }
 
@@ -33,9 +33,26 @@ public:
   virtual dynet::Expression CalcLogProb(dynet::Expression & in, dynet::Expression & prior, const Sentence & ctxt, bool train) override;
   virtual dynet::Expression CalcLogProb(dynet::Expression & in, dynet::Expression & prior, const std::vector<Sentence> & ctxt, bool train) override;
 
+  // Search the classes before their words
+  virtual bool HasClasses() const override { return true; }
+  virtual void SetClassSearch(bool class_search) override { class_search_ = class_search; }
+  virtual dynet::Expression CalcClassLogProb(int class_id) override;
+  virtual const std::vector<std::vector<unsigned> > & GetClassWords() const override { return class_words_; }
+
 protected:
+  // Calculate the log probabilities of all words, or of the classes when searching
+  dynet::Expression CalcFullLogProb(dynet::Expression & in);
+
   std::shared_ptr<dynet::ClassFactoredSoftmaxBuilder> cfsm_builder_;
 
+  // The words in each class, in the same order as the builder
+  std::vector<std::vector<unsigned> > class_words_;
+
+  // Whether to search by class, and the input and class distribution of the
+  // last call to CalcProb or CalcLogProb if so
+  bool class_search_;
+  dynet::Expression last_in_, last_class_;
+
 };
 
 }
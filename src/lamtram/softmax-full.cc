@@ -7,7 +7,7 @@ using namespace lamtram;
 using namespace dynet;
 using namespace std;
 
-SoftmaxFull::SoftmaxFull(const std::string & sig, int input_size, const DictPtr & vocab, ParameterCollection & mod) : SoftmaxBase(sig,input_size,vocab,mod) {
+SoftmaxFull::SoftmaxFull(const std::string & sig, int input_size, const DictPtr & vocab, ParameterCollection & mod) : SoftmaxBase(sig,input_size,vocab,mod), mips_probes_(0) {
   p_sm_W_ = mod.add_parameters({(unsigned int)vocab->size(), (unsigned int)input_size});
   p_sm_b_ = mod.add_parameters({(unsigned int)vocab->size()});  
 }
@@ -15,6 +15,9 @@ SoftmaxFull::SoftmaxFull(const std::string & sig, int input_size, const DictPtr
 void SoftmaxFull::NewGraph(ComputationGraph & cg) {
   i_sm_b_ = parameter(cg, p_sm_b_);
   i_sm_W_ = parameter(cg, p_sm_W_);
+  shortlist_.clear();
+  mips_probes_ = 0;
+  mips_ids_.clear();
 }
 
 // Calculate training loss for one word
@@ -35,23 +38,83 @@ Expression SoftmaxFull::CalcLoss(Expression & in, Expression & prior, const std:
 
 // Calculate the full probability distribution
 Expression SoftmaxFull::CalcProb(Expression & in, Expression & prior, const Sentence & ctxt, bool train) {
-  return (prior.pg != nullptr ? 
-          softmax(affine_transform({i_sm_b_, i_sm_W_, in}) + prior) :
-          softmax(affine_transform({i_sm_b_, i_sm_W_, in})));
+  if(UseMips(prior)) return exp(CalcMipsLogProb(in));
+  return softmax(CalcScore(in, prior));
 }
 Expression SoftmaxFull::CalcProb(Expression & in, Expression & prior, const vector<Sentence> & ctxt, bool train) {
-  return (prior.pg != nullptr ? 
-          softmax(affine_transform({i_sm_b_, i_sm_W_, in}) + prior) :
-          softmax(affine_transform({i_sm_b_, i_sm_W_, in})));
+  if(UseMips(prior)) return exp(CalcMipsLogProb(in));
+  return softmax(CalcScore(in, prior));
 }
 Expression SoftmaxFull::CalcLogProb(Expression & in, Expression & prior, const Sentence & ctxt, bool train) {
-  return (prior.pg != nullptr ? 
-          log_softmax(affine_transform({i_sm_b_, i_sm_W_, in}) + prior) :
-          log_softmax(affine_transform({i_sm_b_, i_sm_W_, in})));
+  if(UseMips(prior)) return CalcMipsLogProb(in);
+  return log_softmax(CalcScore(in, prior));
 }
 Expression SoftmaxFull::CalcLogProb(Expression & in, Expression & prior, const vector<Sentence> & ctxt, bool train) {
-  return (prior.pg != nullptr ? 
-          log_softmax(affine_transform({i_sm_b_, i_sm_W_, in}) + prior) :
-          log_softmax(affine_transform({i_sm_b_, i_sm_W_, in})));
+  if(UseMips(prior)) return CalcMipsLogProb(in);
+  return log_softmax(CalcScore(in, prior));
 }
 
+Expression SoftmaxFull::CalcScore(Expression & in, Expression & prior) {
+  mips_ids_.clear();
+  if(shortlist_.size() == 0)
+    return (prior.pg != nullptr ?
+            affine_transform({i_sm_b_, i_sm_W_, in}) + prior :
+            affine_transform({i_sm_b_, i_sm_W_, in}));
+  // Only calculate the rows of the weight matrix for the shortlisted words
+  return (prior.pg != nullptr ?
+          affine_transform({i_sl_b_, i_sl_W_, in}) + select_rows(prior, shortlist_) :
+          affine_transform({i_sl_b_, i_sl_W_, in}));
+}
+
+Expression SoftmaxFull::CalcMipsLogProb(Expression & in) {
+  // The states are needed to search the index, so the graph is evaluated up
+  // to them here, but not the output layer
+  const Tensor & in_tensor = in.value();
+  unsigned dim = in_tensor.d.batch_size(), batch_size = in_tensor.d.bd;
+  vector<float> in_vals = as_vector(in_tensor);
+  // Score the words of the clusters found for any of the states, so that all
+  // distributions in the batch are over the same words
+  vector<bool> searched(mips_->GetNumClusters(), false);
+  vector<int> clusters;
+  for(unsigned b = 0; b < batch_size; b++) {
+    mips_->SearchClusters(&in_vals[b * dim], mips_probes_, clusters);
+    for(int k : clusters) searched[k] = true;
+  }
+  mips_ids_.clear();
+  for(int k = 0; k < (int)searched.size(); k++)
+    if(searched[k]) mips_->AddRows(k, mips_ids_);
+  Expression i_score = affine_transform({select_rows(i_sm_b_, mips_ids_), select_rows(i_sm_W_, mips_ids_), in});
+  if((int)mips_ids_.size() == mips_->GetNumRows())
+    return log_softmax(i_score);
+  // The other words only add their estimated mass to the normalizer
+  vector<float> rest(batch_size);
+  for(unsigned b = 0; b < batch_size; b++)
+    rest[b] = mips_->EstimateLogMass(&in_vals[b * dim], searched);
+  Expression i_rest = input(*in.pg, Dim({1}, batch_size), rest);
+  return pick_range(log_softmax(concatenate({i_score, i_rest})), 0, mips_ids_.size());
+}
+
+void SoftmaxFull::BuildMipsIndex(int num_clusters) {
+  // Parameters are stored by column, but the index needs each word's row
+  unsigned vocab_size = vocab_->size(), dim = input_size_;
+  vector<float> weights = as_vector(p_sm_W_.get_storage().values), bias = as_vector(p_sm_b_.get_storage().values);
+  vector<float> rows(vocab_size * dim);
+  for(unsigned i = 0; i < vocab_size; i++)
+    for(unsigned j = 0; j < dim; j++)
+      rows[i * dim + j] = weights[j * vocab_size + i];
+  mips_.reset(new MipsIndex(rows.data(), bias.data(), vocab_size, dim, num_clusters));
+}
+
+void SoftmaxFull::SetMipsProbes(int probes) {
+  if(probes > 0 && mips_.get() == nullptr)
+    THROW_ERROR("The index must be built before it can be searched");
+  mips_probes_ = probes;
+}
+
+void SoftmaxFull::SetShortlist(const vector<unsigned> & ids, ComputationGraph & cg) {
+  shortlist_ = ids;
+  if(shortlist_.size() != 0) {
+    i_sl_W_ = select_rows(i_sm_W_, shortlist_);
+    i_sl_b_ = select_rows(i_sm_b_, shortlist_);
+  }
+}
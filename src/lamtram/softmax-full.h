@@ -2,6 +2,7 @@
 
 #include <dynet/expr.h>
 #include <lamtram/softmax-base.h>
+#include <lamtram/mips-index.h>
 
 namespace dynet { struct Parameter; }
 
@@ -11,6 +12,7 @@ namespace lamtram {
 // (potentially batched) and calculates a probability distribution
 // over words
 class SoftmaxFull : public SoftmaxBase {
+    friend class InferenceEngine;
 
 public:
   SoftmaxFull(const std::string & sig, int input_size, const DictPtr & vocab, dynet::ParameterCollection & mod);
@@ -30,13 +32,40 @@ public:
   virtual dynet::Expression CalcLogProb(dynet::Expression & in, dynet::Expression & prior, const Sentence & ctxt, bool train) override;
   virtual dynet::Expression CalcLogProb(dynet::Expression & in, dynet::Expression & prior, const std::vector<Sentence> & ctxt, bool train) override;
 
+  // Restrict the output to a shortlist
+  virtual void SetShortlist(const std::vector<unsigned> & ids, dynet::ComputationGraph & cg) override;
+
+  // Search the output layer with an index
+  virtual void BuildMipsIndex(int num_clusters) override;
+  virtual void SetMipsProbes(int probes) override;
+  virtual const std::vector<unsigned> & GetMipsIds() const override { return mips_ids_; }
+
 protected:
+  // Calculate the scores of all words, or only the shortlist if it exists
+  dynet::Expression CalcScore(dynet::Expression & in, dynet::Expression & prior);
+  // Whether to use the index, which is only done without shortlists or priors
+  bool UseMips(const dynet::Expression & prior) const { return mips_probes_ > 0 && shortlist_.size() == 0 && prior.pg == nullptr; }
+  // Calculate the log probabilities of the words found for the batch of
+  // states in using the index
+  dynet::Expression CalcMipsLogProb(dynet::Expression & in);
+
   dynet::Parameter p_sm_W_; // Softmax weights
   dynet::Parameter p_sm_b_; // Softmax bias
 
   dynet::Expression i_sm_W_;
   dynet::Expression i_sm_b_;
 
+  // The shortlist, and the weights for its words
+  std::vector<unsigned> shortlist_;
+  dynet::Expression i_sl_W_;
+  dynet::Expression i_sl_b_;
+
+  // The index over the output layer, the number of clusters to search, and
+  // the words found for the last batch
+  std::shared_ptr<MipsIndex> mips_;
+  int mips_probes_;
+  std::vector<unsigned> mips_ids_;
+
 };
 
 }
@@ -33,6 +33,20 @@ public:
   virtual dynet::Expression CalcLogProb(dynet::Expression & in, dynet::Expression & prior, const Sentence & ctxt, bool train) override;
   virtual dynet::Expression CalcLogProb(dynet::Expression & in, dynet::Expression & prior, const std::vector<Sentence> & ctxt, bool train) override;
 
+  // Restrict the output of the final softmax to a shortlist
+  virtual void SetShortlist(const std::vector<unsigned> & ids, dynet::ComputationGraph & cg) override {
+    softmax_->SetShortlist(ids, cg);
+  }
+  // Search the final softmax with an index
+  virtual void BuildMipsIndex(int num_clusters) override { softmax_->BuildMipsIndex(num_clusters); }
+  virtual void SetMipsProbes(int probes) override { softmax_->SetMipsProbes(probes); }
+  virtual const std::vector<unsigned> & GetMipsIds() const override { return softmax_->GetMipsIds(); }
+  // Search the final softmax by class
+  virtual bool HasClasses() const override { return softmax_->HasClasses(); }
+  virtual void SetClassSearch(bool class_search) override { softmax_->SetClassSearch(class_search); }
+  virtual dynet::Expression CalcClassLogProb(int class_id) override { return softmax_->CalcClassLogProb(class_id); }
+  virtual const std::vector<std::vector<unsigned> > & GetClassWords() const override { return softmax_->GetClassWords(); }
+
 protected:
   dynet::Parameter p_sm_W_; // Softmax weights
   dynet::Parameter p_sm_b_; // Softmax bias
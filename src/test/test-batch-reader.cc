@@ -0,0 +1,74 @@
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include <lamtram/batch-reader.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+using namespace std;
+using namespace lamtram;
+
+// ****** The tests *******
+BOOST_AUTO_TEST_SUITE(batch_reader)
+
+// Batches should be split when they would exceed the maximum number of words
+BOOST_AUTO_TEST_CASE(TestMaxWords) {
+  int fds[2];
+  BOOST_REQUIRE_EQUAL(pipe(fds), 0);
+  string input = "a b c\nd e\nf g h i\nj\n\nk l";
+  BOOST_REQUIRE_EQUAL(write(fds[1], input.data(), input.size()), (ssize_t)input.size());
+  close(fds[1]);
+  BatchReader reader(fds[0], 5, 1000);
+  vector<string> lines;
+  BOOST_REQUIRE(reader.ReadBatch(lines));
+  vector<string> exp_lines1 = {"a b c", "d e"};
+  BOOST_CHECK_EQUAL_COLLECTIONS(exp_lines1.begin(), exp_lines1.end(), lines.begin(), lines.end());
+  BOOST_REQUIRE(reader.ReadBatch(lines));
+  vector<string> exp_lines2 = {"f g h i", "j"};
+  BOOST_CHECK_EQUAL_COLLECTIONS(exp_lines2.begin(), exp_lines2.end(), lines.begin(), lines.end());
+  BOOST_REQUIRE(reader.ReadBatch(lines));
+  vector<string> exp_lines3 = {"", "k l"};
+  BOOST_CHECK_EQUAL_COLLECTIONS(exp_lines3.begin(), exp_lines3.end(), lines.begin(), lines.end());
+  BOOST_CHECK(!reader.ReadBatch(lines));
+  close(fds[0]);
+}
+
+// An incomplete batch should be returned once the maximum wait has passed
+BOOST_AUTO_TEST_CASE(TestMaxWait) {
+  int fds[2];
+  BOOST_REQUIRE_EQUAL(pipe(fds), 0);
+  string input = "a b\nc d\n";
+  BOOST_REQUIRE_EQUAL(write(fds[1], input.data(), input.size()), (ssize_t)input.size());
+  BatchReader reader(fds[0], 100, 50);
+  vector<string> lines;
+  auto start = chrono::steady_clock::now();
+  BOOST_REQUIRE(reader.ReadBatch(lines));
+  auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+  BOOST_CHECK_EQUAL(lines.size(), 2);
+  BOOST_CHECK_GE(elapsed, 40);
+  close(fds[1]);
+  BOOST_CHECK(!reader.ReadBatch(lines));
+  close(fds[0]);
+}
+
+// Single lines should be returned without waiting when they are available
+BOOST_AUTO_TEST_CASE(TestReadLine) {
+  int fds[2];
+  BOOST_REQUIRE_EQUAL(pipe(fds), 0);
+  string input = "a b\nc";
+  BOOST_REQUIRE_EQUAL(write(fds[1], input.data(), input.size()), (ssize_t)input.size());
+  BatchReader reader(fds[0], 100, 50);
+  string line;
+  BOOST_REQUIRE(reader.ReadLine(line, 0));
+  BOOST_CHECK_EQUAL(line, "a b");
+  BOOST_CHECK(!reader.ReadLine(line, 0));
+  close(fds[1]);
+  BOOST_REQUIRE(reader.ReadLine(line, -1));
+  BOOST_CHECK_EQUAL(line, "c");
+  BOOST_CHECK(!reader.ReadLine(line, -1));
+  close(fds[0]);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
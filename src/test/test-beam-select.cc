@@ -0,0 +1,152 @@
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include <lamtram/macros.h>
+#include <lamtram/beam-select.h>
+#include <tuple>
+#include <random>
+#include <cfloat>
+#include <cmath>
+#include <limits>
+
+using namespace std;
+using namespace lamtram;
+
+// ****** The fixture *******
+struct TestBeamSelect {
+
+  TestBeamSelect() { }
+  ~TestBeamSelect() { }
+
+  // The insertion sort previously used by EnsembleDecoder, as a reference
+  vector<tuple<float,int,int,int> > InsertionBest(const vector<vector<float> > & log_probs, const vector<float> & hyp_scores, int beam_size, float word_pen, int unk_id, float unk_score) {
+    vector<tuple<float,int,int,int> > next_beam_id(beam_size+1, tuple<float,int,int,int>(-DBL_MAX,-1,-1,-1));
+    for(int hypid = 0; hypid < (int)log_probs.size(); hypid++) {
+      vector<float> softmax = log_probs[hypid];
+      for(size_t i = 1; i < softmax.size(); i++)
+        softmax[i] += word_pen;
+      if(unk_id >= 0) softmax[unk_id] += unk_score;
+      for(int wid = 0; wid < (int)softmax.size(); wid++) {
+        float my_score = hyp_scores[hypid] + softmax[wid];
+        int bid;
+        for(bid = beam_size; bid > 0 && my_score > std::get<0>(next_beam_id[bid-1]); bid--)
+          next_beam_id[bid] = next_beam_id[bid-1];
+        next_beam_id[bid] = tuple<float,int,int,int>(my_score,hypid,wid,hypid*10);
+      }
+    }
+    next_beam_id.resize(beam_size);
+    while(next_beam_id.size() && std::get<1>(*next_beam_id.rbegin()) == -1)
+      next_beam_id.pop_back();
+    return next_beam_id;
+  }
+
+  void TestSelection(int vocab_size, int num_hyps, int beam_size, float word_pen, int unk_id, float unk_score, bool ties) {
+    mt19937 rng(vocab_size * 31 + beam_size);
+    uniform_real_distribution<float> dist(-10.f, 0.f);
+    vector<vector<float> > log_probs(num_hyps, vector<float>(vocab_size));
+    vector<float> hyp_scores(num_hyps);
+    for(int i = 0; i < num_hyps; i++) {
+      hyp_scores[i] = (ties ? 0.f : dist(rng));
+      for(auto & val : log_probs[i])
+        val = (ties ? floor(dist(rng)) : dist(rng));
+    }
+    auto exp = InsertionBest(log_probs, hyp_scores, beam_size, word_pen, unk_id, unk_score);
+    BeamSelector selector(beam_size);
+    for(int i = 0; i < num_hyps; i++)
+      selector.AddHypothesis(&log_probs[i][0], vocab_size, hyp_scores[i], word_pen, unk_id, unk_score, i, i*10);
+    vector<BeamCandidate> act = selector.GetBest();
+    BOOST_REQUIRE_EQUAL(exp.size(), act.size());
+    for(size_t i = 0; i < exp.size(); i++) {
+      BOOST_CHECK_EQUAL(std::get<0>(exp[i]), act[i].score_);
+      BOOST_CHECK_EQUAL(std::get<1>(exp[i]), act[i].hyp_id_);
+      BOOST_CHECK_EQUAL(std::get<2>(exp[i]), act[i].word_id_);
+      BOOST_CHECK_EQUAL(std::get<3>(exp[i]), act[i].align_);
+    }
+  }
+
+};
+
+// ****** The tests *******
+BOOST_FIXTURE_TEST_SUITE(beam_select, TestBeamSelect)
+
+BOOST_AUTO_TEST_CASE(TestSelectGreedy)      { TestSelection(1000, 1, 1, 0.f, 1, 0.f, false); }
+BOOST_AUTO_TEST_CASE(TestSelectBeam)        { TestSelection(1003, 5, 5, 0.f, 1, 0.f, false); }
+BOOST_AUTO_TEST_CASE(TestSelectPenalties)   { TestSelection(517, 8, 12, 0.5f, 1, -3.f, false); }
+BOOST_AUTO_TEST_CASE(TestSelectNegativePen) { TestSelection(517, 8, 12, -2.f, 1, 5.f, false); }
+BOOST_AUTO_TEST_CASE(TestSelectTies)        { TestSelection(301, 4, 7, 0.f, 1, 0.f, true); }
+BOOST_AUTO_TEST_CASE(TestSelectTiesPen)     { TestSelection(301, 4, 7, 1.f, 3, -1.f, true); }
+BOOST_AUTO_TEST_CASE(TestSelectSmallVocab)  { TestSelection(3, 2, 10, 0.f, -1, 0.f, false); }
+
+// Words with zero probability should never enter the beam
+BOOST_AUTO_TEST_CASE(TestSelectZeroProb) {
+  vector<float> log_probs(20, -INFINITY);
+  log_probs[7] = -1.f;
+  BeamSelector selector(5);
+  selector.AddHypothesis(&log_probs[0], log_probs.size(), 0.f, 0.f, 1, 0.f, 0, -1);
+  vector<BeamCandidate> act = selector.GetBest();
+  BOOST_REQUIRE_EQUAL(act.size(), 1);
+  BOOST_CHECK_EQUAL(act[0].word_id_, 7);
+}
+
+// Adding the words in groups, as when searching by class, should give the same beam
+BOOST_AUTO_TEST_CASE(TestSelectWords) {
+  mt19937 rng(5);
+  uniform_real_distribution<float> dist(-10.f, 0.f);
+  int vocab_size = 301, num_hyps = 4, beam_size = 7, num_groups = 9;
+  vector<int> groups(vocab_size);
+  for(int wid = 0; wid < vocab_size; wid++) groups[wid] = rng() % num_groups;
+  BeamSelector exp_selector(beam_size), act_selector(beam_size);
+  for(int i = 0; i < num_hyps; i++) {
+    vector<float> log_probs(vocab_size);
+    for(auto & val : log_probs) val = floor(dist(rng));
+    exp_selector.AddHypothesis(&log_probs[0], vocab_size, -1.f, 0.5f, 3, -1.f, i, i*10);
+    for(int g = num_groups - 1; g >= 0; g--) {
+      vector<float> group_probs;
+      vector<unsigned> group_ids;
+      for(int wid = 0; wid < vocab_size; wid++) {
+        if(groups[wid] != g) continue;
+        group_probs.push_back(log_probs[wid]);
+        group_ids.push_back(wid);
+      }
+      act_selector.AddWords(group_probs.data(), group_ids.data(), group_ids.size(), -1.f, 0.5f, 3, -1.f, i, i*10);
+    }
+  }
+  vector<BeamCandidate> exp = exp_selector.GetBest(), act = act_selector.GetBest();
+  BOOST_REQUIRE_EQUAL(exp.size(), act.size());
+  for(size_t i = 0; i < exp.size(); i++) {
+    BOOST_CHECK_EQUAL(exp[i].score_, act[i].score_);
+    BOOST_CHECK_EQUAL(exp[i].hyp_id_, act[i].hyp_id_);
+    BOOST_CHECK_EQUAL(exp[i].word_id_, act[i].word_id_);
+  }
+}
+
+// Candidates far below the best should be pruned by either threshold
+BOOST_AUTO_TEST_CASE(TestPruneCandidates) {
+  vector<BeamCandidate> cands;
+  for(float score : {-1.f, -1.5f, -2.f, -4.f})
+    cands.push_back(BeamCandidate(score, 0, cands.size(), -1, cands.size()));
+  vector<BeamCandidate> act = cands;
+  PruneCandidates(act, 0.f, 0.f);
+  BOOST_CHECK_EQUAL(act.size(), 4);
+  act = cands;
+  PruneCandidates(act, exp(-0.75f), 0.f);
+  BOOST_CHECK_EQUAL(act.size(), 2);
+  act = cands;
+  PruneCandidates(act, 0.f, 2.5f);
+  BOOST_CHECK_EQUAL(act.size(), 3);
+  act = cands;
+  PruneCandidates(act, exp(-2.5f), 0.5f);
+  BOOST_CHECK_EQUAL(act.size(), 2);
+}
+
+// The beam should only be wide when the distribution is flat
+BOOST_AUTO_TEST_CASE(TestAdaptiveBeamSize) {
+  vector<float> peaked = {log(0.98f), log(0.01f), log(0.01f), -FLT_MAX, -numeric_limits<float>::infinity()};
+  vector<float> flat(16, log(1.f/16));
+  BOOST_CHECK_EQUAL(AdaptiveBeamSize(CalcEntropy(&peaked[0], peaked.size()), 8), 1);
+  BOOST_CHECK_CLOSE(CalcEntropy(&flat[0], flat.size()), log(16.f), 0.01);
+  BOOST_CHECK_EQUAL(AdaptiveBeamSize(CalcEntropy(&flat[0], flat.size()), 8), 8);
+  BOOST_CHECK_EQUAL(AdaptiveBeamSize(CalcEntropy(&flat[0], flat.size()), 32), 16);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
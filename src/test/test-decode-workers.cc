@@ -0,0 +1,128 @@
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include <lamtram/macros.h>
+#include <lamtram/decode-workers.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+using namespace std;
+using namespace lamtram;
+
+// ****** The tests *******
+BOOST_AUTO_TEST_SUITE(decode_workers)
+
+// Results should be received in order no matter how many workers there are
+BOOST_AUTO_TEST_CASE(TestResultOrder) {
+  for(int num_workers : {1, 3, 8}) {
+    DecodeWorkers workers(num_workers);
+    vector<int> ids;
+    vector<string> exp_strs, act_strs;
+    workers.Run(20, [](int i) {
+      return vector<string>({to_string(i * i), string(i * 1000, 'a' + i % 26)});
+    }, [&](int i, const vector<string> & result) {
+      ids.push_back(i);
+      BOOST_REQUIRE_EQUAL(result.size(), 2);
+      act_strs.push_back(result[0]);
+      BOOST_CHECK_EQUAL(result[1], string(i * 1000, 'a' + i % 26));
+    });
+    for(int i = 0; i < 20; i++) {
+      BOOST_CHECK_EQUAL(ids[i], i);
+      exp_strs.push_back(to_string(i * i));
+    }
+    BOOST_CHECK_EQUAL_COLLECTIONS(exp_strs.begin(), exp_strs.end(), act_strs.begin(), act_strs.end());
+  }
+}
+
+// Failures in a worker should be reported in the calling process
+BOOST_AUTO_TEST_CASE(TestWorkerFailure) {
+  DecodeWorkers workers(2);
+  BOOST_CHECK_THROW(workers.Run(5, [](int i) {
+    if(i == 3) THROW_ERROR("Failed on purpose");
+    return vector<string>(1, to_string(i));
+  }, [](int i, const vector<string> & result) { }), std::runtime_error);
+}
+
+// Streamed jobs should be passed on in the order they were read, whether they
+// go to the least busy worker or to the workers in turn, and even when later
+// jobs finish first
+BOOST_AUTO_TEST_CASE(TestStreamOrder) {
+  for(int num_workers : {1, 3}) {
+    for(bool round_robin : {false, true}) {
+      DecodeWorkers workers(num_workers);
+      int next_job = 0;
+      vector<int> ids;
+      vector<string> exp_strs, act_strs;
+      workers.RunStream([&](string & job) {
+        if(next_job == 20) return false;
+        job = string(next_job * 1000 % 7000, 'a' + next_job % 26);
+        next_job++;
+        return true;
+      }, [](const string & job) {
+        if(job.size() == 0) usleep(20000);
+        return vector<string>({to_string(job.size()), job});
+      }, [&](int i, const vector<string> & result) {
+        ids.push_back(i);
+        BOOST_REQUIRE_EQUAL(result.size(), 2);
+        act_strs.push_back(result[0]);
+        BOOST_CHECK_EQUAL(result[1], string(i * 1000 % 7000, 'a' + i % 26));
+      }, round_robin);
+      BOOST_REQUIRE_EQUAL(ids.size(), 20);
+      for(int i = 0; i < 20; i++) {
+        BOOST_CHECK_EQUAL(ids[i], i);
+        exp_strs.push_back(to_string(i * 1000 % 7000));
+      }
+      BOOST_CHECK_EQUAL_COLLECTIONS(exp_strs.begin(), exp_strs.end(), act_strs.begin(), act_strs.end());
+    }
+  }
+}
+
+// Failures in a streaming worker should be reported in the calling process
+BOOST_AUTO_TEST_CASE(TestStreamWorkerFailure) {
+  DecodeWorkers workers(2);
+  int next_job = 0;
+  BOOST_CHECK_THROW(workers.RunStream([&](string & job) {
+    job = to_string(next_job++);
+    return next_job <= 5;
+  }, [](const string & job) {
+    if(job == "3") THROW_ERROR("Failed on purpose");
+    return vector<string>(1, job);
+  }, [](int i, const vector<string> & result) { }), std::runtime_error);
+}
+
+// A worker that dies while jobs are still being sent to it should be reported
+// as an error, rather than the calling process being killed by SIGPIPE
+BOOST_AUTO_TEST_CASE(TestStreamWorkerExit) {
+  DecodeWorkers workers(2);
+  int next_job = 0;
+  BOOST_CHECK_THROW(workers.RunStream([&](string & job) {
+    job = string(100000, 'a' + next_job % 26);
+    return ++next_job <= 50;
+  }, [](const string & job) {
+    if(job[0] == 'b') _exit(0);
+    return vector<string>(1, job.substr(0, 1));
+  }, [](int i, const vector<string> & result) { }, true), std::runtime_error);
+}
+
+// Data broadcast to a group should be processed by every process and gathered in order
+BOOST_AUTO_TEST_CASE(TestProcessGroup) {
+  ProcessGroup group(3, [](ProcessGroup & group) {
+    string data;
+    vector<string> all;
+    while(group.Broadcast(data))
+      group.Gather(data + to_string(group.GetProc()), all);
+  });
+  BOOST_CHECK_EQUAL(group.GetNumProcs(), 3);
+  BOOST_CHECK_EQUAL(group.GetProc(), 0);
+  for(string data : {"a", "", "bcd"}) {
+    group.Broadcast(data);
+    vector<string> all;
+    group.Gather(data + "0", all);
+    vector<string> exp_all = {data + "0", data + "1", data + "2"};
+    BOOST_CHECK_EQUAL_COLLECTIONS(exp_all.begin(), exp_all.end(), all.begin(), all.end());
+  }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
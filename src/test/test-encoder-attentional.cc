@@ -2,6 +2,8 @@
 #include <boost/test/unit_test.hpp>
 
 #include <fstream>
+#include <algorithm>
+#include <unistd.h>
 
 #include <dynet/dict.h>
 #include <dynet/training.h>
@@ -10,11 +12,20 @@
 #include <lamtram/encoder-decoder.h>
 #include <lamtram/encoder-attentional.h>
 #include <lamtram/ensemble-decoder.h>
+#include <lamtram/inference-engine.h>
 #include <lamtram/model-utils.h>
 
 using namespace std;
 using namespace lamtram;
 
+// The resident memory of the process in bytes
+static size_t GetResidentMemory() {
+  ifstream in("/proc/self/statm");
+  size_t total = 0, resident = 0;
+  in >> total >> resident;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
 // ****** The fixture *******
 struct TestEncoderAttentional {
 
@@ -38,7 +49,8 @@ struct TestEncoderAttentional {
         const std::string & attention_type = "mlp:2",
         bool attention_feed = false,
         const std::string & attention_hist = "none",
-        const std::string & lex_type = "none"
+        const std::string & lex_type = "none",
+        const std::string & layer_type = "lstm"
   ) {
     // Create a dummy lexicon file if necessary
     string my_lex_type = lex_type;
@@ -50,8 +62,8 @@ struct TestEncoderAttentional {
     }
     // Create the model
     mod = shared_ptr<dynet::ParameterCollection>(new dynet::ParameterCollection);
-    NeuralLMPtr lmptr(new NeuralLM(vocab_trg_, 1, (attention_feed ? 5 : 0), attention_feed, 5, BuilderSpec("lstm:5:1"), -1, "full", *mod));
-    vector<LinearEncoderPtr> encs(1, LinearEncoderPtr(new LinearEncoder(vocab_src_->size(), 5, BuilderSpec("lstm:5:1"), -1, *mod)));
+    NeuralLMPtr lmptr(new NeuralLM(vocab_trg_, 1, (attention_feed ? 5 : 0), attention_feed, 5, BuilderSpec(layer_type + ":5:1"), -1, "full", *mod));
+    vector<LinearEncoderPtr> encs(1, LinearEncoderPtr(new LinearEncoder(vocab_src_->size(), 5, BuilderSpec(layer_type + ":5:1"), -1, *mod)));
     ExternAttentionalPtr ext(new ExternAttentional(encs, attention_type, attention_hist, 5, my_lex_type, vocab_src_, vocab_trg_, *mod));
     encatt = shared_ptr<EncoderAttentional>(new EncoderAttentional(ext, lmptr, *mod));
     // Create the ensemble decoder
@@ -123,6 +135,35 @@ struct TestEncoderAttentional {
     BOOST_CHECK_CLOSE(train_ll, decode_ll, 0.01);
   }
 
+  void TestFastInference(const std::string & attention_type, bool attention_feed, const std::string & attention_hist, const std::string & layer_type = "lstm", bool precompute_inputs = false) {
+    shared_ptr<dynet::ParameterCollection> mod;
+    EncoderAttentionalPtr encatt;
+    shared_ptr<EnsembleDecoder> ensdec;
+    CreateModel(mod, encatt, ensdec, attention_type, attention_feed, attention_hist, "none", layer_type);
+    // The engine should give the same word log probabilities as the graphs
+    LLStats test_stat(vocab_trg_->size());
+    vector<float> exp_wordll, act_wordll;
+    ensdec->CalcSentLL(sent_src_, sent_trg_, test_stat, exp_wordll);
+    InferenceEngine engine(*encatt, false, PRECISION_FP32, precompute_inputs);
+    BOOST_CHECK_EQUAL(engine.HasPrecomputedInputs(), precompute_inputs);
+    float act_ll = engine.CalcSentLL(sent_src_, sent_trg_, act_wordll);
+    BOOST_REQUIRE_EQUAL(exp_wordll.size(), act_wordll.size());
+    for(size_t i = 0; i < exp_wordll.size(); i++)
+      BOOST_CHECK_CLOSE(exp_wordll[i], act_wordll[i], 0.01);
+    BOOST_CHECK_CLOSE(-test_stat.loss_, act_ll, 0.01);
+    // And find the same hypotheses
+    ensdec->SetBeamSize(3);
+    vector<EnsembleDecoderHypPtr> exp_nbest = ensdec->GenerateNbest(sent_src_, 3);
+    BOOST_REQUIRE(ensdec->SetFastInference(true, false, PRECISION_FP32, precompute_inputs));
+    vector<EnsembleDecoderHypPtr> act_nbest = ensdec->GenerateNbest(sent_src_, 3);
+    BOOST_REQUIRE_EQUAL(exp_nbest.size(), act_nbest.size());
+    for(size_t i = 0; i < exp_nbest.size(); i++) {
+      BOOST_CHECK_CLOSE(exp_nbest[i]->GetScore(), act_nbest[i]->GetScore(), 0.01);
+      BOOST_CHECK(exp_nbest[i]->GetSentence() == act_nbest[i]->GetSentence());
+      BOOST_CHECK(exp_nbest[i]->GetAlignment() == act_nbest[i]->GetAlignment());
+    }
+  }
+
   Sentence sent_src_, sent_trg_, sent_src2_, sent_trg2_, cache_;
   DictPtr vocab_src_, vocab_trg_;
 };
@@ -213,6 +254,314 @@ BOOST_AUTO_TEST_CASE(TestDecodingMLPFalseNone)      { TestDecoding("mlp:5", fals
 BOOST_AUTO_TEST_CASE(TestDecodingMLPTrueSum)        { TestDecoding("mlp:5", true,  "sum" , "none"); }
 BOOST_AUTO_TEST_CASE(TestDecodingBilinFalseNone)    { TestDecoding("bilin", false, "none", "none"); }
 
+// Test whether the inference engine agrees with the computation graphs
+BOOST_AUTO_TEST_CASE(TestFastInferenceMLPFalseNone)  { TestFastInference("mlp:5", false, "none"); }
+BOOST_AUTO_TEST_CASE(TestFastInferenceDotTrueNone)   { TestFastInference("dot",   true,  "none"); }
+BOOST_AUTO_TEST_CASE(TestFastInferenceMLPTrueSum)    { TestFastInference("mlp:5", true,  "sum"); }
+BOOST_AUTO_TEST_CASE(TestFastInferenceBilinTrueNone) { TestFastInference("bilin", true,  "none"); }
+BOOST_AUTO_TEST_CASE(TestFastInferenceFastLSTM)      { TestFastInference("mlp:5", true,  "sum", "fastlstm"); }
+BOOST_AUTO_TEST_CASE(TestFastInferencePrecomputedMLP) { TestFastInference("mlp:5", true,  "sum", "lstm", true); }
+BOOST_AUTO_TEST_CASE(TestFastInferencePrecomputedDot) { TestFastInference("dot", false, "none", "lstm", true); }
+
+// Copies of matrices should hold the same values in every format, even when
+// their buffers are aligned differently
+BOOST_AUTO_TEST_CASE(TestInferenceMatrixCopy) {
+  for(int format = 0; format < 3; format++) {
+    InferenceMatrix mat;
+    mat.Resize(37, 5);
+    for(int j = 0; j < mat.GetCols(); j++)
+      for(int i = 0; i < mat.GetRows(); i++)
+        mat.Col(j)[i] = (i - 18) * 0.01f + j;
+    if(format == 1) mat.Quantize();
+    if(format == 2) mat.SetPrecision(PRECISION_BF16);
+    vector<InferenceMatrix> copies;
+    for(int k = 0; k < 8; k++)
+      copies.push_back(k == 0 ? mat : copies[k-1]);
+    vector<float> exp_col(mat.GetRows()), act_col(mat.GetRows());
+    for(auto & copy : copies) {
+      BOOST_REQUIRE_EQUAL(copy.GetCols(), mat.GetCols());
+      for(int j = 0; j < mat.GetCols(); j++) {
+        mat.GetCol(j, exp_col.data());
+        copy.GetCol(j, act_col.data());
+        BOOST_CHECK_EQUAL_COLLECTIONS(exp_col.begin(), exp_col.end(), act_col.begin(), act_col.end());
+      }
+    }
+  }
+}
+
+// Quantizing the weights should change the scores only slightly
+BOOST_AUTO_TEST_CASE(TestFastInferenceQuantized) {
+  shared_ptr<dynet::ParameterCollection> mod;
+  EncoderAttentionalPtr encatt;
+  shared_ptr<EnsembleDecoder> ensdec;
+  CreateModel(mod, encatt, ensdec, "mlp:5", true, "sum");
+  InferenceEngine exp_engine(*encatt), act_engine(*encatt, true);
+  BOOST_CHECK(!exp_engine.IsQuantized());
+  BOOST_CHECK(act_engine.IsQuantized());
+  vector<float> exp_wordll, act_wordll;
+  exp_engine.CalcSentLL(sent_src_, sent_trg_, exp_wordll);
+  act_engine.CalcSentLL(sent_src_, sent_trg_, act_wordll);
+  BOOST_REQUIRE_EQUAL(exp_wordll.size(), act_wordll.size());
+  for(size_t i = 0; i < exp_wordll.size(); i++)
+    BOOST_CHECK_SMALL(exp_wordll[i] - act_wordll[i], 0.05f);
+  BOOST_REQUIRE(ensdec->SetFastInference(true, true));
+  vector<EnsembleDecoderHypPtr> nbest = ensdec->GenerateNbest(sent_src_, 1);
+  BOOST_CHECK_EQUAL(nbest.size(), 1);
+}
+
+// Parameters stored in 16 bits should take less memory and change the scores
+// only slightly
+BOOST_AUTO_TEST_CASE(TestFastInferenceHalfPrecision) {
+  shared_ptr<dynet::ParameterCollection> mod;
+  EncoderAttentionalPtr encatt;
+  shared_ptr<EnsembleDecoder> ensdec;
+  CreateModel(mod, encatt, ensdec, "mlp:5", true, "sum");
+  InferenceEngine exp_engine(*encatt);
+  vector<float> exp_wordll, act_wordll;
+  exp_engine.CalcSentLL(sent_src_, sent_trg_, exp_wordll);
+  for(ParamPrecision precision : {PRECISION_FP16, PRECISION_BF16}) {
+    InferenceEngine act_engine(*encatt, false, precision);
+    BOOST_CHECK_EQUAL(act_engine.GetPrecision(), precision);
+    BOOST_CHECK_LT(act_engine.GetMemorySize(), exp_engine.GetMemorySize());
+    act_engine.CalcSentLL(sent_src_, sent_trg_, act_wordll);
+    BOOST_REQUIRE_EQUAL(exp_wordll.size(), act_wordll.size());
+    for(size_t i = 0; i < exp_wordll.size(); i++)
+      BOOST_CHECK_SMALL(exp_wordll[i] - act_wordll[i], (precision == PRECISION_FP16 ? 0.01f : 0.05f));
+  }
+  BOOST_REQUIRE(ensdec->SetFastInference(true, true, PRECISION_FP16));
+  vector<EnsembleDecoderHypPtr> nbest = ensdec->GenerateNbest(sent_src_, 1);
+  BOOST_CHECK_EQUAL(nbest.size(), 1);
+}
+
+// Releasing the parameters of a model that only the engine uses should give
+// their memory back to the system, while decoding with the engine gives the
+// same results and everything else refuses to run
+BOOST_AUTO_TEST_CASE(TestFastInferenceReleaseParameters) {
+  // A vocabulary large enough for the embeddings and softmax to take many pages
+  int num_words = 50000;
+  for(int i = 0; i < num_words; i++)
+    vocab_trg_->convert("w" + to_string(i));
+  shared_ptr<dynet::ParameterCollection> mod;
+  EncoderAttentionalPtr encatt;
+  shared_ptr<EnsembleDecoder> ensdec;
+  CreateModel(mod, encatt, ensdec, "mlp:5", true, "sum");
+  ensdec->SetBeamSize(3);
+  BOOST_CHECK(!ensdec->IsEngineOnly());
+  BOOST_CHECK_THROW(ensdec->ReleaseParameters(*mod), std::runtime_error);
+  BOOST_REQUIRE(ensdec->SetFastInference(true, false, PRECISION_FP16));
+  BOOST_REQUIRE(ensdec->IsEngineOnly());
+  vector<EnsembleDecoderHypPtr> exp_nbest = ensdec->GenerateNbest(sent_src_, 3);
+  size_t exp_rss = GetResidentMemory();
+  size_t released = ensdec->ReleaseParameters(*mod);
+  size_t act_rss = GetResidentMemory();
+  // At least most of the values and gradients of the softmax weights (with
+  // the 5 decoder nodes and 5 context nodes as input) and the embeddings
+  BOOST_CHECK_GT(released, 2 * num_words * (10 + 5) * sizeof(float) * 9 / 10);
+  BOOST_CHECK_GT(exp_rss, act_rss + released / 2);
+  BOOST_CHECK(ensdec->GetParametersReleased());
+  vector<EnsembleDecoderHypPtr> act_nbest = ensdec->GenerateNbest(sent_src_, 3);
+  vector<vector<EnsembleDecoderHypPtr> > act_batch_nbest = ensdec->GenerateNbest(vector<Sentence>({sent_src2_, sent_src_}), 3);
+  BOOST_REQUIRE_EQUAL(act_batch_nbest.size(), 2);
+  for(auto * nbest : {&act_nbest, &act_batch_nbest[1]}) {
+    BOOST_REQUIRE_EQUAL(exp_nbest.size(), nbest->size());
+    for(size_t i = 0; i < exp_nbest.size(); i++) {
+      BOOST_CHECK(exp_nbest[i]->GetSentence() == (*nbest)[i]->GetSentence());
+      BOOST_CHECK_EQUAL(exp_nbest[i]->GetScore(), (*nbest)[i]->GetScore());
+    }
+  }
+  LLStats test_stat(vocab_trg_->size());
+  vector<float> wordll;
+  BOOST_CHECK_THROW(ensdec->CalcSentLL(sent_src_, sent_trg_, test_stat, wordll), std::runtime_error);
+  BOOST_CHECK_THROW(ensdec->SampleSentences(vector<Sentence>(1, sent_src_), 1), std::runtime_error);
+  BOOST_CHECK_THROW(ensdec->SetFastInference(true), std::runtime_error);
+  ensdec->SetBeamBatch(true);
+  BOOST_CHECK_THROW(ensdec->GenerateNbest(sent_src_, 3), std::runtime_error);
+}
+
+// Parameters saved in 16 bits should be read back into a model with the
+// same structure, and in 32 bits exactly
+BOOST_AUTO_TEST_CASE(TestSaveParametersHalfPrecision) {
+  shared_ptr<dynet::ParameterCollection> exp_mod, act_mod;
+  EncoderAttentionalPtr exp_encatt, act_encatt;
+  shared_ptr<EnsembleDecoder> exp_ensdec, act_ensdec;
+  CreateModel(exp_mod, exp_encatt, exp_ensdec, "mlp:5", true, "sum");
+  CreateModel(act_mod, act_encatt, act_ensdec, "mlp:5", true, "sum");
+  LLStats exp_stat(vocab_trg_->size());
+  vector<float> exp_wordll;
+  exp_ensdec->CalcSentLL(sent_src_, sent_trg_, exp_stat, exp_wordll);
+  for(ParamPrecision precision : {PRECISION_FP32, PRECISION_FP16, PRECISION_BF16}) {
+    ModelUtils::SaveParameters("/tmp/test-params.data", *exp_mod, precision);
+    ModelUtils::LoadParameters("/tmp/test-params.data", *act_mod);
+    LLStats act_stat(vocab_trg_->size());
+    vector<float> act_wordll;
+    act_ensdec->CalcSentLL(sent_src_, sent_trg_, act_stat, act_wordll);
+    BOOST_REQUIRE_EQUAL(exp_wordll.size(), act_wordll.size());
+    for(size_t i = 0; i < exp_wordll.size(); i++)
+      BOOST_CHECK_SMALL(exp_wordll[i] - act_wordll[i], (precision == PRECISION_FP32 ? 1e-5f : 0.05f));
+  }
+}
+
+// A model converted to a binary model should give the same scores when loaded
+BOOST_AUTO_TEST_CASE(TestBinaryModel) {
+  shared_ptr<dynet::ParameterCollection> exp_mod, act_mod;
+  EncoderAttentionalPtr exp_encatt, act_encatt;
+  shared_ptr<EnsembleDecoder> exp_ensdec;
+  CreateModel(exp_mod, exp_encatt, exp_ensdec, "mlp:5", true, "sum");
+  {
+    ofstream out("/tmp/test-binary.mod");
+    WriteDict(*vocab_src_, out);
+    WriteDict(*vocab_trg_, out);
+    exp_encatt->Write(out);
+  }
+  ModelUtils::SaveParameters("/tmp/test-binary.mod.data", *exp_mod);
+  BOOST_CHECK(!ModelUtils::IsBinaryModel("/tmp/test-binary.mod"));
+  ModelUtils::ConvertToBinaryModel("encatt", "/tmp/test-binary.mod", "/tmp/test-binary.bin");
+  BOOST_CHECK(ModelUtils::IsBinaryModel("/tmp/test-binary.bin"));
+  LLStats exp_stat(vocab_trg_->size());
+  vector<float> exp_wordll;
+  exp_ensdec->CalcSentLL(sent_src_, sent_trg_, exp_stat, exp_wordll);
+  for(ParamPrecision precision : {PRECISION_FP32, PRECISION_FP16}) {
+    if(precision != PRECISION_FP32)
+      ModelUtils::ConvertToBinaryModel("encatt", "/tmp/test-binary.mod", "/tmp/test-binary.bin", precision);
+    DictPtr act_vocab_src, act_vocab_trg;
+    act_encatt.reset(ModelUtils::LoadBilingualModelWithParameters<EncoderAttentional>("/tmp/test-binary.bin", act_mod, act_vocab_src, act_vocab_trg));
+    BOOST_CHECK(act_vocab_trg->get_words() == vocab_trg_->get_words());
+    vector<EncoderDecoderPtr> encdecs;
+    vector<EncoderAttentionalPtr> encatts(1, act_encatt);
+    vector<NeuralLMPtr> lms;
+    EnsembleDecoder act_ensdec(encdecs, encatts, lms);
+    LLStats act_stat(vocab_trg_->size());
+    vector<float> act_wordll;
+    act_ensdec.CalcSentLL(sent_src_, sent_trg_, act_stat, act_wordll);
+    BOOST_REQUIRE_EQUAL(exp_wordll.size(), act_wordll.size());
+    for(size_t i = 0; i < exp_wordll.size(); i++)
+      BOOST_CHECK_SMALL(exp_wordll[i] - act_wordll[i], (precision == PRECISION_FP32 ? 1e-5f : 0.05f));
+    // Release the mapping before the file is written again
+    act_encatt.reset(); act_mod.reset();
+  }
+  std::remove("/tmp/test-binary.mod");
+  std::remove("/tmp/test-binary.mod.data");
+  std::remove("/tmp/test-binary.bin");
+}
+
+// Processes sharing a text model should share a binary model written to
+// shared memory by the first one
+BOOST_AUTO_TEST_CASE(TestSharedModel) {
+  shared_ptr<dynet::ParameterCollection> exp_mod;
+  EncoderAttentionalPtr exp_encatt;
+  shared_ptr<EnsembleDecoder> exp_ensdec;
+  CreateModel(exp_mod, exp_encatt, exp_ensdec, "mlp:5", true, "sum");
+  {
+    ofstream out("/tmp/test-shared.mod");
+    WriteDict(*vocab_src_, out);
+    WriteDict(*vocab_trg_, out);
+    exp_encatt->Write(out);
+  }
+  ModelUtils::SaveParameters("/tmp/test-shared.mod.data", *exp_mod);
+  string shared_file = ModelUtils::GetSharedModelFile("/tmp/test-shared.mod");
+  BOOST_CHECK(shared_file != "/tmp/test-shared.mod");
+  std::remove(shared_file.c_str());
+  LLStats exp_stat(vocab_trg_->size());
+  vector<float> exp_wordll;
+  exp_ensdec->CalcSentLL(sent_src_, sent_trg_, exp_stat, exp_wordll);
+  // The first load writes the shared model, and the second maps it
+  for(int i = 0; i < 2; i++) {
+    shared_ptr<dynet::ParameterCollection> act_mod;
+    DictPtr act_vocab_src, act_vocab_trg;
+    EncoderAttentionalPtr act_encatt(ModelUtils::LoadBilingualModelWithParameters<EncoderAttentional>("/tmp/test-shared.mod", act_mod, act_vocab_src, act_vocab_trg, true));
+    BOOST_CHECK(ModelUtils::IsBinaryModel(shared_file));
+    vector<EncoderDecoderPtr> encdecs;
+    vector<EncoderAttentionalPtr> encatts(1, act_encatt);
+    vector<NeuralLMPtr> lms;
+    EnsembleDecoder act_ensdec(encdecs, encatts, lms);
+    LLStats act_stat(vocab_trg_->size());
+    vector<float> act_wordll;
+    act_ensdec.CalcSentLL(sent_src_, sent_trg_, act_stat, act_wordll);
+    BOOST_REQUIRE_EQUAL(exp_wordll.size(), act_wordll.size());
+    for(size_t j = 0; j < exp_wordll.size(); j++)
+      BOOST_CHECK_SMALL(exp_wordll[j] - act_wordll[j], 1e-5f);
+  }
+  // A new version of the model gets a new shared model, which replaces the old one
+  ModelUtils::SaveParameters("/tmp/test-shared.mod.data", *exp_mod, PRECISION_FP16);
+  string new_shared_file = ModelUtils::GetSharedModelFile("/tmp/test-shared.mod");
+  BOOST_CHECK(new_shared_file != shared_file);
+  {
+    shared_ptr<dynet::ParameterCollection> act_mod;
+    DictPtr act_vocab_src, act_vocab_trg;
+    EncoderAttentionalPtr act_encatt(ModelUtils::LoadBilingualModelWithParameters<EncoderAttentional>("/tmp/test-shared.mod", act_mod, act_vocab_src, act_vocab_trg, true));
+    BOOST_CHECK(ModelUtils::IsBinaryModel(new_shared_file));
+    BOOST_CHECK(!ifstream(shared_file));
+  }
+  std::remove("/tmp/test-shared.mod");
+  std::remove("/tmp/test-shared.mod.data");
+  for(const string & file : {shared_file, new_shared_file}) {
+    std::remove(file.c_str());
+    std::remove((file + ".lock").c_str());
+  }
+}
+
+// Models whose parameters are loaded together in threads should give the
+// same scores as the models they were saved from
+BOOST_AUTO_TEST_CASE(TestParallelLoading) {
+  vector<shared_ptr<dynet::ParameterCollection> > exp_mods(3), act_mods(3);
+  vector<EncoderAttentionalPtr> exp_encatts(3), act_encatts(3);
+  vector<shared_ptr<EnsembleDecoder> > exp_ensdecs(3);
+  vector<function<void()> > loads(3);
+  vector<string> files = {"/tmp/test-parallel0.mod", "/tmp/test-parallel1.mod", "/tmp/test-parallel2.mod"};
+  for(int i = 0; i < 3; i++) {
+    CreateModel(exp_mods[i], exp_encatts[i], exp_ensdecs[i], "mlp:5", true, "sum");
+    ofstream out(files[i]);
+    WriteDict(*vocab_src_, out);
+    WriteDict(*vocab_trg_, out);
+    exp_encatts[i]->Write(out);
+  }
+  // Save the parameters in each of the formats
+  ModelUtils::SaveParameters(files[0] + ".data", *exp_mods[0]);
+  ModelUtils::SaveParameters(files[1] + ".data", *exp_mods[1], PRECISION_FP16);
+  ModelUtils::SaveParameters(files[2] + ".data", *exp_mods[2]);
+  ModelUtils::ConvertToBinaryModel("encatt", files[2], files[2] + ".bin");
+  files[2] += ".bin";
+  for(int i = 0; i < 3; i++) {
+    DictPtr act_vocab_src, act_vocab_trg;
+    act_encatts[i].reset(ModelUtils::LoadBilingualModelWithParameters<EncoderAttentional>(files[i], act_mods[i], act_vocab_src, act_vocab_trg, false, &loads[i]));
+    BOOST_REQUIRE(loads[i]);
+  }
+  ModelUtils::LoadInParallel(loads, 2);
+  for(int i = 0; i < 3; i++) {
+    LLStats exp_stat(vocab_trg_->size()), act_stat(vocab_trg_->size());
+    vector<float> exp_wordll, act_wordll;
+    exp_ensdecs[i]->CalcSentLL(sent_src_, sent_trg_, exp_stat, exp_wordll);
+    vector<EncoderDecoderPtr> encdecs;
+    vector<EncoderAttentionalPtr> encatts(1, act_encatts[i]);
+    vector<NeuralLMPtr> lms;
+    EnsembleDecoder act_ensdec(encdecs, encatts, lms);
+    act_ensdec.CalcSentLL(sent_src_, sent_trg_, act_stat, act_wordll);
+    BOOST_REQUIRE_EQUAL(exp_wordll.size(), act_wordll.size());
+    for(size_t j = 0; j < exp_wordll.size(); j++)
+      BOOST_CHECK_SMALL(exp_wordll[j] - act_wordll[j], (i == 1 ? 0.01f : 1e-5f));
+  }
+  // Errors in any thread should be reported
+  vector<function<void()> > bad_loads(2, []() { THROW_ERROR("Could not load"); });
+  BOOST_CHECK_THROW(ModelUtils::LoadInParallel(bad_loads), std::runtime_error);
+  act_encatts.clear(); act_mods.clear();
+  for(const char * file : {"/tmp/test-parallel0.mod", "/tmp/test-parallel1.mod", "/tmp/test-parallel2.mod"}) {
+    std::remove(file);
+    std::remove((string(file) + ".data").c_str());
+  }
+  std::remove("/tmp/test-parallel2.mod.bin");
+}
+
+// The engine should refuse models it cannot run
+BOOST_AUTO_TEST_CASE(TestFastInferenceUnsupported) {
+  shared_ptr<dynet::ParameterCollection> mod;
+  EncoderAttentionalPtr encatt;
+  shared_ptr<EnsembleDecoder> ensdec;
+  CreateModel(mod, encatt, ensdec, "dot", false, "none", "prior");
+  string reason;
+  BOOST_CHECK(!InferenceEngine::IsSupported(*encatt, reason));
+  BOOST_CHECK(!ensdec->SetFastInference(true));
+}
+
 // Test whether scores during decoding are the same as training
 BOOST_AUTO_TEST_CASE(TestBeamDecodingScores) {
   shared_ptr<dynet::ParameterCollection> mod;
@@ -241,6 +590,350 @@ BOOST_AUTO_TEST_CASE(TestBeamDecodingScores) {
   BOOST_CHECK_CLOSE(train_ll, decode_ll, 0.01);
 }
 
+// Test whether batched beam expansion finds the same hypotheses as unbatched
+BOOST_AUTO_TEST_CASE(TestBeamBatchDecoding) {
+  shared_ptr<dynet::ParameterCollection> mod;
+  EncoderAttentionalPtr encatt;
+  shared_ptr<EnsembleDecoder> ensdec;
+  CreateModel(mod, encatt, ensdec, "mlp:5", true, "sum");
+  ensdec->SetBeamSize(5);
+  vector<EnsembleDecoderHypPtr> exp_hyps = ensdec->GenerateNbest(sent_src_, 3);
+  ensdec->SetBeamBatch(true);
+  vector<EnsembleDecoderHypPtr> act_hyps = ensdec->GenerateNbest(sent_src_, 3);
+  ensdec->SetBeamBatch(false);
+  ensdec->SetBeamSize(1);
+  BOOST_REQUIRE_EQUAL(exp_hyps.size(), act_hyps.size());
+  for(size_t i = 0; i < exp_hyps.size(); i++) {
+    BOOST_CHECK_EQUAL_COLLECTIONS(exp_hyps[i]->GetSentence().begin(), exp_hyps[i]->GetSentence().end(),
+                                  act_hyps[i]->GetSentence().begin(), act_hyps[i]->GetSentence().end());
+    BOOST_CHECK_CLOSE(exp_hyps[i]->GetScore(), act_hyps[i]->GetScore(), 0.01);
+  }
+}
+
+// Test whether decoding sentences of different lengths together gives the same results
+BOOST_AUTO_TEST_CASE(TestMultiSentenceDecoding) {
+  shared_ptr<dynet::ParameterCollection> mod;
+  EncoderAttentionalPtr encatt;
+  shared_ptr<EnsembleDecoder> ensdec;
+  CreateModel(mod, encatt, ensdec, "mlp:5", true, "sum", "prior");
+  ensdec->SetBeamSize(3);
+  vector<Sentence> sents_src = {sent_src_, {3, 1, 0}, sent_src2_, {2, 0}};
+  vector<vector<EnsembleDecoderHypPtr> > act_hyps = ensdec->GenerateNbest(sents_src, 2);
+  BOOST_REQUIRE_EQUAL(sents_src.size(), act_hyps.size());
+  for(size_t j = 0; j < sents_src.size(); j++) {
+    vector<EnsembleDecoderHypPtr> exp_hyps = ensdec->GenerateNbest(sents_src[j], 2);
+    BOOST_REQUIRE_EQUAL(exp_hyps.size(), act_hyps[j].size());
+    for(size_t i = 0; i < exp_hyps.size(); i++) {
+      BOOST_CHECK_EQUAL_COLLECTIONS(exp_hyps[i]->GetSentence().begin(), exp_hyps[i]->GetSentence().end(),
+                                    act_hyps[j][i]->GetSentence().begin(), act_hyps[j][i]->GetSentence().end());
+      BOOST_CHECK_EQUAL_COLLECTIONS(exp_hyps[i]->GetAlignment().begin(), exp_hyps[i]->GetAlignment().end(),
+                                    act_hyps[j][i]->GetAlignment().begin(), act_hyps[j][i]->GetAlignment().end());
+      BOOST_CHECK_CLOSE(exp_hyps[i]->GetScore(), act_hyps[j][i]->GetScore(), 0.01);
+    }
+  }
+  ensdec->SetBeamSize(1);
+}
+
+// Test that sentences joining the batch while others are decoded get the same results
+BOOST_AUTO_TEST_CASE(TestContinuousDecoding) {
+  shared_ptr<dynet::ParameterCollection> mod;
+  EncoderAttentionalPtr encatt;
+  shared_ptr<EnsembleDecoder> ensdec;
+  CreateModel(mod, encatt, ensdec, "mlp:5", true, "sum", "prior");
+  ensdec->SetBeamSize(3);
+  vector<Sentence> sents_src = {{2, 0}, sent_src_, {3, 1, 0}, sent_src2_, {2, 0}};
+  vector<vector<EnsembleDecoderHypPtr> > act_hyps(sents_src.size());
+  vector<int> num_done(sents_src.size(), 0);
+  size_t next_sent = 0;
+  ensdec->GenerateNbestContinuous([&](bool wait, int & id, Sentence & sent_src) {
+    if(next_sent == sents_src.size()) return false;
+    id = next_sent;
+    sent_src = sents_src[next_sent++];
+    return true;
+  }, 2, 5, [&](int id, const vector<EnsembleDecoderHypPtr> & hyps) {
+    num_done[id]++;
+    act_hyps[id] = hyps;
+  }, 3);
+  for(size_t j = 0; j < sents_src.size(); j++) {
+    BOOST_CHECK_EQUAL(num_done[j], 1);
+    vector<EnsembleDecoderHypPtr> exp_hyps = ensdec->GenerateNbest(sents_src[j], 2);
+    BOOST_REQUIRE_EQUAL(exp_hyps.size(), act_hyps[j].size());
+    for(size_t i = 0; i < exp_hyps.size(); i++) {
+      BOOST_CHECK_EQUAL_COLLECTIONS(exp_hyps[i]->GetSentence().begin(), exp_hyps[i]->GetSentence().end(),
+                                    act_hyps[j][i]->GetSentence().begin(), act_hyps[j][i]->GetSentence().end());
+      BOOST_CHECK_CLOSE(exp_hyps[i]->GetScore(), act_hyps[j][i]->GetScore(), 0.01);
+    }
+  }
+  ensdec->SetBeamSize(1);
+}
+
+// Test that splitting an ensemble between processes gives the same results
+BOOST_AUTO_TEST_CASE(TestEnsembleThreads) {
+  shared_ptr<dynet::ParameterCollection> mod1, mod2;
+  EncoderAttentionalPtr encatt1, encatt2;
+  shared_ptr<EnsembleDecoder> ensdec1, ensdec2;
+  CreateModel(mod1, encatt1, ensdec1, "mlp:5", true, "sum", "prior");
+  CreateModel(mod2, encatt2, ensdec2, "dot", false, "none", "none");
+  vector<EncoderDecoderPtr> encdecs;
+  vector<EncoderAttentionalPtr> encatts = {encatt1, encatt2};
+  vector<NeuralLMPtr> lms;
+  EnsembleDecoder ensdec(encdecs, encatts, lms);
+  ensdec.SetSizeLimit(100);
+  vector<Sentence> sents_src = {sent_src_, {3, 1, 0}, sent_src2_};
+  auto check_hyps = [](const vector<EnsembleDecoderHypPtr> & exp_hyps, const vector<EnsembleDecoderHypPtr> & act_hyps) {
+    BOOST_REQUIRE_EQUAL(exp_hyps.size(), act_hyps.size());
+    for(size_t i = 0; i < exp_hyps.size(); i++) {
+      BOOST_CHECK_EQUAL_COLLECTIONS(exp_hyps[i]->GetSentence().begin(), exp_hyps[i]->GetSentence().end(),
+                                    act_hyps[i]->GetSentence().begin(), act_hyps[i]->GetSentence().end());
+      BOOST_CHECK_EQUAL_COLLECTIONS(exp_hyps[i]->GetAlignment().begin(), exp_hyps[i]->GetAlignment().end(),
+                                    act_hyps[i]->GetAlignment().begin(), act_hyps[i]->GetAlignment().end());
+      BOOST_CHECK_CLOSE(exp_hyps[i]->GetScore(), act_hyps[i]->GetScore(), 0.01);
+    }
+  };
+  // With a beam of one, only the best word, the end of sentence, and the
+  // unknown word are sent back from the first process, and with a beam of
+  // three, all words are
+  for(int beam_size : {1, 3}) {
+    ensdec.SetBeamSize(beam_size);
+    vector<vector<EnsembleDecoderHypPtr> > exp_hyps, act_hyps, exp_batch_hyps, act_batch_hyps;
+    for(auto & sent_src : sents_src)
+      exp_hyps.push_back(ensdec.GenerateNbest(sent_src, 2));
+    exp_batch_hyps = ensdec.GenerateNbest(sents_src, 2);
+    BOOST_CHECK(ensdec.GetCandIds().empty());
+    ensdec.SetEnsembleThreads(2);
+    for(auto & sent_src : sents_src) {
+      act_hyps.push_back(ensdec.GenerateNbest(sent_src, 2));
+      BOOST_CHECK_EQUAL(ensdec.GetCandIds().size(), (beam_size == 1 ? 3 : vocab_trg_->size()));
+    }
+    act_batch_hyps = ensdec.GenerateNbest(sents_src, 2);
+    ensdec.SetEnsembleThreads(1);
+    for(size_t j = 0; j < sents_src.size(); j++) {
+      check_hyps(exp_hyps[j], act_hyps[j]);
+      check_hyps(exp_batch_hyps[j], act_batch_hyps[j]);
+    }
+  }
+  // Scoring single sentences and batches should give the same likelihoods
+  vector<Sentence> sents_trg = {sent_trg_, {2, 0}};
+  for(string op : {"sum", "logsum"}) {
+    ensdec.SetEnsembleOperation(op);
+    vector<LLStats> exp_stats, act_stats;
+    vector<vector<float> > exp_wordll, act_wordll;
+    for(int threads : {1, 2}) {
+      ensdec.SetEnsembleThreads(threads);
+      vector<LLStats> & stats = (threads == 1 ? exp_stats : act_stats);
+      vector<vector<float> > & wordll = (threads == 1 ? exp_wordll : act_wordll);
+      stats.assign(sents_trg.size() + 1, LLStats(vocab_trg_->size()));
+      wordll.assign(sents_trg.size() + 1, vector<float>());
+      ensdec.CalcSentLL(sent_src_, sents_trg[0], stats[0], wordll[0]);
+      vector<LLStats> batch_stats(sents_trg.size(), LLStats(vocab_trg_->size()));
+      vector<vector<float> > batch_wordll(sents_trg.size());
+      ensdec.CalcSentLL(sent_src_, sents_trg, batch_stats, batch_wordll);
+      copy(batch_stats.begin(), batch_stats.end(), stats.begin() + 1);
+      copy(batch_wordll.begin(), batch_wordll.end(), wordll.begin() + 1);
+    }
+    ensdec.SetEnsembleThreads(1);
+    for(size_t i = 0; i < exp_stats.size(); i++) {
+      BOOST_CHECK_CLOSE(exp_stats[i].loss_, act_stats[i].loss_, 0.01);
+      BOOST_CHECK_EQUAL(exp_stats[i].words_, act_stats[i].words_);
+      BOOST_REQUIRE_EQUAL(exp_wordll[i].size(), act_wordll[i].size());
+      for(size_t t = 0; t < exp_wordll[i].size(); t++)
+        BOOST_CHECK_CLOSE(exp_wordll[i][t], act_wordll[i][t], 0.01);
+    }
+  }
+  ensdec.SetEnsembleOperation("sum");
+}
+
+// Test that search is only stopped early when it runs out of time
+BOOST_AUTO_TEST_CASE(TestDecodeTimeBudget) {
+  shared_ptr<dynet::ParameterCollection> mod;
+  EncoderAttentionalPtr encatt;
+  shared_ptr<EnsembleDecoder> ensdec;
+  CreateModel(mod, encatt, ensdec, "mlp:5", true, "sum", "prior");
+  ensdec->SetBeamSize(3);
+  vector<Sentence> sents_src = {sent_src_, {3, 1, 0}, sent_src2_};
+  vector<vector<EnsembleDecoderHypPtr> > exp_hyps = ensdec->GenerateNbest(sents_src, 2);
+  // A generous budget should give the same results
+  ensdec->SetMaxDecodeMs(100000);
+  vector<vector<EnsembleDecoderHypPtr> > act_hyps = ensdec->GenerateNbest(sents_src, 2);
+  BOOST_CHECK_EQUAL(ensdec->GetNumTimeouts(), 0);
+  for(size_t j = 0; j < sents_src.size(); j++) {
+    BOOST_REQUIRE_EQUAL(exp_hyps[j].size(), act_hyps[j].size());
+    for(size_t i = 0; i < exp_hyps[j].size(); i++) {
+      BOOST_CHECK(!act_hyps[j][i]->IsTruncated());
+      BOOST_CHECK_EQUAL_COLLECTIONS(exp_hyps[j][i]->GetSentence().begin(), exp_hyps[j][i]->GetSentence().end(),
+                                    act_hyps[j][i]->GetSentence().begin(), act_hyps[j][i]->GetSentence().end());
+    }
+  }
+  // With a tiny budget, each sentence gets a result, which is marked if it was cut short
+  ensdec->SetMaxDecodeMs(1);
+  ensdec->SetSizeLimit(1000);
+  int num_truncated = 0;
+  for(auto & sent_src : sents_src) {
+    vector<EnsembleDecoderHypPtr> hyps = ensdec->GenerateNbest(sent_src, 2);
+    BOOST_REQUIRE(hyps.size() > 0);
+    if(hyps[0]->IsTruncated()) num_truncated++;
+  }
+  BOOST_CHECK_EQUAL(ensdec->GetNumTimeouts(), num_truncated);
+  ensdec->SetMaxDecodeMs(0);
+  ensdec->ResetNumTimeouts();
+  ensdec->SetSizeLimit(100);
+  ensdec->SetBeamSize(1);
+}
+
+// Test that adaptive beams and pruning find valid hypotheses, and that loose
+// thresholds do not change the results
+BOOST_AUTO_TEST_CASE(TestAdaptiveBeamDecoding) {
+  shared_ptr<dynet::ParameterCollection> mod;
+  EncoderAttentionalPtr encatt;
+  shared_ptr<EnsembleDecoder> ensdec;
+  CreateModel(mod, encatt, ensdec, "mlp:5", true, "sum", "prior");
+  ensdec->SetBeamSize(8);
+  vector<Sentence> sents_src = {sent_src_, {3, 1, 0}, sent_src2_};
+  for(bool beam_batch : {false, true}) {
+    ensdec->SetBeamBatch(beam_batch);
+    for(auto & sent_src : sents_src) {
+      vector<EnsembleDecoderHypPtr> exp_hyps = ensdec->GenerateNbest(sent_src, 1);
+      ensdec->SetBeamPrune(1e-30f, 1000.f);
+      vector<EnsembleDecoderHypPtr> act_hyps = ensdec->GenerateNbest(sent_src, 1);
+      BOOST_CHECK_EQUAL_COLLECTIONS(exp_hyps[0]->GetSentence().begin(), exp_hyps[0]->GetSentence().end(),
+                                    act_hyps[0]->GetSentence().begin(), act_hyps[0]->GetSentence().end());
+      ensdec->SetBeamPrune(0.1f, 2.f);
+      ensdec->SetBeamAdaptive(true);
+      act_hyps = ensdec->GenerateNbest(sent_src, 1);
+      ensdec->SetBeamAdaptive(false);
+      ensdec->SetBeamPrune(0.f, 0.f);
+      BOOST_REQUIRE(act_hyps.size() > 0);
+      LLStats stat(vocab_trg_->size());
+      vector<float> wordll;
+      ensdec->CalcSentLL(sent_src, act_hyps[0]->GetSentence(), stat, wordll);
+      BOOST_CHECK_CLOSE(-stat.loss_, act_hyps[0]->GetScore(), 0.01);
+    }
+  }
+  ensdec->SetBeamBatch(false);
+  ensdec->SetBeamSize(1);
+}
+
+// Test decoding with a shortlist of target words
+BOOST_AUTO_TEST_CASE(TestShortlistDecoding) {
+  shared_ptr<dynet::ParameterCollection> mod;
+  EncoderAttentionalPtr encatt;
+  shared_ptr<EnsembleDecoder> ensdec;
+  CreateModel(mod, encatt, ensdec, "mlp:5", true, "sum");
+  ensdec->SetBeamSize(3);
+  vector<EnsembleDecoderHypPtr> exp_hyps = ensdec->GenerateNbest(sent_src_, 2);
+  // A shortlist containing the whole vocabulary should not change the results
+  vector<WordId> all_words;
+  for(int i = 0; i < (int)vocab_trg_->size(); i++) all_words.push_back(i);
+  ensdec->SetShortlist(ShortlistPtr(new Shortlist(MultipleIdMapping(), all_words, 0)));
+  vector<EnsembleDecoderHypPtr> act_hyps = ensdec->GenerateNbest(sent_src_, 2);
+  BOOST_REQUIRE_EQUAL(exp_hyps.size(), act_hyps.size());
+  for(size_t i = 0; i < exp_hyps.size(); i++) {
+    BOOST_CHECK_EQUAL_COLLECTIONS(exp_hyps[i]->GetSentence().begin(), exp_hyps[i]->GetSentence().end(),
+                                  act_hyps[i]->GetSentence().begin(), act_hyps[i]->GetSentence().end());
+    BOOST_CHECK_CLOSE(exp_hyps[i]->GetScore(), act_hyps[i]->GetScore(), 0.01);
+  }
+  // With a smaller shortlist, only the candidates should be generated
+  MultipleIdMapping lexicon;
+  lexicon[2].push_back(make_pair(3, 0.9f));
+  lexicon[2].push_back(make_pair(4, 0.1f));
+  ShortlistPtr shortlist(new Shortlist(lexicon, vector<WordId>(1, 1), 1));
+  vector<unsigned> cands = shortlist->GetCandidates(sent_src_);
+  ensdec->SetShortlist(shortlist);
+  ensdec->SetBeamBatch(true);
+  act_hyps = ensdec->GenerateNbest(sent_src_, 2);
+  BOOST_CHECK(act_hyps.size() > 0);
+  for(auto & hyp : act_hyps)
+    for(WordId wid : hyp->GetSentence())
+      BOOST_CHECK(find(cands.begin(), cands.end(), (unsigned)wid) != cands.end());
+  ensdec->SetShortlist(ShortlistPtr());
+  ensdec->SetBeamBatch(false);
+  ensdec->SetBeamSize(1);
+}
+
+// Test whether scoring with encoded sentences restored from the cache gives the same results
+BOOST_AUTO_TEST_CASE(TestEncoderCache) {
+  shared_ptr<dynet::ParameterCollection> mod;
+  EncoderAttentionalPtr encatt;
+  shared_ptr<EnsembleDecoder> ensdec;
+  CreateModel(mod, encatt, ensdec, "mlp:5", true, "sum", "prior");
+  vector<Sentence> sents_trg = {sent_trg_, sent_trg2_};
+  vector<LLStats> exp_stats(2, LLStats(vocab_trg_->size()));
+  vector<vector<float> > exp_wordlls(2);
+  ensdec->CalcSentLL<vector<Sentence>,vector<LLStats>,vector<vector<float> > >(sent_src_, sents_trg, exp_stats, exp_wordlls);
+  // The first call encodes the sentence and the second restores it
+  ensdec->SetEncoderCacheSize(1);
+  for(int i = 0; i < 2; i++) {
+    vector<LLStats> act_stats(2, LLStats(vocab_trg_->size()));
+    vector<vector<float> > act_wordlls(2);
+    ensdec->CalcSentLL<vector<Sentence>,vector<LLStats>,vector<vector<float> > >(sent_src_, sents_trg, act_stats, act_wordlls);
+    for(size_t j = 0; j < sents_trg.size(); j++) {
+      BOOST_CHECK_CLOSE(exp_stats[j].CalcPPL(), act_stats[j].CalcPPL(), 0.01);
+      BOOST_CHECK_EQUAL_COLLECTIONS(exp_wordlls[j].begin(), exp_wordlls[j].end(), act_wordlls[j].begin(), act_wordlls[j].end());
+    }
+  }
+  // Decoding also uses the cache
+  ensdec->SetBeamSize(3);
+  vector<EnsembleDecoderHypPtr> act_hyps = ensdec->GenerateNbest(sent_src_, 2);
+  ensdec->SetEncoderCacheSize(0);
+  vector<EnsembleDecoderHypPtr> exp_hyps = ensdec->GenerateNbest(sent_src_, 2);
+  ensdec->SetBeamSize(1);
+  BOOST_REQUIRE_EQUAL(exp_hyps.size(), act_hyps.size());
+  for(size_t i = 0; i < exp_hyps.size(); i++) {
+    BOOST_CHECK_EQUAL_COLLECTIONS(exp_hyps[i]->GetSentence().begin(), exp_hyps[i]->GetSentence().end(),
+                                  act_hyps[i]->GetSentence().begin(), act_hyps[i]->GetSentence().end());
+    BOOST_CHECK_CLOSE(exp_hyps[i]->GetScore(), act_hyps[i]->GetScore(), 0.01);
+  }
+}
+
+// Test whether speculative decoding with a draft model gives the same results as greedy search
+BOOST_AUTO_TEST_CASE(TestSpeculativeDecoding) {
+  shared_ptr<dynet::ParameterCollection> mod, draft_mod;
+  EncoderAttentionalPtr encatt, draft_encatt;
+  shared_ptr<EnsembleDecoder> ensdec, draft_ensdec;
+  CreateModel(mod, encatt, ensdec, "mlp:5", true, "sum");
+  CreateModel(draft_mod, draft_encatt, draft_ensdec, "dot", false, "none");
+  vector<Sentence> sents_src = {sent_src_, sent_src2_, {3, 1, 0}};
+  for(const Sentence & sent_src : sents_src) {
+    ensdec->SetDraft(shared_ptr<EnsembleDecoder>(), 1);
+    EnsembleDecoderHypPtr exp_hyp = ensdec->Generate(sent_src);
+    for(int draft_len : {1, 3}) {
+      ensdec->SetDraft(draft_ensdec, draft_len);
+      EnsembleDecoderHypPtr act_hyp = ensdec->Generate(sent_src);
+      BOOST_CHECK_EQUAL_COLLECTIONS(exp_hyp->GetSentence().begin(), exp_hyp->GetSentence().end(),
+                                    act_hyp->GetSentence().begin(), act_hyp->GetSentence().end());
+      BOOST_CHECK_EQUAL_COLLECTIONS(exp_hyp->GetAlignment().begin(), exp_hyp->GetAlignment().end(),
+                                    act_hyp->GetAlignment().begin(), act_hyp->GetAlignment().end());
+      BOOST_CHECK_CLOSE(exp_hyp->GetScore(), act_hyp->GetScore(), 0.01);
+    }
+  }
+  ensdec->SetDraft(shared_ptr<EnsembleDecoder>(), 1);
+}
+
+// Test whether the scores of samples drawn together match their likelihood
+BOOST_AUTO_TEST_CASE(TestSampleSentences) {
+  shared_ptr<dynet::ParameterCollection> mod;
+  EncoderAttentionalPtr encatt;
+  shared_ptr<EnsembleDecoder> ensdec;
+  CreateModel(mod, encatt, ensdec, "mlp:5", true, "sum", "prior");
+  ensdec->SetSizeLimit(10);
+  vector<Sentence> sents_src = {sent_src_, {3, 1, 0}, sent_src2_};
+  vector<vector<EnsembleDecoderHypPtr> > samples = ensdec->SampleSentences(sents_src, 4);
+  ensdec->SetSizeLimit(100);
+  BOOST_REQUIRE_EQUAL(sents_src.size(), samples.size());
+  for(size_t j = 0; j < sents_src.size(); j++) {
+    BOOST_REQUIRE_EQUAL(samples[j].size(), 4);
+    for(auto & samp : samples[j]) {
+      BOOST_REQUIRE(samp.get() != nullptr);
+      BOOST_CHECK(samp->GetSentence().size() > 0 && samp->GetSentence().size() <= 11);
+      BOOST_CHECK_EQUAL(samp->GetSentence().size(), samp->GetAlignment().size());
+      LLStats samp_stat(vocab_trg_->size());
+      vector<float> samp_wordll;
+      ensdec->CalcSentLL(sents_src[j], samp->GetSentence(), samp_stat, samp_wordll);
+      BOOST_CHECK_CLOSE(-samp_stat.loss_, samp->GetScore(), 0.01);
+    }
+  }
+}
+
 // Test whether scores improve through beam search
 BOOST_AUTO_TEST_CASE(TestBeamSearchImproves) {
   shared_ptr<dynet::ParameterCollection> mod;
@@ -0,0 +1,161 @@
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include <lamtram/mips-index.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <numeric>
+#include <random>
+#include <vector>
+
+using namespace std;
+using namespace lamtram;
+
+// ****** The fixture *******
+struct TestMipsIndex {
+
+  TestMipsIndex() : num_rows_(2000), dim_(16) {
+    MakeRows(num_rows_, dim_, weights_, bias_);
+  }
+  ~TestMipsIndex() { }
+
+  // Output embeddings grouped around a number of topics, as is typical of
+  // trained output layers
+  static void MakeRows(int num_rows, int dim, vector<float> & weights, vector<float> & bias) {
+    mt19937 rng(1);
+    normal_distribution<float> norm(0.f, 1.f);
+    vector<float> topics(20 * dim);
+    for(float & val : topics) val = norm(rng);
+    weights.resize(num_rows * dim);
+    bias.resize(num_rows);
+    for(int i = 0; i < num_rows; i++) {
+      int topic = i % 20;
+      for(int j = 0; j < dim; j++)
+        weights[i * dim + j] = topics[topic * dim + j] + 0.3f * norm(rng);
+      bias[i] = 0.5f * norm(rng);
+    }
+  }
+
+  // Calculate the exact scores of all rows
+  static vector<float> CalcScores(const vector<float> & weights, const vector<float> & bias, int dim, const float * h) {
+    int num_rows = bias.size();
+    vector<float> scores(num_rows);
+    for(int i = 0; i < num_rows; i++) {
+      scores[i] = bias[i];
+      for(int j = 0; j < dim; j++)
+        scores[i] += weights[i * dim + j] * h[j];
+    }
+    return scores;
+  }
+  vector<float> CalcScores(const float * h) { return CalcScores(weights_, bias_, dim_, h); }
+
+  // The log of the sum of the exponentiated scores
+  static float LogSumExp(const vector<float> & scores) {
+    float max_score = *max_element(scores.begin(), scores.end()), sum = 0.f;
+    for(float score : scores) sum += exp(score - max_score);
+    return max_score + log(sum);
+  }
+
+  int num_rows_, dim_;
+  vector<float> weights_, bias_;
+};
+
+// ****** The tests *******
+BOOST_FIXTURE_TEST_SUITE(mips_index, TestMipsIndex)
+
+// With all clusters probed, the log probabilities should be exact
+BOOST_AUTO_TEST_CASE(TestExactLogProbs) {
+  MipsIndex index(weights_.data(), bias_.data(), num_rows_, dim_, 30);
+  BOOST_CHECK_EQUAL(index.GetNumClusters(), 30);
+  vector<float> h(dim_, 0.2f);
+  vector<float> scores = CalcScores(h.data()), act;
+  vector<unsigned> ids;
+  index.CalcLogProbs(h.data(), index.GetNumClusters(), ids, act);
+  BOOST_CHECK_EQUAL(act.size(), ids.size());
+  float log_z = LogSumExp(scores);
+  for(size_t i = 0; i < ids.size(); i++)
+    BOOST_CHECK_CLOSE(act[i], scores[ids[i]] - log_z, 0.01);
+  index.Search(h.data(), index.GetNumClusters(), ids);
+  sort(ids.begin(), ids.end());
+  vector<unsigned> exp_ids(num_rows_);
+  iota(exp_ids.begin(), exp_ids.end(), 0);
+  BOOST_CHECK(ids == exp_ids);
+}
+
+// Measure how many of the exact top 10 words are found when probing a few
+// clusters, and whether the normalizer estimate is close and unbiased
+BOOST_AUTO_TEST_CASE(TestRecall) {
+  MipsIndex index(weights_.data(), bias_.data(), num_rows_, dim_);
+  int probes = 5, num_states = 100, top_k = 10, found = 0;
+  size_t scored = 0;
+  float max_log_z_err = 0.f, sum_log_z_err = 0.f;
+  mt19937 rng(2);
+  normal_distribution<float> norm(0.f, 1.f);
+  vector<float> h(dim_), log_probs;
+  vector<unsigned> ids;
+  for(int s = 0; s < num_states; s++) {
+    for(float & val : h) val = norm(rng);
+    vector<float> scores = CalcScores(h.data());
+    vector<int> order(num_rows_);
+    iota(order.begin(), order.end(), 0);
+    partial_sort(order.begin(), order.begin() + top_k, order.end(), [&](int a, int b) { return scores[a] > scores[b]; });
+    index.CalcLogProbs(h.data(), probes, ids, log_probs);
+    scored += ids.size();
+    for(int k = 0; k < top_k; k++)
+      found += (find(ids.begin(), ids.end(), (unsigned)order[k]) != ids.end());
+    // The difference between exact and approximate log probabilities of a
+    // scored word is the error of the log normalizer
+    float log_z_err = log_probs[0] - (scores[ids[0]] - LogSumExp(scores));
+    max_log_z_err = max(max_log_z_err, fabs(log_z_err));
+    sum_log_z_err += log_z_err;
+  }
+  float recall = found / (float)(num_states * top_k), mean_log_z_err = sum_log_z_err / num_states;
+  BOOST_TEST_MESSAGE("Recall at " << top_k << " with " << probes << "/" << index.GetNumClusters() << " clusters: " << recall
+                     << ", scoring " << scored / (float)(num_states * num_rows_) << " of the words, log normalizer error at most "
+                     << max_log_z_err << " and " << mean_log_z_err << " on average");
+  BOOST_CHECK_GE(recall, 0.95);
+  BOOST_CHECK_LT(scored, (size_t)(num_states * num_rows_ / 2));
+  BOOST_CHECK_LT(max_log_z_err, 0.5);
+  BOOST_CHECK_LT(fabs(mean_log_z_err), 0.1);
+}
+
+// Compare the time of scoring all words of a layer of realistic size with
+// that of searching the index, and the recall of the best word
+BOOST_AUTO_TEST_CASE(TestSpeed) {
+  int num_rows = 10000, dim = 128, probes = 10, num_states = 50, found = 0;
+  vector<float> weights, bias;
+  MakeRows(num_rows, dim, weights, bias);
+  MipsIndex index(weights.data(), bias.data(), num_rows, dim);
+  mt19937 rng(3);
+  normal_distribution<float> norm(0.f, 0.3f);
+  vector<vector<float> > states(num_states, vector<float>(dim));
+  for(auto & h : states)
+    for(float & val : h) val = norm(rng);
+  vector<int> exact_best;
+  auto start = chrono::steady_clock::now();
+  for(auto & h : states) {
+    vector<float> scores = CalcScores(weights, bias, dim, h.data());
+    float log_z = LogSumExp(scores);
+    for(float & score : scores) score -= log_z;
+    exact_best.push_back(max_element(scores.begin(), scores.end()) - scores.begin());
+  }
+  double exact_time = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  vector<unsigned> ids;
+  vector<float> log_probs;
+  size_t scored = 0;
+  start = chrono::steady_clock::now();
+  for(int s = 0; s < num_states; s++) {
+    index.CalcLogProbs(states[s].data(), probes, ids, log_probs);
+    scored += ids.size();
+    found += ((int)ids[max_element(log_probs.begin(), log_probs.end()) - log_probs.begin()] == exact_best[s]);
+  }
+  double index_time = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  BOOST_TEST_MESSAGE("Scoring " << num_rows << "x" << dim << ": " << exact_time * 1000 / num_states << " ms exact, "
+                     << index_time * 1000 / num_states << " ms with " << probes << "/" << index.GetNumClusters() << " clusters ("
+                     << scored / (float)(num_states * num_rows) << " of the words), best word found " << found << "/" << num_states);
+  BOOST_CHECK_GE(found, num_states * 9 / 10);
+  BOOST_CHECK_LT(scored, (size_t)(num_states * num_rows / 5));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
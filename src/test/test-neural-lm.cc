@@ -9,6 +9,9 @@
 #include <lamtram/model-utils.h>
 #include <dynet/dict.h>
 #include <dynet/dict.h>
+#include <cstdio>
+#include <fstream>
+#include <set>
 
 using namespace std;
 using namespace lamtram;
@@ -81,4 +84,207 @@ BOOST_AUTO_TEST_CASE(TestDecodingScores) {
   BOOST_CHECK_CLOSE(train_stat.CalcPPL(), test_stat.CalcPPL(), 0.1);
 }
 
+// Test whether feed-forward n-gram models recombine hypotheses without losing the best one
+BOOST_AUTO_TEST_CASE(TestRecombination) {
+  std::shared_ptr<dynet::ParameterCollection> mod(new dynet::ParameterCollection);
+  // Create randomized feed-forward and recurrent lms
+  DictPtr vocab(CreateNewDict()); vocab->convert("a"); vocab->convert("b"); vocab->convert("c");
+  NeuralLMPtr fflm(new NeuralLM(vocab, 2, 0, false, 3, BuilderSpec("ff:4:2"), -1, "full", *mod));
+  NeuralLMPtr rnnlm(new NeuralLM(vocab, 2, 0, false, 3, BuilderSpec("rnn:4:1"), -1, "full", *mod));
+  vector<EncoderDecoderPtr> encdecs;
+  vector<EncoderAttentionalPtr> encatts;
+  EnsembleDecoder rnndec(encdecs, encatts, vector<NeuralLMPtr>(1, rnnlm));
+  BOOST_CHECK(!rnndec.GetRecombine());
+  rnndec.SetRecombine(true);
+  BOOST_CHECK(!rnndec.GetRecombine());
+  EnsembleDecoder ffdec(encdecs, encatts, vector<NeuralLMPtr>(1, fflm));
+  BOOST_CHECK(ffdec.GetRecombine());
+  // Decoding scores should match training with feed-forward layers as well
+  LLStats train_stat(vocab->size()), test_stat(vocab->size());
+  vector<dynet::Expression> layer_in;
+  {
+    dynet::ComputationGraph cg;
+    fflm->NewGraph(cg);
+    dynet::Expression loss_expr = fflm->BuildSentGraph(sent_trg_, cache_, nullptr, nullptr, layer_in, 0.f, false, cg, train_stat);
+    train_stat.loss_ += as_scalar(cg.incremental_forward(loss_expr));
+  }
+  vector<float> test_wordll;
+  ffdec.CalcSentLL(sent_src_, sent_trg_, test_stat, test_wordll);
+  BOOST_CHECK_CLOSE(train_stat.CalcPPL(), test_stat.CalcPPL(), 0.1);
+  // Merging only removes hypotheses with a better twin, so the best is never worse
+  ffdec.SetBeamSize(3);
+  ffdec.SetSizeLimit(8);
+  for(bool beam_batch : {false, true}) {
+    ffdec.SetBeamBatch(beam_batch);
+    ffdec.SetRecombine(false);
+    vector<EnsembleDecoderHypPtr> exp_nbest = ffdec.GenerateNbest(sent_src_, 3);
+    ffdec.SetRecombine(true);
+    vector<EnsembleDecoderHypPtr> act_nbest = ffdec.GenerateNbest(sent_src_, 3);
+    BOOST_REQUIRE(exp_nbest.size() > 0 && act_nbest.size() > 0);
+    BOOST_CHECK_GE(act_nbest[0]->GetScore(), exp_nbest[0]->GetScore() - 1e-4);
+  }
+}
+
+// Exposes how the decoder selects the next beam
+class BeamTestDecoder : public EnsembleDecoder {
+public:
+  BeamTestDecoder(const vector<NeuralLMPtr> & lms) : EnsembleDecoder(vector<EncoderDecoderPtr>(), vector<EncoderAttentionalPtr>(), lms) { }
+  using EnsembleDecoder::GetSelectorSize;
+  using EnsembleDecoder::SelectCandidates;
+};
+
+// Test whether merged hypotheses leave their slots in the beam to others
+BOOST_AUTO_TEST_CASE(TestRecombinationFillsBeam) {
+  std::shared_ptr<dynet::ParameterCollection> mod(new dynet::ParameterCollection);
+  DictPtr vocab(CreateNewDict()); vocab->convert("a"); vocab->convert("b"); vocab->convert("c");
+  NeuralLMPtr fflm(new NeuralLM(vocab, 2, 0, false, 3, BuilderSpec("ff:4:2"), -1, "full", *mod));
+  BeamTestDecoder ffdec(vector<NeuralLMPtr>(1, fflm));
+  BOOST_REQUIRE(ffdec.GetRecombine());
+  // Two hypotheses "b a" and "c a" with the same score, so every word gives
+  // each of them the same context and score
+  vector<EnsembleDecoderNode> arena;
+  arena.push_back(EnsembleDecoderNode(-1, -1, -1, 0.f, 0, 0));
+  arena.push_back(EnsembleDecoderNode(0, 3, -1, -1.f, 0, 0));
+  arena.push_back(EnsembleDecoderNode(0, 4, -1, -1.f, 0, 0));
+  arena.push_back(EnsembleDecoderNode(1, 2, -1, -2.f, 0, 0));
+  arena.push_back(EnsembleDecoderNode(2, 2, -1, -2.f, 0, 0));
+  vector<int> parents = {3, 4};
+  vector<float> log_probs = {-10.f, -1.f, -1.1f, -1.2f, -1.3f};
+  // Four words give distinct contexts, and the end of each sentence is kept apart
+  int num_distinct = 6;
+  for(bool recombine : {true, false}) {
+    ffdec.SetRecombine(recombine);
+    for(int beam_size = 1; beam_size <= 8; beam_size++) {
+      ffdec.SetBeamSize(beam_size);
+      BeamSelector selector(ffdec.GetSelectorSize(parents.size()));
+      for(int hypid = 0; hypid < (int)parents.size(); hypid++)
+        selector.AddHypothesis(&log_probs[0], log_probs.size(), arena[parents[hypid]].score_, 0.f, -1, 0.f, hypid, -1);
+      vector<BeamCandidate> next_cands = ffdec.SelectCandidates(selector, -1.f, arena, parents, vector<unsigned>());
+      BOOST_CHECK_EQUAL(next_cands.size(), min(beam_size, recombine ? num_distinct : 2 * (int)log_probs.size()));
+      if(recombine) {
+        set<int> words;
+        for(auto & cand : next_cands)
+          BOOST_CHECK(cand.word_id_ == 0 || words.insert(cand.word_id_).second);
+      }
+    }
+  }
+}
+
+// Test whether searching a class-factored softmax by class finds the same hypotheses
+BOOST_AUTO_TEST_CASE(TestClassSearch) {
+  {
+    ofstream ofs("/tmp/lm_classes.txt");
+    if(!ofs) THROW_ERROR("Could not open /tmp/lm_classes.txt for writing");
+    ofs << "c0 <s>" << endl << "c1 <unk>" << endl << "c1 a" << endl << "c2 b" << endl << "c2 c" << endl << "c2 d" << endl;
+  }
+  std::shared_ptr<dynet::ParameterCollection> mod(new dynet::ParameterCollection);
+  DictPtr vocab(CreateNewDict()); vocab->convert("a"); vocab->convert("b"); vocab->convert("c"); vocab->convert("d");
+  NeuralLMPtr lmptr(new NeuralLM(vocab, 1, 0, false, 3, BuilderSpec("rnn:4:1"), -1, "class:/tmp/lm_classes.txt", *mod));
+  std::remove("/tmp/lm_classes.txt");
+  vector<EncoderDecoderPtr> encdecs;
+  vector<EncoderAttentionalPtr> encatts;
+  EnsembleDecoder ensdec(encdecs, encatts, vector<NeuralLMPtr>(1, lmptr));
+  BOOST_CHECK(ensdec.CanClassSearch());
+  ensdec.SetBeamSize(3);
+  ensdec.SetSizeLimit(6);
+  ensdec.SetClassSearch(false);
+  vector<EnsembleDecoderHypPtr> exp_nbest = ensdec.GenerateNbest(sent_src_, 3);
+  ensdec.SetClassSearch(true);
+  vector<EnsembleDecoderHypPtr> act_nbest = ensdec.GenerateNbest(sent_src_, 3);
+  BOOST_REQUIRE_EQUAL(exp_nbest.size(), act_nbest.size());
+  for(size_t i = 0; i < exp_nbest.size(); i++) {
+    BOOST_CHECK_CLOSE(exp_nbest[i]->GetScore(), act_nbest[i]->GetScore(), 0.01);
+    BOOST_CHECK(exp_nbest[i]->GetSentence() == act_nbest[i]->GetSentence());
+  }
+}
+
+// Test whether precomputing the input projections gives the same scores
+BOOST_AUTO_TEST_CASE(TestPrecomputeProjections) {
+  std::shared_ptr<dynet::ParameterCollection> mod(new dynet::ParameterCollection);
+  DictPtr vocab(CreateNewDict()); vocab->convert("a"); vocab->convert("b"); vocab->convert("c");
+  NeuralLMPtr fflm(new NeuralLM(vocab, 2, 0, false, 3, BuilderSpec("ff:4:2"), -1, "full", *mod));
+  NeuralLMPtr rnnlm(new NeuralLM(vocab, 1, 0, false, 3, BuilderSpec("rnn:4:1"), -1, "full", *mod));
+  BOOST_CHECK(!rnnlm->PrecomputeProjections());
+  vector<EncoderDecoderPtr> encdecs;
+  vector<EncoderAttentionalPtr> encatts;
+  EnsembleDecoder ensdec(encdecs, encatts, vector<NeuralLMPtr>(1, fflm));
+  ensdec.SetBeamSize(3);
+  ensdec.SetSizeLimit(6);
+  LLStats exp_stat(vocab->size()), act_stat(vocab->size());
+  vector<float> exp_wordll, act_wordll;
+  ensdec.CalcSentLL(sent_src_, sent_trg_, exp_stat, exp_wordll);
+  vector<EnsembleDecoderHypPtr> exp_nbest = ensdec.GenerateNbest(sent_src_, 3);
+  BOOST_CHECK(fflm->PrecomputeProjections());
+  ensdec.CalcSentLL(sent_src_, sent_trg_, act_stat, act_wordll);
+  vector<EnsembleDecoderHypPtr> act_nbest = ensdec.GenerateNbest(sent_src_, 3);
+  BOOST_CHECK_CLOSE(exp_stat.CalcPPL(), act_stat.CalcPPL(), 0.01);
+  BOOST_REQUIRE_EQUAL(exp_nbest.size(), act_nbest.size());
+  for(size_t i = 0; i < exp_nbest.size(); i++) {
+    BOOST_CHECK_CLOSE(exp_nbest[i]->GetScore(), act_nbest[i]->GetScore(), 0.01);
+    BOOST_CHECK(exp_nbest[i]->GetSentence() == act_nbest[i]->GetSentence());
+  }
+}
+
+// Test whether the fused lstm gives the same losses, gradients and decoding
+// scores as the stock one with the same parameters
+BOOST_AUTO_TEST_CASE(TestFastLSTM) {
+  std::shared_ptr<dynet::ParameterCollection> exp_mod(new dynet::ParameterCollection), act_mod(new dynet::ParameterCollection);
+  DictPtr vocab(CreateNewDict()); vocab->convert("a"); vocab->convert("b"); vocab->convert("c");
+  NeuralLMPtr exp_lm(new NeuralLM(vocab, 2, 0, false, 3, BuilderSpec("lstm:4:2"), -1, "full", *exp_mod));
+  NeuralLMPtr act_lm(new NeuralLM(vocab, 2, 0, false, 3, BuilderSpec("fastlstm:4:2"), -1, "full", *act_mod));
+  const auto & exp_params = exp_mod->parameters_list(), & act_params = act_mod->parameters_list();
+  const auto & exp_lookups = exp_mod->lookup_parameters_list(), & act_lookups = act_mod->lookup_parameters_list();
+  BOOST_REQUIRE_EQUAL(exp_params.size(), act_params.size());
+  BOOST_REQUIRE_EQUAL(exp_lookups.size(), act_lookups.size());
+  for(size_t i = 0; i < exp_params.size(); i++) act_params[i]->copy(*exp_params[i]);
+  for(size_t i = 0; i < exp_lookups.size(); i++) act_lookups[i]->copy(*exp_lookups[i]);
+  // Train on a batch of two sentences
+  vector<Sentence> sents = {sent_trg_, sent_src_}, caches(2);
+  vector<dynet::Expression> layer_in;
+  float exp_loss, act_loss;
+  {
+    dynet::ComputationGraph cg;
+    exp_lm->NewGraph(cg);
+    LLStats stat(vocab->size());
+    dynet::Expression loss_expr = exp_lm->BuildSentGraph(sents, caches, nullptr, nullptr, layer_in, 0.f, false, cg, stat);
+    exp_loss = as_scalar(cg.incremental_forward(loss_expr));
+    cg.backward(loss_expr);
+  }
+  {
+    dynet::ComputationGraph cg;
+    act_lm->NewGraph(cg);
+    LLStats stat(vocab->size());
+    dynet::Expression loss_expr = act_lm->BuildSentGraph(sents, caches, nullptr, nullptr, layer_in, 0.f, false, cg, stat);
+    act_loss = as_scalar(cg.incremental_forward(loss_expr));
+    cg.backward(loss_expr);
+  }
+  BOOST_CHECK_CLOSE(exp_loss, act_loss, 0.01);
+  for(size_t i = 0; i < exp_params.size(); i++) {
+    vector<float> exp_grad = as_vector(exp_params[i]->g), act_grad = as_vector(act_params[i]->g);
+    BOOST_REQUIRE_EQUAL(exp_grad.size(), act_grad.size());
+    for(size_t j = 0; j < exp_grad.size(); j++)
+      BOOST_CHECK_SMALL(exp_grad[j] - act_grad[j], 1e-4f);
+  }
+  // Decode, with the input projections precomputed as well
+  vector<EncoderDecoderPtr> encdecs;
+  vector<EncoderAttentionalPtr> encatts;
+  EnsembleDecoder exp_dec(encdecs, encatts, vector<NeuralLMPtr>(1, exp_lm)), act_dec(encdecs, encatts, vector<NeuralLMPtr>(1, act_lm));
+  BOOST_CHECK(act_lm->PrecomputeProjections());
+  for(EnsembleDecoder * dec : {&exp_dec, &act_dec}) {
+    dec->SetBeamSize(3);
+    dec->SetSizeLimit(6);
+  }
+  LLStats exp_stat(vocab->size()), act_stat(vocab->size());
+  vector<float> exp_wordll, act_wordll;
+  exp_dec.CalcSentLL(sent_src_, sent_trg_, exp_stat, exp_wordll);
+  act_dec.CalcSentLL(sent_src_, sent_trg_, act_stat, act_wordll);
+  BOOST_CHECK_CLOSE(exp_stat.CalcPPL(), act_stat.CalcPPL(), 0.01);
+  vector<EnsembleDecoderHypPtr> exp_nbest = exp_dec.GenerateNbest(sent_src_, 3), act_nbest = act_dec.GenerateNbest(sent_src_, 3);
+  BOOST_REQUIRE_EQUAL(exp_nbest.size(), act_nbest.size());
+  for(size_t i = 0; i < exp_nbest.size(); i++) {
+    BOOST_CHECK_CLOSE(exp_nbest[i]->GetScore(), act_nbest[i]->GetScore(), 0.01);
+    BOOST_CHECK(exp_nbest[i]->GetSentence() == act_nbest[i]->GetSentence());
+  }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
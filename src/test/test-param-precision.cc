@@ -0,0 +1,77 @@
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include <lamtram/param-precision.h>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <vector>
+
+using namespace std;
+using namespace lamtram;
+
+// ****** The tests *******
+BOOST_AUTO_TEST_SUITE(param_precision)
+
+// Values that can be represented should be converted exactly
+BOOST_AUTO_TEST_CASE(TestExactValues) {
+  for(ParamPrecision precision : {PRECISION_FP16, PRECISION_BF16}) {
+    for(float val : {0.f, -0.f, 1.f, -2.f, 0.5f, 0.375f, -96.f, 1024.f}) {
+      uint16_t half = FloatToHalf(val, precision);
+      BOOST_CHECK_EQUAL(HalfToFloat(half, precision), val);
+      BOOST_CHECK_EQUAL(signbit(HalfToFloat(half, precision)), signbit(val));
+    }
+  }
+  BOOST_CHECK_EQUAL(FloatToHalf(1.f, PRECISION_FP16), 0x3c00);
+  BOOST_CHECK_EQUAL(FloatToHalf(-2.f, PRECISION_FP16), 0xc000);
+  BOOST_CHECK_EQUAL(FloatToHalf(65504.f, PRECISION_FP16), 0x7bff);
+  BOOST_CHECK_EQUAL(FloatToHalf(1.f, PRECISION_BF16), 0x3f80);
+  // The smallest value below the normals
+  BOOST_CHECK_EQUAL(HalfToFloat(0x0001, PRECISION_FP16), ldexp(1.f, -24));
+}
+
+// Other values should be rounded to the nearest, with ties to even
+BOOST_AUTO_TEST_CASE(TestRounding) {
+  // Halfway between 1 and the next value, which is odd
+  BOOST_CHECK_EQUAL(FloatToHalf(1.f + ldexp(1.f, -11), PRECISION_FP16), 0x3c00);
+  BOOST_CHECK_EQUAL(FloatToHalf(1.f + 3 * ldexp(1.f, -11), PRECISION_FP16), 0x3c02);
+  BOOST_CHECK_EQUAL(FloatToHalf(1.f + ldexp(1.f, -8), PRECISION_BF16), 0x3f80);
+  BOOST_CHECK_EQUAL(FloatToHalf(1.f + 3 * ldexp(1.f, -8), PRECISION_BF16), 0x3f82);
+  // The relative error should be within half of the last place
+  mt19937 rng(1);
+  normal_distribution<float> norm(0.f, 1.f);
+  vector<float> vals(1000);
+  for(float & val : vals) val = norm(rng);
+  vector<uint16_t> halves(vals.size());
+  vector<float> back(vals.size());
+  for(ParamPrecision precision : {PRECISION_FP16, PRECISION_BF16}) {
+    float eps = (precision == PRECISION_FP16 ? ldexp(1.f, -11) : ldexp(1.f, -8));
+    FloatToHalf(vals.data(), halves.data(), vals.size(), precision);
+    HalfToFloat(halves.data(), back.data(), vals.size(), precision);
+    for(size_t i = 0; i < vals.size(); i++) {
+      BOOST_CHECK_EQUAL(halves[i], FloatToHalf(vals[i], precision));
+      if(abs(vals[i]) > ldexp(1.f, -14))
+        BOOST_CHECK_LE(abs(back[i] - vals[i]), eps * abs(vals[i]));
+    }
+  }
+}
+
+// Values out of range should become infinite, and NaNs should stay NaNs
+BOOST_AUTO_TEST_CASE(TestSpecialValues) {
+  float inf = numeric_limits<float>::infinity(), nan = numeric_limits<float>::quiet_NaN();
+  BOOST_CHECK_EQUAL(HalfToFloat(FloatToHalf(70000.f, PRECISION_FP16), PRECISION_FP16), inf);
+  BOOST_CHECK_EQUAL(HalfToFloat(FloatToHalf(-inf, PRECISION_FP16), PRECISION_FP16), -inf);
+  BOOST_CHECK_EQUAL(HalfToFloat(FloatToHalf(70000.f, PRECISION_BF16), PRECISION_BF16), 70144.f);
+  BOOST_CHECK_EQUAL(HalfToFloat(FloatToHalf(inf, PRECISION_BF16), PRECISION_BF16), inf);
+  BOOST_CHECK(std::isnan(HalfToFloat(FloatToHalf(nan, PRECISION_FP16), PRECISION_FP16)));
+  BOOST_CHECK(std::isnan(HalfToFloat(FloatToHalf(nan, PRECISION_BF16), PRECISION_BF16)));
+}
+
+// Names should be parsed, and unknown ones refused
+BOOST_AUTO_TEST_CASE(TestParsePrecision) {
+  for(ParamPrecision precision : {PRECISION_FP32, PRECISION_FP16, PRECISION_BF16})
+    BOOST_CHECK_EQUAL(ParsePrecision(PrecisionName(precision)), precision);
+  BOOST_CHECK_THROW(ParsePrecision("fp8"), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
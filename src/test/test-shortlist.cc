@@ -0,0 +1,27 @@
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include <lamtram/macros.h>
+#include <lamtram/shortlist.h>
+
+using namespace std;
+using namespace lamtram;
+
+// ****** The tests *******
+BOOST_AUTO_TEST_SUITE(shortlist)
+
+// Candidates should include the top translations of each word and the frequent words
+BOOST_AUTO_TEST_CASE(TestCandidates) {
+  MultipleIdMapping lexicon;
+  lexicon[3] = {{10, 0.2f}, {11, 0.5f}, {12, 0.3f}};
+  lexicon[4] = {{13, 1.0f}};
+  Shortlist shortlist(lexicon, {1, 20}, 2);
+  vector<unsigned> exp = {0, 1, 11, 12, 20};
+  vector<unsigned> act = shortlist.GetCandidates(Sentence({3, 5, 3}));
+  BOOST_CHECK_EQUAL_COLLECTIONS(exp.begin(), exp.end(), act.begin(), act.end());
+  exp = {0, 1, 11, 12, 13, 20};
+  act = shortlist.GetCandidates(vector<Sentence>({{3}, {4, 0}}));
+  BOOST_CHECK_EQUAL_COLLECTIONS(exp.begin(), exp.end(), act.begin(), act.end());
+}
+
+BOOST_AUTO_TEST_SUITE_END()